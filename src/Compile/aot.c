@@ -0,0 +1,569 @@
+#include <assert.h>
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+#include "aot.h"
+#include "jit.h"
+#include "compile.h"
+#include "Objects/boolean.h"
+#include "Objects/float.h"
+#include "Objects/function.h"
+#include "Objects/integer.h"
+#include "Objects/string.h"
+#include "Vendor/bdwgc/include/gc.h"
+
+/**
+ * Ahead-of-time compilation to C. The CodeContext tree of a script is
+ * written out as a C translation unit: the instructions, source lines,
+ * locals and constants of each context as static data, and one function
+ * per context which runs its instructions as straight-line C. Jumps become
+ * gotos between the labels of the instructions, and the bodies call the
+ * same vmeval_op_* functions as the interpreter and the JIT.
+ *
+ * The generated functions follow the protocol of the JIT (see jit.c): they
+ * are entered at any instruction of the frame, and instructions which enter
+ * or leave a frame (calls and returns) exit back to the interpreter. The
+ * program links against the runtime (everything but Eval/main.c), rebuilds
+ * the code contexts from the static data at startup and attaches the
+ * functions to them, so nothing is parsed or compiled at run-time.
+ *
+ *   lox --aot script.lox -o script.c
+ *   make aot AOT=script.c
+ */
+
+typedef struct aot_emitter {
+    FILE                *output;
+    CodeContext         **codes;
+    unsigned            count, size;
+} AotEmitter;
+
+static void
+aot_collect(AotEmitter *self, CodeContext *code) {
+    Constant *C;
+    unsigned i;
+
+    if (self->count == self->size) {
+        self->size = self->size ? self->size * 2 : 8;
+        self->codes = realloc(self->codes, self->size * sizeof(CodeContext*));
+    }
+    self->codes[self->count++] = code;
+
+    for (i = 0, C = code->constants; i < code->nConstants; i++, C++) {
+        // Function bodies are compiled on the first call, so compile any
+        // which haven't been run
+        if (VmCode_isVmCode(C->value))
+            aot_collect(self, VmCode_getContext((LoxVmCode*) C->value));
+    }
+}
+
+static int
+aot_code_index(AotEmitter *self, CodeContext *code) {
+    unsigned i;
+    for (i = 0; i < self->count; i++) {
+        if (self->codes[i] == code)
+            return i;
+    }
+    assert(!"Code context was not collected");
+    return -1;
+}
+
+static void
+aot_emit_string(AotEmitter *self, const char *characters, size_t length) {
+    fputc('"', self->output);
+    while (length--) {
+        unsigned char c = *characters++;
+        if (c == '"' || c == '\\')
+            fprintf(self->output, "\\%c", c);
+        else if (isprint(c))
+            fputc(c, self->output);
+        else
+            fprintf(self->output, "\\%03o", c);
+    }
+    fputc('"', self->output);
+}
+
+static int
+aot_emit_constant(AotEmitter *self, Object *value) {
+    FILE *output = self->output;
+
+    if (value == LoxNIL) {
+        fprintf(output, "    { AOT_NIL },\n");
+    }
+    else if (value == (Object*) LoxTRUE) {
+        fprintf(output, "    { AOT_TRUE },\n");
+    }
+    else if (value == (Object*) LoxFALSE) {
+        fprintf(output, "    { AOT_FALSE },\n");
+    }
+    else if (Integer_isInteger(value)) {
+        fprintf(output, "    { AOT_INTEGER, .integer = %lldLL },\n",
+            ((LoxInteger*) value)->value);
+    }
+    else if (Float_isFloat(value)) {
+        long double real = ((LoxFloat*) value)->value;
+        fprintf(output, "    { AOT_FLOAT, .real = ");
+        if (isnan(real))
+            fprintf(output, "__builtin_nanl(\"\")");
+        else if (isinf(real))
+            fprintf(output, "%s__builtin_infl()", real < 0 ? "-" : "");
+        else
+            fprintf(output, "%LaL", real);
+        fprintf(output, " },\n");
+    }
+    else if (String_isString(value)) {
+        LoxString *S = (LoxString*) value;
+        fprintf(output, "    { AOT_STRING, .characters = ");
+        aot_emit_string(self, S->characters, S->length);
+        fprintf(output, ", .length = %u },\n", S->length);
+    }
+    else if (VmCode_isVmCode(value)) {
+        LoxVmCode *code = (LoxVmCode*) value;
+        fprintf(output, "    { AOT_CODE, .integer = %d",
+            aot_code_index(self, code->context));
+        if (code->name) {
+            LoxString *S = (LoxString*) code->name;
+            fprintf(output, ", .characters = ");
+            aot_emit_string(self, S->characters, S->length);
+            fprintf(output, ", .length = %u", S->length);
+        }
+        fprintf(output, " },\n");
+    }
+    else {
+        fprintf(stderr, "AOT: Unable to compile a constant of type `%s`\n",
+            OBJECT_TYPE(value)->name);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+aot_emit_data(AotEmitter *self, unsigned index) {
+    CodeContext *code = self->codes[index];
+    InstructionList *instructions = &code->block->instructions;
+    CodeSourceList *lines = &code->block->codesource;
+    FILE *output = self->output;
+    unsigned i;
+
+    fprintf(output, "static Instruction code%u_opcodes[] = {\n", index);
+    for (i = 0; i < instructions->count; i++) {
+        fprintf(output, "    { %d, %d },\n", instructions->opcodes[i].op,
+            instructions->opcodes[i].arg);
+    }
+    fprintf(output, "};\n\n");
+
+    fprintf(output, "static CodeSource code%u_lines[] = {\n", index);
+    for (i = 0; i < lines->count; i++) {
+        fprintf(output, "    { %u, %u },\n", lines->offsets[i].opcode_count,
+            lines->offsets[i].line_number);
+    }
+    fprintf(output, "};\n\n");
+
+    fprintf(output, "static const AotConstant code%u_constants[] = {\n", index);
+    for (i = 0; i < code->nConstants; i++) {
+        if (aot_emit_constant(self, code->constants[i].value))
+            return -1;
+    }
+    fprintf(output, "};\n\n");
+    fprintf(output, "static LoxValue code%u_values[%u];\n\n", index,
+        code->nConstants ? code->nConstants : 1);
+
+    fprintf(output, "static const char * const code%u_locals[] = {\n", index);
+    for (i = 0; i < code->locals.count; i++) {
+        LoxString *S = (LoxString*) code->locals.names[i].value;
+        fprintf(output, "    ");
+        aot_emit_string(self, S->characters, S->length);
+        fprintf(output, ",\n");
+    }
+    fprintf(output, "};\n\n");
+
+    return 0;
+}
+
+static const char*
+aot_compare_operator(enum lox_vm_compare op) {
+    switch (op) {
+    case COMPARE_EQ:        return "==";
+    case COMPARE_NOT_EQ:    return "!=";
+    case COMPARE_LT:        return "<";
+    case COMPARE_LTE:       return "<=";
+    case COMPARE_GT:        return ">";
+    case COMPARE_GTE:       return ">=";
+    default:                return NULL;
+    }
+}
+
+/**
+ * Write the body of the instruction at `index`. Returns true if control never
+ * continues on to the next instruction.
+ */
+static bool
+aot_emit_instruction(AotEmitter *self, unsigned code_index, CodeContext *code,
+    unsigned index
+) {
+    Instruction *opcodes = code->block->instructions.opcodes,
+        *pc = opcodes + index;
+    int target = compile_jump_target(opcodes, index);
+    FILE *output = self->output;
+    const char *operator;
+
+    fprintf(output, "L%u:\n", index);
+
+    switch (pc->op) {
+    case OP_NOOP:
+    case OP_UNARY_INVERT:
+        fprintf(output, "    ;\n");
+        break;
+
+    case OP_JUMP:
+    case OP_BREAK:
+    case OP_CONTINUE:
+        fprintf(output, "    goto L%d;\n", target);
+        return true;
+
+    case OP_POP_JUMP_IF_TRUE:
+    case OP_POP_JUMP_IF_FALSE:
+        fprintf(output, "    if (%sAOT_POP_ISTRUE()) goto L%d;\n",
+            pc->op == OP_POP_JUMP_IF_TRUE ? "" : "!", target);
+        break;
+    case OP_JUMP_IF_TRUE:
+    case OP_JUMP_IF_FALSE:
+        fprintf(output, "    if (%sAOT_ISTRUE(PEEK(stack))) goto L%d;\n",
+            pc->op == OP_JUMP_IF_TRUE ? "" : "!", target);
+        break;
+    case OP_JUMP_IF_TRUE_OR_POP:
+    case OP_JUMP_IF_FALSE_OR_POP:
+        fprintf(output, "    if (%sAOT_ISTRUE(PEEK(stack))) goto L%d;\n",
+            pc->op == OP_JUMP_IF_TRUE_OR_POP ? "" : "!", target);
+        fprintf(output, "    XPOP(stack);\n");
+        break;
+
+    case OP_DUP_TOP:
+        fprintf(output, "    PUSH(stack, PEEK(stack));\n");
+        break;
+
+    case OP_POP_TOP:
+        fprintf(output, "    XPOP(stack);\n");
+        break;
+
+    // Superinstructions are split back up. The instructions following the
+    // first one are intact and are compiled on their own.
+    case OP_LOOKUP_LOCAL2:
+    case OP_LOOKUP_LOCAL_CONSTANT:
+    case OP_MATH_LOCAL_CONST:
+    case OP_GET_ATTR_LOCAL:
+    case OP_LOCAL_POP_JUMP_IF_FALSE:
+    case OP_LOCAL_POP_JUMP_IF_TRUE:
+    case OP_LOOKUP_LOCAL:
+        fprintf(output, "    PUSH(stack, locals[%d]);\n", pc->arg);
+        break;
+
+    case OP_STORE_LOCAL:
+        fprintf(output, "    AOT_STORE_LOCAL(%d);\n", pc->arg);
+        break;
+
+    case OP_CONSTANT:
+        // Constants are retained by the code context, so the values are
+        // resolved once when the module is loaded
+        fprintf(output, "    PUSH(stack, code%u_values[%d]);\n", code_index,
+            pc->arg);
+        break;
+
+    case OP_COMPARE_POP_JUMP_IF_FALSE:
+    case OP_COMPARE_POP_JUMP_IF_TRUE:
+    case OP_COMPARE:
+        if ((operator = aot_compare_operator(pc->arg)))
+            fprintf(output, "    AOT_INT_COMPARE(%s, %u);\n", operator, index);
+        else
+            fprintf(output, "    AOT_CALL(vmeval_op_compare, %u);\n", index);
+        break;
+
+    case OP_BINARY_MATH:
+        if (pc->arg == MATH_BINARY_PLUS || pc->arg == MATH_BINARY_MINUS)
+            fprintf(output, "    AOT_INT_MATH(%c, %u);\n",
+                pc->arg == MATH_BINARY_PLUS ? '+' : '-', index);
+        else
+            fprintf(output, "    AOT_CALL(vmeval_op_binary_math, %u);\n", index);
+        break;
+
+#define AOT_HELPER(opcode, helper) \
+    case opcode: \
+        fprintf(output, "    AOT_CALL(" #helper ", %u);\n", index); \
+        break
+
+    AOT_HELPER(OP_BANG, vmeval_op_bang);
+    AOT_HELPER(OP_UNARY_NEGATIVE, vmeval_op_unary_negative);
+    AOT_HELPER(OP_GET_ATTR, vmeval_op_get_attr);
+    AOT_HELPER(OP_SET_ATTR, vmeval_op_set_attr);
+    AOT_HELPER(OP_LOAD_METHOD, vmeval_op_load_method);
+    case OP_GET_ATTR_THIS:
+    AOT_HELPER(OP_THIS, vmeval_op_this);
+    AOT_HELPER(OP_LOOKUP_GLOBAL, vmeval_op_lookup_global);
+    AOT_HELPER(OP_LOOKUP_CLOSED, vmeval_op_lookup_closed);
+    AOT_HELPER(OP_STORE_CLOSED, vmeval_op_store_closed);
+    AOT_HELPER(OP_LOOKUP_CELL, vmeval_op_lookup_cell);
+    AOT_HELPER(OP_STORE_CELL, vmeval_op_store_cell);
+    AOT_HELPER(OP_CAPTURE_LOCAL, vmeval_op_capture_local);
+    AOT_HELPER(OP_CAPTURE_CLOSED, vmeval_op_capture_closed);
+    AOT_HELPER(OP_STORE_GLOBAL, vmeval_op_store_global);
+    AOT_HELPER(OP_GET_ITEM, vmeval_op_get_item);
+    AOT_HELPER(OP_SET_ITEM, vmeval_op_set_item);
+    AOT_HELPER(OP_BUILD_TUPLE, vmeval_op_build_tuple);
+    AOT_HELPER(OP_GET_ITERATOR, vmeval_op_get_iterator);
+    AOT_HELPER(OP_ENTER_BLOCK, vmeval_op_enter_block);
+    AOT_HELPER(OP_LEAVE_BLOCK, vmeval_op_leave_block);
+#undef AOT_HELPER
+
+    case OP_NEXT_OR_BREAK:
+        fprintf(output, "    if (!vmeval_op_next(frame, stack, opcodes + %u)) goto L%d;\n",
+            index, target);
+        break;
+    case OP_FOR_RANGE:
+        fprintf(output, "    if (!vmeval_op_for_range(frame, stack, opcodes + %u)) goto L%d;\n",
+            index, target);
+        break;
+
+    default:
+        // Calls, returns and everything else run in the interpreter
+        fprintf(output, "    AOT_EXIT(%u);\n", index);
+        return true;
+    }
+
+    return false;
+}
+
+static bool
+aot_uses_locals(CodeContext *code) {
+    Instruction *pc = code->block->instructions.opcodes;
+    unsigned count = code->block->instructions.count;
+
+    for (; count--; pc++) {
+        switch (pc->op) {
+        case OP_LOOKUP_LOCAL2:
+        case OP_LOOKUP_LOCAL_CONSTANT:
+        case OP_MATH_LOCAL_CONST:
+        case OP_GET_ATTR_LOCAL:
+        case OP_LOCAL_POP_JUMP_IF_FALSE:
+        case OP_LOCAL_POP_JUMP_IF_TRUE:
+        case OP_LOOKUP_LOCAL:
+        case OP_STORE_LOCAL:
+            return true;
+        default:
+            break;
+        }
+    }
+    return false;
+}
+
+static void
+aot_emit_function(AotEmitter *self, unsigned index) {
+    CodeContext *code = self->codes[index];
+    unsigned count = code->block->instructions.count, i;
+    FILE *output = self->output;
+    bool terminal = false;
+
+    fprintf(output, "static Instruction*\n");
+    fprintf(output, "code%u_run(VmEvalContext *frame, Instruction *pc) {\n", index);
+    fprintf(output, "    Instruction *opcodes = code%u_opcodes;\n", index);
+    fprintf(output, "    LoxValue *stack = frame->stack;\n");
+    if (aot_uses_locals(code))
+        fprintf(output, "    LoxValue *locals = frame->locals;\n");
+    fprintf(output, "\n");
+
+    fprintf(output, "    switch (pc - opcodes) {\n");
+    for (i = 0; i < count; i++)
+        fprintf(output, "    case %u: goto L%u;\n", i, i);
+    fprintf(output, "    }\n\n");
+
+    for (i = 0; i < count; i++)
+        terminal = aot_emit_instruction(self, index, code, i);
+
+    // Code should never run off the end, but just in case
+    if (!terminal)
+        fprintf(output, "    AOT_EXIT(%u);\n", count - 1);
+    fprintf(output, "}\n\n");
+}
+
+/**
+ * Write the CodeContext tree of the script at `filename` to `output` as C.
+ * Returns non-zero if some part of the code cannot be compiled.
+ */
+int
+LoxAOT_emit(CodeContext *code, const char *filename, FILE *output) {
+    AotEmitter self = { .output = output };
+    int rv = 0;
+    unsigned i;
+
+    aot_collect(&self, code);
+
+    fprintf(output, "// Compiled from %s by `lox --aot`\n\n", filename);
+    fprintf(output, "#include \"Compile/aot.h\"\n\n");
+
+    for (i = 0; i < self.count; i++) {
+        if ((rv = aot_emit_data(&self, i)))
+            goto done;
+    }
+
+    for (i = 0; i < self.count; i++)
+        aot_emit_function(&self, i);
+
+    fprintf(output, "static const AotCode codes[] = {\n");
+    for (i = 0; i < self.count; i++) {
+        code = self.codes[i];
+        fprintf(output, "    {\n");
+        fprintf(output, "        .opcodes = code%u_opcodes,\n", i);
+        fprintf(output, "        .count = %u,\n", code->block->instructions.count);
+        fprintf(output, "        .lines = code%u_lines,\n", i);
+        fprintf(output, "        .nLines = %u,\n", code->block->codesource.count);
+        fprintf(output, "        .constants = code%u_constants,\n", i);
+        fprintf(output, "        .values = code%u_values,\n", i);
+        fprintf(output, "        .nConstants = %u,\n", code->nConstants);
+        fprintf(output, "        .locals = code%u_locals,\n", i);
+        fprintf(output, "        .nLocals = %u,\n", code->locals.count);
+        fprintf(output, "        .nParameters = %u,\n", code->nParameters);
+        fprintf(output, "        .nLoops = %u,\n", code->nLoops);
+        fprintf(output, "        .stacksize = %u,\n", code->stacksize);
+        fprintf(output, "        .native = code%u_run,\n", i);
+        fprintf(output, "    },\n");
+    }
+    fprintf(output, "};\n\n");
+
+    fprintf(output, "static const AotModule module = {\n");
+    fprintf(output, "    .filename = ");
+    aot_emit_string(&self, filename, strlen(filename));
+    fprintf(output, ",\n");
+    fprintf(output, "    .codes = codes,\n");
+    fprintf(output, "    .count = %u,\n", self.count);
+    fprintf(output, "};\n\n");
+
+    fprintf(output, "int\nmain(int argc, char **argv) {\n");
+    fprintf(output, "    return LoxAOT_main(&module);\n");
+    fprintf(output, "}\n");
+
+done:
+    free(self.codes);
+    return rv;
+}
+
+static Object*
+aot_load_constant(const AotConstant *constant, CodeContext **contexts) {
+    switch (constant->kind) {
+    case AOT_NIL:
+        return LoxNIL;
+    case AOT_TRUE:
+        return (Object*) LoxTRUE;
+    case AOT_FALSE:
+        return (Object*) LoxFALSE;
+    case AOT_INTEGER:
+        return (Object*) Integer_fromLongLong(constant->integer);
+    case AOT_FLOAT:
+        return (Object*) Float_fromLongDouble(constant->real);
+    case AOT_STRING:
+        return (Object*) String_intern(constant->characters,
+            constant->length);
+    case AOT_CODE:
+        return VmCode_new(constant->characters
+            ? (Object*) String_intern(constant->characters, constant->length)
+            : NULL,
+            contexts[constant->integer]);
+    }
+
+    assert(!"Unexpected AOT constant");
+    return LoxNIL;
+}
+
+/**
+ * Rebuild the code contexts of a compiled module. Returns the context of the
+ * script itself, with each context already attached to its native code.
+ */
+CodeContext*
+LoxAOT_load(const AotModule *module) {
+    CodeContext **contexts = GC_MALLOC(module->count * sizeof(CodeContext*));
+    const AotCode *aot;
+    CodeContext *code;
+    CodeBlock *block;
+    Object *value;
+    unsigned i, j;
+
+    for (i = 0, aot = module->codes; i < module->count; i++, aot++) {
+        block = GC_MALLOC(sizeof(CodeBlock));
+        *block = (CodeBlock) {
+            .instructions = (InstructionList) {
+                .size = aot->count,
+                .count = aot->count,
+                .opcodes = aot->opcodes,
+            },
+            .codesource = (CodeSourceList) {
+                .filename = module->filename,
+                .size = aot->nLines,
+                .count = aot->nLines,
+                .offsets = aot->lines,
+            },
+        };
+
+        code = contexts[i] = GC_MALLOC(sizeof(CodeContext));
+        *code = (CodeContext) {
+            .nConstants = aot->nConstants,
+            .sizeConstants = aot->nConstants,
+            .constants = GC_MALLOC((aot->nConstants + 1) * sizeof(Constant)),
+            .nParameters = aot->nParameters,
+            .nLoops = aot->nLoops,
+            .stacksize = aot->stacksize,
+            .block = block,
+            .locals = (LocalsList) {
+                .size = aot->nLocals,
+                .count = aot->nLocals,
+                .names = GC_MALLOC((aot->nLocals + 1) * sizeof(Constant)),
+            },
+            .jit = LoxJIT_fromNative(aot->native, aot->opcodes),
+        };
+
+        for (j = 0; j < aot->nLocals; j++) {
+            value = (Object*) String_intern(aot->locals[j],
+                strlen(aot->locals[j]));
+            INCREF(value);
+            code->locals.names[j] = (Constant) {
+                .value = value,
+                .hash = HASHVAL(value),
+            };
+        }
+    }
+
+    // Constants can refer to any of the contexts
+    for (i = 0, aot = module->codes; i < module->count; i++, aot++) {
+        code = contexts[i];
+        for (j = 0; j < aot->nConstants; j++) {
+            value = aot_load_constant(aot->constants + j, contexts);
+            INCREF(value);
+            code->constants[j] = (Constant) {
+                .value = value,
+                .hash = HASHVAL(value),
+            };
+            aot->values[j] = LoxValue_fromObject(value);
+
+            if (aot->constants[j].kind == AOT_CODE)
+                contexts[aot->constants[j].integer]->prev = code;
+        }
+    }
+
+    return contexts[0];
+}
+
+/**
+ * Entry point of a compiled program: load the module and run the script.
+ */
+int
+LoxAOT_main(const AotModule *module) {
+    GC_INIT();
+
+    // Everything is already native, and anything compiled at run-time can
+    // still be picked up by the JIT
+    LoxVM_JitEnabled = true;
+
+    LoxVM_evalCode(LoxAOT_load(module));
+    return 0;
+}
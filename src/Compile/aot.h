@@ -0,0 +1,106 @@
+#ifndef COMPILE_AOT_H
+#define COMPILE_AOT_H
+
+#include <stdio.h>
+
+#include "vm.h"
+#include "jit.h"
+
+// Constants of the compiled code, which are rebuilt when the program starts
+enum aot_constant_kind {
+    AOT_NIL = 0,
+    AOT_TRUE,
+    AOT_FALSE,
+    AOT_INTEGER,
+    AOT_FLOAT,
+    AOT_STRING,
+    AOT_CODE,                               // `integer` is the index of the code
+}
+__attribute__((packed));
+
+typedef struct aot_constant {
+    enum aot_constant_kind kind;
+    long long           integer;
+    long double         real;
+    const char          *characters;        // String (or name of the code)
+    unsigned            length;
+} AotConstant;
+
+// A CodeContext compiled to C. The `values` are filled in from the
+// `constants` when the module is loaded.
+typedef struct aot_code {
+    Instruction         *opcodes;
+    unsigned            count;
+    CodeSource          *lines;
+    unsigned            nLines;
+    const AotConstant   *constants;
+    LoxValue            *values;
+    unsigned            nConstants;
+    const char * const  *locals;
+    unsigned            nLocals;
+    unsigned            nParameters;
+    unsigned            nLoops;
+    unsigned            stacksize;
+    JitNative           native;
+} AotCode;
+
+typedef struct aot_module {
+    const char          *filename;
+    const AotCode       *codes;             // The first is the script itself
+    unsigned            count;
+} AotModule;
+
+int LoxAOT_emit(CodeContext*, const char*, FILE*);
+CodeContext* LoxAOT_load(const AotModule*);
+int LoxAOT_main(const AotModule*);
+
+// Used by the generated code. Each function keeps the top of the operand
+// stack in `stack` and the instructions it was compiled from in `opcodes`.
+#define AOT_EXIT(index) do { \
+    frame->stack = stack; \
+    return opcodes + (index); \
+} while (0)
+
+#define AOT_CALL(helper, index) stack = helper(frame, stack, opcodes + (index))
+
+#define AOT_ISTRUE(value) ({ \
+    LoxValue _value = (value); \
+    _value == VALUE_TRUE || (_value != VALUE_FALSE && LoxValue_isTrue(_value)); \
+})
+
+#define AOT_POP_ISTRUE() ({ \
+    LoxValue _value = POP(stack); \
+    _value == VALUE_TRUE || (_value != VALUE_FALSE && vmeval_pop_istrue(_value)); \
+})
+
+#define AOT_STORE_LOCAL(index) do { \
+    LoxValue _old = locals[index]; \
+    locals[index] = POP(stack); \
+    VALUE_DECREF(_old); \
+} while (0)
+
+// Integer fast paths for `+`, `-` and comparisons. Anything else (or a result
+// which does not fit) is left to the interpreter's instruction body.
+#define AOT_INT_MATH(operator, index) do { \
+    LoxValue _a = stack[-2], _b = stack[-1]; \
+    long long _result; \
+    if (VALUE_IS_INT(_a) && VALUE_IS_INT(_b) \
+            && VALUE_INT_FITS(_result = VALUE_AS_INT(_a) operator VALUE_AS_INT(_b))) { \
+        stack[-2] = VALUE_FROM_INT(_result); \
+        stack--; \
+    } \
+    else \
+        AOT_CALL(vmeval_op_binary_math, index); \
+} while (0)
+
+#define AOT_INT_COMPARE(operator, index) do { \
+    LoxValue _a = stack[-2], _b = stack[-1]; \
+    if (VALUE_IS_INT(_a) && VALUE_IS_INT(_b)) { \
+        stack[-2] = VALUE_FROM_BOOL(VALUE_AS_INT(_a) operator VALUE_AS_INT(_b)); \
+        stack--; \
+    } \
+    else \
+        AOT_CALL(vmeval_op_compare, index); \
+} while (0)
+
+#endif
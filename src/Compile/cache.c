@@ -0,0 +1,884 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "vm.h"
+#include "cache.h"
+#include "compile.h"
+#include "Objects/boolean.h"
+#include "Objects/float.h"
+#include "Objects/function.h"
+#include "Objects/integer.h"
+#include "Objects/string.h"
+#include "Parse/parse.h"
+#include "Parse/stream.h"
+#include "Vendor/bdwgc/include/gc.h"
+
+/**
+ * Bytecode cache. The CodeContext tree compiled from `script.lox` is written
+ * to `script.loxc` next to it, and is loaded instead of compiling the script
+ * again for as long as the size, mtime and hash of the source still match.
+ *
+ * Function bodies are compiled on the first call, so the cache is written
+ * when the interpreter exits (see LoxCache_flush) with the bodies compiled
+ * by then. The others are written as stubs, which stay lazy when loaded: the
+ * script is parsed again for the function if one is called. The text it is
+ * parsed from is the one read to check the cache, which is kept while there
+ * are stubs, so the script can change on disk meanwhile. The cache is written
+ * again if a run compiles any of them.
+ *
+ * The file is mapped privately and the instructions and source lines are
+ * used from the mapping in place (so quickening them only touches private
+ * pages). The constants and local names are rebuilt as objects. The code
+ * contexts are listed depth-first with the script itself first, and a code
+ * constant refers to its context by index. Every record is padded to eight
+ * bytes:
+ *
+ *   LoxcHeader
+ *   for each context:
+ *     LoxcContext
+ *     Instruction[nInstructions]
+ *     CodeSource[nLines]
+ *     LoxcConstant[nConstants], each followed by its payload (a stub is
+ *       followed by a LoxcStub, the function and class names of its
+ *       CompileInfo and the names of its upvalues)
+ *     LoxcConstant[nLocals] (strings), the names of the locals
+ *
+ * The `owner` of the methods of a class is set when the class is built, so
+ * it is not part of the cache.
+ */
+bool LoxCache_Enabled = true;
+
+#define LOXC_MAGIC "LOXC"
+
+typedef struct loxc_header {
+    char            magic[4];
+    uint16_t        version;            // LOXC_VERSION
+    uint16_t        nOpcodes;           // __OP_MAX
+    uint32_t        nContexts;
+    uint32_t        optimize;           // LoxCompile_OptimizeLevel
+    int64_t         mtime;              // Of the source file
+    uint64_t        size;
+    uint64_t        hash;               // Of the source text
+} LoxcHeader;
+
+typedef struct loxc_context {
+    uint32_t        nInstructions;
+    uint32_t        nLines;
+    uint32_t        nConstants;
+    uint32_t        nLocals;
+    uint32_t        nParameters;
+    uint32_t        nLoops;
+    uint32_t        stacksize;
+    uint32_t        reserved;
+} LoxcContext;
+
+enum loxc_constant_kind {
+    LOXC_NIL = 0,
+    LOXC_TRUE,
+    LOXC_FALSE,
+    LOXC_INTEGER,
+    LOXC_FLOAT,                         // Followed by a long double
+    LOXC_STRING,                        // Followed by the characters
+    LOXC_CODE,                          // `integer` is the index of the code,
+                                        // followed by the name (if any)
+    LOXC_STUB,                          // Function body not compiled yet,
+                                        // followed by the name (if any)
+};
+
+typedef struct loxc_constant {
+    uint32_t        kind;
+    uint32_t        length;             // Of the characters which follow
+    int64_t         integer;
+} LoxcConstant;
+
+// What the compiler needs to compile a stub, see CompileDeferred
+typedef struct loxc_stub {
+    uint32_t        line;               // Of the function in the source
+    uint32_t        offset;
+    uint32_t        flags;
+    uint32_t        hasInfo;
+    uint32_t        nUpvalues;
+    uint32_t        reserved;
+} LoxcStub;
+
+#define LOXC_ALIGN(size) (((size) + 7) & ~(size_t) 7)
+
+// Identity of the source text which the cache was compiled from
+typedef struct loxc_source {
+    int64_t         mtime;
+    uint64_t        size;
+    uint64_t        hash;
+} LoxcSource;
+
+/* Identify the source read from `input`, whose text is returned in `text` */
+static bool
+cache_source_identify(FILE *input, LoxcSource *source, char **text) {
+    struct stat info;
+    char *buffer;
+    size_t length;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    if (fstat(fileno(input), &info) != 0 || !S_ISREG(info.st_mode))
+        return false;
+
+    // FNV-1a of the text. The file is rewound for the compiler afterwards.
+    buffer = GC_MALLOC_ATOMIC(info.st_size + 1);
+    length = fread(buffer, 1, info.st_size, input);
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ (unsigned char) buffer[i]) * 0x100000001b3ULL;
+    rewind(input);
+
+    *source = (LoxcSource) {
+        .mtime = info.st_mtime,
+        .size = length,
+        .hash = hash,
+    };
+    *text = buffer;
+    return true;
+}
+
+// A script compiled through the cache, kept until the cache is written at
+// exit. `dirty` is set if the cache is missing or stale, or if any stub it
+// was loaded with has been compiled since.
+typedef struct cache_script {
+    const char      *path;              // Of the script
+    const char      *filename;
+    char            *cached;            // Of the cache file
+    LoxcSource      source;
+    CodeContext     *code;
+    bool            dirty;
+    char            *text;              // Of the source, while there are stubs
+    unsigned        stubs;              // Loaded from the cache
+    ASTNode         **ast;              // The script, parsed again for stubs
+    unsigned        nAst;
+    struct cache_script *next;
+} CacheScript;
+
+static CacheScript *cache_scripts;
+
+static char*
+cache_path(const char *path) {
+    size_t length = strlen(path);
+    char *cached = malloc(length + 2);
+
+    memcpy(cached, path, length);
+    cached[length] = 'c';
+    cached[length + 1] = 0;
+    return cached;
+}
+
+/* Writing ------------------------------------------------------------- */
+
+typedef struct cache_writer {
+    FILE            *output;
+    CodeContext     **codes;
+    unsigned        count, size;
+    bool            failed;
+} CacheWriter;
+
+static void
+cache_collect(CacheWriter *self, CodeContext *code) {
+    Constant *C;
+    unsigned i;
+
+    if (self->count == self->size) {
+        self->size = self->size ? self->size * 2 : 8;
+        self->codes = realloc(self->codes, self->size * sizeof(CodeContext*));
+    }
+    self->codes[self->count++] = code;
+
+    for (i = 0, C = code->constants; i < code->nConstants; i++, C++) {
+        // Bodies which haven't been compiled are written as stubs
+        if (VmCode_isVmCode(C->value) && ((LoxVmCode*) C->value)->context)
+            cache_collect(self, ((LoxVmCode*) C->value)->context);
+    }
+}
+
+static void
+cache_write(CacheWriter *self, const void *data, size_t length) {
+    static const char padding[8] = { 0 };
+
+    if (length && fwrite(data, length, 1, self->output) != 1)
+        self->failed = true;
+    if (LOXC_ALIGN(length) != length
+        && fwrite(padding, LOXC_ALIGN(length) - length, 1, self->output) != 1)
+        self->failed = true;
+}
+
+static void
+cache_write_string(CacheWriter *self, enum loxc_constant_kind kind,
+    int64_t integer, Object *string
+) {
+    LoxString *S = (LoxString*) string;
+    LoxcConstant record = {
+        .kind = kind,
+        .length = S ? S->length : 0,
+        .integer = integer,
+    };
+
+    cache_write(self, &record, sizeof(record));
+    if (S)
+        cache_write(self, S->characters, S->length);
+}
+
+static int
+cache_code_index(CacheWriter *self, CodeContext *code) {
+    unsigned i;
+    for (i = 0; i < self->count; i++) {
+        if (self->codes[i] == code)
+            return i;
+    }
+    assert(!"Code context was not collected");
+    return -1;
+}
+
+static void cache_write_stub(CacheWriter*, LoxVmCode*);
+
+static void
+cache_write_constant(CacheWriter *self, Object *value) {
+    LoxcConstant record = { 0 };
+
+    if (value == LoxNIL) {
+        record.kind = LOXC_NIL;
+    }
+    else if (value == (Object*) LoxTRUE) {
+        record.kind = LOXC_TRUE;
+    }
+    else if (value == (Object*) LoxFALSE) {
+        record.kind = LOXC_FALSE;
+    }
+    else if (Integer_isInteger(value)) {
+        record.kind = LOXC_INTEGER;
+        record.integer = ((LoxInteger*) value)->value;
+    }
+    else if (Float_isFloat(value)) {
+        long double real = ((LoxFloat*) value)->value;
+        record.kind = LOXC_FLOAT;
+        cache_write(self, &record, sizeof(record));
+        cache_write(self, &real, sizeof(real));
+        return;
+    }
+    else if (String_isString(value)) {
+        cache_write_string(self, LOXC_STRING, 0, value);
+        return;
+    }
+    else if (VmCode_isVmCode(value)) {
+        LoxVmCode *code = (LoxVmCode*) value;
+        if (code->context)
+            cache_write_string(self, LOXC_CODE,
+                cache_code_index(self, code->context), code->name);
+        else
+            cache_write_stub(self, code);
+        return;
+    }
+    else {
+        // Not something the compiler emits; don't cache this script
+        self->failed = true;
+        return;
+    }
+
+    cache_write(self, &record, sizeof(record));
+}
+
+static void
+cache_write_stub(CacheWriter *self, LoxVmCode *code) {
+    CompileDeferred *deferred = code->deferred;
+    unsigned i;
+
+    LoxcStub record = {
+        .line = deferred->line,
+        .offset = deferred->offset,
+        .flags = deferred->flags,
+        .hasInfo = deferred->has_info,
+        .nUpvalues = deferred->upvalues.count,
+    };
+
+    cache_write_string(self, LOXC_STUB, 0, code->name);
+    cache_write(self, &record, sizeof(record));
+    cache_write_constant(self, deferred->info.function_name
+        ? deferred->info.function_name : LoxNIL);
+    cache_write_constant(self, deferred->info.class_name
+        ? deferred->info.class_name : LoxNIL);
+
+    for (i = 0; i < deferred->upvalues.count; i++)
+        cache_write_constant(self, deferred->upvalues.names[i].value);
+}
+
+/*
+ * Write the instructions of the code as compiled. The code has been run, so
+ * the attribute access with an inline cache is turned back into the generic
+ * instruction (the other quickened instructions check their operands, and are
+ * fine to keep).
+ */
+static void
+cache_write_instructions(CacheWriter *self, CodeContext *code) {
+    InstructionList *instructions = &code->block->instructions;
+    Instruction *opcodes, *pc;
+    unsigned i;
+
+    if (!(opcodes = malloc(instructions->count * sizeof(Instruction)))) {
+        self->failed = true;
+        return;
+    }
+    memcpy(opcodes, instructions->opcodes, instructions->count * sizeof(Instruction));
+
+    for (i = 0, pc = opcodes; i < instructions->count; i++, pc++) {
+        switch (pc->op) {
+        case OP_GET_ATTR_CACHED:
+            *pc = (Instruction) { OP_GET_ATTR, code->attrCaches[pc->arg].name };
+            break;
+        case OP_SET_ATTR_CACHED:
+            *pc = (Instruction) { OP_SET_ATTR, code->attrCaches[pc->arg].name };
+            break;
+        case OP_LOAD_METHOD_CACHED:
+            *pc = (Instruction) { OP_LOAD_METHOD, code->attrCaches[pc->arg].name };
+            break;
+        default:
+            break;
+        }
+    }
+
+    cache_write(self, opcodes, instructions->count * sizeof(Instruction));
+    free(opcodes);
+}
+
+static void
+cache_write_context(CacheWriter *self, CodeContext *code) {
+    InstructionList *instructions = &code->block->instructions;
+    CodeSourceList *lines = &code->block->codesource;
+    unsigned i;
+
+    LoxcContext record = {
+        .nInstructions = instructions->count,
+        .nLines = lines->count,
+        .nConstants = code->nConstants,
+        .nLocals = code->locals.count,
+        .nParameters = code->nParameters,
+        .nLoops = code->nLoops,
+        .stacksize = code->stacksize,
+    };
+
+    cache_write(self, &record, sizeof(record));
+    cache_write_instructions(self, code);
+    cache_write(self, lines->offsets, lines->count * sizeof(CodeSource));
+
+    for (i = 0; i < code->nConstants; i++)
+        cache_write_constant(self, code->constants[i].value);
+
+    for (i = 0; i < code->locals.count; i++)
+        cache_write_string(self, LOXC_STRING, 0, code->locals.names[i].value);
+}
+
+/**
+ * Write the code compiled from the script to its cache. It is written to a
+ * temporary file first, so that a concurrent run never sees half of it.
+ * Returns non-zero if the cache could not be written.
+ */
+static int
+cache_store(CacheScript *script) {
+    const char *path = script->cached;
+    LoxcSource *source = &script->source;
+    char temporary[strlen(path) + 16];
+    unsigned i;
+
+    snprintf(temporary, sizeof(temporary), "%s.%d", path, (int) getpid());
+
+    CacheWriter self = { .output = fopen(temporary, "wb") };
+    if (!self.output)
+        return -1;
+
+    cache_collect(&self, script->code);
+
+    LoxcHeader header = {
+        .magic = LOXC_MAGIC,
+        .version = LOXC_VERSION,
+        .nOpcodes = __OP_MAX,
+        .nContexts = self.count,
+        .optimize = LoxCompile_OptimizeLevel,
+        .mtime = source->mtime,
+        .size = source->size,
+        .hash = source->hash,
+    };
+    cache_write(&self, &header, sizeof(header));
+
+    for (i = 0; i < self.count; i++)
+        cache_write_context(&self, self.codes[i]);
+
+    if (fclose(self.output) != 0)
+        self.failed = true;
+
+    if (self.failed || rename(temporary, path) != 0) {
+        unlink(temporary);
+        self.failed = true;
+    }
+
+    free(self.codes);
+    return self.failed ? -1 : 0;
+}
+
+/* Loading ------------------------------------------------------------- */
+
+typedef struct cache_reader {
+    char            *data;
+    size_t          size, offset;
+    CacheScript     *script;
+} CacheReader;
+
+// Take the next `length` bytes of the file, or NULL if it is truncated
+static void*
+cache_read(CacheReader *self, size_t length) {
+    void *data = self->data + self->offset;
+
+    if (length > self->size - self->offset
+            || LOXC_ALIGN(length) > self->size - self->offset)
+        return NULL;
+
+    self->offset += LOXC_ALIGN(length);
+    return data;
+}
+
+static Object* cache_read_stub(CacheReader*, LoxcConstant*, CodeContext**, unsigned,
+    CodeContext*);
+
+/* Read a constant of `outer`, whose code constants refer to `contexts` */
+static Object*
+cache_read_constant(CacheReader *self, CodeContext **contexts, unsigned count,
+    CodeContext *outer
+) {
+    LoxcConstant *record = cache_read(self, sizeof(LoxcConstant));
+    const char *characters, *data;
+    long double real;
+    Object *name = NULL;
+
+    if (!record)
+        return NULL;
+
+    switch (record->kind) {
+    case LOXC_NIL:
+        return LoxNIL;
+    case LOXC_TRUE:
+        return (Object*) LoxTRUE;
+    case LOXC_FALSE:
+        return (Object*) LoxFALSE;
+    case LOXC_INTEGER:
+        return (Object*) Integer_fromLongLong(record->integer);
+    case LOXC_FLOAT:
+        // (Records are only aligned to eight bytes)
+        if (!(data = cache_read(self, sizeof(long double))))
+            return NULL;
+        memcpy(&real, data, sizeof(real));
+        return (Object*) Float_fromLongDouble(real);
+    case LOXC_STRING:
+        if (!(characters = cache_read(self, record->length)))
+            return NULL;
+        return (Object*) String_intern(characters, record->length);
+    case LOXC_CODE:
+        if (record->integer < 1 || record->integer >= count)
+            return NULL;
+        if (record->length) {
+            if (!(characters = cache_read(self, record->length)))
+                return NULL;
+            name = (Object*) String_intern(characters, record->length);
+        }
+        return VmCode_new(name, contexts[record->integer]);
+    case LOXC_STUB:
+        return cache_read_stub(self, record, contexts, count, outer);
+    default:
+        return NULL;
+    }
+}
+
+static bool
+cache_read_constants(CacheReader *self, Constant *constants, unsigned count,
+    CodeContext **contexts, unsigned nContexts, CodeContext *outer
+) {
+    Object *value;
+
+    while (count--) {
+        if (!(value = cache_read_constant(self, contexts, nContexts, outer)))
+            return false;
+
+        INCREF(value);
+        *constants++ = (Constant) {
+            .value = value,
+            .hash = HASHVAL(value),
+        };
+    }
+    return true;
+}
+
+static Object*
+cache_read_stub(CacheReader *self, LoxcConstant *record, CodeContext **contexts,
+    unsigned count, CodeContext *outer
+) {
+    CompileDeferred *deferred;
+    LoxVmCode *code;
+    LoxcStub *stub;
+    const char *characters;
+    Object *name = NULL, *function_name, *class_name;
+
+    if (record->length) {
+        if (!(characters = cache_read(self, record->length)))
+            return NULL;
+        name = (Object*) String_intern(characters, record->length);
+    }
+
+    if (!(stub = cache_read(self, sizeof(LoxcStub)))
+        || !(function_name = cache_read_constant(self, contexts, count, outer))
+        || !(class_name = cache_read_constant(self, contexts, count, outer)))
+        return NULL;
+
+    deferred = GC_MALLOC(sizeof(CompileDeferred));
+    *deferred = (CompileDeferred) {
+        .outer = outer,
+        .upvalues = (LocalsList) {
+            .size = stub->nUpvalues,
+            .count = stub->nUpvalues,
+            .names = GC_MALLOC((stub->nUpvalues + 1) * sizeof(Constant)),
+        },
+        .flags = stub->flags,
+        .info = (CompileInfo) {
+            .function_name = function_name == LoxNIL ? NULL : function_name,
+            .class_name = class_name == LoxNIL ? NULL : class_name,
+        },
+        .has_info = stub->hasInfo,
+        .line = stub->line,
+        .offset = stub->offset,
+        .script = self->script,
+    };
+
+    if (!cache_read_constants(self, deferred->upvalues.names, stub->nUpvalues,
+            contexts, count, outer))
+        return NULL;
+
+    code = (LoxVmCode*) VmCode_new(name, NULL);
+    code->deferred = deferred;
+    self->script->stubs++;
+    return (Object*) code;
+}
+
+static CodeContext*
+cache_read_contexts(CacheReader *self, unsigned count, const char *filename) {
+    CodeContext **contexts = GC_MALLOC(count * sizeof(CodeContext*));
+    LoxcContext *record;
+    CodeContext *code;
+    CodeBlock *block;
+    Instruction *opcodes;
+    CodeSource *lines;
+    unsigned i, j;
+
+    // The contexts are allocated up front, since code constants can refer to
+    // any of them
+    for (i = 0; i < count; i++)
+        contexts[i] = GC_MALLOC(sizeof(CodeContext));
+
+    for (i = 0; i < count; i++) {
+        if (!(record = cache_read(self, sizeof(LoxcContext)))
+            || !(opcodes = cache_read(self, record->nInstructions * sizeof(Instruction)))
+            || !(lines = cache_read(self, record->nLines * sizeof(CodeSource)))
+            || record->nInstructions == 0)
+            return NULL;
+
+        block = GC_MALLOC(sizeof(CodeBlock));
+        *block = (CodeBlock) {
+            .instructions = (InstructionList) {
+                .size = record->nInstructions,
+                .count = record->nInstructions,
+                .opcodes = opcodes,
+            },
+            .codesource = (CodeSourceList) {
+                .filename = filename,
+                .size = record->nLines,
+                .count = record->nLines,
+                .offsets = lines,
+            },
+        };
+
+        code = contexts[i];
+        *code = (CodeContext) {
+            .nConstants = record->nConstants,
+            .sizeConstants = record->nConstants,
+            .constants = GC_MALLOC((record->nConstants + 1) * sizeof(Constant)),
+            .nParameters = record->nParameters,
+            .nLoops = record->nLoops,
+            .stacksize = record->stacksize,
+            .block = block,
+            .locals = (LocalsList) {
+                .size = record->nLocals,
+                .count = record->nLocals,
+                .names = GC_MALLOC((record->nLocals + 1) * sizeof(Constant)),
+            },
+        };
+
+        if (!cache_read_constants(self, code->constants, code->nConstants,
+                contexts, count, code)
+            || !cache_read_constants(self, code->locals.names, code->locals.count,
+                contexts, count, code))
+            return NULL;
+
+        for (j = 0; j < code->nConstants; j++) {
+            if (VmCode_isVmCode(code->constants[j].value)
+                    && ((LoxVmCode*) code->constants[j].value)->context)
+                ((LoxVmCode*) code->constants[j].value)->context->prev = code;
+        }
+        compile_immortalize_constants(code);
+    }
+
+    return contexts[0];
+}
+
+/**
+ * Load the code cached for the script, if it was compiled from the source.
+ * The mapping is never released, since the instructions are run from it.
+ */
+static CodeContext*
+cache_load(CacheScript *script) {
+    struct stat info;
+    CodeContext *code = NULL;
+    LoxcHeader *header;
+    CacheReader self;
+    int fd;
+
+    if ((fd = open(script->cached, O_RDONLY)) < 0)
+        return NULL;
+
+    if (fstat(fd, &info) != 0 || info.st_size < sizeof(LoxcHeader)) {
+        close(fd);
+        return NULL;
+    }
+
+    self = (CacheReader) { .size = info.st_size, .script = script };
+    self.data = mmap(NULL, self.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (self.data == MAP_FAILED)
+        return NULL;
+
+    header = cache_read(&self, sizeof(LoxcHeader));
+    if (memcmp(header->magic, LOXC_MAGIC, sizeof(header->magic)) == 0
+            && header->version == LOXC_VERSION
+            && header->nOpcodes == __OP_MAX
+            && header->optimize == LoxCompile_OptimizeLevel
+            && header->mtime == script->source.mtime
+            && header->size == script->source.size
+            && header->hash == script->source.hash
+            && header->nContexts > 0)
+        code = cache_read_contexts(&self, header->nContexts, script->filename);
+
+    if (!code)
+        munmap(self.data, self.size);
+
+    return code;
+}
+
+/**
+ * Compile the script read from `input`, which was opened from `path`. The
+ * cache next to the script is used if it is still valid, and otherwise
+ * (re)written when the interpreter exits.
+ */
+CodeContext*
+LoxCache_compileFile(FILE *input, const char *path, const char *filename) {
+    Compiler compiler = { .flags = 0 };
+    CacheScript *script;
+    LoxcSource source;
+    char *text;
+
+    if (!LoxCache_Enabled || !cache_source_identify(input, &source, &text))
+        return compile_file(&compiler, input, filename);
+
+    script = GC_MALLOC(sizeof(CacheScript));
+    *script = (CacheScript) {
+        .path = GC_STRNDUP(path, strlen(path)),
+        .filename = GC_STRNDUP(filename, strlen(filename)),
+        .cached = cache_path(path),
+        .source = source,
+        .text = text,
+        .next = cache_scripts,
+    };
+
+    if (!(script->code = cache_load(script))) {
+        script->code = compile_file(&compiler, input, filename);
+        script->dirty = true;
+    }
+
+    // Nothing will be parsed from the text without stubs
+    if (!script->stubs)
+        script->text = NULL;
+
+    if (script->code)
+        cache_scripts = script;
+
+    return script->code;
+}
+
+/**
+ * Write the cache of the scripts compiled in this run, or whose cached stubs
+ * were compiled since they were loaded.
+ */
+void
+LoxCache_flush(void) {
+    CacheScript *script;
+
+    for (script = cache_scripts; script; script = script->next) {
+        if (script->dirty)
+            cache_store(script);
+        script->dirty = false;
+    }
+}
+
+static ASTFunction*
+cache_find_function(ASTNode *node, unsigned line, unsigned offset) {
+    ASTFunction *found;
+
+#define FIND(child) do { \
+    if ((found = cache_find_function((child), line, offset))) \
+        return found; \
+} while (0)
+
+    for (; node; node = node->next) {
+        switch (node->type) {
+        case AST_FUNCTION:
+            if (node->line == line && node->offset == offset)
+                return (ASTFunction*) node;
+            FIND(((ASTFunction*) node)->arglist);
+            FIND(((ASTFunction*) node)->block);
+            break;
+        case AST_ASSIGNMENT:
+            FIND(((ASTAssignment*) node)->expression);
+            break;
+        case AST_EXPRESSION:
+            FIND(((ASTExpression*) node)->lhs);
+            FIND(((ASTExpression*) node)->rhs);
+            break;
+        case AST_UNARY:
+            FIND(((ASTUnary*) node)->expr);
+            break;
+        case AST_RETURN:
+            FIND(((ASTReturn*) node)->expression);
+            break;
+        case AST_PARAM:
+            FIND(((ASTFuncParam*) node)->default_value);
+            break;
+        case AST_WHILE:
+            FIND(((ASTWhile*) node)->condition);
+            FIND(((ASTWhile*) node)->block);
+            break;
+        case AST_FOR:
+            FIND(((ASTFor*) node)->initializer);
+            FIND(((ASTFor*) node)->condition);
+            FIND(((ASTFor*) node)->post_loop);
+            FIND(((ASTFor*) node)->block);
+            break;
+        case AST_IF:
+            FIND(((ASTIf*) node)->condition);
+            FIND(((ASTIf*) node)->block);
+            FIND(((ASTIf*) node)->otherwise);
+            break;
+        case AST_VAR:
+            FIND(((ASTVar*) node)->expression);
+            break;
+        case AST_INVOKE:
+            FIND(((ASTInvoke*) node)->callable);
+            FIND(((ASTInvoke*) node)->args);
+            break;
+        case AST_CLASS:
+            FIND(((ASTClass*) node)->extends);
+            FIND(((ASTClass*) node)->body);
+            break;
+        case AST_ATTRIBUTE:
+            FIND(((ASTAttribute*) node)->object);
+            FIND(((ASTAttribute*) node)->value);
+            break;
+        case AST_SLICE:
+            FIND(((ASTSlice*) node)->object);
+            FIND(((ASTSlice*) node)->start);
+            FIND(((ASTSlice*) node)->end);
+            FIND(((ASTSlice*) node)->step);
+            FIND(((ASTSlice*) node)->value);
+            break;
+        case AST_TUPLE_LITERAL:
+            FIND(((ASTTupleLiteral*) node)->items);
+            break;
+        case AST_INTERPOL_STRING:
+            FIND(((ASTInterpolatedString*) node)->items);
+            break;
+        case AST_INTERPOLATED:
+            FIND(((ASTInterpolatedExpr*) node)->expr);
+            break;
+        case AST_TABLE_LITERAL:
+            FIND(((ASTTableLiteral*) node)->keys);
+            FIND(((ASTTableLiteral*) node)->values);
+            break;
+        case AST_FOREACH:
+            FIND(((ASTForeach*) node)->iterable);
+            FIND(((ASTForeach*) node)->block);
+            break;
+        case AST_ASSERT:
+            FIND(((ASTAssert*) node)->expression);
+            FIND(((ASTAssert*) node)->message);
+            break;
+        default:
+            break;
+        }
+    }
+#undef FIND
+
+    return NULL;
+}
+
+/* Parse the script again, from the text its cache was loaded for */
+static bool
+cache_parse_script(CacheScript *script) {
+    Stream stream;
+    Parser parser;
+    ASTNode *node;
+    unsigned size = 0;
+
+    if (!script->text)
+        return false;
+
+    stream_init_buffer(&stream, script->text, script->source.size);
+    stream.name = (char*) script->filename;
+    parser_init(&parser, &stream);
+    while ((node = parser.next(&parser))) {
+        if (script->nAst == size) {
+            size = size ? size * 2 : 64;
+            script->ast = GC_REALLOC(script->ast, size * sizeof(ASTNode*));
+        }
+        script->ast[script->nAst++] = node;
+    }
+
+    return true;
+}
+
+/**
+ * Find the node of a function body loaded from the cache as a stub. The
+ * cached script is parsed once, when the first of its stubs is compiled.
+ */
+ASTFunction*
+LoxCache_findFunction(CompileDeferred *deferred) {
+    CacheScript *script = deferred->script;
+    ASTFunction *found;
+    unsigned i;
+
+    if (!script || (!script->ast && !cache_parse_script(script)))
+        return NULL;
+
+    for (i = 0; i < script->nAst; i++) {
+        if ((found = cache_find_function(script->ast[i], deferred->line,
+                deferred->offset))) {
+            // The body compiled from it has to be cached next time
+            script->dirty = true;
+            return found;
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,21 @@
+#ifndef COMPILE_CACHE_H
+#define COMPILE_CACHE_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "vm.h"
+
+// Bump whenever the instructions or the layout of the cache files change, so
+// that caches written by older builds are ignored
+#define LOXC_VERSION 8
+
+extern bool LoxCache_Enabled;
+
+struct compile_deferred;
+
+CodeContext* LoxCache_compileFile(FILE*, const char*, const char*);
+struct ast_fun* LoxCache_findFunction(struct compile_deferred*);
+void LoxCache_flush(void);
+
+#endif
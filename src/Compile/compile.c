@@ -1,15 +1,21 @@
 #include <assert.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 
 #include "vm.h"
+#include "cache.h"
 #include "compile.h"
 #include "Parse/debug_parse.h"
 #include "Objects/function.h"
 #include "Vendor/bdwgc/include/gc.h"
 
+unsigned LoxCompile_OptimizeLevel = 1;
+CompileStats LoxCompile_Stats;
+
 static unsigned compile_node_count(Compiler *self, ASTNode* ast, unsigned *count);
 static unsigned compile_node(Compiler *self, ASTNode* ast);
 static unsigned compile_node1(Compiler *self, ASTNode* ast);
@@ -68,27 +74,18 @@ compile_push_context(Compiler* self) {
     compile_start_block(self);
 }
 
-static inline CodeBlock*
-compile_pop_block(Compiler *self) {
-    CodeBlock *rv = self->context->block;
-    self->context->block = rv->prev;
-    return rv;
-}
-
-static CodeBlock*
-compile_block(Compiler *self, ASTNode* node) {
-    compile_start_block(self);
-    compile_node(self, node);
-    return compile_pop_block(self);
+// Grow a list by half again, for amortized constant-time appends
+static inline unsigned
+compile_grow_size(unsigned size) {
+    return size < 8 ? 8 : size + size / 2;
 }
 
-
 static inline void
 compile_block_ensure_size(CodeBlock *block, unsigned size) {
     InstructionList *instructions = &block->instructions;
     if (instructions->size < size) {
         while (instructions->size < size)
-            instructions->size += 16;
+            instructions->size = compile_grow_size(instructions->size);
 
         instructions->opcodes = GC_REALLOC(instructions->opcodes,
             instructions->size * sizeof(Instruction));
@@ -99,83 +96,143 @@ static inline void
 compile_source_ensure_size(CodeBlock *block, unsigned size) {
     if (block->codesource.size < size) {
         while (block->codesource.size < size)
-            block->codesource.size += 16;
+            block->codesource.size = compile_grow_size(block->codesource.size);
 
         block->codesource.offsets = GC_REALLOC(block->codesource.offsets,
             block->codesource.size * sizeof(CodeSource));
     }
 }
 
-static unsigned
-compile_merge_block_into(Compiler *self, CodeBlock *dst, CodeBlock *src) {
-    compile_block_ensure_size(dst, dst->instructions.count
-        + src->instructions.count);
-    Instruction *i = src->instructions.opcodes;
-    unsigned rv = JUMP_LENGTH(src);
-    for (; src->instructions.count--; i++)
-        *(dst->instructions.opcodes + dst->instructions.count++) = *i;
-
-    // And, copy the corresponding source location pointers
-    CodeSource *tail = dst->codesource.offsets + dst->codesource.count - 1;
-    CodeSource *head = src->codesource.offsets;
-    int count = src->codesource.count;
-
-    if (head->line_number == tail->line_number) {
-        tail->opcode_count += head->opcode_count;
-        head++;
-        count--;
-    }
+// Slot for a hash in the index. Integers hash to themselves (and floats to
+// their integer part), so the bits are mixed to avoid long runs of slots
+// in use, which make linear probing slow.
+static inline unsigned
+compile_index_slot(hashval_t hash, unsigned mask) {
+    unsigned long long bits = hash;
 
-    if (count) {
-        compile_source_ensure_size(dst, dst->codesource.count + count);
-    }
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    return bits & mask;
+}
+
+static inline void
+compile_index_insert(ConstantIndex *index, const Constant *list, unsigned position) {
+    unsigned mask = index->size - 1,
+        slot = compile_index_slot(list[position].hash, mask);
+
+    while (index->slots[slot])
+        slot = (slot + 1) & mask;
+
+    index->slots[slot] = position + 1;
+}
 
-    while (count--) {
-        *(dst->codesource.offsets + dst->codesource.count++) = *head;
-        head++;
+/**
+ * Bring the index up to date with the first `count` items of the list. Items
+ * are added to the index lazily, so lists filled in directly (by the cache
+ * and AOT loaders) are indexed the first time they are searched.
+ */
+static void
+compile_index_update(ConstantIndex *index, const Constant *list, unsigned count) {
+    unsigned size = index->size ? index->size : 16;
+
+    // Keep the table at most half full
+    while (size < count * 2)
+        size *= 2;
+
+    if (size != index->size) {
+        index->slots = GC_MALLOC_ATOMIC(size * sizeof(unsigned));
+        memset(index->slots, 0, size * sizeof(unsigned));
+        index->size = size;
+        index->count = 0;
     }
 
-    return rv;
+    for (; index->count < count; index->count++)
+        compile_index_insert(index, list, index->count);
 }
 
-static inline unsigned
-compile_merge_block(Compiler *self, CodeBlock* block) {
-    return compile_merge_block_into(self, self->context->block, block);
+/**
+ * Find the position of `value` in a list of constants (or local names) in
+ * about constant time, which keeps the compile time of large scripts linear.
+ * Items are matched by hash, type and `compare`. Returns -1 if `value` is
+ * not in the list.
+ */
+static int
+compile_index_find(ConstantIndex *index, const Constant *list, unsigned count,
+    Object *value, hashval_t hash
+) {
+    const Constant *C;
+    unsigned mask, slot, position;
+
+    compile_index_update(index, list, count);
+
+    mask = index->size - 1;
+    slot = compile_index_slot(hash, mask);
+    while ((position = index->slots[slot])) {
+        C = list + position - 1;
+        if (C->hash == hash
+            && OBJECT_TYPE(C->value) == OBJECT_TYPE(value)
+            && 0 == OBJECT_TYPE(value)->compare(value, C->value)
+        ) {
+            return position - 1;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    return -1;
 }
 
-static unsigned short
-compile_emit_constant(Compiler *self, Object *value) {
-    CodeContext *context = self->context;
-    unsigned short index = 0;
+/**
+ * Find or add `value` in the constants of the context, and return its index
+ */
+unsigned
+compile_context_constant(CodeContext *context, Object *value) {
+    hashval_t hash = (OBJECT_TYPE(value)->hash) ? OBJECT_TYPE(value)->hash(value) : 0;
+    int index = compile_index_find(&context->constantsIndex, context->constants,
+        context->nConstants, value, hash);
+    Constant *C;
 
     // Short-circuit this process for emitting repeat constants
-    Constant *C = context->constants;
-    while (index < context->nConstants) {
-        if (C->value->type == value->type
-                && 0 == value->type->compare(value, C->value))
-            return index;
-        index++;
-        C++;
-    }
+    if (index >= 0)
+        return index;
 
     if (context->nConstants == context->sizeConstants) {
-        unsigned new_size = context->sizeConstants + 8;
+        unsigned new_size = compile_grow_size(context->sizeConstants);
         C = GC_REALLOC(context->constants, new_size * sizeof(Constant));
         if (!C)
             // TODO: Raise compiler error?
             return 0;
         context->constants = C;
+        context->sizeConstants = new_size;
     }
 
     index = context->nConstants++;
     *(context->constants + index) = (Constant) {
         .value = value,
-        .hash = (value->type->hash) ? value->type->hash(value) : 0,
+        .hash = hash,
     };
     INCREF(value);
     return index;
 }
 
+/**
+ * The constants are kept for as long as the code, which is for the rest of
+ * the run. Once the code is finished, they are made immortal so that pushing
+ * them on the operand stack does not write to them.
+ */
+void
+compile_immortalize_constants(CodeContext *context) {
+    unsigned i;
+
+    for (i = 0; i < context->nConstants; i++)
+        LoxObject_Immortalize(context->constants[i].value);
+}
+
+static inline unsigned
+compile_emit_constant(Compiler *self, Object *value) {
+    return compile_context_constant(self->context, value);
+}
+
 static void
 compile_source_record_location(CodeBlock *block, ASTNode *node) {
     // Check if last-recorded location is still the same
@@ -203,7 +260,7 @@ compile_source_record_location(CodeBlock *block, ASTNode *node) {
 }
 
 static unsigned
-compile_emit_into(CodeBlock *block, enum opcode op, short argument) {
+compile_emit_into(CodeBlock *block, enum opcode op, int argument) {
     compile_block_ensure_size(block, block->instructions.count + 1);
     *(block->instructions.opcodes + block->instructions.count++) = (Instruction) {
         .op = op,
@@ -214,7 +271,7 @@ compile_emit_into(CodeBlock *block, enum opcode op, short argument) {
 }
 
 static inline unsigned
-compile_emit(Compiler* self, enum opcode op, short argument, ASTNode *node) {
+compile_emit(Compiler* self, enum opcode op, int argument, ASTNode *node) {
     unsigned length = compile_emit_into(self->context->block, op, argument);
 
     compile_source_record_location(self->context->block, node);
@@ -222,67 +279,426 @@ compile_emit(Compiler* self, enum opcode op, short argument, ASTNode *node) {
     return length;
 }
 
+/**
+ * Jumps are emitted straight into the block. The target of a forward jump is
+ * not known yet, so the jump is emitted with an argument of zero and its
+ * index is returned to be passed to compile_patch_jump() once the code at the
+ * target is about to be emitted. A backward jump goes to a label, which is
+ * the index of an instruction emitted earlier (see compile_label()).
+ */
+static inline unsigned
+compile_label(Compiler *self) {
+    return self->context->block->instructions.count;
+}
+
+static inline unsigned
+compile_emit_jump(Compiler *self, enum opcode op, ASTNode *node) {
+    unsigned index = compile_label(self);
+
+    compile_emit(self, op, 0, node);
+    return index;
+}
+
+static void
+compile_set_jump(Compiler *self, unsigned index, unsigned target) {
+    // Jumps are relative to the instruction following them
+    long offset = (long) target - index - 1;
+
+    if (offset < INSTRUCTION_ARG_MIN || offset > INSTRUCTION_ARG_MAX)
+        compile_error(self, "Jump is too far (%ld instructions)", offset);
+
+    (self->context->block->instructions.opcodes + index)->arg = offset;
+}
+
+// Point the jump at `index` to the next instruction to be emitted
+static inline void
+compile_patch_jump(Compiler *self, unsigned index) {
+    compile_set_jump(self, index, compile_label(self));
+}
+
+static inline unsigned
+compile_emit_loop(Compiler *self, enum opcode op, unsigned label, ASTNode *node) {
+    unsigned index = compile_emit_jump(self, op, node);
+
+    compile_set_jump(self, index, label);
+    return 1;
+}
+
+/**
+ * Net change of the operand stack depth when the instruction runs. For
+ * branching instructions, `jump` receives the change along the branch.
+ */
 static int
-compile_locals_islocal(CodeContext *context, Object *name, hashval_t hash) {
-    assert(name->type->compare);
+compile_stack_effect(const Instruction *op, int *jump) {
+    *jump = 0;
 
-    int index = 0;
-    LocalsList *locals = &context->locals;
+    switch (op->op) {
+    case OP_POP_JUMP_IF_TRUE:
+    case OP_POP_JUMP_IF_FALSE:
+        *jump = -1;
+        return -1;
 
-    // Direct search through the locals list
-    while (index < locals->count) {
-        if ((locals->names + index)->hash == hash
-            && 0 == name->type->compare(name, (locals->names + index)->value)
-        ) {
-            // Already in the locals list
-            return index;
+    case OP_JUMP_IF_FALSE_OR_POP:
+    case OP_JUMP_IF_TRUE_OR_POP:
+    case OP_POP_TOP:
+    case OP_RETURN:
+    case OP_STORE:
+    case OP_STORE_LOCAL:
+    case OP_STORE_GLOBAL:
+    case OP_STORE_CLOSED:
+    case OP_STORE_CELL:
+    case OP_COMPARE:
+    case OP_BINARY_MATH:
+    case OP_GET_ITEM:
+    case OP_ADD_INT_INT:
+    case OP_SUB_INT_INT:
+    case OP_MUL_INT_INT:
+    case OP_ADD_FLOAT_FLOAT:
+    case OP_SUB_FLOAT_FLOAT:
+    case OP_MUL_FLOAT_FLOAT:
+    case OP_DIV_FLOAT_FLOAT:
+    case OP_ADD_STR_STR:
+    case OP_EQ_INT_INT:
+    case OP_NOT_EQ_INT_INT:
+    case OP_LT_INT_INT:
+    case OP_LTE_INT_INT:
+    case OP_GT_INT_INT:
+    case OP_GTE_INT_INT:
+        return -1;
+
+    case OP_ASSERT:
+        if (op->arg & ASSERT_FLAG_FAILED)
+            return (op->arg & ASSERT_FLAG_HAS_MESSAGE) ? -1 : 0;
+        return -1;
+
+    case OP_DUP_TOP:
+    case OP_LOOKUP:
+    case OP_LOOKUP_LOCAL:
+    case OP_LOOKUP_GLOBAL:
+    case OP_LOOKUP_CLOSED:
+    case OP_LOOKUP_CELL:
+    case OP_CAPTURE_LOCAL:
+    case OP_CAPTURE_CLOSED:
+    case OP_CONSTANT:
+    case OP_THIS:
+    case OP_SUPER:
+    case OP_LOAD_METHOD:
+    case OP_LOAD_METHOD_CACHED:
+        return 1;
+
+    case OP_SET_ATTR:
+    case OP_SET_ATTR_CACHED:
+    case OP_DEL_ITEM:
+        return -2;
+
+    case OP_SET_ITEM:
+        return -3;
+
+    case OP_CALL_FUN:
+    case OP_CLOSE_FUN:
+        return -op->arg;
+    case OP_RECURSE:
+        return 1 - op->arg;
+    case OP_CALL_METHOD:
+        return -op->arg - 1;
+
+    case OP_BUILD_CLASS:
+        return 1 - 2 * op->arg;
+    case OP_BUILD_SUBCLASS:
+        return -2 * op->arg;
+    case OP_BUILD_TUPLE:
+    case OP_BUILD_STRING:
+        return 1 - op->arg;
+    case OP_BUILD_TABLE:
+        return 1 - 2 * op->arg;
+
+    case OP_LEAVE_BLOCK:
+        return -op->arg;
+
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Find the instruction to which `op` (at `index`) may branch. Returns -1 if
+ * the instruction does not branch.
+ */
+int
+compile_jump_target(const Instruction *opcodes, int index) {
+    const Instruction *op = opcodes + index;
+    int j;
+
+    switch (op->op) {
+    case OP_JUMP:
+    case OP_JUMP_IF_TRUE:
+    case OP_POP_JUMP_IF_TRUE:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_FALSE_OR_POP:
+    case OP_JUMP_IF_TRUE_OR_POP:
+        return index + op->arg + 1;
+
+    case OP_BREAK:
+    case OP_CONTINUE:
+    case OP_NEXT_OR_BREAK:
+    case OP_FOR_RANGE:
+        // Find the innermost loop block
+        for (j = index - 1; j >= 0; j--) {
+            if (opcodes[j].op == OP_ENTER_BLOCK && j + opcodes[j].arg >= index)
+                return (op->op == OP_CONTINUE) ? j + 1 : j + opcodes[j].arg + 1;
         }
-        index++;
+    default:
+        return -1;
     }
+}
 
-    return -1;
+bool
+compile_is_terminal(const Instruction *op) {
+    switch (op->op) {
+    case OP_JUMP:
+    case OP_RETURN:
+    case OP_HALT:
+    case OP_BREAK:
+    case OP_CONTINUE:
+        return true;
+    case OP_ASSERT:
+        return op->arg & ASSERT_FLAG_FAILED;
+    default:
+        return false;
+    }
 }
 
 /**
- * Returns 0-based local slot of local variable in the immediately-outer closed
- * context. Returns -1 if the context is not nested or the variable is not
- * closed in the outer context.
+ * Compute the maximum depth of the operand stack for the code in the
+ * context by following every path through the instructions.
  */
-static int
-compile_locals_isclosed(Compiler *self, Object *name) {
-    if (!self->context->prev)
-        return -1;
+static unsigned
+compile_stack_depth(CodeContext *context) {
+    InstructionList *instructions = &context->block->instructions;
+    Instruction *op;
+    int count = instructions->count, max = 0, depth, effect, jump, target, i;
 
-    hashval_t hash = HASHVAL(name);
-    return compile_locals_islocal(self->context->prev, name, hash);
+    if (!count)
+        return 0;
+
+    int *depths = malloc(count * sizeof(int)),
+        *pending = malloc(count * sizeof(int)), npending = 0;
+
+    for (i = 0; i < count; i++)
+        depths[i] = -1;
+
+    depths[0] = 0;
+    pending[npending++] = 0;
+
+    while (npending) {
+        i = pending[--npending];
+        op = instructions->opcodes + i;
+        effect = compile_stack_effect(op, &jump);
 
-    // TODO: Recurse through further nesting?
+        target = compile_jump_target(instructions->opcodes, i);
+        if (target >= 0 && target < count && depths[target] < 0) {
+            depths[target] = depths[i] + jump;
+            pending[npending++] = target;
+        }
+
+        depth = depths[i] + effect;
+        if (depth > max)
+            max = depth;
+
+        if (!compile_is_terminal(op) && i + 1 < count && depths[i + 1] < 0) {
+            depths[i + 1] = depth;
+            pending[npending++] = i + 1;
+        }
+    }
+
+    free(depths);
+    free(pending);
+
+    return max;
+}
+
+// Wrap up the code of a context once all of it has been emitted
+static void
+compile_finish_context(CodeContext *context) {
+    if (LoxCompile_OptimizeLevel > 0)
+        optimize_bytecode(context);
+
+    context->stacksize = compile_stack_depth(context);
+
+    // This rewrites the instructions, so it runs after the analysis above
+    optimize_superinstructions(context);
+
+    compile_immortalize_constants(context);
+
+    LoxCompile_Stats.instructions += context->block->instructions.count;
+    LoxCompile_Stats.constants += context->nConstants;
 }
 
+static int
+compile_names_find(LocalsList *list, Object *name, hashval_t hash) {
+    assert(OBJECT_TYPE(name)->compare);
 
+    return compile_index_find(&list->index, list->names, list->count,
+        name, hash);
+}
+
+// Find or add the name to the list, and return its index
 static unsigned
-compile_locals_allocate(Compiler *self, Object *name) {
-    assert(name->type);
+compile_names_add(LocalsList *list, Object *name) {
+    assert(OBJECT_TYPE(name));
 
     int index;
-    LocalsList *locals = &self->context->locals;
-
     hashval_t hash = HASHVAL(name);
-    if (-1 != (index = compile_locals_islocal(self->context, name, hash))) {
+    if (-1 != (index = compile_names_find(list, name, hash))) {
         return index;
     }
 
-    // Ensure space in the index and locals
-    if (locals->size <= locals->count) {
-        locals->size += 8;
-        locals->names = GC_REALLOC(locals->names, sizeof(*locals->names) * locals->size);
+    // Ensure space in the index and list
+    if (list->size <= list->count) {
+        list->size = compile_grow_size(list->size);
+        list->names = GC_REALLOC(list->names, sizeof(*list->names) * list->size);
     }
 
-    *(locals->names + locals->count) = (Constant) {
+    *(list->names + list->count) = (Constant) {
         .value = name,
         .hash = hash,
     };
-    return locals->count++;
+    return list->count++;
+}
+
+static inline int
+compile_locals_islocal(CodeContext *context, Object *name, hashval_t hash) {
+    return compile_names_find(&context->locals, name, hash);
+}
+
+/**
+ * Index of the cell of a variable of the enclosing code, which the running
+ * closure captured. Returns -1 if the variable was not captured.
+ */
+static inline int
+compile_locals_isclosed(CodeContext *context, Object *name, hashval_t hash) {
+    return compile_names_find(&context->upvalues, name, hash);
+}
+
+// Local variables captured by a closure live in a cell (see OP_LOOKUP_CELL)
+static inline bool
+compile_locals_iscell(CodeContext *context, unsigned index) {
+    Constant *C = context->locals.names + index;
+    return context->cells.count
+        && -1 != compile_names_find(&context->cells, C->value, C->hash);
+}
+
+static inline unsigned
+compile_locals_allocate(Compiler *self, Object *name) {
+    return compile_names_add(&self->context->locals, name);
+}
+
+static unsigned
+compile_emit_store_local(Compiler *self, unsigned index, ASTNode *node) {
+    return compile_emit(self,
+        compile_locals_iscell(self->context, index) ? OP_STORE_CELL : OP_STORE_LOCAL,
+        index, node);
+}
+
+/**
+ * Collect the names used in the functions nested in the code (or in all of
+ * the code if `nested` is set). These are the variables which closures could
+ * capture from the code. Shadowed names are included too, which only means
+ * that some variables are kept in a cell without need.
+ */
+static void
+compile_collect_names(LocalsList *names, ASTNode *node, bool nested) {
+    for (; node; node = node->next) {
+        switch (node->type) {
+        case AST_LOOKUP:
+            if (nested)
+                compile_names_add(names, ((ASTLookup*) node)->name);
+            break;
+        case AST_ASSIGNMENT:
+            if (nested)
+                compile_names_add(names, ((ASTAssignment*) node)->name);
+            compile_collect_names(names, ((ASTAssignment*) node)->expression, nested);
+            break;
+        case AST_EXPRESSION:
+            compile_collect_names(names, ((ASTExpression*) node)->lhs, nested);
+            compile_collect_names(names, ((ASTExpression*) node)->rhs, nested);
+            break;
+        case AST_UNARY:
+            compile_collect_names(names, ((ASTUnary*) node)->expr, nested);
+            break;
+        case AST_RETURN:
+            compile_collect_names(names, ((ASTReturn*) node)->expression, nested);
+            break;
+        case AST_FUNCTION:
+            compile_collect_names(names, ((ASTFunction*) node)->arglist, true);
+            compile_collect_names(names, ((ASTFunction*) node)->block, true);
+            break;
+        case AST_PARAM:
+            compile_collect_names(names, ((ASTFuncParam*) node)->default_value, nested);
+            break;
+        case AST_WHILE:
+            compile_collect_names(names, ((ASTWhile*) node)->condition, nested);
+            compile_collect_names(names, ((ASTWhile*) node)->block, nested);
+            break;
+        case AST_FOR:
+            compile_collect_names(names, ((ASTFor*) node)->initializer, nested);
+            compile_collect_names(names, ((ASTFor*) node)->condition, nested);
+            compile_collect_names(names, ((ASTFor*) node)->post_loop, nested);
+            compile_collect_names(names, ((ASTFor*) node)->block, nested);
+            break;
+        case AST_IF:
+            compile_collect_names(names, ((ASTIf*) node)->condition, nested);
+            compile_collect_names(names, ((ASTIf*) node)->block, nested);
+            compile_collect_names(names, ((ASTIf*) node)->otherwise, nested);
+            break;
+        case AST_VAR:
+            compile_collect_names(names, ((ASTVar*) node)->expression, nested);
+            break;
+        case AST_INVOKE:
+            compile_collect_names(names, ((ASTInvoke*) node)->callable, nested);
+            compile_collect_names(names, ((ASTInvoke*) node)->args, nested);
+            break;
+        case AST_CLASS:
+            compile_collect_names(names, ((ASTClass*) node)->extends, nested);
+            compile_collect_names(names, ((ASTClass*) node)->body, nested);
+            break;
+        case AST_ATTRIBUTE:
+            compile_collect_names(names, ((ASTAttribute*) node)->object, nested);
+            compile_collect_names(names, ((ASTAttribute*) node)->value, nested);
+            break;
+        case AST_SLICE:
+            compile_collect_names(names, ((ASTSlice*) node)->object, nested);
+            compile_collect_names(names, ((ASTSlice*) node)->start, nested);
+            compile_collect_names(names, ((ASTSlice*) node)->end, nested);
+            compile_collect_names(names, ((ASTSlice*) node)->step, nested);
+            compile_collect_names(names, ((ASTSlice*) node)->value, nested);
+            break;
+        case AST_TUPLE_LITERAL:
+            compile_collect_names(names, ((ASTTupleLiteral*) node)->items, nested);
+            break;
+        case AST_INTERPOL_STRING:
+            compile_collect_names(names, ((ASTInterpolatedString*) node)->items, nested);
+            break;
+        case AST_INTERPOLATED:
+            compile_collect_names(names, ((ASTInterpolatedExpr*) node)->expr, nested);
+            break;
+        case AST_TABLE_LITERAL:
+            compile_collect_names(names, ((ASTTableLiteral*) node)->keys, nested);
+            compile_collect_names(names, ((ASTTableLiteral*) node)->values, nested);
+            break;
+        case AST_FOREACH:
+            compile_collect_names(names, ((ASTForeach*) node)->iterable, nested);
+            compile_collect_names(names, ((ASTForeach*) node)->block, nested);
+            break;
+        case AST_ASSERT:
+            compile_collect_names(names, ((ASTAssert*) node)->expression, nested);
+            compile_collect_names(names, ((ASTAssert*) node)->message, nested);
+            break;
+        default:
+            break;
+        }
+    }
 }
 
 static void
@@ -323,10 +739,20 @@ compile_assignment(Compiler *self, ASTAssignment *assign) {
     unsigned index;
 
     if (self->flags & CFLAG_LOCAL_VARS) {
-        // XXX: Consider assignment to non-local (closed) vars?
+        hashval_t hash = HASHVAL(assign->name);
+        int closed;
+
+        // Assign to a variable captured from the enclosing code, unless
+        // there is a local of the same name
+        if (-1 == compile_locals_islocal(self->context, assign->name, hash)
+            && -1 != (closed = compile_locals_isclosed(self->context, assign->name, hash))
+        ) {
+            return length + compile_emit(self, OP_STORE_CLOSED, closed, (ASTNode*) assign);
+        }
+
         // Lookup or allocate a local variable
         index = compile_locals_allocate(self, assign->name);
-        length += compile_emit(self, OP_STORE_LOCAL, index, (ASTNode*) assign);
+        length += compile_emit_store_local(self, index, (ASTNode*) assign);
     }
     else {
         // Non-local
@@ -363,7 +789,7 @@ static int _cmpfunc (const void * a, const void * b) {
 static unsigned
 compile_expression(Compiler* self, ASTExpression *expr) {
     // Push the LHS
-    unsigned length = compile_node(self, expr->lhs), rhs_length;
+    unsigned length = compile_node(self, expr->lhs), jump;
 
     static bool lookup_sorted = false;
     if (!lookup_sorted) {
@@ -374,30 +800,26 @@ compile_expression(Compiler* self, ASTExpression *expr) {
 
     // Perform the binary op
     if (expr->binary_op) {
-        // Compile the RHS in a sub-block so we can get a length to jump
-        // over and emit the code after the short-circuit logic.
-        CodeBlock *block = compile_block(self, expr->rhs);
-        rhs_length = JUMP_LENGTH(block);
-
-        // Handle short-circuit logic first
+        // Handle short-circuit logic first. If the LHS decides the answer,
+        // then jump past the end of the expression, leaving it on the stack.
         switch (expr->binary_op) {
         case T_AND:
-            // If the LHS is false, then jump past the end of the expression 
-            // as we've already decided on the answer
-            length += compile_emit(self, OP_JUMP_IF_FALSE_OR_POP, rhs_length, (ASTNode*) expr);
+            jump = compile_emit_jump(self, OP_JUMP_IF_FALSE_OR_POP, (ASTNode*) expr);
+            length += 1 + compile_node(self, expr->rhs);
+            compile_patch_jump(self, jump);
             break;
 
         case T_OR:
-            // XXX: Length of OP_POP_TOP might not be identically 1
-            length += compile_emit(self, OP_JUMP_IF_TRUE_OR_POP, rhs_length, (ASTNode*) expr);
+            jump = compile_emit_jump(self, OP_JUMP_IF_TRUE_OR_POP, (ASTNode*) expr);
+            length += 1 + compile_node(self, expr->rhs);
+            compile_patch_jump(self, jump);
+            break;
 
         default:
-            break;
+            // Emit the RHS
+            length += compile_node(self, expr->rhs);
         }
 
-        // Emit the RHS
-        length += compile_merge_block(self, block);
-
         switch (expr->binary_op) {
         case T_OP_PLUS:
         case T_OP_MINUS:
@@ -545,10 +967,13 @@ static unsigned
 compile_lookup(Compiler *self, ASTLookup *node) {
     // See if the name is in the locals list
     int index;
-    if (-1 != (index = compile_locals_islocal(self->context, node->name, HASHVAL(node->name)))) {
-        return compile_emit(self, OP_LOOKUP_LOCAL, index, (ASTNode*) node);
+    hashval_t hash = HASHVAL(node->name);
+    if (-1 != (index = compile_locals_islocal(self->context, node->name, hash))) {
+        return compile_emit(self,
+            compile_locals_iscell(self->context, index) ? OP_LOOKUP_CELL : OP_LOOKUP_LOCAL,
+            index, (ASTNode*) node);
     }
-    else if (-1 != (index = compile_locals_isclosed(self, node->name))) {
+    else if (-1 != (index = compile_locals_isclosed(self->context, node->name, hash))) {
         return compile_emit(self, OP_LOOKUP_CLOSED, index, (ASTNode*) node);
     }
     // Fetch the index of the name constant
@@ -567,81 +992,185 @@ compile_magic(Compiler *self, ASTMagic *node) {
     return 0;
 }
 
+/**
+ * Compile a `while` loop. Like a `for` loop, it has a loop block for `break`,
+ * and `continue` jumps to the condition at the bottom.
+ */
 static unsigned
 compile_while(Compiler* self, ASTWhile *node) {
-    // Emit the condition
-    unsigned length = 0;
-    // Emit the block in a different context, capture the length
-    CodeBlock *block = compile_block(self, node->block);
-    // Jump over the block
-    length = compile_emit(self, OP_JUMP, JUMP_LENGTH(block), (ASTNode*) node);
+    unsigned length = 2, enter, jump, top, i;
+    CompileLoop loop = { 0 };
+    Compiler nested = (Compiler) {
+        .context = self->context,
+        .flags = self->flags,
+        .info = self->info,
+        .loop = &loop,
+    };
+
+    enter = compile_emit_jump(self, OP_ENTER_BLOCK, (ASTNode*) node);
+    // Jump over the block to the condition
+    jump = compile_emit_jump(self, OP_JUMP, (ASTNode*) node);
     // Do the block
-    length += compile_merge_block(self, block);
+    top = compile_label(self);
+    length += compile_node(&nested, node->block);
     // Check the condition
+    for (i = 0; i < loop.count; i++)
+        compile_patch_jump(self, loop.continues[i]);
+    compile_patch_jump(self, jump);
     length += compile_node(self, node->condition);
     // Jump back if TRUE
-    // XXX: This assumes size of JUMP is the same as POP_JUMP_IF_TRUE (probably safe)
-    length += compile_emit(self, OP_POP_JUMP_IF_TRUE, -length, (ASTNode*) node);
+    length += compile_emit_loop(self, OP_POP_JUMP_IF_TRUE, top, (ASTNode*) node);
 
-    return length;
+    compile_patch_jump(self, enter);
+    self->context->nLoops++;
+
+    return length + compile_emit(self, OP_LEAVE_BLOCK, 0, (ASTNode*) node);
+}
+
+/**
+ * Compile a C-style `for` loop. The condition is tested at the bottom, so
+ * each iteration runs a single (compare and) branch. The loop block is for
+ * `break`, which goes right after the branch back to the top.
+ */
+static unsigned
+compile_for(Compiler *self, ASTFor *node) {
+    unsigned length = 0, enter, jump = 0, top, i;
+    CompileLoop loop = { 0 };
+    Compiler nested = (Compiler) {
+        .context = self->context,
+        .flags = self->flags | CFLAG_LOCAL_VARS,
+        .info = self->info,
+        .loop = &loop,
+    };
+
+    if (node->initializer)
+        length += compile_node(&nested, node->initializer);
+
+    enter = compile_emit_jump(self, OP_ENTER_BLOCK, (ASTNode*) node);
+    length++;
+
+    // Jump over the block to the condition
+    if (node->condition) {
+        jump = compile_emit_jump(self, OP_JUMP, (ASTNode*) node);
+        length++;
+    }
+
+    top = compile_label(self);
+    length += compile_node(&nested, node->block);
+
+    // `continue` goes to the post-loop expression
+    for (i = 0; i < loop.count; i++)
+        compile_patch_jump(self, loop.continues[i]);
+
+    if (node->post_loop)
+        length += compile_node(&nested, node->post_loop);
+
+    if (node->condition) {
+        compile_patch_jump(self, jump);
+        length += compile_node(&nested, node->condition);
+        length += compile_emit_loop(self, OP_POP_JUMP_IF_TRUE, top, (ASTNode*) node);
+    }
+    else {
+        length += compile_emit_loop(self, OP_JUMP, top, (ASTNode*) node);
+    }
+
+    compile_patch_jump(self, enter);
+    self->context->nLoops++;
+
+    return length + compile_emit(self, OP_LEAVE_BLOCK, 0, (ASTNode*) node);
 }
 
 static unsigned
 compile_if(Compiler *self, ASTIf *node) {
     // Emit the condition
-    unsigned length = compile_node(self, node->condition);
-
-    // Compile (but not emit) the code block
-    CodeBlock *block = compile_block(self, node->block);
+    unsigned length = compile_node(self, node->condition), jump, skip;
 
     // Jump over the block if condition is false
-    // TODO: The JUMP could perhaps be omitted (if the end of `block` is RETURN)
-    // ... 1 for JUMP below (if node->otherwise)
-    length += compile_emit(self, OP_POP_JUMP_IF_FALSE, JUMP_LENGTH(block) + (
-        node->otherwise ? 1 : 0), (ASTNode*) node);
-    // Add in the block following the condition
-    length += compile_merge_block(self, block);
+    jump = compile_emit_jump(self, OP_POP_JUMP_IF_FALSE, (ASTNode*) node);
+    length += 1 + compile_node(self, node->block);
 
     // If there's an otherwise, then emit it
     if (node->otherwise) {
-        block = compile_block(self, node->otherwise);
-        // (As part of the positive/previous block), skip the ELSE part.
-        // TODO: If the last line was RETURN, this could be ignored
-        length += compile_emit(self, OP_JUMP, JUMP_LENGTH(block), (ASTNode*) node);
-        length += compile_merge_block(self, block);
+        // (As part of the positive/previous block), skip the ELSE part. The
+        // optimizer drops it if the block ends with RETURN.
+        skip = compile_emit_jump(self, OP_JUMP, (ASTNode*) node);
+        compile_patch_jump(self, jump);
+        length += 1 + compile_node(self, node->otherwise);
+        compile_patch_jump(self, skip);
+    }
+    else {
+        compile_patch_jump(self, jump);
     }
     return length;
 }
 
+// Whether the node is a call to the `range` builtin (unless it is shadowed
+// by a variable)
+static bool
+compile_is_range(Compiler *self, ASTNode *node) {
+    static Object *range = NULL;
+    ASTLookup *callable;
+
+    if (node->type != AST_INVOKE
+        || ((ASTInvoke*) node)->callable->type != AST_LOOKUP)
+        return false;
+
+    if (!range) {
+        range = (Object*) String_fromConstant("range");
+        INCREF(range);
+    }
+
+    callable = (ASTLookup*) ((ASTInvoke*) node)->callable;
+    hashval_t hash = HASHVAL(callable->name);
+    return hash == HASHVAL(range)
+        && 0 == OBJECT_TYPE(range)->compare(range, callable->name)
+        && -1 == compile_locals_islocal(self->context, callable->name, hash)
+        && -1 == compile_locals_isclosed(self->context, callable->name, hash);
+}
+
 static unsigned
 compile_foreach(Compiler *self, ASTForeach *node) {
-    unsigned length = compile_node(self, node->iterable);
+    unsigned length = compile_node(self, node->iterable), enter, top;
+    // Integer ranges are iterated without boxing the items. The instruction
+    // falls back to NEXT_OR_BREAK if `range` returns something else.
+    enum opcode next = compile_is_range(self, node->iterable)
+        ? OP_FOR_RANGE : OP_NEXT_OR_BREAK;
     length += compile_emit(self, OP_GET_ITERATOR, 0, (ASTNode*) node);
 
-    CodeBlock *loop = compile_start_block(self);
+    // The loop block is patched like a jump to where BREAK goes, right after
+    // the jump back to the top at the bottom of the block
+    enter = compile_emit_jump(self, OP_ENTER_BLOCK, (ASTNode*) node);
 
     if (node->loop_var->type != AST_VAR)
         compile_error(self, "Foreach loop variable must be a `var` declaration");
 
     ASTVar *var = (ASTVar*) node->loop_var;
     int index = compile_locals_allocate(self,
-        (Object*) String_fromCharsAndSize(var->name, var->name_length));
-
-    length += compile_emit(self, OP_NEXT_OR_BREAK, index, (ASTNode*) node);
+        (Object*) String_intern(var->name, var->name_length));
+
+    top = compile_label(self);
+    if (compile_locals_iscell(self->context, index)) {
+        // The loop variable is captured by a closure. Go through a hidden
+        // local so that the cell is updated rather than replaced.
+        unsigned item = compile_locals_allocate(self,
+            (Object*) String_fromConstant("(foreach)"));
+        length += 1 + compile_emit(self, next, item, (ASTNode*) node);
+        length += compile_emit(self, OP_LOOKUP_LOCAL, item, (ASTNode*) node);
+        length += compile_emit(self, OP_STORE_CELL, index, (ASTNode*) node);
+    }
+    else {
+        length += 1 + compile_emit(self, next, index, (ASTNode*) node);
+    }
 
     Compiler nested = (Compiler) {
         .context = self->context,
         .flags = self->flags | CFLAG_LOCAL_VARS,
         .info = self->info,
     };
-    CodeBlock *block = compile_block(&nested, node->block);
-    compile_merge_block_into(self, loop, block);
-    compile_emit(self, OP_JUMP, -JUMP_LENGTH(loop) - 1, (ASTNode*) node);
+    length += compile_node(&nested, node->block);
+    length += compile_emit_loop(self, OP_JUMP, top, (ASTNode*) node);
 
-    // Now grab the loop block and return to the outer context
-    compile_pop_block(self);
-    length += compile_emit(self, OP_ENTER_BLOCK, JUMP_LENGTH(loop), (ASTNode*) node);
-    length += compile_merge_block(self, loop);
+    compile_patch_jump(self, enter);
 
     // Track the number of loop blocks in the code block
     self->context->nLoops++;
@@ -656,20 +1185,31 @@ compile_control(Compiler *self, ASTControl *node) {
         return compile_emit(self, OP_BREAK, 0, (ASTNode*) node);
     }
     if (node->loop_continue) {
-        return compile_emit(self, OP_CONTINUE, 0, (ASTNode*) node);
+        CompileLoop *loop = self->loop;
+        if (!loop)
+            return compile_emit(self, OP_CONTINUE, 0, (ASTNode*) node);
+
+        if (loop->count == loop->size) {
+            loop->size = compile_grow_size(loop->size);
+            loop->continues = GC_REALLOC(loop->continues,
+                loop->size * sizeof(unsigned));
+        }
+        loop->continues[loop->count++] = compile_emit_jump(self, OP_JUMP,
+            (ASTNode*) node);
+        return 1;
     }
     compile_error(self, "Unhandled control");
     return 0;
 }
 
-static unsigned
-compile_function_inner(Compiler *self, ASTFunction *node) {
+static CodeContext*
+compile_function_body(Compiler *self, ASTFunction *node, LocalsList *upvalues) {
     // Create a new compiler context for the function's code (with new constants)
     compile_push_context(self);
+    self->context->upvalues = *upvalues;
 
     ASTNode *p;
     ASTFuncParam *param;
-    unsigned index, length = 0;
 
     // (When the function is executed), load the arguments off the args list
     // Into local variables. The arguments will be in the proper order already,
@@ -679,9 +1219,13 @@ compile_function_inner(Compiler *self, ASTFunction *node) {
         assert(p->type == AST_PARAM);
         param = (ASTFuncParam*) p;
         compile_locals_allocate(self,
-            (Object*) String_fromCharsAndSize(param->name, param->name_length));
+            (Object*) String_intern(param->name, param->name_length));
     }
 
+    // Find the locals which closures in the function may capture before any
+    // code using them is emitted
+    compile_collect_names(&self->context->cells, node->block, false);
+
     // Compile the function's code in the new context
     // Local vars are welcome inside the function
     Compiler nested = (Compiler) {
@@ -689,16 +1233,109 @@ compile_function_inner(Compiler *self, ASTFunction *node) {
         .flags = self->flags | CFLAG_LOCAL_VARS,
         .info = self->info,
     };
-    length += compile_node(&nested, node->block);
+    compile_node(&nested, node->block);
     if ((self->context->block->instructions.opcodes + (self->context->block->instructions.count - 1))->op != OP_RETURN)
-        length += compile_emit(&nested, OP_HALT, 0, (ASTNode*) node);
+        compile_emit(&nested, OP_HALT, 0, (ASTNode*) node);
 
-    // Create a constant for the function
-    index = compile_emit_constant(self,
-        VmCode_fromContext(node, compile_pop_context(self)));
+    compile_finish_context(self->context);
 
     // (Meanwhile, back in the original context)
-    return length + compile_emit(self, OP_CONSTANT, index, (ASTNode*) node);
+    return compile_pop_context(self);
+}
+
+/**
+ * Compile a function body which was deferred by compile_function_inner(),
+ * as it would have been compiled where it is defined.
+ */
+CodeContext*
+compile_deferred(CompileDeferred *deferred) {
+    Compiler compiler = (Compiler) {
+        .context = deferred->outer,
+        .flags = deferred->flags,
+    };
+    CodeContext *context;
+    clock_t start = clock();
+
+    // Bodies loaded from the cache are parsed from the script again
+    if (!deferred->node && !(deferred->node = LoxCache_findFunction(deferred))) {
+        fprintf(stderr, "Error: Unable to find the source of a cached function\n");
+        exit(1);
+    }
+
+    if (deferred->has_info)
+        compile_push_info(&compiler, deferred->info);
+
+    context = compile_function_body(&compiler, deferred->node,
+        &deferred->upvalues);
+
+    if (deferred->has_info)
+        compile_pop_info(&compiler);
+
+    LoxCompile_Stats.seconds += (double) (clock() - start) / CLOCKS_PER_SEC;
+    return context;
+}
+
+static unsigned
+compile_function_inner(Compiler *self, ASTFunction *node, LocalsList upvalues) {
+    // The body is compiled when the function is first called. Keep what is
+    // needed to compile it as if it were compiled now.
+    CompileDeferred *deferred = GC_MALLOC(sizeof(CompileDeferred));
+    *deferred = (CompileDeferred) {
+        .node = node,
+        .outer = self->context,
+        .upvalues = upvalues,
+        .flags = self->flags,
+        .line = node->node.line,
+        .offset = node->node.offset,
+    };
+    if (self->info) {
+        deferred->info = *self->info;
+        deferred->info.prev = NULL;
+        deferred->has_info = true;
+    }
+
+    // Create a constant for the function
+    unsigned index = compile_emit_constant(self,
+        VmCode_fromDeferred(node, deferred));
+
+    return compile_emit(self, OP_CONSTANT, index, (ASTNode*) node);
+}
+
+/**
+ * Create a closure of the function. Closures are flat: the cells of all the
+ * variables the function (or the functions nested in it) uses from the
+ * enclosing code are pushed, along with the code, for OP_CLOSE_FUN.
+ * Variables of code further out are passed along through the cells captured
+ * by the enclosing closure. Locals declared after the function are not in
+ * its scope (which matters as the function is compiled later).
+ */
+static unsigned
+compile_closure(Compiler *self, ASTFunction *node) {
+    LocalsList names = { 0 }, upvalues = { 0 };
+    unsigned length = 0, i;
+    hashval_t hash;
+    Constant *C;
+    int index;
+
+    compile_collect_names(&names, node->arglist, true);
+    compile_collect_names(&names, node->block, true);
+
+    for (i = 0, C = names.names; i < names.count; i++, C++) {
+        hash = C->hash;
+        if (-1 != (index = compile_locals_islocal(self->context, C->value, hash))) {
+            length += compile_emit(self, OP_CAPTURE_LOCAL, index, (ASTNode*) node);
+        }
+        else if (-1 != (index = compile_locals_isclosed(self->context, C->value, hash))) {
+            length += compile_emit(self, OP_CAPTURE_CLOSED, index, (ASTNode*) node);
+        }
+        else {
+            continue;
+        }
+        compile_names_add(&upvalues, C->value);
+    }
+
+    length += compile_function_inner(self, node, upvalues);
+    return length + compile_emit(self, OP_CLOSE_FUN, upvalues.count, (ASTNode*) node);
 }
 
 static unsigned
@@ -708,22 +1345,19 @@ compile_function(Compiler *self, ASTFunction *node) {
     Object *name = NULL;
 
     if (node->name_length) {
-        name = (Object*) String_fromCharsAndSize(node->name, node->name_length);
+        name = (Object*) String_intern(node->name, node->name_length);
         compile_push_info(self, (CompileInfo) {
             .function_name = name,
         });
     }
 
-    length = compile_function_inner(self, node);
-
-    // Create closure and stash in context
-    length += compile_emit(self, OP_CLOSE_FUN, 0, (ASTNode*) node);
+    length = compile_closure(self, node);
 
     // Store the named function?
     if (name) {
         if (self->flags & CFLAG_LOCAL_VARS) {
             index = compile_locals_allocate(self, name);
-            length += compile_emit(self, OP_STORE_LOCAL, index, (ASTNode*) node);
+            length += compile_emit_store_local(self, index, (ASTNode*) node);
         }
         else {
             index = compile_emit_constant(self, name);
@@ -738,7 +1372,7 @@ static unsigned
 compile_invoke(Compiler* self, ASTInvoke *node) {
     // Push the function / callable / lookup
     unsigned length = 0;
-    bool recursing = false;
+    bool recursing = false, method = false;
 
     // TODO: If we are currently executing a function with the same name
     // as the one being invoked here, and the name of the function is not
@@ -749,17 +1383,31 @@ compile_invoke(Compiler* self, ASTInvoke *node) {
         && node->callable->type == AST_LOOKUP
     ) {
         Object *name = ((ASTLookup*) node->callable)->name;
-        if (name->type == self->info->function_name->type
-            && 0 == name->type->compare(name, self->info->function_name)
+        if (OBJECT_TYPE(name) == OBJECT_TYPE(self->info->function_name)
+            && 0 == OBJECT_TYPE(name)->compare(name, self->info->function_name)
             && -1 == compile_locals_islocal(self->context, name, HASHVAL(name))
+            && -1 == compile_locals_isclosed(self->context, name, HASHVAL(name))
         ) {
             recursing = true;
         }
     }
 
-    // Make the function
-    if (!recursing)
+    // Make the function. For `object.method(...)`, push the method and the
+    // receiver separately so that a bound method need not be created.
+    if (recursing) {
+        // Pass
+    }
+    else if (node->callable->type == AST_ATTRIBUTE) {
+        ASTAttribute *attr = (ASTAttribute*) node->callable;
+        assert(attr->value == NULL);
+        length += compile_node(self, attr->object);
+        length += compile_emit(self, OP_LOAD_METHOD,
+            compile_emit_constant(self, attr->attribute), (ASTNode*) attr);
+        method = true;
+    }
+    else {
         length += compile_node(self, node->callable);
+    }
 
     // Push all the arguments
     if (node->nargs && node->args != NULL)
@@ -768,6 +1416,8 @@ compile_invoke(Compiler* self, ASTInvoke *node) {
     // Call the function
     if (recursing)
         length += compile_emit(self, OP_RECURSE, node->nargs, (ASTNode*) node);
+    else if (method)
+        length += compile_emit(self, OP_CALL_METHOD, node->nargs, (ASTNode*) node);
     else
         length += compile_emit(self, OP_CALL_FUN, node->nargs, (ASTNode*) node);
 
@@ -783,11 +1433,11 @@ compile_var(Compiler *self, ASTVar *node) {
 
     // Make room in the locals for the name
     index = compile_locals_allocate(self,
-        (Object*) String_fromCharsAndSize(node->name, node->name_length));
+        (Object*) String_intern(node->name, node->name_length));
 
     if (node->expression) {
         length += compile_node(self, node->expression);
-        length += compile_emit(self, OP_STORE_LOCAL, index, (ASTNode*) node);
+        length += compile_emit_store_local(self, index, (ASTNode*) node);
     }
 
     return length;
@@ -807,7 +1457,7 @@ compile_class(Compiler *self, ASTClass *node) {
         assert(body->type == AST_FUNCTION);
         method = (ASTFunction*) body;
         if (method->name_length) {
-            method_name = (Object*) String_fromCharsAndSize(method->name,
+            method_name = (Object*) String_intern(method->name,
                 method->name_length);
             index = compile_emit_constant(self, method_name);
             compile_push_info(self, (CompileInfo) {
@@ -815,7 +1465,8 @@ compile_class(Compiler *self, ASTClass *node) {
             });
         }
 
-        compile_function_inner(self, method);
+        // Methods are not closures
+        compile_function_inner(self, method, (LocalsList) { 0 });
 
         // Anonymous methods?
         if (method->name_length) {
@@ -840,7 +1491,7 @@ compile_class(Compiler *self, ASTClass *node) {
     if (node->name) {
         if (self->flags & CFLAG_LOCAL_VARS) {
             index = compile_locals_allocate(self, node->name);
-            length += compile_emit(self, OP_STORE_LOCAL, index, (ASTNode*) node);
+            length += compile_emit_store_local(self, index, (ASTNode*) node);
         }
         else {
             index = compile_emit_constant(self, node->name);
@@ -901,32 +1552,27 @@ compile_table_literal(Compiler *self, ASTTableLiteral *node) {
 
 static unsigned
 compile_assert(Compiler *self, ASTAssert *node) {
-    unsigned length=0, skip=0, has_message=0;
-    CodeBlock *block=NULL;
+    unsigned length=0, jump;
 
-    // TODO: Skip if ASSERTs should be optimized out
+    // Like Python's -O, the expression is not evaluated at all
+    if (LoxCompile_OptimizeLevel > 1)
+        return 0;
 
     length += compile_node(self, node->expression);
 
     if (node->message) {
-        block = compile_block(self, node->message);
-        skip += JUMP_LENGTH(block);
-        has_message = ASSERT_FLAG_HAS_MESSAGE;
-    }
-    else {
-        // TODO: Fetch the source code of the expression and use it as the message
-    }
-
-    if (block != NULL) {
         // Lazily evaluate the "message"
-        length += compile_emit(self, OP_POP_JUMP_IF_TRUE, skip + 1, (ASTNode*) node);
-        length += compile_merge_block(self, block);
-        return length + compile_emit(self, OP_ASSERT, has_message | ASSERT_FLAG_FAILED, (ASTNode*) node);
+        jump = compile_emit_jump(self, OP_POP_JUMP_IF_TRUE, (ASTNode*) node);
+        length += 1 + compile_node(self, node->message);
+        length += compile_emit(self, OP_ASSERT,
+            ASSERT_FLAG_HAS_MESSAGE | ASSERT_FLAG_FAILED, (ASTNode*) node);
+        compile_patch_jump(self, jump);
+        return length;
     }
     else {
-        return length + compile_emit(self, OP_ASSERT, has_message, (ASTNode*) node);
+        // TODO: Fetch the source code of the expression and use it as the message
+        return length + compile_emit(self, OP_ASSERT, 0, (ASTNode*) node);
     }
-
 }
 
 static unsigned
@@ -943,6 +1589,7 @@ compile_node1(Compiler* self, ASTNode* ast) {
     case AST_WHILE:
         return compile_while(self, (ASTWhile*) ast);
     case AST_FOR:
+        return compile_for(self, (ASTFor*) ast);
     case AST_IF:
         return compile_if(self, (ASTIf*) ast);
     case AST_VAR:
@@ -1017,10 +1664,12 @@ compile_compile(Compiler* self, Parser* parser) {
         return 0;
 
     while ((ast = parser->next(parser))) {
+        compile_collect_names(&self->context->cells, ast, false);
         length += compile_node(self, ast);
     }
 
     length += compile_emit(self, OP_HALT, 0, NULL);
+    compile_finish_context(self->context);
 
     return length;
 }
@@ -1028,10 +1677,14 @@ compile_compile(Compiler* self, Parser* parser) {
 static void
 _compile_init_stream(Compiler *self, Stream *stream) {
     Parser _parser, *parser = &_parser;
+    clock_t start = clock();
 
     parser_init(parser, stream);
     compile_init(self, stream->name);
     compile_compile(self, parser);
+
+    LoxCompile_Stats.lines += stream->line;
+    LoxCompile_Stats.seconds += (double) (clock() - start) / CLOCKS_PER_SEC;
 }
 
 CodeContext*
@@ -1058,12 +1711,14 @@ compile_ast(Compiler* self, ASTNode* node) {
     unsigned length = 0;
 
     compile_init(self, "(eval)");
+    compile_collect_names(&self->context->cells, node, false);
     while (node) {
         length += compile_node(self, node);
         node = node->next;
     }
 
     length += compile_emit(self, OP_RETURN, 0, node);
+    compile_finish_context(self->context);
 
     return self->context;
 }
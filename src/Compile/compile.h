@@ -8,6 +8,21 @@ enum compiler_flags {
     CFLAG_LOCAL_VARS =  0x00000001,         // Use local vars where possible
 };
 
+// Bytecode optimization level. At 0, only the superinstructions are formed;
+// 1 (the default) runs the optimizer passes and 2 (-O) also compiles out the
+// `assert` statements.
+extern unsigned LoxCompile_OptimizeLevel;
+
+// Compile-time statistics (printed with -s)
+typedef struct compile_stats {
+    unsigned long       lines;              // Of the scripts parsed
+    unsigned long       instructions;
+    unsigned long       constants;
+    double              seconds;            // Processor time to parse and compile
+} CompileStats;
+
+extern CompileStats LoxCompile_Stats;
+
 enum compiler_special {
     CINFO_CALL_RECURSE = -1,                // Code can recurse rather than call()
 };
@@ -18,16 +33,53 @@ typedef struct compiler_info {
     struct compiler_info *prev;
 } CompileInfo;
 
+// A C-style `for` or a `while` loop being compiled. `continue` in the loop
+// jumps to the post-loop expression (or the condition), so the jumps are
+// patched once it is emitted.
+typedef struct compiler_loop {
+    unsigned            *continues;         // Index of the OP_JUMP instructions
+    unsigned            count;
+    unsigned            size;
+} CompileLoop;
+
 typedef struct compiler_object {
     CodeContext         *context;
     CompileInfo         *info;
     unsigned            flags;
+    CompileLoop         *loop;              // Innermost loop, unless a `foreach`
 } Compiler;
 
+// A function body which has not been compiled yet. It keeps what the
+// compiler knew where the function was defined.
+typedef struct compile_deferred {
+    ASTFunction         *node;              // NULL if loaded from the cache
+    CodeContext         *outer;             // Context the function is defined in
+    LocalsList          upvalues;           // Cells captured from `outer`
+    unsigned            flags;
+    CompileInfo         info;
+    bool                has_info;
+    unsigned            line, offset;       // Of the node in the source
+    struct cache_script *script;            // Cached script to parse for the node
+} CompileDeferred;
+
 void print_codeblock(const CodeContext*, const CodeBlock*);
-void print_instructions(const CodeContext*, const Instruction*, int);
+void print_instructions(const CodeContext*, const Instruction*, int, int);
+void print_compile_stats(void);
+void print_quicken_stats(void);
+void print_opcode_pairs(void);
+void print_jit_stats(void);
+void print_garbage_stats(void);
+void print_slab_stats(void);
 CodeContext* compile_string(Compiler *self, const char * text, size_t length);
 CodeContext* compile_file(Compiler *self, FILE *restrict input, const char*);
 CodeContext* compile_ast(Compiler*, ASTNode*);
+int compile_jump_target(const Instruction*, int);
+bool compile_is_terminal(const Instruction*);
+unsigned compile_context_constant(CodeContext*, Object*);
+void compile_immortalize_constants(CodeContext*);
+CodeContext* compile_deferred(CompileDeferred*);
+
+void optimize_bytecode(CodeContext*);
+void optimize_superinstructions(CodeContext*);
 
 #endif
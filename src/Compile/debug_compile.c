@@ -3,6 +3,10 @@
 #include <stdlib.h>
 
 #include "vm.h"
+#include "compile.h"
+#include "jit.h"
+#include "Objects/garbage.h"
+#include "Objects/slab.h"
 
 struct named_opcode {
     enum opcode     code;
@@ -37,6 +41,10 @@ static struct named_opcode OpcodeNames[] = {
     { OP_STORE_LOCAL,   "STORE_LOCAL" },
     { OP_STORE_GLOBAL,  "STORE_GLOBAL" },
     { OP_STORE_CLOSED,  "STORE_CLOSED" },
+    { OP_LOOKUP_CELL,   "LOOKUP_CELL" },
+    { OP_STORE_CELL,    "STORE_CELL" },
+    { OP_CAPTURE_LOCAL, "CAPTURE_LOCAL" },
+    { OP_CAPTURE_CLOSED, "CAPTURE_CLOSED" },
     { OP_CONSTANT,      "CONSTANT" },
 
     // Comparison
@@ -57,6 +65,8 @@ static struct named_opcode OpcodeNames[] = {
     { OP_SET_ATTR,      "SET_ATTRIBUTE" },
     { OP_THIS,          "THIS" },
     { OP_SUPER,         "SUPER" },
+    { OP_LOAD_METHOD,   "LOAD_METHOD" },
+    { OP_CALL_METHOD,   "CALL_METHOD" },
 
     // Hash and list types
     { OP_GET_ITEM,      "GET_ITEM" },
@@ -76,8 +86,41 @@ static struct named_opcode OpcodeNames[] = {
     { OP_CONTINUE,      "CONTINUE" },
     { OP_GET_ITERATOR,  "GET_ITERATOR" },
     { OP_NEXT_OR_BREAK, "NEXT_OR_BREAK" },
+    { OP_FOR_RANGE,     "FOR_RANGE" },
+
+    // Quickened
+    { OP_ADD_INT_INT,   "ADD_INT_INT" },
+    { OP_SUB_INT_INT,   "SUB_INT_INT" },
+    { OP_MUL_INT_INT,   "MUL_INT_INT" },
+    { OP_ADD_FLOAT_FLOAT, "ADD_FLOAT_FLOAT" },
+    { OP_SUB_FLOAT_FLOAT, "SUB_FLOAT_FLOAT" },
+    { OP_MUL_FLOAT_FLOAT, "MUL_FLOAT_FLOAT" },
+    { OP_DIV_FLOAT_FLOAT, "DIV_FLOAT_FLOAT" },
+    { OP_ADD_STR_STR,   "ADD_STR_STR" },
+    { OP_EQ_INT_INT,    "EQ_INT_INT" },
+    { OP_NOT_EQ_INT_INT, "NOT_EQ_INT_INT" },
+    { OP_LT_INT_INT,    "LT_INT_INT" },
+    { OP_LTE_INT_INT,   "LTE_INT_INT" },
+    { OP_GT_INT_INT,    "GT_INT_INT" },
+    { OP_GTE_INT_INT,   "GTE_INT_INT" },
+    { OP_GET_ATTR_CACHED, "GET_ATTRIBUTE_CACHED" },
+    { OP_SET_ATTR_CACHED, "SET_ATTRIBUTE_CACHED" },
+    { OP_LOAD_METHOD_CACHED, "LOAD_METHOD_CACHED" },
+
+    // Superinstructions
+    { OP_LOOKUP_LOCAL2, "LOOKUP_LOCAL2" },
+    { OP_LOOKUP_LOCAL_CONSTANT, "LOOKUP_LOCAL_CONSTANT" },
+    { OP_MATH_LOCAL_CONST, "MATH_LOCAL_CONST" },
+    { OP_COMPARE_POP_JUMP_IF_FALSE, "COMPARE_POP_JUMP_IF_FALSE" },
+    { OP_COMPARE_POP_JUMP_IF_TRUE, "COMPARE_POP_JUMP_IF_TRUE" },
+    { OP_GET_ATTR_LOCAL, "GET_ATTRIBUTE_LOCAL" },
+    { OP_GET_ATTR_THIS, "GET_ATTRIBUTE_THIS" },
+    { OP_LOCAL_POP_JUMP_IF_FALSE, "LOCAL_POP_JUMP_IF_FALSE" },
+    { OP_LOCAL_POP_JUMP_IF_TRUE, "LOCAL_POP_JUMP_IF_TRUE" },
 };
 
+#define OPCODE_PAIRS_TOP 25
+
 static int cmpfunc (const void * a, const void * b) {
    return ((struct named_opcode*) a)->code - ((struct named_opcode*) b)->code;
 }
@@ -120,26 +163,39 @@ static int math_cmpfunc (const void * a, const void * b) {
    return ((struct token_to_math_op*) a)->math_op - ((struct token_to_math_op*) b)->math_op;
 }
 
-static inline void
-print_opcode(const CodeContext *context, const Instruction *op) {
-    struct named_opcode* T, key = { .code = op->op }, unknown;
+static void
+sort_names(void) {
+    static bool sorted = false;
+    if (!sorted) {
+        qsort(OpcodeNames, sizeof(OpcodeNames) / sizeof(struct named_opcode),
+            sizeof(struct named_opcode), cmpfunc);
+        qsort(TokenToMathOp, sizeof(TokenToMathOp) / sizeof(struct token_to_math_op),
+            sizeof(struct token_to_math_op), math_cmpfunc);
+        qsort(TokenToCompareOp, sizeof(TokenToCompareOp) / sizeof(struct token_to_compare_op),
+            sizeof(struct token_to_compare_op), math_cmpfunc);
+        sorted = true;
+    }
+}
+
+static const char*
+opcode_name(enum opcode code) {
+    struct named_opcode* T, key = { .code = code };
     T = bsearch(&key, OpcodeNames, sizeof(OpcodeNames) / sizeof(struct named_opcode),
         sizeof(struct named_opcode), cmpfunc);
 
-    if (T == NULL) {
-        unknown = (struct named_opcode) {
-            .name = "(unknown)",
-        };
-        T = &unknown;
-    }
+    return T ? T->name : "(unknown)";
+}
 
-    printf("%-20s %d", T->name, op->arg);
+static inline void
+print_opcode(const CodeContext *context, const Instruction *op) {
+    printf("%-20s %d", opcode_name(op->op), op->arg);
 
     // For opcodes which use constants, print the constant value too
     switch (op->op) {
     case OP_FORMAT:
     case OP_GET_ATTR:
     case OP_SET_ATTR:
+    case OP_LOAD_METHOD:
     case OP_CONSTANT:
     case OP_STORE:
     case OP_LOOKUP:
@@ -147,8 +203,21 @@ print_opcode(const CodeContext *context, const Instruction *op) {
     case OP_STORE_GLOBAL: {
         Constant *C = context->constants + op->arg;
         Object *T = C->value;
-        if (T && T->type && T->type->as_string) {
-            LoxString *S = (LoxString*) T->type->as_string(T);
+        if (T && OBJECT_TYPE(T) && OBJECT_TYPE(T)->as_string) {
+            LoxString *S = (LoxString*) OBJECT_TYPE(T)->as_string(T);
+            assert(String_isString((Object*) S));
+            printf(" (%.*s)", S->length, S->characters);
+        }
+    }
+    break;
+
+    case OP_GET_ATTR_CACHED:
+    case OP_SET_ATTR_CACHED:
+    case OP_LOAD_METHOD_CACHED: {
+        Constant *C = context->constants + (context->attrCaches + op->arg)->name;
+        Object *T = C->value;
+        if (T && OBJECT_TYPE(T) && OBJECT_TYPE(T)->as_string) {
+            LoxString *S = (LoxString*) OBJECT_TYPE(T)->as_string(T);
             assert(String_isString((Object*) S));
             printf(" (%.*s)", S->length, S->characters);
         }
@@ -157,10 +226,20 @@ print_opcode(const CodeContext *context, const Instruction *op) {
 
     case OP_STORE_LOCAL:
     case OP_LOOKUP_LOCAL:
-    case OP_NEXT_OR_BREAK: {
+    case OP_LOOKUP_LOCAL2:
+    case OP_LOOKUP_LOCAL_CONSTANT:
+    case OP_MATH_LOCAL_CONST:
+    case OP_GET_ATTR_LOCAL:
+    case OP_LOCAL_POP_JUMP_IF_FALSE:
+    case OP_LOCAL_POP_JUMP_IF_TRUE:
+    case OP_LOOKUP_CELL:
+    case OP_STORE_CELL:
+    case OP_CAPTURE_LOCAL:
+    case OP_NEXT_OR_BREAK:
+    case OP_FOR_RANGE: {
         Object *T = (context->locals.names + op->arg)->value;
-        if (T && T->type && T->type->as_string) {
-            LoxString *S = (LoxString*) T->type->as_string(T);
+        if (T && OBJECT_TYPE(T) && OBJECT_TYPE(T)->as_string) {
+            LoxString *S = (LoxString*) OBJECT_TYPE(T)->as_string(T);
             assert(String_isString((Object*) S));
             printf(" (%.*s)", S->length, S->characters);
         }
@@ -168,12 +247,13 @@ print_opcode(const CodeContext *context, const Instruction *op) {
     break;
 
     case OP_STORE_CLOSED:
-    case OP_LOOKUP_CLOSED: {
-        CodeContext *outer = context->prev;
-        if (outer) {
-            Object *T = (outer->locals.names + op->arg)->value;
-            if (T && T->type && T->type->as_string) {
-                LoxString *S = (LoxString*) T->type->as_string(T);
+    case OP_LOOKUP_CLOSED:
+    case OP_CAPTURE_CLOSED: {
+        // The names are not kept in the cache files
+        if (op->arg < context->upvalues.count) {
+            Object *T = (context->upvalues.names + op->arg)->value;
+            if (T && OBJECT_TYPE(T) && OBJECT_TYPE(T)->as_string) {
+                LoxString *S = (LoxString*) OBJECT_TYPE(T)->as_string(T);
                 assert(String_isString((Object*) S));
                 printf(" (%.*s)", S->length, S->characters);
             }
@@ -181,7 +261,15 @@ print_opcode(const CodeContext *context, const Instruction *op) {
     }
     break;
 
-    case OP_BINARY_MATH: {
+    case OP_BINARY_MATH:
+    case OP_ADD_INT_INT:
+    case OP_SUB_INT_INT:
+    case OP_MUL_INT_INT:
+    case OP_ADD_FLOAT_FLOAT:
+    case OP_SUB_FLOAT_FLOAT:
+    case OP_MUL_FLOAT_FLOAT:
+    case OP_DIV_FLOAT_FLOAT:
+    case OP_ADD_STR_STR: {
         struct token_to_math_op* T, key = { .math_op = op->arg };
         T = bsearch(&key, TokenToMathOp, sizeof(TokenToMathOp) / sizeof(struct token_to_math_op),
             sizeof(struct token_to_math_op), math_cmpfunc);
@@ -189,7 +277,15 @@ print_opcode(const CodeContext *context, const Instruction *op) {
     }
     break;
 
-    case OP_COMPARE: {
+    case OP_COMPARE:
+    case OP_COMPARE_POP_JUMP_IF_FALSE:
+    case OP_COMPARE_POP_JUMP_IF_TRUE:
+    case OP_EQ_INT_INT:
+    case OP_NOT_EQ_INT_INT:
+    case OP_LT_INT_INT:
+    case OP_LTE_INT_INT:
+    case OP_GT_INT_INT:
+    case OP_GTE_INT_INT: {
         struct token_to_compare_op* T, key = { .compare_op = op->arg };
         T = bsearch(&key, TokenToCompareOp, sizeof(TokenToCompareOp) / sizeof(struct token_to_compare_op),
             sizeof(struct token_to_compare_op), math_cmpfunc);
@@ -205,15 +301,7 @@ print_opcode(const CodeContext *context, const Instruction *op) {
 
 void
 print_instructions(const CodeContext *context, const Instruction *block, int count, int start) {
-    static bool sorted = false;
-    if (!sorted) {
-        qsort(OpcodeNames, sizeof(OpcodeNames) / sizeof(struct named_opcode),
-            sizeof(struct named_opcode), cmpfunc);
-        qsort(TokenToMathOp, sizeof(TokenToMathOp) / sizeof(struct token_to_math_op),
-            sizeof(struct token_to_math_op), math_cmpfunc);
-        qsort(TokenToCompareOp, sizeof(TokenToCompareOp) / sizeof(struct token_to_compare_op),
-            sizeof(struct token_to_compare_op), math_cmpfunc);
-    }
+    sort_names();
 
     int i = 0;
     while (count--) {
@@ -239,3 +327,94 @@ print_codeblock(const CodeContext* context, const CodeBlock *block) {
         source++;
     }
 }
+
+void
+print_quicken_stats(void) {
+    VmQuickenStats *stats = &LoxVM_QuickenStats;
+    unsigned long total;
+    int i;
+
+    sort_names();
+
+    printf("Quickened instructions: %lu\n", stats->quickened);
+    printf("%-28s %12s %12s %8s\n", "Opcode", "Hits", "Misses", "Hit %");
+    for (i = 0; i < __OP_MAX; i++) {
+        total = stats->hits[i] + stats->misses[i];
+        if (total == 0)
+            continue;
+
+        printf("%-28s %12lu %12lu %7.2f%%\n", opcode_name(i), stats->hits[i],
+            stats->misses[i], 100.0 * stats->hits[i] / total);
+    }
+}
+
+void
+print_compile_stats(void) {
+    CompileStats *stats = &LoxCompile_Stats;
+
+    printf("Compiled %lu lines to %lu instructions and %lu constants in %.3fs",
+        stats->lines, stats->instructions, stats->constants, stats->seconds);
+    if (stats->seconds > 0)
+        printf(" (%.0f lines/s)", stats->lines / stats->seconds);
+    printf("\n");
+}
+
+void
+print_jit_stats(void) {
+    printf("JIT compiled %u code contexts (%zu bytes)\n", LoxJIT_Stats.compiled,
+        LoxJIT_Stats.bytes);
+}
+
+void
+print_garbage_stats(void) {
+    GarbageStats *stats = &LoxGarbage_Stats;
+
+    printf("Collected %lu containers in %lu cycle collections in %.3fs, %lu alive\n",
+        stats->collected, stats->collections, stats->seconds, stats->tracked);
+}
+
+void
+print_slab_stats(void) {
+    SlabStats *stats;
+    int i;
+
+    printf("%-6s %12s %12s %8s %8s\n", "Slab", "Allocated", "Released",
+        "Slabs", "Peak");
+    for (i = 0; i < SLAB_CLASSES; i++) {
+        stats = &LoxSlab_Stats[i];
+        if (stats->allocated == 0)
+            continue;
+
+        printf("%-6zu %12lu %12lu %8u %8u\n", stats->size, stats->allocated,
+            stats->released, stats->slabs, stats->peak);
+    }
+}
+
+void
+print_opcode_pairs(void) {
+    struct opcode_pair {
+        enum opcode     first, second;
+        unsigned long   count;
+    } top[OPCODE_PAIRS_TOP] = { 0 }, *T;
+    int i, j, k;
+
+    sort_names();
+
+    for (i = 0; i < __OP_MAX; i++) {
+        for (j = 0; j < __OP_MAX; j++) {
+            unsigned long count = LoxVM_OpcodePairs[i][j];
+            if (count <= top[OPCODE_PAIRS_TOP - 1].count)
+                continue;
+
+            // Insertion sort into the (descending) top list
+            for (k = OPCODE_PAIRS_TOP - 1; k > 0 && top[k - 1].count < count; k--)
+                top[k] = top[k - 1];
+            top[k] = (struct opcode_pair) { i, j, count };
+        }
+    }
+
+    printf("%-20s %-20s %12s\n", "Opcode", "Followed by", "Count");
+    for (T = top; T < top + OPCODE_PAIRS_TOP && T->count; T++)
+        printf("%-20s %-20s %12lu\n", opcode_name(T->first),
+            opcode_name(T->second), T->count);
+}
@@ -1,18 +1,22 @@
 #include <assert.h>
+#include <float.h>
+#include <math.h>
 #include <string.h>
 
 #include "vm.h"
 #include "compile.h"
+#include "jit.h"
+#include "cache.h"
 #include "Include/Lox.h"
 #include "Lib/builtin.h"
 #include "Vendor/bdwgc/include/gc.h"
 
 #include "Objects/file.h"
 #include "Objects/hash.h"
+#include "Objects/range.h"
 #include "Objects/class.h"
 #include "Objects/exception.h"
-
-#define STACK_SIZE 32
+#include "Objects/tuple.h"
 
 /**
  * Utility method to print the backtrace of the current execution stack.
@@ -21,7 +25,7 @@
 static void
 vmeval_print_backtrace(VmEvalContext *ctx) {
     // Read through the codesources to identify the offset for the current opcode
-    int offset = *ctx->pc - ctx->code->block->instructions.opcodes,
+    int offset = ctx->pc - ctx->code->block->instructions.opcodes,
         cs_count = ctx->code->block->codesource.count;
     CodeSource *cs = ctx->code->block->codesource.offsets;
 
@@ -80,6 +84,9 @@ assert_safe_code(CodeContext *code) {
         switch (pc->op) {
         case OP_STORE_LOCAL:
         case OP_LOOKUP_LOCAL:
+        case OP_STORE_CELL:
+        case OP_LOOKUP_CELL:
+        case OP_CAPTURE_LOCAL:
             assert(pc->arg < code->locals.count);
             break;
         case OP_BINARY_MATH:
@@ -92,48 +99,1237 @@ assert_safe_code(CodeContext *code) {
     }
 }
 
+static LoxValue vmeval_run(VmEvalContext*);
+
 Object*
 LoxVM_evalSafely(VmEvalContext *ctx) {
     assert_safe_code(ctx->code);
     return LoxVM_eval(ctx);
 }
 
+/**
+ * Evaluate the code in the context and return an owned reference to the
+ * result. Immediate results from the VM are boxed into a new object.
+ */
 Object*
 LoxVM_eval(VmEvalContext *ctx) {
-    assert(ctx);
-    assert(ctx->scope);
+    return LoxValue_asObject(vmeval_run(ctx));
+}
 
-    Object *lhs, *rhs, **local, *rv = LoxUndefined, *item;
-    Constant *C;
+/**
+ * Build a tuple from the values on the stack so they can be passed along to
+ * native functions, which only understand objects.
+ */
+static LoxTuple*
+vmeval_tuple_fromValues(size_t count, LoxValue *values) {
+    LoxTuple *self = Tuple_new(count);
+    Object **item = self->items;
+
+    while (count--) {
+        *item = LoxValue_box(*values++);
+        INCREF(*item);
+        item++;
+    }
+    return self;
+}
+
+/**
+ * Fast path for math on two immediate integers. Returns false if the
+ * operation should be handled by the LoxInteger type instead, such as for
+ * overflow, division by zero, or operations with special handling.
+ */
+static inline bool
+vmeval_math_int(enum lox_vm_math op, long long lhs, long long rhs, LoxValue *result) {
+    long long value;
+
+    switch (op) {
+    case MATH_BINARY_PLUS:
+        if (__builtin_add_overflow(lhs, rhs, &value))
+            return false;
+        break;
+    case MATH_BINARY_MINUS:
+        if (__builtin_sub_overflow(lhs, rhs, &value))
+            return false;
+        break;
+    case MATH_BINARY_STAR:
+        if (__builtin_mul_overflow(lhs, rhs, &value))
+            return false;
+        break;
+    case MATH_BINARY_SLASH:
+        if (rhs == 0)
+            return false;
+        value = lhs / rhs;
+        break;
+    case MATH_BINARY_MODULUS:
+        if (rhs == 0)
+            return false;
+        value = lhs % rhs;
+        break;
+    case MATH_BINARY_LSHIFT:
+        if (rhs < 0 || rhs > 63)
+            return false;
+        value = (long long) ((unsigned long long) lhs << rhs);
+        break;
+    case MATH_BINARY_RSHIFT:
+        if (rhs < 0 || rhs > 63)
+            return false;
+        value = lhs >> rhs;
+        break;
+    case MATH_BINARY_AND:
+        value = lhs & rhs;
+        break;
+    case MATH_BINARY_OR:
+        value = lhs | rhs;
+        break;
+    default:
+        return false;
+    }
+
+    *result = LoxValue_fromLongLong(value);
+    return true;
+}
+
+/**
+ * Fast path for math where at least one side is an immediate double and the
+ * other is an immediate number. Only the operations supported by LoxFloat
+ * are handled here.
+ */
+static inline bool
+vmeval_math_double(enum lox_vm_math op, LoxValue lhs, LoxValue rhs, LoxValue *result) {
+    double a, b;
+
+    if (VALUE_IS_DOUBLE(lhs))
+        a = VALUE_AS_DOUBLE(lhs);
+    else if (VALUE_IS_INT(lhs))
+        a = VALUE_AS_INT(lhs);
+    else
+        return false;
+
+    if (VALUE_IS_DOUBLE(rhs))
+        b = VALUE_AS_DOUBLE(rhs);
+    else if (VALUE_IS_INT(rhs))
+        b = VALUE_AS_INT(rhs);
+    else
+        return false;
+
+    switch (op) {
+    case MATH_BINARY_PLUS:
+        *result = VALUE_FROM_DOUBLE(a + b);
+        break;
+    case MATH_BINARY_MINUS:
+        *result = VALUE_FROM_DOUBLE(a - b);
+        break;
+    case MATH_BINARY_STAR:
+        *result = VALUE_FROM_DOUBLE(a * b);
+        break;
+    case MATH_BINARY_SLASH:
+        *result = VALUE_FROM_DOUBLE(a / b);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+#define COMPARE(lhs, rhs) \
+    lhs == rhs ? 0 : \
+        (OBJECT_TYPE(lhs)->compare ? OBJECT_TYPE(lhs)->compare(lhs, rhs) : \
+             (OBJECT_TYPE(rhs)->compare ? - OBJECT_TYPE(rhs)->compare(rhs, lhs) : \
+                 -1))
+
+/**
+ * Compare two values, using the `compare` method of the boxed types for
+ * anything other than two immediate integers or an immediate double on the
+ * left-hand side. Reference counts of the values are not affected.
+ */
+static int
+vmeval_compare(LoxValue lhs, LoxValue rhs) {
+    if (VALUE_IS_INT(lhs) && VALUE_IS_INT(rhs)) {
+        long long a = VALUE_AS_INT(lhs), b = VALUE_AS_INT(rhs);
+        return (a > b) - (a < b);
+    }
+    else if (VALUE_IS_DOUBLE(lhs) && (VALUE_IS_DOUBLE(rhs) || VALUE_IS_INT(rhs))) {
+        double diff = VALUE_AS_DOUBLE(lhs)
+            - (VALUE_IS_INT(rhs) ? VALUE_AS_INT(rhs) : VALUE_AS_DOUBLE(rhs));
+        if (fabs(diff) < DBL_EPSILON)
+            return 0;
+        return diff < 0 ? -1 : 1;
+    }
+
+    Object *a = LoxValue_box(lhs), *b = LoxValue_box(rhs);
+    INCREF(a);
+    INCREF(b);
+    int result = COMPARE(a, b);
+    DECREF(a);
+    DECREF(b);
+    return result;
+}
+
+static inline bool
+vmeval_compare_int(enum lox_vm_compare op, long long lhs, long long rhs) {
+    switch (op) {
+    case COMPARE_EQ:
+        return lhs == rhs;
+    case COMPARE_NOT_EQ:
+        return lhs != rhs;
+    case COMPARE_LT:
+        return lhs < rhs;
+    case COMPARE_LTE:
+        return lhs <= rhs;
+    case COMPARE_GT:
+        return lhs > rhs;
+    case COMPARE_GTE:
+        return lhs >= rhs;
+    default:
+        assert(!"Unexpected comparison for integers");
+        return false;
+    }
+}
+
+/**
+ * Compare two values for COMPARE_EXACT, which also requires the types of the
+ * values to match. Returns true if the values are exactly equal.
+ */
+static bool
+vmeval_compare_exact(LoxValue lhs, LoxValue rhs) {
+    if (VALUE_IS_INT(lhs) && VALUE_IS_INT(rhs))
+        return lhs == rhs;
+    else if (VALUE_IS_DOUBLE(lhs) && VALUE_IS_DOUBLE(rhs))
+        return vmeval_compare(lhs, rhs) == 0;
+
+    Object *a = LoxValue_box(lhs), *b = LoxValue_box(rhs);
+    INCREF(a);
+    INCREF(b);
+    bool result = OBJECT_TYPE(a) == OBJECT_TYPE(b) && (COMPARE(a, b)) == 0;
+    DECREF(a);
+    DECREF(b);
+    return result;
+}
+
+VmQuickenStats LoxVM_QuickenStats;
+unsigned long LoxVM_OpcodePairs[__OP_MAX][__OP_MAX];
+
+/**
+ * Select a type-specialized opcode for OP_BINARY_MATH given the operands it
+ * just received. Returns OP_BINARY_MATH if there is no specialization.
+ */
+static inline enum opcode
+vmeval_quicken_math(enum lox_vm_math op, LoxValue lhs, LoxValue rhs) {
+    if (VALUE_IS_INT(lhs) && VALUE_IS_INT(rhs)) {
+        switch (op) {
+        case MATH_BINARY_PLUS:
+            return OP_ADD_INT_INT;
+        case MATH_BINARY_MINUS:
+            return OP_SUB_INT_INT;
+        case MATH_BINARY_STAR:
+            return OP_MUL_INT_INT;
+        default:
+            break;
+        }
+    }
+    else if (VALUE_IS_DOUBLE(lhs) && VALUE_IS_DOUBLE(rhs)) {
+        switch (op) {
+        case MATH_BINARY_PLUS:
+            return OP_ADD_FLOAT_FLOAT;
+        case MATH_BINARY_MINUS:
+            return OP_SUB_FLOAT_FLOAT;
+        case MATH_BINARY_STAR:
+            return OP_MUL_FLOAT_FLOAT;
+        case MATH_BINARY_SLASH:
+            return OP_DIV_FLOAT_FLOAT;
+        default:
+            break;
+        }
+    }
+    else if (op == MATH_BINARY_PLUS
+        && VALUE_IS_OBJECT(lhs) && String_isString(VALUE_AS_OBJECT(lhs))
+        && VALUE_IS_OBJECT(rhs) && String_isString(VALUE_AS_OBJECT(rhs))
+    ) {
+        return OP_ADD_STR_STR;
+    }
+    return OP_BINARY_MATH;
+}
+
+/**
+ * Select a type-specialized opcode for OP_COMPARE. Returns OP_COMPARE if
+ * there is no specialization.
+ */
+static inline enum opcode
+vmeval_quicken_compare(enum lox_vm_compare op, LoxValue lhs, LoxValue rhs) {
+    if (VALUE_IS_INT(lhs) && VALUE_IS_INT(rhs)) {
+        switch (op) {
+        case COMPARE_EQ:
+            return OP_EQ_INT_INT;
+        case COMPARE_NOT_EQ:
+            return OP_NOT_EQ_INT_INT;
+        case COMPARE_LT:
+            return OP_LT_INT_INT;
+        case COMPARE_LTE:
+            return OP_LTE_INT_INT;
+        case COMPARE_GT:
+            return OP_GT_INT_INT;
+        case COMPARE_GTE:
+            return OP_GTE_INT_INT;
+        default:
+            break;
+        }
+    }
+    return OP_COMPARE;
+}
+
+// Rewrite the current instruction to a specialized opcode, if any
+#define QUICKEN(specialized) do { \
+    enum opcode _quick = (specialized); \
+    if (_quick != pc->op) { \
+        pc->op = _quick; \
+        LoxVM_QuickenStats.quickened++; \
+    } \
+} while(0)
+
+// Verify the operand types of a quickened instruction. On a mismatch, the
+// instruction is de-quickened and the generic opcode handles the operands.
+#define QUICKEN_GUARD(test, generic) do { \
+    if (unlikely(!(test))) { \
+        LoxVM_QuickenStats.misses[pc->op]++; \
+        pc->op = generic; \
+        goto generic; \
+    } \
+    LoxVM_QuickenStats.hits[pc->op]++; \
+} while(0)
+
+/**
+ * Add an inline cache for the attribute access at `pc` and rewrite the
+ * instruction to use it. Returns false if the code has no room for more
+ * caches, in which case the instruction is left alone.
+ */
+static bool
+vmeval_attrcache_quicken(CodeContext *code, Instruction *pc, enum opcode cached) {
+    if (code->nAttrCaches > INSTRUCTION_ARG_MAX)
+        return false;
+
+    if (code->nAttrCaches == code->sizeAttrCaches) {
+        code->sizeAttrCaches += 8;
+        code->attrCaches = GC_REALLOC(code->attrCaches,
+            code->sizeAttrCaches * sizeof(AttrCache));
+    }
+
+    *(code->attrCaches + code->nAttrCaches) = (AttrCache) {
+        .name = pc->arg,
+    };
+
+    pc->op = cached;
+    pc->arg = code->nAttrCaches++;
+    LoxVM_QuickenStats.quickened++;
+    return true;
+}
+
+static inline AttrCacheEntry*
+vmeval_attrcache_find(AttrCache *cache, LoxClass *class) {
+    AttrCacheEntry *entry = cache->entries;
+    int i = ATTR_CACHE_ENTRIES;
+
+    for (; i; i--, entry++) {
+        if (entry->class == class && entry->epoch == LoxClass_Epoch)
+            return entry;
+    }
+    return NULL;
+}
+
+static inline void
+vmeval_attrcache_store(AttrCache *cache, LoxClass *class, Object *method, unsigned slot) {
+    cache->entries[cache->next] = (AttrCacheEntry) {
+        .class = class,
+        .epoch = LoxClass_Epoch,
+        .method = method,
+        .slot = slot,
+    };
+    cache->next = (cache->next + 1) % ATTR_CACHE_ENTRIES;
+}
+
+/**
+ * Fetch the instance table entry for `name` from the slot remembered in the
+ * cache entry, if it is still there.
+ */
+static inline HashEntry*
+vmeval_attrcache_slot(AttrCacheEntry *entry, LoxTable *attributes, Object *name,
+    hashval_t hash
+) {
+    HashEntry *slot;
+
+    if (attributes && entry->slot < attributes->size) {
+        slot = attributes->table + entry->slot;
+        if (slot->key && slot->hash == hash
+            && (slot->key == name || 0 == OBJECT_TYPE(slot->key)->compare(slot->key, name))
+        ) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Find an attribute of an instance through an inline cache. Attributes of
+ * the instance itself are read straight from the cached slot, and attributes
+ * resolved through the class (and its parents) are reused without walking
+ * the class hierarchy again. If the attribute comes from the class, it is
+ * returned unbound and `from_class` is set. `op` is the instruction to
+ * account the hit or miss to.
+ */
+static Object*
+vmeval_instance_lookup(AttrCache *cache, LoxInstance *instance, Object *name,
+    hashval_t hash, bool *from_class, enum opcode op
+) {
+    AttrCacheEntry *entry = vmeval_attrcache_find(cache, instance->class);
+    HashEntry *slot;
+    Object *method;
+
+    *from_class = false;
+
+    if (likely(entry != NULL)) {
+        if ((slot = vmeval_attrcache_slot(entry, instance->attributes, name, hash))) {
+            LoxVM_QuickenStats.hits[op]++;
+            return slot->value;
+        }
+        else if (entry->method) {
+            // Attributes of the instance shadow the class
+            if (!instance->attributes
+                || !(slot = Hash_lookupEx(instance->attributes, name, hash))
+            ) {
+                LoxVM_QuickenStats.hits[op]++;
+                *from_class = true;
+                return entry->method;
+            }
+        }
+    }
+
+    LoxVM_QuickenStats.misses[op]++;
+
+    if (instance->attributes
+        && (slot = Hash_lookupEx(instance->attributes, name, hash))
+    ) {
+        vmeval_attrcache_store(cache, instance->class, NULL,
+            slot - instance->attributes->table);
+        return slot->value;
+    }
+
+    method = object_getattr((Object*) instance->class, name, hash);
+    if (method == LoxUndefined)
+        return method;
+
+    vmeval_attrcache_store(cache, instance->class, method, 0);
+    *from_class = true;
+    return method;
+}
+
+/**
+ * Equivalent of object_getattr() for an attribute access site with an inline
+ * cache.
+ */
+static Object*
+vmeval_getattr_cached(AttrCache *cache, Object *object, Object *name, hashval_t hash) {
+    if (unlikely(!Instance_isInstance(object))) {
+        LoxVM_QuickenStats.misses[OP_GET_ATTR_CACHED]++;
+        return object_getattr(object, name, hash);
+    }
+
+    bool from_class;
+    Object *attr = vmeval_instance_lookup(cache, (LoxInstance*) object, name, hash,
+        &from_class, OP_GET_ATTR_CACHED);
+
+    if (from_class)
+        return BoundMethod_create(attr, object);
+
+    return attr;
+}
+
+/**
+ * Fetch the callable for a method call, `object.name(...)`. When the method
+ * is a function defined by the class of an instance (or a native type), it
+ * is returned unbound and `unbound` is set, in which case the caller should
+ * invoke it with `object` as `this`. Otherwise, this is object_getattr().
+ * The `cache` is only used for instances and may be NULL.
+ */
+static Object*
+vmeval_getmethod(AttrCache *cache, Object *object, Object *name, hashval_t hash,
+    bool *unbound
+) {
+    Object *method;
+    bool from_class;
+
+    *unbound = false;
+
+    if (cache && Instance_isInstance(object)) {
+        method = vmeval_instance_lookup(cache, (LoxInstance*) object, name, hash,
+            &from_class, OP_LOAD_METHOD_CACHED);
+        if (!from_class)
+            return method;
+
+        if (VmCode_isVmCode(method) || VmFunction_isVmFunction(method)
+            || Function_isNativeFunction(method)
+        ) {
+            *unbound = true;
+            return method;
+        }
+        return BoundMethod_create(method, object);
+    }
+    else if (cache) {
+        LoxVM_QuickenStats.misses[OP_LOAD_METHOD_CACHED]++;
+    }
+
+    if (!OBJECT_TYPE(object)->getattr && OBJECT_TYPE(object)->properties) {
+        method = object_getmethod(object, name, hash);
+        if (method && Function_isNativeFunction(method)) {
+            *unbound = true;
+            return method;
+        }
+    }
+
+    return object_getattr(object, name, hash);
+}
+
+/**
+ * Equivalent of the `setattr` of the object for an attribute access site
+ * with an inline cache. Existing attributes of an instance are replaced in
+ * the cached slot of its attributes table. Otherwise, as for the first
+ * assignment in a constructor, the attribute is stored in the table with a
+ * single probe and its slot is cached. That counts as a hit if the site has
+ * seen the class before.
+ */
+static void
+vmeval_setattr_cached(AttrCache *cache, Object *object, Object *name, Object *value,
+    hashval_t hash
+) {
+    HashEntry *slot;
+
+    if (likely(Instance_isInstance(object))) {
+        LoxInstance *instance = (LoxInstance*) object;
+        AttrCacheEntry *entry = vmeval_attrcache_find(cache, instance->class);
+
+        if (entry
+            && (slot = vmeval_attrcache_slot(entry, instance->attributes, name, hash))
+        ) {
+            LoxVM_QuickenStats.hits[OP_SET_ATTR_CACHED]++;
+            INCREF(value);
+            DECREF(slot->value);
+            slot->value = value;
+            return;
+        }
+
+        slot = LoxInstance_storeAttribute(instance, name, value, hash);
+        if (entry) {
+            LoxVM_QuickenStats.hits[OP_SET_ATTR_CACHED]++;
+            if (slot)
+                entry->slot = slot - instance->attributes->table;
+        }
+        else {
+            LoxVM_QuickenStats.misses[OP_SET_ATTR_CACHED]++;
+            if (slot)
+                vmeval_attrcache_store(cache, instance->class, NULL,
+                    slot - instance->attributes->table);
+        }
+        return;
+    }
+
+    LoxVM_QuickenStats.misses[OP_SET_ATTR_CACHED]++;
+    if (unlikely(!OBJECT_TYPE(object)->setattr)) {
+        fprintf(stderr, "WARNING: `setattr` not defined for type: `%s`\n", OBJECT_TYPE(object)->name);
+    }
+    else {
+        OBJECT_TYPE(object)->setattr(object, name, value, hash);
+    }
+}
+
+// Data stack for the run-time frames. Memory is handed out in LIFO order from
+// chunks which never move, so pointers into a suspended frame stay valid as
+// deeper frames are pushed. Recursion is only limited by available memory.
+#define VMSTACK_CHUNK_SIZE (256 * 1024)
+
+typedef struct vmeval_stack_chunk {
+    struct vmeval_stack_chunk *previous;
+    char            *top;
+    char            *end;
+    char            data[];
+} VmStackChunk;
+
+static VmStackChunk *vmstack = NULL;
+static VmStackChunk *vmstack_spare = NULL;
+
+static VmStackChunk*
+vmstack_grow(size_t size) {
+    VmStackChunk *chunk = vmstack_spare;
+
+    if (chunk && (size_t) (chunk->end - chunk->data) >= size) {
+        vmstack_spare = NULL;
+    }
+    else {
+        size_t length = VMSTACK_CHUNK_SIZE;
+        while (length < size + sizeof(VmStackChunk))
+            length <<= 1;
+
+        chunk = malloc(length);
+        assert(chunk);
+        chunk->end = (char*) chunk + length;
+    }
+
+    chunk->top = chunk->data;
+    chunk->previous = vmstack;
+    return vmstack = chunk;
+}
+
+static inline void*
+vmstack_push(size_t size) {
+    VmStackChunk *chunk = vmstack;
 
-    Object *_locals[ctx->code->locals.count], **locals = &_locals[0];
-    bool locals_in_stack = true;
+    // Keep everything aligned for LoxValue and pointers
+    size = (size + 15) & ~15;
+    if (unlikely(!chunk || chunk->top + size > chunk->end))
+        chunk = vmstack_grow(size);
+
+    void *rv = chunk->top;
+    chunk->top += size;
+    return rv;
+}
+
+static inline void
+vmstack_pop(void *data) {
+    VmStackChunk *chunk = vmstack;
+    assert((char*) data >= chunk->data && (char*) data < chunk->top);
+
+    chunk->top = data;
+    if (unlikely(chunk->top == chunk->data && chunk->previous)) {
+        // Keep one empty chunk around so that calls right at the boundary
+        // don't thrash malloc
+        vmstack = chunk->previous;
+        if (vmstack_spare)
+            free(vmstack_spare);
+        vmstack_spare = chunk;
+    }
+}
+
+/**
+ * Allocate a frame for a call to `code` on the data stack. The arguments are
+ * copied into the locals, each with a new reference.
+ */
+static inline VmEvalContext*
+vmeval_frame_push(CodeContext *code, VmScope *scope, Object *this,
+    LoxValue *args, unsigned nargs, VmEvalContext *previous
+) {
+    unsigned nlocals = code->locals.count;
+
+    // Blocks are pre-incremented on entry, so the first one is never used
+    VmEvalContext *frame = vmstack_push(sizeof(VmEvalContext)
+        + sizeof(LoxValue) * (nlocals + code->stacksize)
+        + sizeof(VmEvalLoopBlock) * (code->nLoops + 1));
+    LoxValue *locals = (LoxValue*) (frame + 1);
+    VmEvalLoopBlock *blocks = (VmEvalLoopBlock*) (locals + nlocals);
+
+    frame->code = code;
+    frame->scope = scope;
+    frame->args = (VmCallArgs) {
+        .values = args,
+        .count = nargs,
+    };
+    frame->this = this;
+    frame->pc = code->block->instructions.opcodes;
+    frame->previous = previous;
+    frame->locals = locals;
+    frame->base = frame->stack = (LoxValue*) (blocks + code->nLoops + 1);
+    frame->pblock = blocks;
+    frame->release = 0;
 
     // Store parameters in the local variables
-    int i = ctx->code->locals.count, j = ctx->args.count;
-    assert(i >= j);
-    while (i > j) {
-        *(locals + --i) = LoxUndefined;
-		INCREF(LoxUndefined);
-	}
+    int i = nlocals;
+    assert(i >= nargs);
+    while (i > nargs)
+        *(locals + --i) = VALUE_UNDEFINED;
 
     while (i--) {
-        *(locals + i) = *(ctx->args.values + i);
-		INCREF(*(locals + i));
-	}
+        *(locals + i) = *(args + i);
+        VALUE_INCREF(*(locals + i));
+    }
+
+    return frame;
+}
+
+static inline void
+vmeval_frame_pop(VmEvalContext *frame) {
+    int i = frame->code->locals.count;
+    while (i--)
+        VALUE_DECREF(*(frame->locals + i));
 
-    // Get number of nested block depth in compiler
-    VmEvalLoopBlock blocks[ctx->code->nLoops], *pblock = &blocks[0];
+    vmstack_pop(frame);
+}
+
+#define VALUE_ISTRUE(value) \
+    ((value) == VALUE_TRUE ? true : (value) == VALUE_FALSE ? false : LoxValue_isTrue(value))
 
-    // TODO: Add estimate for MAX_STACK in the compile phase
-    // XXX: Program could overflow 32-slot stack
-    Object *_stack[STACK_SIZE], **stack = &_stack[0];
+/**
+ * Apply the math operator to the values, falling back to the operator
+ * methods of the boxed types. Both references are consumed and the result is
+ * owned by the caller.
+ */
+static LoxValue
+vmeval_binary_math(enum lox_vm_math op, LoxValue a, LoxValue b) {
+    LoxValue result;
+    Object *lhs, *rhs;
+
+    if (VALUE_IS_INT(a) && VALUE_IS_INT(b)) {
+        if (vmeval_math_int(op, VALUE_AS_INT(a), VALUE_AS_INT(b), &result))
+            return result;
+    }
+    else if ((VALUE_IS_DOUBLE(a) || VALUE_IS_DOUBLE(b))
+        && vmeval_math_double(op, a, b, &result)
+    ) {
+        return result;
+    }
 
-    InstructionList *instructions = &ctx->code->block->instructions;
-    Instruction *pc = instructions->opcodes,
-        *end = pc + instructions->count;
+    lhs = LoxValue_asObject(a);
+    rhs = LoxValue_asObject(b);
 
-    ctx->pc = &pc;
+    // The op is the binary function index in the object type. The first one
+    // is op_plus. We should just advance ahead a number of functions based on
+    // the op to find the appropriate method to invoke.
+    lox_vm_binary_math_func *operfunc =
+        (void*) OBJECT_TYPE(lhs)
+        + offsetof(ObjectType, op_plus)
+        + op * sizeof(lox_vm_binary_math_func);
+
+    if (*operfunc) {
+        assert(op < __MATH_BINARY_MAX);
+        result = LoxValue_fromObjectRef((*operfunc)(lhs, rhs));
+    }
+    else {
+        fprintf(stderr, "WARNING: Type `%s` does not support op `%hd`\n", OBJECT_TYPE(lhs)->name, op);
+        result = VALUE_UNDEFINED;
+    }
+    DECREF(lhs);
+    DECREF(rhs);
+    return result;
+}
+
+/**
+ * Compare the values with the comparison operator. Both references are
+ * consumed and the result is owned by the caller.
+ */
+static LoxValue
+vmeval_compare_op(enum lox_vm_compare op, LoxValue a, LoxValue b) {
+    LoxValue result;
+    Object *lhs, *rhs;
+
+    switch (op) {
+    case COMPARE_IN:
+        // The container is on the right
+        lhs = LoxValue_asObject(b);
+        rhs = LoxValue_asObject(a);
+        if (likely(OBJECT_TYPE(lhs)->contains != NULL)) {
+            result = LoxValue_fromObjectRef((Object*) OBJECT_TYPE(lhs)->contains(lhs, rhs));
+        }
+        else {
+            fprintf(stderr, "WARNING: Type <%s> does not support IN\n", OBJECT_TYPE(lhs)->name);
+            result = VALUE_UNDEFINED;
+        }
+        DECREF(lhs);
+        DECREF(rhs);
+        return result;
+
+    case COMPARE_EXACT:
+        result = VALUE_FROM_BOOL(vmeval_compare_exact(a, b));
+        break;
+    case COMPARE_NOT_EXACT:
+        result = VALUE_FROM_BOOL(!vmeval_compare_exact(a, b));
+        break;
+    case COMPARE_IS:
+        result = VALUE_FROM_BOOL(a == b);
+        break;
+    case COMPARE_EQ:
+        result = VALUE_FROM_BOOL(vmeval_compare(a, b) == 0);
+        break;
+    case COMPARE_NOT_EQ:
+        result = VALUE_FROM_BOOL(vmeval_compare(a, b) != 0);
+        break;
+    case COMPARE_GT:
+        result = VALUE_FROM_BOOL(vmeval_compare(a, b) > 0);
+        break;
+    case COMPARE_GTE:
+        result = VALUE_FROM_BOOL(vmeval_compare(a, b) >= 0);
+        break;
+    case COMPARE_LT:
+        result = VALUE_FROM_BOOL(vmeval_compare(a, b) < 0);
+        break;
+    case COMPARE_LTE:
+        result = VALUE_FROM_BOOL(vmeval_compare(a, b) <= 0);
+        break;
+    case COMPARE_SPACESHIP:
+        result = VALUE_FROM_INT(vmeval_compare(a, b));
+        break;
+    default:
+        assert(!"Unexpected comparison");
+        result = VALUE_UNDEFINED;
+    }
+    VALUE_DECREF(a);
+    VALUE_DECREF(b);
+    return result;
+}
+
+/**
+ * Evaluate an instruction on constant operands for the optimizer (see
+ * optimize.c). For unary instructions, `b` is ignored. Only the cases which
+ * can neither raise nor warn are folded: math and comparison of immediate
+ * numbers through the same fast paths as the instructions, and string
+ * concatenation. Returns false if the instruction has to be left to run-time;
+ * otherwise the result is owned by the caller.
+ */
+bool
+LoxVM_foldConstant(const Instruction *op, LoxValue a, LoxValue b, LoxValue *result) {
+    bool numbers = (VALUE_IS_INT(a) || VALUE_IS_DOUBLE(a))
+        && (VALUE_IS_INT(b) || VALUE_IS_DOUBLE(b));
+
+    switch (op->op) {
+    case OP_BINARY_MATH:
+        if (VALUE_IS_INT(a) && VALUE_IS_INT(b))
+            return vmeval_math_int(op->arg, VALUE_AS_INT(a), VALUE_AS_INT(b), result);
+        else if (numbers)
+            return vmeval_math_double(op->arg, a, b, result);
+        else if (op->arg == MATH_BINARY_PLUS
+            && VALUE_IS_OBJECT(a) && String_isString(VALUE_AS_OBJECT(a))
+            && VALUE_IS_OBJECT(b) && String_isString(VALUE_AS_OBJECT(b))
+        ) {
+            VALUE_INCREF(a);
+            VALUE_INCREF(b);
+            *result = vmeval_binary_math(op->arg, a, b);
+            return true;
+        }
+        return false;
+
+    case OP_COMPARE:
+        switch ((enum lox_vm_compare) op->arg) {
+        case COMPARE_EQ:
+        case COMPARE_NOT_EQ:
+        case COMPARE_LT:
+        case COMPARE_LTE:
+        case COMPARE_GT:
+        case COMPARE_GTE:
+            if (!numbers)
+                return false;
+            *result = vmeval_compare_op(op->arg, a, b);
+            return true;
+        default:
+            return false;
+        }
+
+    case OP_UNARY_NEGATIVE:
+        if (VALUE_IS_INT(a))
+            *result = LoxValue_fromLongLong(-VALUE_AS_INT(a));
+        else if (VALUE_IS_DOUBLE(a))
+            *result = VALUE_FROM_DOUBLE(-VALUE_AS_DOUBLE(a));
+        else
+            return false;
+        return true;
+
+    case OP_BANG:
+        if (VALUE_IS_OBJECT(a))
+            return false;
+        *result = VALUE_FROM_BOOL(!LoxValue_isTrue(a));
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+/*
+ * Instruction bodies which are shared by the interpreter and the native code
+ * from the JIT. Each takes the top of the operand stack and returns the new
+ * top of the stack.
+ */
+LoxValue*
+vmeval_op_binary_math(VmEvalContext *ctx, LoxValue *stack, Instruction *pc) {
+    LoxValue b = POP(stack), a = POP(stack);
+    XPUSH(stack, vmeval_binary_math(pc->arg, a, b));
+    return stack;
+}
+
+LoxValue*
+vmeval_op_compare(VmEvalContext *ctx, LoxValue *stack, Instruction *pc) {
+    LoxValue b = POP(stack), a = POP(stack);
+    XPUSH(stack, vmeval_compare_op(pc->arg, a, b));
+    return stack;
+}
+
+LoxValue*
+vmeval_op_bang(VmEvalContext *ctx, LoxValue *stack, Instruction *pc) {
+    LoxValue a = POP(stack);
+    XPUSH(stack, VALUE_FROM_BOOL(!VALUE_ISTRUE(a)));
+    VALUE_DECREF(a);
+    return stack;
+}
+
+LoxValue*
+vmeval_op_unary_negative(VmEvalContext *ctx, LoxValue *stack, Instruction *pc) {
+    LoxValue a = POP(stack);
+    Object *object;
+
+    if (VALUE_IS_INT(a)) {
+        XPUSH(stack, LoxValue_fromLongLong(-VALUE_AS_INT(a)));
+    }
+    else if (VALUE_IS_DOUBLE(a)) {
+        XPUSH(stack, VALUE_FROM_DOUBLE(-VALUE_AS_DOUBLE(a)));
+    }
+    else {
+        object = LoxValue_asObject(a);
+        PUSH_OBJECT(stack, OBJECT_TYPE(object)->op_neg(object));
+        DECREF(object);
+    }
+    return stack;
+}
+
+/**
+ * Find the constant for the attribute name of OP_*_ATTR and OP_LOAD_METHOD
+ * and their cached variants. The first time an instance is seen, an inline
+ * cache is attached to the instruction (`cached` is the opcode to switch to).
+ */
+static inline Constant*
+vmeval_attr_name(VmEvalContext *ctx, Instruction *pc, LoxValue receiver,
+    enum opcode cached, AttrCache **cache
+) {
+    if (pc->op != cached && VALUE_IS_OBJECT(receiver)
+        && Instance_isInstance(VALUE_AS_OBJECT(receiver))
+    ) {
+        vmeval_attrcache_quicken(ctx->code, pc, cached);
+    }
+
+    if (pc->op == cached) {
+        *cache = ctx->code->attrCaches + pc->arg;
+        return ctx->code->constants + (*cache)->name;
+    }
+
+    *cache = NULL;
+    return ctx->code->constants + pc->arg;
+}
+
+// Fetch the attribute for OP_GET_ATTR at `pc`. The caller keeps `object`
+// alive, be it through a reference on the stack or a borrowed one.
+static inline Object*
+vmeval_get_attr(VmEvalContext *ctx, Instruction *pc, Object *object) {
+    AttrCache *cache;
+    Constant *C = vmeval_attr_name(ctx, pc, VALUE_FROM_OBJECT(object),
+        OP_GET_ATTR_CACHED, &cache);
+
+    if (cache)
+        return vmeval_getattr_cached(cache, object, C->value, C->hash);
+    return object_getattr(object, C->value, C->hash);
+}
+
+LoxValue*
+vmeval_op_get_attr(VmEvalContext *ctx, LoxValue *stack, Instruction *pc) {
+    Object *object = POP_OBJECT(stack);
+
+    PUSH_OBJECT(stack, vmeval_get_attr(ctx, pc, object));
+    DECREF(object);
+    return stack;
+}
+
+LoxValue*
+vmeval_op_set_attr(VmEvalContext *ctx, LoxValue *stack, Instruction *pc) {
+    AttrCache *cache;
+    Constant *C = vmeval_attr_name(ctx, pc, *(stack - 2), OP_SET_ATTR_CACHED, &cache);
+    Object *value = POP_OBJECT(stack),
+        *object = POP_OBJECT(stack);
+
+    if (cache) {
+        vmeval_setattr_cached(cache, object, C->value, value, C->hash);
+    }
+    else if (unlikely(!OBJECT_TYPE(object)->setattr)) {
+        fprintf(stderr, "WARNING: `setattr` not defined for type: `%s`\n", OBJECT_TYPE(object)->name);
+    }
+    else {
+        OBJECT_TYPE(object)->setattr(object, C->value, value, C->hash);
+    }
+
+    DECREF(value);
+    DECREF(object);
+    return stack;
+}
+
+LoxValue*
+vmeval_op_load_method(VmEvalContext *ctx, LoxValue *stack, Instruction *pc) {
+    // Stack after: (callable) (receiver or EMPTY)
+    AttrCache *cache;
+    Constant *C = vmeval_attr_name(ctx, pc, PEEK(stack), OP_LOAD_METHOD_CACHED, &cache);
+    Object *object = POP_OBJECT(stack);
+    bool unbound;
+
+    PUSH_OBJECT(stack, vmeval_getmethod(cache, object, C->value, C->hash, &unbound));
+    if (unbound) {
+        // The stack takes the reference to the receiver (which might be a
+        // boxed immediate)
+        XPUSH(stack, VALUE_FROM_OBJECT(object));
+    }
+    else {
+        XPUSH(stack, VALUE_EMPTY);
+        DECREF(object);
+    }
+    return stack;
+}
+
+LoxValue*
+vmeval_op_this(VmEvalContext *ctx, LoxValue *stack, Instruction *pc) {
+    PUSH_OBJECT(stack, ctx->this);
+    return stack;
+}
+
+LoxValue*
+vmeval_op_lookup_global(VmEvalContext *ctx, LoxValue *stack, Instruction *pc) {
+    Constant *C = ctx->code->constants + pc->arg;
+    Object *item = VmScope_lookup_global(ctx->scope, C->value, C->hash);
+
+    if (LoxNativeProperty_isProperty(item))
+        item = LoxNativeProperty_callGetter(item, ctx->scope, ctx->this);
+    PUSH_OBJECT(stack, item);
+    return stack;
+}
+
+LoxValue*
+vmeval_op_lookup_closed(VmEvalContext *ctx, LoxValue *stack, Instruction *pc) {
+    assert(ctx->scope && pc->arg < ctx->scope->cells_count);
+
+    LoxCell *cell = (LoxCell*) VALUE_AS_OBJECT(ctx->scope->cells[pc->arg]);
+    PUSH(stack, cell->value);
+    return stack;
+}
+
+LoxValue*
+vmeval_op_store_closed(VmEvalContext *ctx, LoxValue *stack, Instruction *pc) {
+    assert(ctx->scope && pc->arg < ctx->scope->cells_count);
+
+    LoxCell *cell = (LoxCell*) VALUE_AS_OBJECT(ctx->scope->cells[pc->arg]);
+    VALUE_DECREF(cell->value);
+    cell->value = POP(stack);
+    return stack;
+}
+
+/**
+ * The slot of a captured local holds its cell once a closure has captured
+ * it (or it was assigned), and the plain value until then.
+ */
+LoxValue*
+vmeval_op_lookup_cell(VmEvalContext *ctx, LoxValue *stack, Instruction *pc) {
+    LoxValue value = *(ctx->locals + pc->arg);
+
+    if (LoxCell_isCell(value))
+        value = ((LoxCell*) VALUE_AS_OBJECT(value))->value;
+    PUSH(stack, value);
+    return stack;
+}
+
+LoxValue*
+vmeval_op_store_cell(VmEvalContext *ctx, LoxValue *stack, Instruction *pc) {
+    LoxValue *slot = ctx->locals + pc->arg, value = POP(stack);
+
+    if (LoxCell_isCell(*slot)) {
+        LoxCell *cell = (LoxCell*) VALUE_AS_OBJECT(*slot);
+        VALUE_DECREF(cell->value);
+        cell->value = value;
+    }
+    else {
+        VALUE_DECREF(*slot);
+        *slot = LoxValue_fromObjectRef((Object*) LoxCell_create(value));
+    }
+    return stack;
+}
+
+// Push the cell of a local for OP_CLOSE_FUN, moving the value into a new
+// cell if the local was not captured yet
+LoxValue*
+vmeval_op_capture_local(VmEvalContext *ctx, LoxValue *stack, Instruction *pc) {
+    LoxValue *slot = ctx->locals + pc->arg;
+
+    if (!LoxCell_isCell(*slot))
+        *slot = LoxValue_fromObjectRef((Object*) LoxCell_create(*slot));
+    PUSH(stack, *slot);
+    return stack;
+}
+
+LoxValue*
+vmeval_op_capture_closed(VmEvalContext *ctx, LoxValue *stack, Instruction *pc) {
+    assert(ctx->scope && pc->arg < ctx->scope->cells_count);
+
+    PUSH(stack, ctx->scope->cells[pc->arg]);
+    return stack;
+}
+
+LoxValue*
+vmeval_op_store_global(VmEvalContext *ctx, LoxValue *stack, Instruction *pc) {
+    Constant *C = ctx->code->constants + pc->arg;
+    Object *value = POP_OBJECT(stack);
+
+    VmScope_assign(ctx->scope, C->value, value, C->hash);
+    DECREF(value);
+    return stack;
+}
+
+LoxValue*
+vmeval_op_get_item(VmEvalContext *ctx, LoxValue *stack, Instruction *pc) {
+    Object *key = POP_OBJECT(stack),
+        *object = POP_OBJECT(stack);
+
+    if (OBJECT_TYPE(object)->get_item)
+        PUSH_OBJECT(stack, OBJECT_TYPE(object)->get_item(object, key));
+    else
+        fprintf(stderr, "lhs type `%s` does not support GET_ITEM\n", OBJECT_TYPE(object)->name);
+    DECREF(object);
+    DECREF(key);
+    return stack;
+}
+
+LoxValue*
+vmeval_op_set_item(VmEvalContext *ctx, LoxValue *stack, Instruction *pc) {
+    Object *value = POP_OBJECT(stack),
+        *key = POP_OBJECT(stack),
+        *object = POP_OBJECT(stack);
+
+    if (OBJECT_TYPE(object)->set_item)
+        OBJECT_TYPE(object)->set_item(object, key, value);
+    else
+        fprintf(stderr, "lhs type `%s` does not support SET_ITEM\n", OBJECT_TYPE(object)->name);
+    DECREF(object);
+    DECREF(value);
+    DECREF(key);
+    return stack;
+}
+
+LoxValue*
+vmeval_op_build_tuple(VmEvalContext *ctx, LoxValue *stack, Instruction *pc) {
+    Object *tuple = (Object*) vmeval_tuple_fromValues(pc->arg, stack - pc->arg);
+    int i = pc->arg;
+
+    while (i--)
+        XPOP(stack);
+    PUSH_OBJECT(stack, tuple);
+    return stack;
+}
+
+LoxValue*
+vmeval_op_get_iterator(VmEvalContext *ctx, LoxValue *stack, Instruction *pc) {
+    Object *object = POP_OBJECT(stack), *iterator;
+
+    if (OBJECT_TYPE(object)->iterate) {
+        iterator = (Object*) OBJECT_TYPE(object)->iterate(object);
+    }
+    else {
+        fprintf(stderr, "Type `%s` is not iterable\n", OBJECT_TYPE(object)->name);
+        iterator = LoxUndefined;
+    }
+    PUSH_OBJECT(stack, iterator);
+    DECREF(object);
+    return stack;
+}
+
+// The loop blocks are only kept in the frame while running native code
+LoxValue*
+vmeval_op_enter_block(VmEvalContext *ctx, LoxValue *stack, Instruction *pc) {
+    *(++ctx->pblock) = (VmEvalLoopBlock) {
+        .top = pc,
+        .bottom = pc + pc->arg,
+    };
+    return stack;
+}
+
+LoxValue*
+vmeval_op_leave_block(VmEvalContext *ctx, LoxValue *stack, Instruction *pc) {
+    int i = pc->arg;
+
+    ctx->pblock--;
+    while (i--)
+        XPOP(stack);
+    return stack;
+}
+
+// Advance the iterator on the top of the stack. Returns false at the end.
+bool
+vmeval_op_next(VmEvalContext *ctx, LoxValue *stack, Instruction *pc) {
+    Iterator *iterator = (Iterator*) PEEK_OBJECT(stack);
+    Object *item = iterator->next(iterator);
+
+    if (item == LoxStopIteration || item == NULL)
+        return false;
+
+    VALUE_DECREF(*(ctx->locals + pc->arg));
+    *(ctx->locals + pc->arg) = LoxValue_fromObjectRef(item);
+    return true;
+}
+
+/**
+ * Advance the iterator of an integer range on the top of the stack, like
+ * vmeval_op_next() but without boxing the item. Returns false at the end.
+ */
+static inline bool
+vmeval_range_next(LoxIntRangeIterator *iterator, LoxValue *local) {
+    LoxIntRange *range = (LoxIntRange*) iterator->iterator.target;
+    long long current = iterator->current += range->step;
+
+    if (current >= range->end)
+        return false;
+
+    VALUE_DECREF(*local);
+    *local = likely(VALUE_INT_FITS(current))
+        ? VALUE_FROM_INT(current) : LoxValue_fromLongLong(current);
+    return true;
+}
+
+bool
+vmeval_op_for_range(VmEvalContext *ctx, LoxValue *stack, Instruction *pc) {
+    Object *iterator = PEEK_OBJECT(stack);
+
+    if (unlikely(!LoxIntRange_isIterator(iterator)))
+        return vmeval_op_next(ctx, stack, pc);
+
+    return vmeval_range_next((LoxIntRangeIterator*) iterator, ctx->locals + pc->arg);
+}
+
+bool
+vmeval_pop_istrue(LoxValue value) {
+    bool result = LoxValue_isTrue(value);
+    VALUE_DECREF(value);
+    return result;
+}
+
+void
+vmeval_decref(LoxValue value) {
+    VALUE_DECREF(value);
+}
+
+// Count a call or loop iteration of the code, and compile it once it is hot
+static inline bool
+vmeval_jit_hot(CodeContext *code) {
+    if (!code->jit && ++code->hotness == JIT_THRESHOLD)
+        code->jit = LoxJIT_compile(code);
+    return code->jit != NULL;
+}
+
+/**
+ * Run the code of the context until it returns. Calls to VM functions push a
+ * new frame and continue in the same loop, so they do not recurse in C.
+ */
+static LoxValue
+vmeval_run(VmEvalContext *caller) {
+    assert(caller);
+    assert(caller->scope);
+
+    Object *lhs, *rhs, *item;
+    LoxValue a, b, rv;
+    long long ival;
+    Constant *C;
+    int i;
+
+    VmEvalContext *ctx, *frame, *entry;
+    ctx = entry = vmeval_frame_push(caller->code, caller->scope, caller->this,
+        caller->args.values, caller->args.count, caller->previous);
+
+    // Registers of the current frame
+    LoxValue *locals = ctx->locals, *stack = ctx->stack;
+    VmEvalLoopBlock *pblock = ctx->pblock;
+    Instruction *pc = ctx->pc;
 
     static void *_labels[] = {
         [OP_NOOP] = &&OP_NOOP,
@@ -156,7 +1352,11 @@ LoxVM_eval(VmEvalContext *ctx) {
         [OP_LOOKUP_CLOSED] = &&OP_LOOKUP_CLOSED,
         [OP_STORE_LOCAL] = &&OP_STORE_LOCAL,
         [OP_STORE_GLOBAL] = &&OP_STORE_GLOBAL,
-//        [OP_STORE_CLOSED] = &&OP_STORE_CLOSED,
+        [OP_STORE_CLOSED] = &&OP_STORE_CLOSED,
+        [OP_LOOKUP_CELL] = &&OP_LOOKUP_CELL,
+        [OP_STORE_CELL] = &&OP_STORE_CELL,
+        [OP_CAPTURE_LOCAL] = &&OP_CAPTURE_LOCAL,
+        [OP_CAPTURE_CLOSED] = &&OP_CAPTURE_CLOSED,
         [OP_CONSTANT] = &&OP_CONSTANT,
         [OP_COMPARE] = &&OP_COMPARE,
         [OP_BANG] = &&OP_BANG,
@@ -169,6 +1369,8 @@ LoxVM_eval(VmEvalContext *ctx) {
         [OP_SET_ATTR] = &&OP_SET_ATTR,
         [OP_THIS] = &&OP_THIS,
         [OP_SUPER] = &&OP_SUPER,
+        [OP_LOAD_METHOD] = &&OP_LOAD_METHOD,
+        [OP_CALL_METHOD] = &&OP_CALL_METHOD,
         [OP_GET_ITEM] = &&OP_GET_ITEM,
         [OP_SET_ITEM] = &&OP_SET_ITEM,
 //        [OP_DEL_ITEM] = &&OP_DEL_ITEM,
@@ -182,79 +1384,183 @@ LoxVM_eval(VmEvalContext *ctx) {
         [OP_CONTINUE] = &&OP_CONTINUE,
         [OP_GET_ITERATOR] = &&OP_GET_ITERATOR,
         [OP_NEXT_OR_BREAK] = &&OP_NEXT_OR_BREAK,
+        [OP_FOR_RANGE] = &&OP_FOR_RANGE,
         [OP_ASSERT] = &&OP_ASSERT,
+        [OP_ADD_INT_INT] = &&OP_ADD_INT_INT,
+        [OP_SUB_INT_INT] = &&OP_SUB_INT_INT,
+        [OP_MUL_INT_INT] = &&OP_MUL_INT_INT,
+        [OP_ADD_FLOAT_FLOAT] = &&OP_ADD_FLOAT_FLOAT,
+        [OP_SUB_FLOAT_FLOAT] = &&OP_SUB_FLOAT_FLOAT,
+        [OP_MUL_FLOAT_FLOAT] = &&OP_MUL_FLOAT_FLOAT,
+        [OP_DIV_FLOAT_FLOAT] = &&OP_DIV_FLOAT_FLOAT,
+        [OP_ADD_STR_STR] = &&OP_ADD_STR_STR,
+        [OP_EQ_INT_INT] = &&OP_EQ_INT_INT,
+        [OP_NOT_EQ_INT_INT] = &&OP_NOT_EQ_INT_INT,
+        [OP_LT_INT_INT] = &&OP_LT_INT_INT,
+        [OP_LTE_INT_INT] = &&OP_LTE_INT_INT,
+        [OP_GT_INT_INT] = &&OP_GT_INT_INT,
+        [OP_GTE_INT_INT] = &&OP_GTE_INT_INT,
+        [OP_GET_ATTR_CACHED] = &&OP_GET_ATTR_CACHED,
+        [OP_SET_ATTR_CACHED] = &&OP_SET_ATTR_CACHED,
+        [OP_LOAD_METHOD_CACHED] = &&OP_LOAD_METHOD_CACHED,
+        [OP_LOOKUP_LOCAL2] = &&OP_LOOKUP_LOCAL2,
+        [OP_LOOKUP_LOCAL_CONSTANT] = &&OP_LOOKUP_LOCAL_CONSTANT,
+        [OP_MATH_LOCAL_CONST] = &&OP_MATH_LOCAL_CONST,
+        [OP_COMPARE_POP_JUMP_IF_FALSE] = &&OP_COMPARE_POP_JUMP_IF_FALSE,
+        [OP_COMPARE_POP_JUMP_IF_TRUE] = &&OP_COMPARE_POP_JUMP_IF_TRUE,
+        [OP_GET_ATTR_LOCAL] = &&OP_GET_ATTR_LOCAL,
+        [OP_GET_ATTR_THIS] = &&OP_GET_ATTR_THIS,
+        [OP_LOCAL_POP_JUMP_IF_FALSE] = &&OP_LOCAL_POP_JUMP_IF_FALSE,
+        [OP_LOCAL_POP_JUMP_IF_TRUE] = &&OP_LOCAL_POP_JUMP_IF_TRUE,
     };
 
-#define DISPATCH() goto *_labels[(++pc)->op]
-
-    // DISPATCH()
+#if DEBUG
+    // Verify the operand stack stays within the depth computed by the compiler
+#define DISPATCH_CHECK() \
+    assert(stack >= ctx->base && stack <= ctx->base + ctx->code->stacksize)
+#else
+#define DISPATCH_CHECK()
+#endif
+
+#if OPCODE_PAIR_STATS
+    // Only count pairs which are adjacent in the code. `lastpc` is where the
+    // previous DISPATCH went, so it differs from `pc` after a jump.
+    Instruction *lastpc = NULL;
+#define DISPATCH_COUNT() do { \
+    if (lastpc == pc) \
+        LoxVM_OpcodePairs[pc->op][(pc + 1)->op]++; \
+    lastpc = pc + 1; \
+} while (0)
+#else
+#define DISPATCH_COUNT()
+#endif
+
+#define DISPATCH() do { \
+    DISPATCH_CHECK(); \
+    DISPATCH_COUNT(); \
+    goto *_labels[(++pc)->op]; \
+} while (0)
+
+    // Suspend the current frame and start running `frame`
+#define FRAME_ENTER(frame) do { \
+    ctx->pc = pc; \
+    ctx->stack = stack; \
+    ctx->pblock = pblock; \
+    ctx = (frame); \
+    locals = ctx->locals; \
+    stack = ctx->stack; \
+    pblock = ctx->pblock; \
+    pc = ctx->pc; \
+} while (0)
+
+    // Start the frame in native code once it is hot (see jit.c). The
+    // native code returns here with an instruction it does not handle.
+#define JIT_START() do { \
+    if (unlikely(LoxVM_JitEnabled) && vmeval_jit_hot(ctx->code)) \
+        goto jit_enter; \
+    goto *_labels[pc->op]; \
+} while (0)
+
+    // Continue with the next instruction, in native code if there is any
+#define JIT_DISPATCH() do { \
+    if (ctx->code->jit) \
+        goto jit_resume; \
+    DISPATCH(); \
+} while (0)
+
+    // Backward jumps are loop iterations, which count towards the JIT
+    // threshold too
+#define JIT_LOOP(offset) do { \
+    if ((offset) < 0 && unlikely(LoxVM_JitEnabled) && vmeval_jit_hot(ctx->code)) \
+        goto jit_resume; \
+} while (0)
+
+    JIT_START();
+
+jit_resume:
+    pc++;
+jit_enter:
+    ctx->stack = stack;
+    ctx->pblock = pblock;
+    pc = LoxJIT_run(ctx->code->jit, ctx, pc);
+    stack = ctx->stack;
+    pblock = ctx->pblock;
     goto *_labels[pc->op];
 
     for (;;) {
 OP_JUMP:
-            pc += pc->arg;
+            i = pc->arg;
+            pc += i;
+            JIT_LOOP(i);
             DISPATCH();
 
 OP_POP_JUMP_IF_TRUE:
-            lhs = POP(stack);
-            if (Bool_isTrue(lhs))
-                pc += pc->arg;
-            DECREF(lhs);
+            a = POP(stack);
+            i = VALUE_ISTRUE(a) ? pc->arg : 0;
+            VALUE_DECREF(a);
+            pc += i;
+            JIT_LOOP(i);
             DISPATCH();
 
 OP_JUMP_IF_TRUE:
-            lhs = PEEK(stack);
-            if (Bool_isTrue(lhs))
+            a = PEEK(stack);
+            if (VALUE_ISTRUE(a))
                 pc += pc->arg;
             DISPATCH();
 
 OP_JUMP_IF_TRUE_OR_POP:
-            lhs = PEEK(stack);
-            if (Bool_isTrue(lhs))
+            a = PEEK(stack);
+            if (VALUE_ISTRUE(a))
                 pc += pc->arg;
             else
                 XPOP(stack);
             DISPATCH();
 
 OP_POP_JUMP_IF_FALSE:
-            lhs = POP(stack);
-            if (!Bool_isTrue(lhs))
+            a = POP(stack);
+            if (!VALUE_ISTRUE(a))
                 pc += pc->arg;
-            DECREF(lhs);
+            VALUE_DECREF(a);
             DISPATCH();
 
 OP_JUMP_IF_FALSE:
-            lhs = PEEK(stack);
-            if (!Bool_isTrue(lhs))
+            a = PEEK(stack);
+            if (!VALUE_ISTRUE(a))
                 pc += pc->arg;
             DISPATCH();
 
 OP_JUMP_IF_FALSE_OR_POP:
-            lhs = PEEK(stack);
-            if (!Bool_isTrue(lhs))
+            a = PEEK(stack);
+            if (!VALUE_ISTRUE(a))
                 pc += pc->arg;
             else
                 XPOP(stack);
             DISPATCH();
 
 OP_DUP_TOP:
-            lhs = PEEK(stack);
-            PUSH(stack, lhs);
+            a = PEEK(stack);
+            PUSH(stack, a);
             DISPATCH();
 
 OP_POP_TOP:
-            POP(stack);
+            XPOP(stack);
             DISPATCH();
 
 OP_ASSERT:
-            if ((pc->arg & ASSERT_FLAG_FAILED) == 0)
-                // Need to test the top-of-stack for truthy
-                if (Bool_isTrue(POP(stack)))
+            if ((pc->arg & ASSERT_FLAG_FAILED) == 0) {
+                // Need to test the top-of-stack for truthy. (VALUE_ISTRUE
+                // evaluates its argument more than once)
+                a = POP(stack);
+                if (VALUE_ISTRUE(a)) {
+                    VALUE_DECREF(a);
                     DISPATCH();
+                }
+            }
 
             // This is FATAL if we arrive here
+            ctx->pc = pc;
             if ((pc->arg & ASSERT_FLAG_HAS_MESSAGE) != 0) {
-                item = POP(stack);
+                item = POP_OBJECT(stack);
                 vmeval_raise(ctx, Exception_fromObject(item));
                 DECREF(item);
             }
@@ -265,55 +1571,53 @@ OP_ASSERT:
             DISPATCH();
 
 OP_CLOSE_FUN: {
-            LoxVmCode *code = (LoxVmCode*) POP(stack);
-            assert_safe_code(code->context);
-            // Move the locals into a malloc'd object so that future local
-            // changes will be represented in this closure
-            if (locals_in_stack) {
-                unsigned locals_count = ctx->code->locals.count;
-                Object **mlocals = GC_MALLOC(sizeof(Object*) * locals_count);
-                while (locals_count--) {
-                    *(mlocals + locals_count) = *(locals + locals_count);
-                    INCREF(*(mlocals + locals_count));
-                }
-                locals = mlocals;
-                locals_in_stack = false;
+            LoxVmCode *code = (LoxVmCode*) VALUE_AS_OBJECT(POP(stack));
+            LoxValue *cells = NULL;
+            if (code->context)
+                assert_safe_code(code->context);
+            // The cells captured by the closure are below the code. Their
+            // references move into the scope of the closure.
+            if (pc->arg) {
+                stack -= pc->arg;
+                cells = GC_MALLOC(sizeof(LoxValue) * pc->arg);
+                memcpy(cells, stack, sizeof(LoxValue) * pc->arg);
             }
             LoxVmFunction *fun = VmCode_makeFunction((Object*) code,
                 // XXX: Globals?
-                VmScope_create(ctx->scope, code->context, locals, ctx->code->locals.count));
-            PUSH(stack, (Object*) fun);
-            DISPATCH();
+                VmScope_create(ctx->scope, code->context, cells, pc->arg));
+            PUSH_OBJECT(stack, fun);
+            JIT_DISPATCH();
         }
 
 OP_CALL_FUN: {
-            Object *fun = *(stack - pc->arg - 1);
+            Object *fun = LoxValue_box(*(stack - pc->arg - 1));
 
             if (VmFunction_isVmFunction(fun)) {
-                VmEvalContext call_ctx = (VmEvalContext) {
-                    .code = ((LoxVmFunction*)fun)->code->context,
-                    .scope = ((LoxVmFunction*)fun)->scope,
-                    .previous = ctx,
-                    .args = (VmCallArgs) {
-                        .values = stack - pc->arg,
-                        .count = pc->arg,
-                    },
-                };
-                rv = LoxVM_eval(&call_ctx);
+                frame = vmeval_frame_push(VmCode_getContext(((LoxVmFunction*) fun)->code),
+                    ((LoxVmFunction*) fun)->scope, NULL, stack - pc->arg, pc->arg, ctx);
+                frame->release = pc->arg + 1;
+                FRAME_ENTER(frame);
+                JIT_START();
             }
             else if (Function_isCallable(fun)) {
-                LoxTuple *args = Tuple_fromList(pc->arg, stack - pc->arg);
-                rv = fun->type->call(fun, ctx->scope, ctx->this, (Object*) args);
-                INCREF(rv);
-                if (Exception_isException(rv)) {
+                LoxTuple *args = vmeval_tuple_fromValues(pc->arg, stack - pc->arg);
+                INCREF(args);
+                item = OBJECT_TYPE(fun)->call(fun, ctx->scope, ctx->this, (Object*) args);
+                if (Exception_isException(item)) {
                     // exceptions from VM code will happen in the block above
-                    vmeval_raise(ctx, rv);
+                    ctx->pc = pc;
+                    vmeval_raise(ctx, item);
                 }
-                LoxObject_Cleanup((Object*) args);
+                rv = LoxValue_fromObjectRef(item);
+                DECREF(args);
             }
             else {
-                fprintf(stderr, "WARNING: Type `%s` is not callable\n", fun->type->name);
-                rv = LoxUndefined;
+                // Immediate values are boxed fresh, so the INCREF + DECREF
+                // will release the box
+                INCREF(fun);
+                fprintf(stderr, "WARNING: Type `%s` is not callable\n", OBJECT_TYPE(fun)->name);
+                DECREF(fun);
+                rv = VALUE_UNDEFINED;
             }
 
             i = pc->arg; // POP_N, {pc->arg}
@@ -322,45 +1626,33 @@ OP_CALL_FUN: {
                 XPOP(stack);
 
             XPUSH(stack, rv);
-            DISPATCH();
+            JIT_DISPATCH();
         }
 
 OP_RECURSE: {
             // This will only happen for a LoxVmFunction. In this case, we will
             // execute the same code again, but with different arguments.
-            VmEvalContext call_ctx = *ctx;
-            call_ctx.previous = ctx;
-            call_ctx.args = (VmCallArgs) {
-                .values = stack - pc->arg,
-                .count = pc->arg,
-            };
-            // Don't INCREF because the return value of the call should be
-            // decref'd in this scope which would cancel an INCREF
-            rv = LoxVM_eval(&call_ctx);
-
-            // DECREF all the arguments
-            i = pc->arg;
-            while (i--)
-                XPOP(stack);
-
-            XPUSH(stack, rv);
-            DISPATCH();
+            frame = vmeval_frame_push(ctx->code, ctx->scope, ctx->this,
+                stack - pc->arg, pc->arg, ctx);
+            frame->release = pc->arg;
+            FRAME_ENTER(frame);
+            JIT_START();
         }
 
 OP_BUILD_SUBCLASS:
-            item = POP(stack);               // (parent)
+            item = POP_OBJECT(stack);        // (parent)
             // Build the class as usual
 OP_BUILD_CLASS: {
             size_t count = pc->arg;
             LoxTable *attributes = Hash_newWithSize(count);
             while (count--) {
-                lhs = POP(stack);
-                rhs = POP(stack);
+                lhs = POP_OBJECT(stack);
+                rhs = POP_OBJECT(stack);
                 Hash_setItem(attributes, lhs, rhs);
                 DECREF(lhs);
                 DECREF(rhs);
             }
-            PUSH(stack, (Object*) Class_build(attributes,
+            PUSH_OBJECT(stack, Class_build(attributes,
                 pc->op == OP_BUILD_SUBCLASS ? (LoxClass*) item : NULL));
             if (pc->op == OP_BUILD_SUBCLASS)
                 DECREF(item);
@@ -368,28 +1660,69 @@ OP_BUILD_CLASS: {
         }
 
 OP_GET_ATTR:
-            C = ctx->code->constants + pc->arg;
-            lhs = POP(stack);
-            PUSH(stack, object_getattr(lhs, C->value, C->hash));
-            DECREF(lhs);
+OP_GET_ATTR_CACHED:
+            stack = vmeval_op_get_attr(ctx, stack, pc);
             DISPATCH();
 
 OP_SET_ATTR:
-            C = ctx->code->constants + pc->arg;
-            rhs = POP(stack);
-            lhs = POP(stack);
-            if (unlikely(!lhs->type->setattr)) {
-                fprintf(stderr, "WARNING: `setattr` not defined for type: `%s`\n", lhs->type->name);
+OP_SET_ATTR_CACHED:
+            stack = vmeval_op_set_attr(ctx, stack, pc);
+            DISPATCH();
+
+OP_LOAD_METHOD:
+OP_LOAD_METHOD_CACHED:
+            stack = vmeval_op_load_method(ctx, stack, pc);
+            DISPATCH();
+
+OP_CALL_METHOD: {
+            a = *(stack - pc->arg - 1);
+            if (a == VALUE_EMPTY) {
+                // Not a method of the receiver. Drop the empty slot and call
+                // the callable like any other function
+                memmove(stack - pc->arg - 1, stack - pc->arg, pc->arg * sizeof(LoxValue));
+                stack--;
+                goto OP_CALL_FUN;
+            }
+
+            Object *fun = VALUE_AS_OBJECT(*(stack - pc->arg - 2)),
+                *this = VALUE_AS_OBJECT(a);
+
+            if (VmCode_isVmCode(fun)) {
+                // Same as codeobject_call(), which runs in the caller's scope
+                frame = vmeval_frame_push(VmCode_getContext((LoxVmCode*) fun), ctx->scope,
+                    this, stack - pc->arg, pc->arg, ctx);
+            }
+            else if (VmFunction_isVmFunction(fun)) {
+                frame = vmeval_frame_push(VmCode_getContext(((LoxVmFunction*) fun)->code),
+                    ((LoxVmFunction*) fun)->scope, this, stack - pc->arg, pc->arg, ctx);
             }
             else {
-                lhs->type->setattr(lhs, C->value, rhs, C->hash);
+                assert(Function_isNativeFunction(fun));
+                LoxTuple *args = vmeval_tuple_fromValues(pc->arg, stack - pc->arg);
+                INCREF(args);
+                item = ((LoxNativeFunc*) fun)->callable(ctx->scope, this, (Object*) args);
+                if (Exception_isException(item)) {
+                    ctx->pc = pc;
+                    vmeval_raise(ctx, item);
+                }
+                rv = LoxValue_fromObjectRef(item);
+                DECREF(args);
+
+                i = pc->arg + 2;
+                while (i--)
+                    XPOP(stack);
+
+                XPUSH(stack, rv);
+                JIT_DISPATCH();
             }
-            DECREF(rhs);
-            DECREF(lhs);
-            DISPATCH();
+
+            frame->release = pc->arg + 2;
+            FRAME_ENTER(frame);
+            JIT_START();
+        }
 
 OP_THIS:
-            PUSH(stack, ctx->this);
+            stack = vmeval_op_this(ctx, stack, pc);
             DISPATCH();
 
 OP_SUPER: {
@@ -406,37 +1739,45 @@ OP_SUPER: {
                     lhs = LoxUndefined;
                 }
             }
-            PUSH(stack, lhs);
+            PUSH_OBJECT(stack, lhs);
             DISPATCH();
         }
 
 OP_LOOKUP_GLOBAL:
-            C = ctx->code->constants + pc->arg;
-            item = VmScope_lookup_global(ctx->scope, C->value, C->hash);
-            if (LoxNativeProperty_isProperty(item))
-                item = LoxNativeProperty_callGetter(item, ctx->scope, ctx->this);
-            PUSH(stack, item);
+            stack = vmeval_op_lookup_global(ctx, stack, pc);
             DISPATCH();
 
 OP_LOOKUP_CLOSED:
-            if (ctx->scope) {
-                lhs = VmScope_lookup_local(ctx->scope, pc->arg);
-            }
-            else
-                lhs = LoxUndefined;
-            PUSH(stack, lhs);
+            stack = vmeval_op_lookup_closed(ctx, stack, pc);
+            DISPATCH();
+
+OP_STORE_CLOSED:
+            stack = vmeval_op_store_closed(ctx, stack, pc);
+            DISPATCH();
+
+OP_LOOKUP_CELL:
+            stack = vmeval_op_lookup_cell(ctx, stack, pc);
+            DISPATCH();
+
+OP_STORE_CELL:
+            stack = vmeval_op_store_cell(ctx, stack, pc);
+            DISPATCH();
+
+OP_CAPTURE_LOCAL:
+            stack = vmeval_op_capture_local(ctx, stack, pc);
+            DISPATCH();
+
+OP_CAPTURE_CLOSED:
+            stack = vmeval_op_capture_closed(ctx, stack, pc);
             DISPATCH();
 
 OP_STORE_GLOBAL:
-            C = ctx->code->constants + pc->arg;
-            lhs = POP(stack);
-            VmScope_assign(ctx->scope, C->value, lhs, C->hash);
-            DECREF(lhs);
+            stack = vmeval_op_store_global(ctx, stack, pc);
             DISPATCH();
 
 OP_STORE_LOCAL:
-            item = *(locals + pc->arg);
-            DECREF(item);
+            a = *(locals + pc->arg);
+            VALUE_DECREF(a);
             *(locals + pc->arg) = POP(stack);
             DISPATCH();
 
@@ -445,200 +1786,266 @@ OP_LOOKUP_LOCAL:
             DISPATCH();
 
 OP_CONSTANT:
+            // Constants are retained by the code context, so no temporary
+            // needs to be released if the constant unboxes
             C = ctx->code->constants + pc->arg;
-            PUSH(stack, C->value);
+            PUSH(stack, LoxValue_fromObject(C->value));
             DISPATCH();
 
-#define COMPARE(lhs, rhs) \
-    lhs == rhs ? 0 : \
-        (lhs->type->compare ? lhs->type->compare(lhs, rhs) : \
-             (rhs->type->compare ? - rhs->type->compare(rhs, lhs) : \
-                 -1))
-
-#define BINARY_COMPARE() ({ \
-    rhs = POP(stack); \
-    lhs = POP(stack); \
-    int x = COMPARE(lhs, rhs); \
-    DECREF(lhs); \
-    DECREF(rhs); \
-    x; \
-})
-
         // Comparison
 OP_COMPARE:
-            switch ((enum lox_vm_compare) pc->arg) {
-            case COMPARE_IN:
-                lhs = POP(stack);
-                rhs = POP(stack);
-                if (likely(lhs->type->contains != NULL)) {
-                    PUSH(stack, (Object*) lhs->type->contains(lhs, rhs));
-                }
-                else {
-                    fprintf(stderr, "WARNING: Type <%s> does not support IN\n", lhs->type->name);
-                    PUSH(stack, LoxUndefined);
-                }
-                DECREF(lhs);
-                DECREF(rhs);
-                break;
-                
-            case COMPARE_EXACT:
-                rhs = POP(stack);
-                lhs = POP(stack);
-                if (lhs->type != rhs->type)
-                    PUSH(stack, (Object*) LoxFALSE);
-                else if (COMPARE(lhs, rhs) == 0)
-                    PUSH(stack, (Object*) LoxTRUE);
-                else
-                    PUSH(stack, (Object*) LoxFALSE);
-                DECREF(lhs);
-                DECREF(rhs);
-                break;
-
-            case COMPARE_NOT_EXACT:
-                rhs = POP(stack);
-                lhs = POP(stack);
-                if (lhs->type != rhs->type)
-                    PUSH(stack, (Object*) LoxTRUE);
-                else if (COMPARE(lhs, rhs) != 0)
-                    PUSH(stack, (Object*) LoxFALSE);
-                else
-                    PUSH(stack, (Object*) LoxTRUE);
-                DECREF(lhs);
-                DECREF(rhs);
-                break;
-
-            case COMPARE_IS:
-                rhs = POP(stack);
-                lhs = POP(stack);
-                PUSH(stack, (Object*) (lhs == rhs ? LoxTRUE : LoxFALSE));
-                DECREF(lhs);
-                DECREF(rhs);
-                break;
-
-            case COMPARE_EQ:
-                PUSH(stack, (Object*) (BINARY_COMPARE() == 0 ? LoxTRUE : LoxFALSE));
-                break;
-            case COMPARE_NOT_EQ:
-                PUSH(stack, (Object*) (BINARY_COMPARE() != 0 ? LoxTRUE : LoxFALSE));
-                break;
-            case COMPARE_GT:
-                PUSH(stack, (Object*) (BINARY_COMPARE() > 0 ? LoxTRUE : LoxFALSE));
-                break;
-            case COMPARE_GTE:
-                PUSH(stack, (Object*) (BINARY_COMPARE() < 0 ? LoxFALSE : LoxTRUE));
-                break;
-            case COMPARE_LT:
-                PUSH(stack, (Object*) (BINARY_COMPARE() < 0 ? LoxTRUE : LoxFALSE));
-                break;
-            case COMPARE_LTE:
-                PUSH(stack, (Object*) (BINARY_COMPARE() > 0 ? LoxFALSE : LoxTRUE));
-                break;
-            case COMPARE_SPACESHIP:
-                PUSH(stack, (Object*) Integer_fromLongLong(BINARY_COMPARE()));
-                break;
-            }
+            QUICKEN(vmeval_quicken_compare(pc->arg, *(stack - 2), PEEK(stack)));
+            stack = vmeval_op_compare(ctx, stack, pc);
             DISPATCH();
 
         // Boolean
 OP_BANG:
-            lhs = POP(stack);
-            PUSH(stack, (Object*) (Bool_isTrue(lhs) ? LoxFALSE : LoxTRUE));
-            DECREF(lhs);
+            stack = vmeval_op_bang(ctx, stack, pc);
             DISPATCH();
 
         // Expressions
 OP_BINARY_MATH:
-            rhs = POP(stack);
-            lhs = POP(stack);
-
-            // The pc->arg is the binary function index in the object type.
-            // The first on is op_plus. We should just advance ahead a number
-            // of functions based on pc->arg to find the appropriate method
-            // to invoke.
-            lox_vm_binary_math_func *operfunc = 
-                (void*) lhs->type
-                + offsetof(ObjectType, op_plus) 
-                + pc->arg * sizeof(lox_vm_binary_math_func);
-
-            if (*operfunc) {
-                assert(pc->arg < __MATH_BINARY_MAX);
-                PUSH(stack, (*operfunc)(lhs, rhs));
+            QUICKEN(vmeval_quicken_math(pc->arg, *(stack - 2), PEEK(stack)));
+            stack = vmeval_op_binary_math(ctx, stack, pc);
+            DISPATCH();
+
+        // Quickened math and comparison. Operands are peeked so that a failed
+        // guard can hand them to the generic instruction as-is.
+OP_ADD_INT_INT:
+            a = *(stack - 2);
+            b = PEEK(stack);
+            QUICKEN_GUARD(VALUE_IS_INT(a) && VALUE_IS_INT(b), OP_BINARY_MATH);
+            *(--stack - 1) = LoxValue_fromLongLong(VALUE_AS_INT(a) + VALUE_AS_INT(b));
+            DISPATCH();
+
+OP_SUB_INT_INT:
+            a = *(stack - 2);
+            b = PEEK(stack);
+            QUICKEN_GUARD(VALUE_IS_INT(a) && VALUE_IS_INT(b), OP_BINARY_MATH);
+            *(--stack - 1) = LoxValue_fromLongLong(VALUE_AS_INT(a) - VALUE_AS_INT(b));
+            DISPATCH();
+
+OP_MUL_INT_INT:
+            a = *(stack - 2);
+            b = PEEK(stack);
+            QUICKEN_GUARD(VALUE_IS_INT(a) && VALUE_IS_INT(b), OP_BINARY_MATH);
+            if (unlikely(__builtin_mul_overflow(VALUE_AS_INT(a), VALUE_AS_INT(b), &ival)))
+                // Let LoxInteger handle the overflow
+                goto OP_BINARY_MATH;
+            *(--stack - 1) = LoxValue_fromLongLong(ival);
+            DISPATCH();
+
+OP_ADD_FLOAT_FLOAT:
+            a = *(stack - 2);
+            b = PEEK(stack);
+            QUICKEN_GUARD(VALUE_IS_DOUBLE(a) && VALUE_IS_DOUBLE(b), OP_BINARY_MATH);
+            *(--stack - 1) = VALUE_FROM_DOUBLE(VALUE_AS_DOUBLE(a) + VALUE_AS_DOUBLE(b));
+            DISPATCH();
+
+OP_SUB_FLOAT_FLOAT:
+            a = *(stack - 2);
+            b = PEEK(stack);
+            QUICKEN_GUARD(VALUE_IS_DOUBLE(a) && VALUE_IS_DOUBLE(b), OP_BINARY_MATH);
+            *(--stack - 1) = VALUE_FROM_DOUBLE(VALUE_AS_DOUBLE(a) - VALUE_AS_DOUBLE(b));
+            DISPATCH();
+
+OP_MUL_FLOAT_FLOAT:
+            a = *(stack - 2);
+            b = PEEK(stack);
+            QUICKEN_GUARD(VALUE_IS_DOUBLE(a) && VALUE_IS_DOUBLE(b), OP_BINARY_MATH);
+            *(--stack - 1) = VALUE_FROM_DOUBLE(VALUE_AS_DOUBLE(a) * VALUE_AS_DOUBLE(b));
+            DISPATCH();
+
+OP_DIV_FLOAT_FLOAT:
+            a = *(stack - 2);
+            b = PEEK(stack);
+            QUICKEN_GUARD(VALUE_IS_DOUBLE(a) && VALUE_IS_DOUBLE(b), OP_BINARY_MATH);
+            *(--stack - 1) = VALUE_FROM_DOUBLE(VALUE_AS_DOUBLE(a) / VALUE_AS_DOUBLE(b));
+            DISPATCH();
+
+OP_ADD_STR_STR:
+            a = *(stack - 2);
+            b = PEEK(stack);
+            QUICKEN_GUARD(VALUE_IS_OBJECT(a) && String_isString(VALUE_AS_OBJECT(a))
+                && VALUE_IS_OBJECT(b) && String_isString(VALUE_AS_OBJECT(b)), OP_BINARY_MATH);
+            stack -= 2;
+            PUSH_OBJECT(stack, String_concat((LoxString*) VALUE_AS_OBJECT(a),
+                (LoxString*) VALUE_AS_OBJECT(b)));
+            VALUE_DECREF(a);
+            VALUE_DECREF(b);
+            DISPATCH();
+
+#define QUICK_INT_COMPARE(test) do { \
+    a = *(stack - 2); \
+    b = PEEK(stack); \
+    QUICKEN_GUARD(VALUE_IS_INT(a) && VALUE_IS_INT(b), OP_COMPARE); \
+    *(--stack - 1) = VALUE_FROM_BOOL(VALUE_AS_INT(a) test VALUE_AS_INT(b)); \
+} while(0)
+
+OP_EQ_INT_INT:
+            QUICK_INT_COMPARE(==);
+            DISPATCH();
+
+OP_NOT_EQ_INT_INT:
+            QUICK_INT_COMPARE(!=);
+            DISPATCH();
+
+OP_LT_INT_INT:
+            QUICK_INT_COMPARE(<);
+            DISPATCH();
+
+OP_LTE_INT_INT:
+            QUICK_INT_COMPARE(<=);
+            DISPATCH();
+
+OP_GT_INT_INT:
+            QUICK_INT_COMPARE(>);
+            DISPATCH();
+
+OP_GTE_INT_INT:
+            QUICK_INT_COMPARE(>=);
+            DISPATCH();
+
+        // Superinstructions. On a guard failure, the first instruction is
+        // restored and the sequence runs one instruction at a time.
+OP_LOOKUP_LOCAL2:
+            PUSH(stack, *(locals + pc->arg));
+            pc++;
+            PUSH(stack, *(locals + pc->arg));
+            DISPATCH();
+
+OP_LOOKUP_LOCAL_CONSTANT:
+            PUSH(stack, *(locals + pc->arg));
+            pc++;
+            C = ctx->code->constants + pc->arg;
+            PUSH(stack, LoxValue_fromObject(C->value));
+            DISPATCH();
+
+OP_MATH_LOCAL_CONST:
+            a = *(locals + pc->arg);
+            QUICKEN_GUARD(VALUE_IS_INT(a), OP_LOOKUP_LOCAL);
+            // The compiler only fuses integer constants
+            C = ctx->code->constants + (pc + 1)->arg;
+            if (unlikely(!vmeval_math_int((pc + 2)->arg, VALUE_AS_INT(a),
+                ((LoxInteger*) C->value)->value, &rv))
+            ) {
+                pc->op = OP_LOOKUP_LOCAL;
+                goto OP_LOOKUP_LOCAL;
             }
-            else {
-                fprintf(stderr, "WARNING: Type `%s` does not support op `%hd`\n", lhs->type->name, pc->arg);
-                PUSH(stack, LoxUndefined);
+            XPUSH(stack, rv);
+            pc += 2;
+            DISPATCH();
+
+OP_COMPARE_POP_JUMP_IF_FALSE:
+            a = *(stack - 2);
+            b = PEEK(stack);
+            QUICKEN_GUARD(VALUE_IS_INT(a) && VALUE_IS_INT(b), OP_COMPARE);
+            stack -= 2;
+            pc++;
+            if (!vmeval_compare_int((pc - 1)->arg, VALUE_AS_INT(a), VALUE_AS_INT(b)))
+                pc += pc->arg;
+            DISPATCH();
+
+OP_COMPARE_POP_JUMP_IF_TRUE:
+            a = *(stack - 2);
+            b = PEEK(stack);
+            QUICKEN_GUARD(VALUE_IS_INT(a) && VALUE_IS_INT(b), OP_COMPARE);
+            stack -= 2;
+            pc++;
+            if (vmeval_compare_int((pc - 1)->arg, VALUE_AS_INT(a), VALUE_AS_INT(b))) {
+                i = pc->arg;
+                pc += i;
+                JIT_LOOP(i);
+            }
+            DISPATCH();
+
+        // Superinstructions which borrow the operand instead of pushing it.
+        // Locals and `this` are owned by the frame and nothing else can
+        // rebind them while the instruction runs, so the INCREF of the push
+        // and the DECREF of the pop would cancel out.
+OP_GET_ATTR_LOCAL:
+            a = *(locals + pc->arg);
+            QUICKEN_GUARD(VALUE_IS_OBJECT(a), OP_LOOKUP_LOCAL);
+            pc++;
+            PUSH_OBJECT(stack, vmeval_get_attr(ctx, pc, VALUE_AS_OBJECT(a)));
+            DISPATCH();
+
+OP_GET_ATTR_THIS:
+            QUICKEN_GUARD(ctx->this != NULL, OP_THIS);
+            pc++;
+            PUSH_OBJECT(stack, vmeval_get_attr(ctx, pc, ctx->this));
+            DISPATCH();
+
+OP_LOCAL_POP_JUMP_IF_FALSE:
+            a = *(locals + pc->arg);
+            pc++;
+            if (!VALUE_ISTRUE(a))
+                pc += pc->arg;
+            DISPATCH();
+
+OP_LOCAL_POP_JUMP_IF_TRUE:
+            a = *(locals + pc->arg);
+            pc++;
+            if (VALUE_ISTRUE(a)) {
+                i = pc->arg;
+                pc += i;
+                JIT_LOOP(i);
             }
-            DECREF(lhs);
-            DECREF(rhs);
             DISPATCH();
 
 OP_UNARY_NEGATIVE:
-            lhs = POP(stack);
-            PUSH(stack, (Object*) lhs->type->op_neg(lhs));
-            DECREF(lhs);
+            stack = vmeval_op_unary_negative(ctx, stack, pc);
             DISPATCH();
 
 OP_UNARY_INVERT:
             DISPATCH();
 
 OP_GET_ITEM:
-            rhs = POP(stack);
-            lhs = POP(stack);
-            if (lhs->type->get_item)
-                PUSH(stack, lhs->type->get_item(lhs, rhs));
-            else
-                fprintf(stderr, "lhs type `%s` does not support GET_ITEM\n", lhs->type->name);
-            DECREF(lhs);
-            DECREF(rhs);
+            stack = vmeval_op_get_item(ctx, stack, pc);
             DISPATCH();
 
 OP_SET_ITEM:
-            rhs = POP(stack);
-            item = POP(stack);
-            lhs = POP(stack);
-            if (lhs->type->set_item)
-                lhs->type->set_item(lhs, item, rhs);
-            else
-                fprintf(stderr, "lhs type `%s` does not support SET_ITEM\n", lhs->type->name);
-            DECREF(lhs);
-            DECREF(rhs);
-            DECREF(item);
+            stack = vmeval_op_set_item(ctx, stack, pc);
             DISPATCH();
 
 OP_BUILD_TUPLE:
-            item = (Object*) Tuple_fromList(pc->arg, stack - pc->arg);
-            i = pc->arg;
-            while (i--)
-                XPOP(stack);
-            PUSH(stack, item);
+            stack = vmeval_op_build_tuple(ctx, stack, pc);
             DISPATCH();
 
-OP_BUILD_STRING:
-            item = LoxString_BuildFromList(pc->arg, stack - pc->arg);
+OP_BUILD_STRING: {
+            Object *items[pc->arg];
+            i = pc->arg;
+            while (i--) {
+                items[i] = POP_OBJECT(stack);
+            }
+            item = LoxString_BuildFromList(pc->arg, items);
+            PUSH_OBJECT(stack, item);
             i = pc->arg;
             while (i--)
-                XPOP(stack);
-            PUSH(stack, item);
+                DECREF(items[i]);
             DISPATCH();
+        }
 
 OP_FORMAT:
             C = ctx->code->constants + pc->arg;
             assert(String_isString(C->value));
-            item = LoxObject_Format(POP(stack), ((LoxString*) C->value)->characters);
-            PUSH(stack, item);
+            lhs = POP_OBJECT(stack);
+            item = LoxObject_Format(lhs, ((LoxString*) C->value)->characters);
+            PUSH_OBJECT(stack, item);
+            DECREF(lhs);
             DISPATCH();
 
 OP_BUILD_TABLE:
             i = pc->arg;
             item = (Object*) Hash_newWithSize(i);
             while (i--) {
-                rhs = POP(stack);
-                lhs = POP(stack);
+                rhs = POP_OBJECT(stack);
+                lhs = POP_OBJECT(stack);
                 Hash_setItem((LoxTable*) item, lhs, rhs);
                 DECREF(rhs);
                 DECREF(lhs);
             }
-            PUSH(stack, item);
+            PUSH_OBJECT(stack, item);
             DISPATCH();
 
 OP_ENTER_BLOCK:
@@ -650,6 +2057,7 @@ OP_ENTER_BLOCK:
 
 OP_CONTINUE:
             pc = pblock->top;
+            JIT_LOOP(-1);
             DISPATCH();
 
 OP_LEAVE_BLOCK:
@@ -659,15 +2067,23 @@ OP_LEAVE_BLOCK:
                 XPOP(stack);
             DISPATCH();
 
+OP_FOR_RANGE:
+            lhs = PEEK_OBJECT(stack);
+            QUICKEN_GUARD(LoxIntRange_isIterator(lhs), OP_NEXT_OR_BREAK);
+            if (!vmeval_range_next((LoxIntRangeIterator*) lhs, locals + pc->arg))
+                pc = pblock->bottom;
+            DISPATCH();
+
 OP_NEXT_OR_BREAK:
-            lhs = PEEK(stack);
+            lhs = PEEK_OBJECT(stack);
+            if (LoxIntRange_isIterator(lhs)) {
+                QUICKEN(OP_FOR_RANGE);
+                goto OP_FOR_RANGE;
+            }
             item = ((Iterator*) lhs)->next((Iterator*) lhs);
             if (item != LoxStopIteration && item != NULL) {
-                Object *old = *(locals + pc->arg);
-                if (old)
-                    DECREF(old);
-                *(locals + pc->arg) = item;
-                INCREF(item);
+                VALUE_DECREF(*(locals + pc->arg));
+                *(locals + pc->arg) = LoxValue_fromObjectRef(item);
             }
             else {
 OP_BREAK:
@@ -676,16 +2092,7 @@ OP_BREAK:
             DISPATCH();
 
 OP_GET_ITERATOR:
-            lhs = POP(stack);
-            if (lhs->type->iterate) {
-                item = (Object*) lhs->type->iterate(lhs);
-            }
-            else {
-                fprintf(stderr, "Type `%s` is not iterable\n", lhs->type->name);
-                item = LoxUndefined;
-            }
-            PUSH(stack, item);
-            DECREF(lhs);
+            stack = vmeval_op_get_iterator(ctx, stack, pc);
             DISPATCH();
 
 OP_NOOP:
@@ -696,19 +2103,34 @@ OP_RETURN:
     }
 
     // Default return value is NIL
-    if (stack == _stack)
-        rv = LoxNIL;
+    if (stack == ctx->base)
+        rv = VALUE_NIL;
     else
         rv = POP(stack);
 
-    i = ctx->code->locals.count;
-    while (i--)
-        DECREF(*(locals + i));
-
     // Check stack overflow and underflow
-    assert(stack == _stack);
+    assert(stack == ctx->base);
 
-    return rv;
+    frame = ctx;
+    ctx = frame->previous;
+    i = frame->release;
+    vmeval_frame_pop(frame);
+
+    if (frame == entry)
+        return rv;
+
+    // Resume the caller, which is suspended on the call instruction
+    locals = ctx->locals;
+    stack = ctx->stack;
+    pblock = ctx->pblock;
+    pc = ctx->pc;
+
+    // DECREF the callable and all the arguments
+    while (i--)
+        XPOP(stack);
+
+    XPUSH(stack, rv);
+    JIT_DISPATCH();
 }
 
 static Object*
@@ -759,10 +2181,9 @@ LoxVM_evalString(const char * text, size_t length) {
 
 Object*
 LoxVM_evalFileWithScope(FILE *input, const char* filename, VmScope* scope) {
-    Compiler compiler = { .flags = 0 };
     CodeContext *context;
 
-    context = compile_file(&compiler, input, filename);
+    context = LoxCache_compileFile(input, filename, filename);
 
     return LoxVM_evalWithScope(context, scope);
 }
@@ -772,6 +2193,16 @@ LoxVM_evalFile(FILE *input, const char* filename) {
     return LoxVM_evalFileWithScope(input, filename, NULL);
 }
 
+Object*
+LoxVM_evalCodeWithScope(CodeContext *code, VmScope *scope) {
+    return LoxVM_evalWithScope(code, scope);
+}
+
+Object*
+LoxVM_evalCode(CodeContext *code) {
+    return LoxVM_evalWithScope(code, NULL);
+}
+
 Object*
 LoxVM_evalAST(ASTNode *input) {
     Compiler compiler = { .flags = 0 };
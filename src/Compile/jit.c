@@ -0,0 +1,644 @@
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+#include "jit.h"
+#include "compile.h"
+
+bool LoxVM_JitEnabled = false;
+JitStats LoxJIT_Stats;
+
+struct jit_code {
+    void            *memory;
+    size_t          size;
+    Instruction     *opcodes;
+    void            **entries;          // Native address of each instruction
+    JitNative       native;             // Compiled ahead of time (see aot.c)
+};
+
+// Native entry point: (frame, address to start at) -> instruction to interpret
+typedef Instruction* (*JitEntry)(VmEvalContext*, void*);
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+
+/**
+ * Baseline (template) JIT for x86-64. Each instruction of a CodeContext is
+ * translated to a fixed sequence of native code, which mostly calls the same
+ * runtime functions as the interpreter. Jumps become direct native jumps, so
+ * there is no dispatch between instructions.
+ *
+ * The native code keeps the frame in %rbx, the top of the operand stack in
+ * %r12 and the locals in %r13, all of which are preserved across calls to C.
+ * Instructions which enter or leave a frame (calls and returns), and anything
+ * else not handled here, exit back to the interpreter: the exit stub saves
+ * the stack into the frame and returns the instruction to be interpreted.
+ * The interpreter re-enters the native code when the frame is resumed.
+ *
+ * Native code is generated into a malloc'd buffer and copied into its own
+ * mapping, which is then made read-only and executable.
+ */
+typedef struct jit_fixup {
+    size_t          offset;             // Location of the rel32 to patch
+    unsigned        target;             // Index of the target instruction
+} JitFixup;
+
+typedef struct jit_buffer {
+    unsigned char   *code;
+    size_t          size, length;
+    size_t          *offsets;           // Offset of each instruction
+    JitFixup        *fixups;
+    unsigned        nFixups, sizeFixups;
+} JitBuffer;
+
+#define JIT_EPILOGUE_OFFSET 24
+
+// Top 16 bits of immediate values (see value.h)
+#define JIT_OBJECT_KIND ((VALUE_SIGN_BIT | VALUE_QNAN) >> 48)
+#define JIT_INT_KIND    ((VALUE_QNAN | VALUE_TAG_INT) >> 48)
+
+static void
+jit_emit(JitBuffer *buf, const void *bytes, size_t length) {
+    if (buf->length + length > buf->size) {
+        buf->size = (buf->size + length) * 2;
+        buf->code = realloc(buf->code, buf->size);
+    }
+    memcpy(buf->code + buf->length, bytes, length);
+    buf->length += length;
+}
+
+#define EMIT(buf, ...) do { \
+    static const unsigned char _bytes[] = { __VA_ARGS__ }; \
+    jit_emit(buf, _bytes, sizeof(_bytes)); \
+} while (0)
+
+static inline void
+jit_emit32(JitBuffer *buf, uint32_t value) {
+    jit_emit(buf, &value, sizeof(value));
+}
+
+static inline void
+jit_emit64(JitBuffer *buf, uint64_t value) {
+    jit_emit(buf, &value, sizeof(value));
+}
+
+// Short forward jumps. The rel8 is patched when the target is reached
+static inline size_t
+jit_emit_jcc8(JitBuffer *buf, unsigned char opcode) {
+    EMIT(buf, 0x00, 0x00);
+    buf->code[buf->length - 2] = opcode;
+    return buf->length;
+}
+
+static inline void
+jit_patch8(JitBuffer *buf, size_t from) {
+    assert(buf->length - from < 128);
+    buf->code[from - 1] = buf->length - from;
+}
+
+// Jump to the instruction at `target`, which is patched once all the code is
+// emitted. `opcode` is either { 0xe9 } (jmp) or { 0x0f, 0x8x } (jcc)
+static void
+jit_emit_jump(JitBuffer *buf, const unsigned char *opcode, size_t length,
+    unsigned target
+) {
+    jit_emit(buf, opcode, length);
+    if (buf->nFixups == buf->sizeFixups) {
+        buf->sizeFixups = buf->sizeFixups ? buf->sizeFixups * 2 : 16;
+        buf->fixups = realloc(buf->fixups, buf->sizeFixups * sizeof(JitFixup));
+    }
+    buf->fixups[buf->nFixups++] = (JitFixup) {
+        .offset = buf->length,
+        .target = target,
+    };
+    jit_emit32(buf, 0);
+}
+
+#define JMP(buf, target) jit_emit_jump(buf, (unsigned char[]) { 0xe9 }, 1, target)
+#define JZ(buf, target) jit_emit_jump(buf, (unsigned char[]) { 0x0f, 0x84 }, 2, target)
+#define JNZ(buf, target) jit_emit_jump(buf, (unsigned char[]) { 0x0f, 0x85 }, 2, target)
+
+static inline void
+jit_emit_mov_rax(JitBuffer *buf, uint64_t value) {
+    EMIT(buf, 0x48, 0xb8);                  // mov rax, imm64
+    jit_emit64(buf, value);
+}
+
+static inline void
+jit_emit_mov_rcx(JitBuffer *buf, uint64_t value) {
+    EMIT(buf, 0x48, 0xb9);                  // mov rcx, imm64
+    jit_emit64(buf, value);
+}
+
+static inline void
+jit_emit_call(JitBuffer *buf, void *function) {
+    jit_emit_mov_rax(buf, (uintptr_t) function);
+    EMIT(buf, 0xff, 0xd0);                  // call rax
+}
+
+// stack = helper(frame, stack, pc)
+static void
+jit_emit_helper(JitBuffer *buf, JitHelper helper, Instruction *pc) {
+    EMIT(buf, 0x48, 0x89, 0xdf);            // mov rdi, rbx
+    EMIT(buf, 0x4c, 0x89, 0xe6);            // mov rsi, r12
+    EMIT(buf, 0x48, 0xba);                  // mov rdx, imm64
+    jit_emit64(buf, (uintptr_t) pc);
+    jit_emit_call(buf, helper);
+    EMIT(buf, 0x49, 0x89, 0xc4);            // mov r12, rax
+}
+
+// Check the kind of the value in `reg` (0 = rax, 1 = rcx, 2 = rdx, 7 = rdi)
+// and emit a short jump for a mismatch, to be patched by the caller
+static size_t
+jit_emit_kind_check(JitBuffer *buf, unsigned char reg, uint32_t kind) {
+    unsigned char mov[] = { 0x48, 0x89, 0xc1 | (reg << 3) };
+
+    jit_emit(buf, mov, sizeof(mov));        // mov rcx, reg
+    EMIT(buf, 0x48, 0xc1, 0xe9, 0x30);      // shr rcx, 48
+    EMIT(buf, 0x81, 0xf9);                  // cmp ecx, imm32
+    jit_emit32(buf, kind);
+    return jit_emit_jcc8(buf, 0x75);        // jne
+}
+
+// Add a reference for the value in rax, if it's a mortal object
+static void
+jit_emit_incref_rax(JitBuffer *buf) {
+    size_t skip = jit_emit_kind_check(buf, 0, JIT_OBJECT_KIND), immortal;
+    jit_emit_mov_rcx(buf, VALUE_PAYLOAD_MASK);
+    EMIT(buf, 0x48, 0x21, 0xc1);            // and rcx, rax
+    EMIT(buf, 0x80, 0x79,                   // cmp byte [rcx + immortal], 0
+        offsetof(Object, immortal), 0x00);
+    immortal = jit_emit_jcc8(buf, 0x75);    // jne
+    EMIT(buf, 0xff, 0x41,                   // inc dword [rcx + refcount]
+        offsetof(Object, refcount));
+    jit_patch8(buf, skip);
+    jit_patch8(buf, immortal);
+}
+
+// Release the value in rdi, if it's an object
+static void
+jit_emit_decref_rdi(JitBuffer *buf) {
+    size_t skip = jit_emit_kind_check(buf, 7, JIT_OBJECT_KIND);
+    jit_emit_call(buf, vmeval_decref);
+    jit_patch8(buf, skip);
+}
+
+// Push rax (which already owns its reference)
+static inline void
+jit_emit_push_rax(JitBuffer *buf) {
+    EMIT(buf, 0x49, 0x89, 0x04, 0x24);      // mov [r12], rax
+    EMIT(buf, 0x49, 0x83, 0xc4, 0x08);      // add r12, 8
+}
+
+// Pop into rdi, without releasing it
+static inline void
+jit_emit_pop_rdi(JitBuffer *buf) {
+    EMIT(buf, 0x49, 0x83, 0xec, 0x08);      // sub r12, 8
+    EMIT(buf, 0x49, 0x8b, 0x3c, 0x24);      // mov rdi, [r12]
+}
+
+/**
+ * Branch to `target` if the truthiness of the top of the stack matches
+ * `when`. Booleans are tested inline, anything else is coerced in C.
+ */
+static void
+jit_emit_branch(JitBuffer *buf, bool when, bool pop, unsigned target) {
+    size_t next;
+
+    if (pop)
+        jit_emit_pop_rdi(buf);
+    else
+        EMIT(buf, 0x49, 0x8b, 0x7c, 0x24, 0xf8);    // mov rdi, [r12 - 8]
+
+    jit_emit_mov_rax(buf, VALUE_FROM_BOOL(when));
+    EMIT(buf, 0x48, 0x39, 0xc7);            // cmp rdi, rax
+    JZ(buf, target);
+    jit_emit_mov_rax(buf, VALUE_FROM_BOOL(!when));
+    EMIT(buf, 0x48, 0x39, 0xc7);            // cmp rdi, rax
+    next = jit_emit_jcc8(buf, 0x74);        // je
+
+    jit_emit_call(buf, pop ? (void*) vmeval_pop_istrue : (void*) LoxValue_isTrue);
+    EMIT(buf, 0x84, 0xc0);                  // test al, al
+    if (when)
+        JNZ(buf, target);
+    else
+        JZ(buf, target);
+
+    jit_patch8(buf, next);
+}
+
+/**
+ * Integer fast path for math and comparison on the top two items of the
+ * stack. If either is not an immediate integer (or the result does not fit),
+ * `helper` handles the instruction instead.
+ */
+static void
+jit_emit_int_binary(JitBuffer *buf, Instruction *pc, JitHelper helper,
+    bool compare
+) {
+    size_t slow[3], done;
+    unsigned char setcc;
+
+    EMIT(buf, 0x49, 0x8b, 0x44, 0x24, 0xf0);    // mov rax, [r12 - 16]
+    EMIT(buf, 0x49, 0x8b, 0x54, 0x24, 0xf8);    // mov rdx, [r12 - 8]
+    slow[0] = jit_emit_kind_check(buf, 0, JIT_INT_KIND);
+    slow[1] = jit_emit_kind_check(buf, 2, JIT_INT_KIND);
+
+    // Sign extend both from 48 bits
+    EMIT(buf, 0x48, 0xc1, 0xe0, 0x10);      // shl rax, 16
+    EMIT(buf, 0x48, 0xc1, 0xf8, 0x10);      // sar rax, 16
+    EMIT(buf, 0x48, 0xc1, 0xe2, 0x10);      // shl rdx, 16
+    EMIT(buf, 0x48, 0xc1, 0xfa, 0x10);      // sar rdx, 16
+
+    if (compare) {
+        switch ((enum lox_vm_compare) pc->arg) {
+        case COMPARE_EQ:        setcc = 0x94; break;
+        case COMPARE_NOT_EQ:    setcc = 0x95; break;
+        case COMPARE_LT:        setcc = 0x9c; break;
+        case COMPARE_LTE:       setcc = 0x9e; break;
+        case COMPARE_GT:        setcc = 0x9f; break;
+        case COMPARE_GTE:       setcc = 0x9d; break;
+        default:
+            assert(!"Unexpected comparison for integers");
+            return;
+        }
+        EMIT(buf, 0x48, 0x39, 0xd0);        // cmp rax, rdx
+        EMIT(buf, 0x0f, 0x00, 0xc0);        // setcc al
+        buf->code[buf->length - 2] = setcc;
+        EMIT(buf, 0x0f, 0xb6, 0xc0);        // movzx eax, al
+        // VALUE_TRUE is VALUE_FALSE + 1
+        jit_emit_mov_rcx(buf, VALUE_FALSE);
+        EMIT(buf, 0x48, 0x01, 0xc8);        // add rax, rcx
+        slow[2] = 0;
+    }
+    else {
+        if (pc->arg == MATH_BINARY_PLUS)
+            EMIT(buf, 0x48, 0x01, 0xd0);    // add rax, rdx
+        else
+            EMIT(buf, 0x48, 0x29, 0xd0);    // sub rax, rdx
+
+        // The result has to fit back into 48 bits
+        EMIT(buf, 0x48, 0x89, 0xc1);        // mov rcx, rax
+        EMIT(buf, 0x48, 0xc1, 0xe1, 0x10);  // shl rcx, 16
+        EMIT(buf, 0x48, 0xc1, 0xf9, 0x10);  // sar rcx, 16
+        EMIT(buf, 0x48, 0x39, 0xc1);        // cmp rcx, rax
+        slow[2] = jit_emit_jcc8(buf, 0x75); // jne
+
+        EMIT(buf, 0x48, 0xc1, 0xe0, 0x10);  // shl rax, 16
+        EMIT(buf, 0x48, 0xc1, 0xe8, 0x10);  // shr rax, 16
+        jit_emit_mov_rcx(buf, VALUE_QNAN | VALUE_TAG_INT);
+        EMIT(buf, 0x48, 0x09, 0xc8);        // or rax, rcx
+    }
+
+    EMIT(buf, 0x49, 0x89, 0x44, 0x24, 0xf0);    // mov [r12 - 16], rax
+    EMIT(buf, 0x49, 0x83, 0xec, 0x08);          // sub r12, 8
+    done = jit_emit_jcc8(buf, 0xeb);            // jmp
+
+    jit_patch8(buf, slow[0]);
+    jit_patch8(buf, slow[1]);
+    if (slow[2])
+        jit_patch8(buf, slow[2]);
+    jit_emit_helper(buf, helper, pc);
+
+    jit_patch8(buf, done);
+}
+
+// Save the stack and return to the interpreter to run `pc`
+static void
+jit_emit_exit(JitBuffer *buf, Instruction *pc) {
+    EMIT(buf, 0x4c, 0x89, 0xa3);            // mov [rbx + stack], r12
+    jit_emit32(buf, offsetof(VmEvalContext, stack));
+    jit_emit_mov_rax(buf, (uintptr_t) pc);
+    EMIT(buf, 0xe9);                        // jmp epilogue
+    jit_emit32(buf, JIT_EPILOGUE_OFFSET - (buf->length + 4));
+}
+
+static void
+jit_emit_prologue(JitBuffer *buf) {
+    EMIT(buf, 0x53);                        // push rbx
+    EMIT(buf, 0x41, 0x54);                  // push r12
+    EMIT(buf, 0x41, 0x55);                  // push r13
+    EMIT(buf, 0x48, 0x89, 0xfb);            // mov rbx, rdi
+    EMIT(buf, 0x4c, 0x8b, 0xa3);            // mov r12, [rbx + stack]
+    jit_emit32(buf, offsetof(VmEvalContext, stack));
+    EMIT(buf, 0x4c, 0x8b, 0xab);            // mov r13, [rbx + locals]
+    jit_emit32(buf, offsetof(VmEvalContext, locals));
+    EMIT(buf, 0xff, 0xe6);                  // jmp rsi
+
+    assert(buf->length == JIT_EPILOGUE_OFFSET);
+    EMIT(buf, 0x41, 0x5d);                  // pop r13
+    EMIT(buf, 0x41, 0x5c);                  // pop r12
+    EMIT(buf, 0x5b);                        // pop rbx
+    EMIT(buf, 0xc3);                        // ret
+}
+
+static inline bool
+jit_is_int_compare(enum lox_vm_compare op) {
+    return op == COMPARE_EQ || op == COMPARE_NOT_EQ || op == COMPARE_LT
+        || op == COMPARE_LTE || op == COMPARE_GT || op == COMPARE_GTE;
+}
+
+static void
+jit_compile_instruction(JitBuffer *buf, CodeContext *code, int index) {
+    Instruction *opcodes = code->block->instructions.opcodes,
+        *pc = opcodes + index;
+    int target = compile_jump_target(opcodes, index);
+    LoxValue value;
+
+    switch (pc->op) {
+    case OP_NOOP:
+    case OP_UNARY_INVERT:
+        break;
+
+    case OP_JUMP:
+    case OP_BREAK:
+    case OP_CONTINUE:
+        JMP(buf, target);
+        break;
+
+    case OP_POP_JUMP_IF_TRUE:
+        jit_emit_branch(buf, true, true, target);
+        break;
+    case OP_POP_JUMP_IF_FALSE:
+        jit_emit_branch(buf, false, true, target);
+        break;
+    case OP_JUMP_IF_TRUE:
+        jit_emit_branch(buf, true, false, target);
+        break;
+    case OP_JUMP_IF_FALSE:
+        jit_emit_branch(buf, false, false, target);
+        break;
+    case OP_JUMP_IF_TRUE_OR_POP:
+    case OP_JUMP_IF_FALSE_OR_POP:
+        jit_emit_branch(buf, pc->op == OP_JUMP_IF_TRUE_OR_POP, false, target);
+        jit_emit_pop_rdi(buf);
+        jit_emit_decref_rdi(buf);
+        break;
+
+    case OP_DUP_TOP:
+        EMIT(buf, 0x49, 0x8b, 0x44, 0x24, 0xf8);    // mov rax, [r12 - 8]
+        jit_emit_push_rax(buf);
+        jit_emit_incref_rax(buf);
+        break;
+
+    case OP_POP_TOP:
+        jit_emit_pop_rdi(buf);
+        jit_emit_decref_rdi(buf);
+        break;
+
+    // Superinstructions are split back up. The instructions following the
+    // first one are intact and are compiled on their own.
+    case OP_LOOKUP_LOCAL2:
+    case OP_LOOKUP_LOCAL_CONSTANT:
+    case OP_MATH_LOCAL_CONST:
+    case OP_GET_ATTR_LOCAL:
+    case OP_LOCAL_POP_JUMP_IF_FALSE:
+    case OP_LOCAL_POP_JUMP_IF_TRUE:
+    case OP_LOOKUP_LOCAL:
+        EMIT(buf, 0x49, 0x8b, 0x85);                // mov rax, [r13 + disp32]
+        jit_emit32(buf, pc->arg * sizeof(LoxValue));
+        jit_emit_push_rax(buf);
+        jit_emit_incref_rax(buf);
+        break;
+
+    case OP_STORE_LOCAL:
+        EMIT(buf, 0x49, 0x83, 0xec, 0x08);          // sub r12, 8
+        EMIT(buf, 0x49, 0x8b, 0x04, 0x24);          // mov rax, [r12]
+        EMIT(buf, 0x49, 0x8b, 0xbd);                // mov rdi, [r13 + disp32]
+        jit_emit32(buf, pc->arg * sizeof(LoxValue));
+        EMIT(buf, 0x49, 0x89, 0x85);                // mov [r13 + disp32], rax
+        jit_emit32(buf, pc->arg * sizeof(LoxValue));
+        jit_emit_decref_rdi(buf);
+        break;
+
+    case OP_CONSTANT:
+        // Constants are retained by the code context, so the value can be
+        // resolved now. They are usually immortal by now, too.
+        value = LoxValue_fromObject((code->constants + pc->arg)->value);
+        jit_emit_mov_rax(buf, value);
+        jit_emit_push_rax(buf);
+        if (VALUE_IS_OBJECT(value) && !VALUE_AS_OBJECT(value)->immortal) {
+            jit_emit_mov_rcx(buf, (uintptr_t) VALUE_AS_OBJECT(value));
+            EMIT(buf, 0xff, 0x41,                   // inc dword [rcx + refcount]
+                offsetof(Object, refcount));
+        }
+        break;
+
+    case OP_COMPARE_POP_JUMP_IF_FALSE:
+    case OP_COMPARE_POP_JUMP_IF_TRUE:
+    case OP_COMPARE:
+    case OP_EQ_INT_INT:
+    case OP_NOT_EQ_INT_INT:
+    case OP_LT_INT_INT:
+    case OP_LTE_INT_INT:
+    case OP_GT_INT_INT:
+    case OP_GTE_INT_INT:
+        if (jit_is_int_compare(pc->arg))
+            jit_emit_int_binary(buf, pc, vmeval_op_compare, true);
+        else
+            jit_emit_helper(buf, vmeval_op_compare, pc);
+        break;
+
+    case OP_BINARY_MATH:
+    case OP_ADD_INT_INT:
+    case OP_SUB_INT_INT:
+    case OP_MUL_INT_INT:
+    case OP_ADD_FLOAT_FLOAT:
+    case OP_SUB_FLOAT_FLOAT:
+    case OP_MUL_FLOAT_FLOAT:
+    case OP_DIV_FLOAT_FLOAT:
+    case OP_ADD_STR_STR:
+        if (pc->arg == MATH_BINARY_PLUS || pc->arg == MATH_BINARY_MINUS)
+            jit_emit_int_binary(buf, pc, vmeval_op_binary_math, false);
+        else
+            jit_emit_helper(buf, vmeval_op_binary_math, pc);
+        break;
+
+    case OP_BANG:
+        jit_emit_helper(buf, vmeval_op_bang, pc);
+        break;
+    case OP_UNARY_NEGATIVE:
+        jit_emit_helper(buf, vmeval_op_unary_negative, pc);
+        break;
+    case OP_GET_ATTR:
+    case OP_GET_ATTR_CACHED:
+        jit_emit_helper(buf, vmeval_op_get_attr, pc);
+        break;
+    case OP_SET_ATTR:
+    case OP_SET_ATTR_CACHED:
+        jit_emit_helper(buf, vmeval_op_set_attr, pc);
+        break;
+    case OP_LOAD_METHOD:
+    case OP_LOAD_METHOD_CACHED:
+        jit_emit_helper(buf, vmeval_op_load_method, pc);
+        break;
+    case OP_THIS:
+    case OP_GET_ATTR_THIS:
+        jit_emit_helper(buf, vmeval_op_this, pc);
+        break;
+    case OP_LOOKUP_GLOBAL:
+        jit_emit_helper(buf, vmeval_op_lookup_global, pc);
+        break;
+    case OP_LOOKUP_CLOSED:
+        jit_emit_helper(buf, vmeval_op_lookup_closed, pc);
+        break;
+    case OP_STORE_CLOSED:
+        jit_emit_helper(buf, vmeval_op_store_closed, pc);
+        break;
+    case OP_LOOKUP_CELL:
+        jit_emit_helper(buf, vmeval_op_lookup_cell, pc);
+        break;
+    case OP_STORE_CELL:
+        jit_emit_helper(buf, vmeval_op_store_cell, pc);
+        break;
+    case OP_CAPTURE_LOCAL:
+        jit_emit_helper(buf, vmeval_op_capture_local, pc);
+        break;
+    case OP_CAPTURE_CLOSED:
+        jit_emit_helper(buf, vmeval_op_capture_closed, pc);
+        break;
+    case OP_STORE_GLOBAL:
+        jit_emit_helper(buf, vmeval_op_store_global, pc);
+        break;
+    case OP_GET_ITEM:
+        jit_emit_helper(buf, vmeval_op_get_item, pc);
+        break;
+    case OP_SET_ITEM:
+        jit_emit_helper(buf, vmeval_op_set_item, pc);
+        break;
+    case OP_BUILD_TUPLE:
+        jit_emit_helper(buf, vmeval_op_build_tuple, pc);
+        break;
+    case OP_GET_ITERATOR:
+        jit_emit_helper(buf, vmeval_op_get_iterator, pc);
+        break;
+    case OP_ENTER_BLOCK:
+        jit_emit_helper(buf, vmeval_op_enter_block, pc);
+        break;
+    case OP_LEAVE_BLOCK:
+        jit_emit_helper(buf, vmeval_op_leave_block, pc);
+        break;
+
+    case OP_NEXT_OR_BREAK:
+    case OP_FOR_RANGE:
+        EMIT(buf, 0x48, 0x89, 0xdf);                // mov rdi, rbx
+        EMIT(buf, 0x4c, 0x89, 0xe6);                // mov rsi, r12
+        EMIT(buf, 0x48, 0xba);                      // mov rdx, imm64
+        jit_emit64(buf, (uintptr_t) pc);
+        jit_emit_call(buf, pc->op == OP_FOR_RANGE
+            ? vmeval_op_for_range : vmeval_op_next);
+        EMIT(buf, 0x84, 0xc0);                      // test al, al
+        JZ(buf, target);
+        break;
+
+    default:
+        // Calls, returns and everything else run in the interpreter
+        jit_emit_exit(buf, pc);
+        break;
+    }
+}
+
+/**
+ * Compile the instructions of the code context to native code. Returns NULL
+ * if the native code could not be mapped.
+ */
+JitCode*
+LoxJIT_compile(CodeContext *code) {
+    InstructionList *instructions = &code->block->instructions;
+    unsigned count = instructions->count, i;
+    JitBuffer buf = { 0 };
+    JitFixup *fixup;
+    int32_t rel;
+
+    buf.offsets = malloc(sizeof(size_t) * (count + 1));
+    jit_emit_prologue(&buf);
+
+    for (i = 0; i < count; i++) {
+        buf.offsets[i] = buf.length;
+        jit_compile_instruction(&buf, code, i);
+    }
+
+    // Code should never run off the end, but just in case
+    buf.offsets[count] = buf.length;
+    jit_emit_exit(&buf, instructions->opcodes + count - 1);
+
+    for (i = 0; i < buf.nFixups; i++) {
+        fixup = buf.fixups + i;
+        assert(fixup->target <= count);
+        rel = buf.offsets[fixup->target] - (fixup->offset + 4);
+        memcpy(buf.code + fixup->offset, &rel, sizeof(rel));
+    }
+
+    JitCode *jit = NULL;
+    void *memory = mmap(NULL, buf.length, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (memory != MAP_FAILED) {
+        memcpy(memory, buf.code, buf.length);
+        if (mprotect(memory, buf.length, PROT_READ | PROT_EXEC) == 0) {
+            jit = malloc(sizeof(JitCode));
+            *jit = (JitCode) {
+                .memory = memory,
+                .size = buf.length,
+                .opcodes = instructions->opcodes,
+                .entries = malloc(sizeof(void*) * count),
+            };
+            for (i = 0; i < count; i++)
+                jit->entries[i] = memory + buf.offsets[i];
+
+            LoxJIT_Stats.compiled++;
+            LoxJIT_Stats.bytes += buf.length;
+        }
+        else {
+            munmap(memory, buf.length);
+        }
+    }
+
+    free(buf.code);
+    free(buf.offsets);
+    free(buf.fixups);
+
+    return jit;
+}
+
+#else
+
+JitCode*
+LoxJIT_compile(CodeContext *code) {
+    // Only x86-64 on Linux is supported
+    return NULL;
+}
+
+#endif
+
+/**
+ * Wrap a function compiled ahead of time from the instructions at `opcodes`.
+ * It is called the same way as the native code from LoxJIT_compile().
+ */
+JitCode*
+LoxJIT_fromNative(JitNative native, Instruction *opcodes) {
+    JitCode *jit = malloc(sizeof(JitCode));
+    *jit = (JitCode) {
+        .opcodes = opcodes,
+        .native = native,
+    };
+    return jit;
+}
+
+/**
+ * Run the native code of the frame starting at `pc`. Returns the instruction
+ * which the interpreter should run next; the operand stack of the frame is
+ * saved into the frame.
+ */
+Instruction*
+LoxJIT_run(JitCode *jit, VmEvalContext *frame, Instruction *pc) {
+    assert(pc >= jit->opcodes);
+    if (jit->native)
+        return jit->native(frame, pc);
+
+    return ((JitEntry) jit->memory)(frame, jit->entries[pc - jit->opcodes]);
+}
@@ -0,0 +1,63 @@
+#ifndef COMPILE_JIT_H
+#define COMPILE_JIT_H
+
+#include <stdbool.h>
+
+#include "vm.h"
+
+// Number of calls and loop iterations before a code context is compiled to
+// native code
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 100
+#endif
+
+typedef struct jit_stats {
+    unsigned        compiled;           // Code contexts compiled
+    size_t          bytes;              // Native code generated
+} JitStats;
+
+extern bool LoxVM_JitEnabled;
+extern JitStats LoxJIT_Stats;
+
+// Native code compiled by the C compiler (see aot.c). It is given the frame
+// and the instruction to start at, and returns the instruction which the
+// interpreter should run next.
+typedef Instruction* (*JitNative)(VmEvalContext*, Instruction*);
+
+JitCode* LoxJIT_compile(CodeContext*);
+JitCode* LoxJIT_fromNative(JitNative, Instruction*);
+Instruction* LoxJIT_run(JitCode*, VmEvalContext*, Instruction*);
+
+// Instruction bodies called from the native code. Each receives the frame,
+// the top of its operand stack and the instruction, and returns the new top
+// of the stack.
+typedef LoxValue* (*JitHelper)(VmEvalContext*, LoxValue*, Instruction*);
+
+LoxValue* vmeval_op_binary_math(VmEvalContext*, LoxValue*, Instruction*);
+LoxValue* vmeval_op_compare(VmEvalContext*, LoxValue*, Instruction*);
+LoxValue* vmeval_op_bang(VmEvalContext*, LoxValue*, Instruction*);
+LoxValue* vmeval_op_unary_negative(VmEvalContext*, LoxValue*, Instruction*);
+LoxValue* vmeval_op_get_attr(VmEvalContext*, LoxValue*, Instruction*);
+LoxValue* vmeval_op_set_attr(VmEvalContext*, LoxValue*, Instruction*);
+LoxValue* vmeval_op_load_method(VmEvalContext*, LoxValue*, Instruction*);
+LoxValue* vmeval_op_this(VmEvalContext*, LoxValue*, Instruction*);
+LoxValue* vmeval_op_lookup_global(VmEvalContext*, LoxValue*, Instruction*);
+LoxValue* vmeval_op_lookup_closed(VmEvalContext*, LoxValue*, Instruction*);
+LoxValue* vmeval_op_store_closed(VmEvalContext*, LoxValue*, Instruction*);
+LoxValue* vmeval_op_lookup_cell(VmEvalContext*, LoxValue*, Instruction*);
+LoxValue* vmeval_op_store_cell(VmEvalContext*, LoxValue*, Instruction*);
+LoxValue* vmeval_op_capture_local(VmEvalContext*, LoxValue*, Instruction*);
+LoxValue* vmeval_op_capture_closed(VmEvalContext*, LoxValue*, Instruction*);
+LoxValue* vmeval_op_store_global(VmEvalContext*, LoxValue*, Instruction*);
+LoxValue* vmeval_op_get_item(VmEvalContext*, LoxValue*, Instruction*);
+LoxValue* vmeval_op_set_item(VmEvalContext*, LoxValue*, Instruction*);
+LoxValue* vmeval_op_build_tuple(VmEvalContext*, LoxValue*, Instruction*);
+LoxValue* vmeval_op_get_iterator(VmEvalContext*, LoxValue*, Instruction*);
+LoxValue* vmeval_op_enter_block(VmEvalContext*, LoxValue*, Instruction*);
+LoxValue* vmeval_op_leave_block(VmEvalContext*, LoxValue*, Instruction*);
+bool vmeval_op_next(VmEvalContext*, LoxValue*, Instruction*);
+bool vmeval_op_for_range(VmEvalContext*, LoxValue*, Instruction*);
+bool vmeval_pop_istrue(LoxValue);
+void vmeval_decref(LoxValue);
+
+#endif
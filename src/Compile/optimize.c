@@ -0,0 +1,495 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "vm.h"
+#include "compile.h"
+#include "Objects/integer.h"
+
+/**
+ * Superinstructions fuse a run of instructions into a single dispatch. The
+ * fused opcode replaces only the first instruction of the run; the rest are
+ * left in place and are skipped over by the fused handler. That way, jump
+ * offsets don't change, a jump into the middle of the run still works, and
+ * the instruction can be split again by restoring the first opcode.
+ *
+ * The sequences were picked from the opcode-pair histogram of the test
+ * scripts (build with OPCODE_PAIR_STATS=1 and run with -s). The most common
+ * pairs were a comparison followed by a conditional jump, a local lookup
+ * followed by a constant (usually followed by math), and back-to-back local
+ * lookups.
+ *
+ * A local or `this` consumed right away by an attribute access or a
+ * conditional jump is borrowed rather than pushed. The frame owns the value
+ * for the length of the instruction, so the reference the operand stack
+ * would take (and drop again) is skipped. Globals are not borrowed, as the
+ * code run for the access could rebind one and release the value.
+ */
+
+static inline bool
+optimize_is_int_constant(CodeContext *context, const Instruction *op) {
+    return op->op == OP_CONSTANT
+        && Integer_isInteger((context->constants + op->arg)->value);
+}
+
+static inline bool
+optimize_is_int_compare(const Instruction *op) {
+    if (op->op != OP_COMPARE)
+        return false;
+
+    switch ((enum lox_vm_compare) op->arg) {
+    case COMPARE_EQ:
+    case COMPARE_NOT_EQ:
+    case COMPARE_LT:
+    case COMPARE_LTE:
+    case COMPARE_GT:
+    case COMPARE_GTE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static inline bool
+optimize_is_int_math(const Instruction *op) {
+    if (op->op != OP_BINARY_MATH)
+        return false;
+
+    switch ((enum lox_vm_math) op->arg) {
+    case MATH_BINARY_PLUS:
+    case MATH_BINARY_MINUS:
+    case MATH_BINARY_STAR:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * Returns the number of instructions covered by the superinstruction that
+ * `op` was rewritten to, or 1 if it was left alone.
+ */
+static unsigned
+optimize_fuse(CodeContext *context, Instruction *op, unsigned remaining) {
+    Instruction *next = op + 1;
+
+    if (remaining < 2)
+        return 1;
+
+    switch (op->op) {
+    case OP_LOOKUP_LOCAL:
+        if (remaining > 2
+            && optimize_is_int_constant(context, next)
+            && optimize_is_int_math(next + 1)
+        ) {
+            op->op = OP_MATH_LOCAL_CONST;
+            return 3;
+        }
+        else if (next->op == OP_CONSTANT) {
+            op->op = OP_LOOKUP_LOCAL_CONSTANT;
+            return 2;
+        }
+        else if (next->op == OP_LOOKUP_LOCAL) {
+            op->op = OP_LOOKUP_LOCAL2;
+            return 2;
+        }
+        else if (next->op == OP_GET_ATTR) {
+            op->op = OP_GET_ATTR_LOCAL;
+            return 2;
+        }
+        else if (next->op == OP_POP_JUMP_IF_FALSE) {
+            op->op = OP_LOCAL_POP_JUMP_IF_FALSE;
+            return 2;
+        }
+        else if (next->op == OP_POP_JUMP_IF_TRUE) {
+            op->op = OP_LOCAL_POP_JUMP_IF_TRUE;
+            return 2;
+        }
+        break;
+
+    case OP_THIS:
+        if (next->op == OP_GET_ATTR) {
+            op->op = OP_GET_ATTR_THIS;
+            return 2;
+        }
+        break;
+
+    case OP_COMPARE:
+        if (!optimize_is_int_compare(op))
+            break;
+
+        if (next->op == OP_POP_JUMP_IF_FALSE) {
+            op->op = OP_COMPARE_POP_JUMP_IF_FALSE;
+            return 2;
+        }
+        else if (next->op == OP_POP_JUMP_IF_TRUE) {
+            op->op = OP_COMPARE_POP_JUMP_IF_TRUE;
+            return 2;
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    return 1;
+}
+
+void
+optimize_superinstructions(CodeContext *context) {
+    InstructionList *instructions = &context->block->instructions;
+    Instruction *op = instructions->opcodes;
+    unsigned remaining = instructions->count, length;
+
+    while (remaining) {
+        length = optimize_fuse(context, op, remaining);
+        op += length;
+        remaining -= length;
+    }
+}
+
+/**
+ * The optimizer passes run over the instructions of a context once all of it
+ * has been emitted, before the stack analysis and the superinstructions.
+ * A pass which removes an instruction rewrites it to OP_NOOP so that the
+ * offsets hold while the passes run. The NOOPs are then dropped all at once
+ * by optimize_compact(), which fixes up the jumps, the loop blocks and the
+ * line numbers of the code.
+ */
+typedef struct optimizer {
+    CodeContext     *context;
+    Instruction     *opcodes;
+    int             count;
+    bool            *targets;           // Instruction is the target of a jump
+} Optimizer;
+
+static inline bool
+optimize_is_relative_jump(const Instruction *op) {
+    switch (op->op) {
+    case OP_JUMP:
+    case OP_JUMP_IF_TRUE:
+    case OP_POP_JUMP_IF_TRUE:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_FALSE_OR_POP:
+    case OP_JUMP_IF_TRUE_OR_POP:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static inline bool
+optimize_set_jump(Instruction *op, int index, int target) {
+    int arg = target - index - 1;
+
+    if (arg < INSTRUCTION_ARG_MIN || arg > INSTRUCTION_ARG_MAX)
+        return false;
+
+    op->arg = arg;
+    return true;
+}
+
+static void
+optimize_find_targets(Optimizer *self) {
+    int i, target;
+
+    for (i = 0; i < self->count; i++)
+        self->targets[i] = false;
+
+    for (i = 0; i < self->count; i++) {
+        target = compile_jump_target(self->opcodes, i);
+        if (target >= 0 && target < self->count)
+            self->targets[target] = true;
+
+        // The top and the bottom of a loop block are where CONTINUE and
+        // BREAK go to
+        if (self->opcodes[i].op == OP_ENTER_BLOCK) {
+            if (i + 1 < self->count)
+                self->targets[i + 1] = true;
+            target = i + self->opcodes[i].arg + 1;
+            if (target < self->count)
+                self->targets[target] = true;
+        }
+    }
+}
+
+static inline LoxValue
+optimize_constant_value(Optimizer *self, const Instruction *op) {
+    return LoxValue_fromObject((self->context->constants + op->arg)->value);
+}
+
+// Rewrite the constant instruction to load the folded `value`
+static void
+optimize_set_constant(Optimizer *self, Instruction *op, LoxValue value) {
+    op->arg = compile_context_constant(self->context, LoxValue_box(value));
+    VALUE_DECREF(value);
+}
+
+/**
+ * Constant folding. The instructions which push an operand are kept on a
+ * stack while the pass runs through straight-line code, so that a math,
+ * comparison or unary instruction can be folded if its operands were both
+ * pushed by OP_CONSTANT. A folded result is itself a constant, so nested
+ * expressions fold completely. A conditional jump on a constant becomes an
+ * OP_JUMP (or nothing) and a value popped right after it is pushed is not
+ * pushed at all.
+ */
+static void
+optimize_fold_constants(Optimizer *self) {
+    Instruction *op, *a, *b;
+    LoxValue result;
+    int *pushed = malloc(self->count * sizeof(int)), npushed = 0, i;
+
+    for (i = 0; i < self->count; i++) {
+        op = self->opcodes + i;
+        if (op->op == OP_NOOP)
+            continue;
+
+        // Code can be reached from elsewhere here
+        if (self->targets[i])
+            npushed = 0;
+
+        a = npushed > 1 ? self->opcodes + pushed[npushed - 2] : NULL;
+        b = npushed > 0 ? self->opcodes + pushed[npushed - 1] : NULL;
+
+        switch (op->op) {
+        case OP_BINARY_MATH:
+        case OP_COMPARE:
+            if (a && a->op == OP_CONSTANT && b->op == OP_CONSTANT
+                && LoxVM_foldConstant(op, optimize_constant_value(self, a),
+                    optimize_constant_value(self, b), &result)
+            ) {
+                optimize_set_constant(self, a, result);
+                b->op = OP_NOOP;
+                op->op = OP_NOOP;
+                npushed--;
+                continue;
+            }
+            break;
+
+        case OP_UNARY_NEGATIVE:
+        case OP_BANG:
+            if (b && b->op == OP_CONSTANT
+                && LoxVM_foldConstant(op, optimize_constant_value(self, b),
+                    VALUE_UNDEFINED, &result)
+            ) {
+                optimize_set_constant(self, b, result);
+                op->op = OP_NOOP;
+                continue;
+            }
+            break;
+
+        case OP_POP_JUMP_IF_TRUE:
+        case OP_POP_JUMP_IF_FALSE:
+            if (b && b->op == OP_CONSTANT
+                && !VALUE_IS_OBJECT(optimize_constant_value(self, b))
+            ) {
+                if (LoxValue_isTrue(optimize_constant_value(self, b))
+                        == (op->op == OP_POP_JUMP_IF_TRUE))
+                    op->op = OP_JUMP;
+                else
+                    op->op = OP_NOOP;
+                b->op = OP_NOOP;
+                npushed = 0;
+                continue;
+            }
+            break;
+
+        case OP_POP_TOP:
+            if (b && (b->op == OP_CONSTANT || b->op == OP_LOOKUP_LOCAL
+                    || b->op == OP_LOOKUP_CELL || b->op == OP_DUP_TOP)
+            ) {
+                b->op = OP_NOOP;
+                op->op = OP_NOOP;
+                npushed--;
+                continue;
+            }
+            break;
+
+        default:
+            break;
+        }
+
+        pushed[npushed++] = i;
+    }
+
+    free(pushed);
+}
+
+/**
+ * Jump threading. A jump to an OP_JUMP goes straight to where that one goes.
+ */
+static void
+optimize_thread_jumps(Optimizer *self) {
+    Instruction *op;
+    int i, target, hops;
+
+    for (i = 0; i < self->count; i++) {
+        op = self->opcodes + i;
+        if (!optimize_is_relative_jump(op))
+            continue;
+
+        target = compile_jump_target(self->opcodes, i);
+        for (hops = 0; hops < self->count; hops++) {
+            while (target < self->count && self->opcodes[target].op == OP_NOOP)
+                target++;
+            if (target >= self->count || self->opcodes[target].op != OP_JUMP)
+                break;
+            target = compile_jump_target(self->opcodes, target);
+        }
+
+        optimize_set_jump(op, i, target);
+    }
+}
+
+/**
+ * Unreachable code removal. The instructions are followed from the start
+ * like compile_stack_depth() does, and the ones never reached are removed.
+ * This also drops the JUMP over the ELSE block after a block which returns.
+ */
+static void
+optimize_unreachable(Optimizer *self) {
+    bool *reached = calloc(self->count, sizeof(bool));
+    int *pending = malloc(self->count * sizeof(int)), npending = 0, i, target;
+
+    reached[0] = true;
+    pending[npending++] = 0;
+
+    while (npending) {
+        i = pending[--npending];
+
+        target = compile_jump_target(self->opcodes, i);
+        if (target >= 0 && target < self->count && !reached[target]) {
+            reached[target] = true;
+            pending[npending++] = target;
+        }
+
+        if (!compile_is_terminal(self->opcodes + i) && i + 1 < self->count
+                && !reached[i + 1]) {
+            reached[i + 1] = true;
+            pending[npending++] = i + 1;
+        }
+    }
+
+    for (i = 0; i < self->count; i++) {
+        if (!reached[i])
+            self->opcodes[i].op = OP_NOOP;
+    }
+
+    free(reached);
+    free(pending);
+}
+
+/**
+ * An OP_JUMP to the instruction after it (once the NOOPs are dropped) is
+ * removed.
+ */
+static void
+optimize_jumps_to_next(Optimizer *self) {
+    int i, j, target;
+
+    for (i = 0; i < self->count; i++) {
+        if (self->opcodes[i].op != OP_JUMP)
+            continue;
+
+        target = compile_jump_target(self->opcodes, i);
+        if (target <= i)
+            continue;
+
+        for (j = i + 1; j < target && self->opcodes[j].op == OP_NOOP; j++);
+        if (j == target)
+            self->opcodes[i].op = OP_NOOP;
+    }
+}
+
+/**
+ * Drop the NOOPs left by the passes. Jumps which go to a removed instruction
+ * go to the next one kept instead, as do the bottoms of the loop blocks. The
+ * runs of instructions in the line number list shrink by the instructions
+ * removed from them.
+ */
+static void
+optimize_compact(Optimizer *self) {
+    CodeBlock *block = self->context->block;
+    CodeSourceList *lines = &block->codesource;
+    CodeSource *source;
+    Instruction *op;
+    unsigned start, end, kept, count = 0;
+    int i;
+
+    // `map[i]` is the number of instructions kept before `i`, which is the new
+    // offset of `i` (or of the next instruction kept, if `i` is removed)
+    int *map = malloc((self->count + 1) * sizeof(int));
+
+    for (i = 0; i < self->count; i++) {
+        map[i] = count;
+        if (self->opcodes[i].op != OP_NOOP)
+            count++;
+    }
+    map[self->count] = count;
+
+    if (count == self->count) {
+        free(map);
+        return;
+    }
+
+    for (i = 0; i < self->count; i++) {
+        op = self->opcodes + i;
+        if (optimize_is_relative_jump(op) || op->op == OP_ENTER_BLOCK) {
+            // Both are relative to the instruction after the jump
+            op->arg = map[i + op->arg + 1] - map[i] - 1;
+        }
+    }
+
+    for (i = 0; i < self->count; i++) {
+        if (self->opcodes[i].op != OP_NOOP)
+            self->opcodes[map[i]] = self->opcodes[i];
+    }
+    block->instructions.count = count;
+
+    for (i = 0, start = 0, count = 0; i < lines->count; i++) {
+        source = lines->offsets + i;
+        end = start + source->opcode_count;
+        kept = map[end < self->count ? end : self->count]
+            - map[start < self->count ? start : self->count];
+        start = end;
+
+        if (!kept)
+            continue;
+        if (count && lines->offsets[count - 1].line_number == source->line_number)
+            lines->offsets[count - 1].opcode_count += kept;
+        else
+            lines->offsets[count++] = (CodeSource) {
+                .opcode_count = kept,
+                .line_number = source->line_number,
+            };
+    }
+    lines->count = count;
+
+    free(map);
+}
+
+void
+optimize_bytecode(CodeContext *context) {
+    InstructionList *instructions = &context->block->instructions;
+    Optimizer self = {
+        .context = context,
+        .opcodes = instructions->opcodes,
+        .count = instructions->count,
+    };
+
+    if (!self.count)
+        return;
+
+    self.targets = malloc(self.count * sizeof(bool));
+
+    optimize_find_targets(&self);
+    optimize_fold_constants(&self);
+    optimize_thread_jumps(&self);
+    optimize_unreachable(&self);
+    optimize_jumps_to_next(&self);
+    optimize_compact(&self);
+
+    free(self.targets);
+}
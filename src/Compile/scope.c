@@ -10,21 +10,21 @@ static void
 VmScope_cleanup(GC_PTR object, GC_PTR client_data) {
     VmScope* self = (VmScope*) object;
 
-    int i = self->locals_count;
+    int i = self->cells_count;
     while (i--) {
-        DECREF(*(self->locals + i));
+        VALUE_DECREF(*(self->cells + i));
     }
 }
 
 VmScope*
-VmScope_create(VmScope *outer, CodeContext *code, Object **locals, unsigned locals_count) {
+VmScope_create(VmScope *outer, CodeContext *code, LoxValue *cells, unsigned cells_count) {
     VmScope *self = GC_MALLOC(sizeof(VmScope));
     *self = (VmScope) {
         .outer = outer,
         .globals = outer->globals,
         .code = code,
-        .locals_count = locals_count,
-        .locals = locals,
+        .cells_count = cells_count,
+        .cells = cells,
     };
     GC_REGISTER_FINALIZER(self, VmScope_cleanup, NULL, NULL, NULL);
     return self;
@@ -54,16 +54,6 @@ VmScope_lookup_global(VmScope* self, Object* name, hashval_t hash) {
 
 }
 
-Object*
-VmScope_lookup_local(VmScope *self, unsigned index) {
-    assert(self);
-
-    if (index >= self->locals_count)
-        return LoxNIL;
-
-    return *(self->locals + index);
-}
-
 void
 VmScope_assign(VmScope* self, Object* name, Object* value, hashval_t hash) {
     // TODO: Assign local?
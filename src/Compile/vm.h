@@ -3,6 +3,7 @@
 
 #include "Include/Lox.h"
 #include "Objects/class.h"
+#include "Objects/value.h"
 
 #define likely(x)       __builtin_expect((x),1)
 #define unlikely(x)     __builtin_expect((x),0)
@@ -39,6 +40,15 @@ enum opcode {
     OP_STORE_CLOSED,
     OP_CONSTANT,
 
+    // Closures. Locals captured by a closure are kept in a cell, which the
+    // frame and the closures share. The `arg` of the CELL and CAPTURE_LOCAL
+    // instructions is a local slot, and that of LOOKUP_CLOSED, STORE_CLOSED
+    // and CAPTURE_CLOSED is an index into the cells of the running closure.
+    OP_LOOKUP_CELL,
+    OP_STORE_CELL,
+    OP_CAPTURE_LOCAL,
+    OP_CAPTURE_CLOSED,
+
     // Comparison
     OP_COMPARE,
 
@@ -57,6 +67,8 @@ enum opcode {
     OP_SET_ATTR,
     OP_THIS,
     OP_SUPER,
+    OP_LOAD_METHOD,
+    OP_CALL_METHOD,
 
     // Hash and list types
     OP_GET_ITEM,
@@ -76,6 +88,50 @@ enum opcode {
     OP_CONTINUE,
     OP_GET_ITERATOR,
     OP_NEXT_OR_BREAK,
+    // NEXT_OR_BREAK specialized for integer ranges, which stores the items in
+    // the local unboxed. It is emitted for `foreach (... in range(...))` and
+    // NEXT_OR_BREAK is quickened to it when the iterator is of an int range.
+    OP_FOR_RANGE,
+
+    // Quickened (type-specialized) instructions. These are never emitted by
+    // the compiler; the VM rewrites OP_BINARY_MATH and OP_COMPARE in place
+    // after observing the operand types. The `arg` is left untouched, so the
+    // instruction can be de-quickened by restoring the generic opcode.
+    OP_ADD_INT_INT,
+    OP_SUB_INT_INT,
+    OP_MUL_INT_INT,
+    OP_ADD_FLOAT_FLOAT,
+    OP_SUB_FLOAT_FLOAT,
+    OP_MUL_FLOAT_FLOAT,
+    OP_DIV_FLOAT_FLOAT,
+    OP_ADD_STR_STR,
+    OP_EQ_INT_INT,
+    OP_NOT_EQ_INT_INT,
+    OP_LT_INT_INT,
+    OP_LTE_INT_INT,
+    OP_GT_INT_INT,
+    OP_GTE_INT_INT,
+
+    // Attribute access through an inline cache. The `arg` is an index into
+    // the CodeContext attrCaches list, which keeps the original name index.
+    OP_GET_ATTR_CACHED,
+    OP_SET_ATTR_CACHED,
+    OP_LOAD_METHOD_CACHED,
+
+    // Superinstructions, emitted by optimize_superinstructions() in place of
+    // the first instruction of a common sequence. The `arg` is that of the
+    // first instruction; the others are read from the instructions which
+    // follow (and are skipped).
+    OP_LOOKUP_LOCAL2,                   // LOOKUP_LOCAL, LOOKUP_LOCAL
+    OP_LOOKUP_LOCAL_CONSTANT,           // LOOKUP_LOCAL, CONSTANT
+    OP_MATH_LOCAL_CONST,                // LOOKUP_LOCAL, CONSTANT (int), BINARY_MATH
+    OP_COMPARE_POP_JUMP_IF_FALSE,       // COMPARE, POP_JUMP_IF_FALSE
+    OP_COMPARE_POP_JUMP_IF_TRUE,        // COMPARE, POP_JUMP_IF_TRUE
+    OP_GET_ATTR_LOCAL,                  // LOOKUP_LOCAL, GET_ATTR
+    OP_GET_ATTR_THIS,                   // THIS, GET_ATTR
+    OP_LOCAL_POP_JUMP_IF_FALSE,         // LOOKUP_LOCAL, POP_JUMP_IF_FALSE
+    OP_LOCAL_POP_JUMP_IF_TRUE,          // LOOKUP_LOCAL, POP_JUMP_IF_TRUE
+    __OP_MAX,
 }
 __attribute__((packed));
 
@@ -129,11 +185,16 @@ typedef struct code_source_list {
     CodeSource  *offsets;
 } CodeSourceList;
 
+// The argument shares the 32-bit word with the opcode, which leaves 24 bits
+// for jump offsets and constant and local indexes
 typedef struct instruction {
     enum opcode     op;
-    short           arg;
+    signed int      arg : 24;
 } Instruction;
 
+#define INSTRUCTION_ARG_MIN (-(1 << 23))
+#define INSTRUCTION_ARG_MAX ((1 << 23) - 1)
+
 typedef struct instruction_list {
     unsigned        size, count;        // Size of the Instruction list and current usage
     Instruction     *opcodes;
@@ -150,58 +211,106 @@ typedef struct code_constant {
     hashval_t           hash;
 } Constant;
 
+// Compile-time hash index to find an item of a Constant list by value (see
+// compile_index_find)
+typedef struct constant_index {
+    unsigned            *slots;     // Position in the list + 1, or 0 if empty
+    unsigned            size;       // Number of slots (a power of two)
+    unsigned            count;      // Items of the list in the index
+} ConstantIndex;
+
 typedef struct locals_list {
     Constant            *names;     // Compile-time names of local vars
     unsigned            size;
     unsigned            count;
+    ConstantIndex       index;
 } LocalsList;
 
+// Inline cache for an attribute access site. Entries are keyed by the class
+// of the receiving instance. The `method` is the attribute resolved through
+// the class (borrowed, and only trusted while `epoch` matches LoxClass_Epoch);
+// if it is NULL, the attribute was found on the instance itself. The `slot` is
+// where the attribute was last found in the instance attributes table, which
+// is verified before use.
+#define ATTR_CACHE_ENTRIES 4
+
+typedef struct attr_cache_entry {
+    LoxClass            *class;
+    unsigned long       epoch;
+    Object              *method;
+    unsigned            slot;
+} AttrCacheEntry;
+
+typedef struct attr_cache {
+    int                 name;               // Constant index of the attribute name
+    unsigned char       next;               // Next entry to be replaced
+    AttrCacheEntry      entries[ATTR_CACHE_ENTRIES];
+} AttrCache;
+
+// Native code for a CodeContext (see jit.c)
+typedef struct jit_code JitCode;
+
 // Compile-time code context. Represents a compiled block of code / function body.
 typedef struct code_context {
     unsigned            nConstants;
     unsigned            nParameters;
     unsigned            nLoops;             // Number of loop blocks
+    unsigned            stacksize;          // Max depth of the operand stack
     CodeBlock           *block;
     unsigned            sizeConstants;
     Constant            *constants;
+    ConstantIndex       constantsIndex;
     LocalsList          locals;
+    LocalsList          cells;              // Names of locals captured by closures (compile time)
+    LocalsList          upvalues;           // Names of the cells captured from `prev`
     struct code_context *prev;
     Object              *owner;             // If defined in a class
+    unsigned            nAttrCaches;        // Inline caches (added at run-time)
+    unsigned            sizeAttrCaches;
+    AttrCache           *attrCaches;
+    unsigned            hotness;            // Calls and loop iterations, for the JIT
+    JitCode             *jit;
 } CodeContext;
 
-#define JUMP_LENGTH(block) ((block)->instructions.count)
-
 // Run-time data to evaluate a CodeContext block
 typedef struct vmeval_scope {
     struct vmeval_scope *outer;
-    Object              **locals;
-    size_t              locals_count;
+    LoxValue            *cells;             // Captured by the closure (LoxCell)
+    size_t              cells_count;
     CodeContext         *code;
     LoxTable            *globals;
 } VmScope;
 
-VmScope* VmScope_create(VmScope*, CodeContext*, Object**, unsigned);
+VmScope* VmScope_create(VmScope*, CodeContext*, LoxValue*, unsigned);
 void VmScope_assign(VmScope*, Object*, Object*, hashval_t);
 Object* VmScope_lookup_global(VmScope*, Object*, hashval_t);
-Object* VmScope_lookup_local(VmScope*, unsigned);
 VmScope* VmScope_leave(VmScope*);
 
 // Run-time args passing between calls to LoxVM_eval
 typedef struct vmeval_call_args {
-    Object              **values;
+    LoxValue            *values;
     size_t              count;
 } VmCallArgs;
 
+// The operand stack holds LoxValue items, each owning a reference if it
+// is an object
 #define POP(stack) *(--(stack))
-#define XPOP(stack) do { --(stack); DECREF(*stack); } while(0)
+#define XPOP(stack) do { --(stack); VALUE_DECREF(*stack); } while(0)
 #define PEEK(stack) *(stack - 1)
 #define PUSH(stack, what) ({ \
-    typeof(what) _what = (what); \
+    LoxValue _what = (what); \
     *(stack++) = _what; \
-    INCREF((Object*) _what); \
+    VALUE_INCREF(_what); \
 })
 #define XPUSH(stack, what) *(stack++) = (what)
 
+// Object-flavored stack access. POP_OBJECT returns an owned reference which
+// should be DECREF'd by the caller; PUSH_OBJECT unboxes immediate types and
+// releases `what` if it was a temporary.
+#define POP_OBJECT(stack) LoxValue_asObject(POP(stack))
+#define PEEK_OBJECT(stack) VALUE_AS_OBJECT(PEEK(stack))
+#define PUSH_OBJECT(stack, what) XPUSH(stack, LoxValue_fromObjectRef((Object*) (what)))
+
 #define PRINT(value) do { \
     if (NULL == value) { \
         printf("(null)\n"); \
@@ -209,24 +318,51 @@ typedef struct vmeval_call_args {
     else { \
         LoxString *S = String_fromObject(value); \
         INCREF(S); \
-        printf("(%s) %.*s\n", ((Object*) value)->type->name, S->length, S->characters); \
+        printf("(%s) %.*s\n", OBJECT_TYPE(value)->name, S->length, S->characters); \
         DECREF(S); \
     } \
 } while(0)
 
+typedef struct vmeval_loop_block {
+    Instruction     *top;
+    Instruction     *bottom;
+} VmEvalLoopBlock;
+
+// Run-time frame of a call. Frames are allocated on the VM data stack and are
+// followed by the locals, loop blocks and operand stack of the call. The
+// registers (pc, stack, pblock) are only saved when the frame is suspended
+// to call another function.
 typedef struct vmeval_context {
     CodeContext     *code;
     VmScope         *scope;
     VmCallArgs      args;
     Object          *this;
-    Instruction     **pc;
+    Instruction     *pc;
+    LoxValue        *locals;
+    LoxValue        *base;              // Bottom of the operand stack
+    LoxValue        *stack;
     struct vmeval_context *previous;
+    VmEvalLoopBlock *pblock;
+    unsigned        release;            // Caller stack slots to release on return
 } VmEvalContext;
 
-typedef struct vmeval_loop_block {
-    Instruction     *top;
-    Instruction     *bottom;
-} VmEvalLoopBlock;
+// Run-time statistics for quickened instructions
+typedef struct vmeval_quicken_stats {
+    unsigned long   quickened;              // Instructions rewritten to a specialized opcode
+    unsigned long   hits[__OP_MAX];         // Specialized opcode ran with the expected types
+    unsigned long   misses[__OP_MAX];       // Guard failed and the instruction was de-quickened
+} VmQuickenStats;
+
+extern VmQuickenStats LoxVM_QuickenStats;
+
+// Build with OPCODE_PAIR_STATS=1 to count how often each opcode runs straight
+// after the one before it. The histogram (printed with -s) is what the set of
+// superinstructions is chosen from.
+#ifndef OPCODE_PAIR_STATS
+#define OPCODE_PAIR_STATS 0
+#endif
+
+extern unsigned long LoxVM_OpcodePairs[__OP_MAX][__OP_MAX];
 
 Object* LoxVM_eval(VmEvalContext*);
 Object* LoxVM_evalString(const char*, size_t);
@@ -234,4 +370,7 @@ Object* LoxVM_evalStringWithScope(const char*, size_t, VmScope*);
 Object* LoxVM_evalFile(FILE *input, const char*);
 Object* LoxVM_evalFileWithScope(FILE *input, const char*, VmScope*);
 Object* LoxVM_evalAST(ASTNode*);
+Object* LoxVM_evalCode(CodeContext*);
+Object* LoxVM_evalCodeWithScope(CodeContext*, VmScope*);
+bool LoxVM_foldConstant(const Instruction*, LoxValue, LoxValue, LoxValue*);
 #endif
@@ -1,4 +1,5 @@
 #include <ctype.h>
+#include <getopt.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -6,8 +7,12 @@
 
 #include "interpreter.h"
 #include "repl.h"
+#include "Compile/aot.h"
+#include "Compile/cache.h"
 #include "Compile/compile.h"
+#include "Compile/jit.h"
 #include "Include/Lox.h"
+#include "Objects/garbage.h"
 
 #include "Vendor/bdwgc/include/gc.h"
 
@@ -19,17 +24,53 @@ const char *argp_program_bug_address =
 struct arguments {
     char *cmd;
     char *input_file;
+    char *output_file;
+    bool stats;
+    bool jit;
+    bool aot;
+    bool no_cache;
+    int optimize;
 };
 
+static struct option long_options[] = {
+    { "aot",    no_argument,        NULL, 'a' },
+    { 0 },
+};
+
+// Compile the script to a C program (see Compile/aot.c)
+static int
+compile_aot(const char *input_file, const char *output_file) {
+    FILE *input = fopen(input_file, "r"), *output = stdout;
+    if (!input) {
+        fprintf(stderr, "Unable to open `%s`\n", input_file);
+        return 1;
+    }
+
+    Compiler compiler = { .flags = 0 };
+    CodeContext *context = compile_file(&compiler, input, input_file);
+    fclose(input);
+
+    if (output_file && !(output = fopen(output_file, "w"))) {
+        fprintf(stderr, "Unable to write `%s`\n", output_file);
+        return 1;
+    }
+
+    int rv = LoxAOT_emit(context, input_file, output);
+    if (output != stdout)
+        fclose(output);
+
+    return rv ? 1 : 0;
+}
+
 static void
 pretty_print(Object* value) {
-    if (!value || !value->type)
+    if (!value || !OBJECT_TYPE(value))
         return;
     
-    printf("Result: (%s)", value->type->name);
-    if (value->type->as_string) {
-        LoxString* text = (LoxString*) value->type->as_string(value);
-        // TODO: assert(text->type->code == TYPE_STRING);
+    printf("Result: (%s)", OBJECT_TYPE(value)->name);
+    if (OBJECT_TYPE(value)->as_string) {
+        LoxString* text = (LoxString*) OBJECT_TYPE(value)->as_string(value);
+        // TODO: assert(OBJECT_TYPE(text)->code == TYPE_STRING);
         printf(" %.*s\n", text->length, text->characters);
     }
 }
@@ -37,16 +78,35 @@ pretty_print(Object* value) {
 int
 main(int argc, char** argv) {
     struct arguments _arguments, *arguments = &_arguments;
-    *arguments = (struct arguments) {};
+    *arguments = (struct arguments) { .optimize = -1 };
 
     int c;
-    while ((c = getopt(argc, argv, "Vhc:")) != -1) {
+    while ((c = getopt_long(argc, argv, "VhjsCO::c:o:", long_options, NULL)) != -1) {
         switch (c) {
+        case 'a':
+            arguments->aot = true;
+            break;
+        case 'o':
+            arguments->output_file = optarg;
+            break;
         case 'c':
             arguments->cmd = optarg;
             break;
+        case 's':
+            arguments->stats = true;
+            break;
+        case 'j':
+            arguments->jit = true;
+            break;
+        case 'C':
+            arguments->no_cache = true;
+            break;
+        case 'O':
+            // -O alone also compiles out assertions, -O0 disables the optimizer
+            arguments->optimize = optarg ? atoi(optarg) : 2;
+            break;
         case '?':
-            if (optopt == 'c')
+            if (optopt == 'c' || optopt == 'o')
                 fprintf (stderr, "Option -%c requires an argument.\n", optopt);
             else if (isprint (optopt))
                 fprintf (stderr, "Unknown option `-%c'.\n", optopt);
@@ -69,6 +129,20 @@ main(int argc, char** argv) {
 
     GC_INIT();
 
+    LoxCache_Enabled = !arguments->no_cache;
+    if (arguments->optimize >= 0)
+        LoxCompile_OptimizeLevel = arguments->optimize;
+
+    if (arguments->aot) {
+        if (!arguments->input_file) {
+            fprintf(stderr, "--aot requires a script to compile\n");
+            return 1;
+        }
+        return compile_aot(arguments->input_file, arguments->output_file);
+    }
+
+    LoxVM_JitEnabled = arguments->jit;
+
     Object *result = NULL;
     if (arguments->input_file) {
         FILE *file = fopen(arguments->input_file, "r");
@@ -91,5 +165,19 @@ main(int argc, char** argv) {
     else
         printf("NULL\n");
 
+    // The cache keeps the function bodies compiled while running
+    LoxCache_flush();
+
+    if (arguments->stats) {
+        print_compile_stats();
+        print_quicken_stats();
+        if (OPCODE_PAIR_STATS)
+            print_opcode_pairs();
+        if (LoxVM_JitEnabled)
+            print_jit_stats();
+        print_garbage_stats();
+        print_slab_stats();
+    }
+
     return 0;
 }
@@ -52,14 +52,17 @@ static bool
 repl_onecmd(CmdLoop *self, const char* line) {
     static Object* _ = NULL;
     if (!_)
-        _ = (Object*) String_fromCharsAndSize("_", 1);
+        _ = (Object*) String_fromConstant("_");
 
     if (strncmp(line, "EOF", 3) == 0)
         return true;
 
-    char buffer[strlen(line) + 10];
-    snprintf(buffer, sizeof(buffer), "%s", line);
-    Object* result = LoxVM_evalStringWithScope(buffer, sizeof(buffer), self->scope);
+    // Function bodies are compiled on their first call, from the text of
+    // the line, so it has to outlive this command
+    size_t length = strlen(line) + 10;
+    char *buffer = GC_MALLOC_ATOMIC(length);
+    snprintf(buffer, length, "%s", line);
+    Object* result = LoxVM_evalStringWithScope(buffer, length, self->scope);
 
     if (result && result != LoxNIL) {
         Hash_setItem(self->scope->globals, _, result);
@@ -86,8 +89,10 @@ repl_loop(CmdLoop* self) {
         int start = input->pos, length;
 
         for (;;) {
-            if (prompt)
+            if (prompt) {
                 printf("%s", prompt);
+                fflush(stdout);
+            }
 
             for (;;) {
                 char n = input->next(input);
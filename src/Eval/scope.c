@@ -63,7 +63,7 @@ Scope_assign_local(Scope* self, Object* name, Object* value) {
     if (!locals)
         locals = self->locals = Hash_new();
 
-    locals->base.type->set_item((Object*) locals, name, value);
+    OBJECT_TYPE(locals)->set_item((Object*) locals, name, value);
 }
 
 void
@@ -71,7 +71,7 @@ Scope_assign(Scope* self, Object* name, Object* value) {
     // Check local variables
     LoxTable *table = Scope_locate(self, name);
     if (table)
-         return table->base.type->set_item((Object*) table, name, value);
+         return OBJECT_TYPE(table)->set_item((Object*) table, name, value);
 
     return Scope_assign_local(self, name, value);
 }
\ No newline at end of file
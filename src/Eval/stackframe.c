@@ -37,7 +37,7 @@ StackFrame_lookup(StackFrame *self, Object *key) {
     if ((rv = Scope_lookup(self->scope, key)))
         return rv;
 
-    LoxString* skey = (LoxString*) key->type->as_string(key);
+    LoxString* skey = (LoxString*) OBJECT_TYPE(key)->as_string(key);
     eval_error(NULL, "%.*s: Variable has not yet been set in this scope\n", skey->length, skey->characters);
 
     return NULL;
@@ -49,13 +49,13 @@ StackFrame_assign_local(StackFrame *self, Object *name, Object *value) {
     if (!table)
         table = self->locals = Hash_new();
 
-    return table->base.type->set_item((Object*) table, name, value);
+    return OBJECT_TYPE(table)->set_item((Object*) table, name, value);
 }
 
 void
 StackFrame_assign(StackFrame* self, Object* name, Object* value) {
     LoxTable *table = self->locals;
-    if (table && table->base.type->contains((Object*) table, name))
+    if (table && OBJECT_TYPE(table)->contains((Object*) table, name))
         return StackFrame_assign_local(self, name, value);
 
     return Scope_assign(self->scope, name, value);
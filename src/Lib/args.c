@@ -26,8 +26,8 @@ Lox_ParseArgs(Object *args, const char *format, ...) {
         case 's': {
             LoxString *string;
             if (!String_isString(oArg)) {
-                if (oArg->type->as_string) {
-                    string = (LoxString*) oArg->type->as_string(oArg);
+                if (OBJECT_TYPE(oArg)->as_string) {
+                    string = (LoxString*) OBJECT_TYPE(oArg)->as_string(oArg);
                 }
                 else {
                     // Error
@@ -55,8 +55,8 @@ Lox_ParseArgs(Object *args, const char *format, ...) {
         case 'L':
         case 'K': {
             LoxInteger *value;
-            if (oArg->type->as_int)
-                value = (LoxInteger*) oArg->type->as_int(oArg);
+            if (OBJECT_TYPE(oArg)->as_int)
+                value = (LoxInteger*) OBJECT_TYPE(oArg)->as_int(oArg);
             else
                 // Error
                 printf("eval: cannot coerce argument to integer\n");
@@ -8,6 +8,7 @@
 
 #include "Objects/exception.h"
 #include "Objects/file.h"
+#include "Objects/garbage.h"
 #include "Objects/integer.h"
 #include "Objects/list.h"
 #include "Objects/range.h"
@@ -57,8 +58,8 @@ builtin_int(VmScope* state, Object* self, Object* args) {
 
     Object* arg = Tuple_getItem((LoxTuple*) args, 0);
 
-    if (arg->type->as_int) {
-        return arg->type->as_int(arg);
+    if (OBJECT_TYPE(arg)->as_int) {
+        return OBJECT_TYPE(arg)->as_int(arg);
     }
 
     // TODO: Raise error
@@ -72,8 +73,8 @@ builtin_len(VmScope* state, Object* self, Object* args) {
     size_t argc = Tuple_getSize(args);
     Object* arg = Tuple_getItem((LoxTuple*) args, 0);
 
-    if (arg->type->len) {
-        return arg->type->len(arg);
+    if (OBJECT_TYPE(arg)->len) {
+        return OBJECT_TYPE(arg)->len(arg);
     }
 
     // TODO: Raise error
@@ -162,8 +163,8 @@ builtin_type(VmScope *state, Object *self, Object *args) {
     Object *object;
     Lox_ParseArgs(args, "O", &object);
 
-    return (Object*) String_fromCharsAndSize(object->type->name,
-        strlen(object->type->name));
+    return (Object*) String_fromCharsAndSize(OBJECT_TYPE(object)->name,
+        strlen(OBJECT_TYPE(object)->name));
 }
 
 static Object*
@@ -173,11 +174,11 @@ builtin_iter(VmScope *state, Object *self, Object *args) {
     Object *object;
     Lox_ParseArgs(args, "O", &object);
 
-    if (object->type->iterate) {
-        return (Object*) object->type->iterate(object);
+    if (OBJECT_TYPE(object)->iterate) {
+        return (Object*) OBJECT_TYPE(object)->iterate(object);
     }
     else {
-        fprintf(stderr, "Type `%s` is not iterable", object->type->name);
+        fprintf(stderr, "Type `%s` is not iterable", OBJECT_TYPE(object)->name);
     }
 
     // TODO: Raise error
@@ -193,9 +194,9 @@ builtin_list(VmScope *state, Object *self, Object *args) {
     Object *object=NULL, *item;
     Lox_ParseArgs(args, "|O", &object);
 
-    if (object && object->type->iterate) {
+    if (object && OBJECT_TYPE(object)->iterate) {
         INCREF(object);
-        Iterator *it = object->type->iterate(object);
+        Iterator *it = OBJECT_TYPE(object)->iterate(object);
         INCREF(it);
         while (LoxStopIteration != (item = it->next(it))) {
             LoxList_append(result, item);
@@ -221,7 +222,7 @@ builtin_range(VmScope *state, Object *self, Object *args) {
     }
     else {
         LoxInteger *zero = Integer_fromLongLong(0);
-        start = (Object*) end->type->op_star(end, (Object*) zero);
+        start = (Object*) OBJECT_TYPE(end)->op_star(end, (Object*) zero);
         LoxObject_Cleanup((Object*) zero);
     }
 
@@ -255,10 +256,10 @@ builtin_sum(VmScope *state, Object *self, Object *args) {
     Object *iterable, *initial=NULL, *next, *value;
     Lox_ParseArgs(args, "O|O", &iterable, &initial);
 
-    if (!iterable->type->iterate)
+    if (!OBJECT_TYPE(iterable)->iterate)
         return LoxUndefined;
 
-    Iterator *it = iterable->type->iterate(iterable);
+    Iterator *it = OBJECT_TYPE(iterable)->iterate(iterable);
     INCREF(it);
     if (initial == NULL)
         initial = (Object*) Integer_fromLongLong(0);
@@ -266,7 +267,7 @@ builtin_sum(VmScope *state, Object *self, Object *args) {
     while (LoxStopIteration != (next = it->next(it))) {
         INCREF(initial);
         INCREF(next);
-        value = initial->type->op_plus(initial, next);
+        value = OBJECT_TYPE(initial)->op_plus(initial, next);
         DECREF(initial);
         DECREF(next);
         initial = value;
@@ -283,6 +284,12 @@ builtin_clock(VmScope *state, Object *self, Object *args) {
     return (Object*) Float_fromLongDouble(elapsed / 1e6);
 }
 
+// Collect reference cycles now and return how many containers were freed
+static Object*
+builtin_collect(VmScope *state, Object *self, Object *args) {
+    return (Object*) Integer_fromLongLong(garbage_collect());
+}
+
 static Object*
 builtin_undef(VmScope *state, Object *self, Object *args) {
     return LoxUndefined;
@@ -319,6 +326,7 @@ builtins_module_def = {
         { "sum",    builtin_sum },
         { "globals", builtin_globals },
         { "clock",  builtin_clock },
+        { "collect", builtin_collect },
 
         // CONSTANTS
         // XXX: Make a PROPERTY type which will be called by the interpreter
@@ -107,9 +107,9 @@ LoxObject_ParseFormatSpec(const char *spec, struct format_spec *format) {
 
 Object*
 LoxObject_Format(Object *object, const char *spec) {
-    if (object->type->format != NULL) {
+    if (OBJECT_TYPE(object)->format != NULL) {
         LoxString *spec_string = String_fromCharsAndSize(spec, strlen(spec));
-        Object *rv = object->type->format(object, (Object*) spec_string);
+        Object *rv = OBJECT_TYPE(object)->format(object, (Object*) spec_string);
         LoxObject_Cleanup((Object*) spec_string);
         return rv;
     }
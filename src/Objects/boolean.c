@@ -17,15 +17,15 @@ Bool_fromBool(bool value) {
 
 Object*
 Bool_fromObject(Object* value) {
-    if (value->type == &BooleanType)
+    if (OBJECT_TYPE_ID(value) == TYPEID_BOOL)
         return value;
-    else if (value->type->as_bool)
-        return (Object*) value->type->as_bool(value);
+    else if (OBJECT_TYPE(value)->as_bool)
+        return (Object*) OBJECT_TYPE(value)->as_bool(value);
     // TODO: If type has a len() method, compare > zero
     else if (value == LoxNIL)
         return (Object*) LoxFALSE;
 
-    fprintf(stderr, "Cannot coerce type `%s` to bool", value->type->name);
+    fprintf(stderr, "Cannot coerce type `%s` to bool", OBJECT_TYPE(value)->name);
     return LoxUndefined;
 }
 
@@ -34,48 +34,49 @@ Bool_isBool(Object* value) {
     if (!value)
         return false;
 
-    return value->type == &BooleanType;
+    return OBJECT_TYPE_ID(value) == TYPEID_BOOL;
 }
 
 bool
 Bool_isTrue(Object* value) {
-    if (value->type != &BooleanType)
+    if (OBJECT_TYPE_ID(value) != TYPEID_BOOL)
         value = (Object*) Bool_fromObject(value);
     return value == (Object*) LoxTRUE;
 }
 
 static LoxBool*
 bool_self(Object* self) {
-    assert(self->type == &BooleanType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_BOOL);
     return (LoxBool*) self;
 }
 
 static Object*
 bool_asint(Object* self) {
-    assert(self->type == &BooleanType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_BOOL);
     return (Object*) Integer_fromLongLong(((LoxBool*)self)->value ? 1 : 0);
 }
 
 static Object*
 bool_asstring(Object* self) {
-    assert(self->type == &BooleanType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_BOOL);
     return (Object*) String_fromConstant(((LoxBool*)self)->value ? "true" : "false");
 }
 
 static int
 bool_compare(Object* self, Object* other) {
-    assert(self->type == &BooleanType);
-    if (other->type != self->type) {
-        if (!other->type->as_bool) {
+    assert(OBJECT_TYPE_ID(self) == TYPEID_BOOL);
+    if (OBJECT_TYPE(other) != OBJECT_TYPE(self)) {
+        if (!OBJECT_TYPE(other)->as_bool) {
             // Raise error
         }
-        other = (Object*) other->type->as_bool(other);
+        other = (Object*) OBJECT_TYPE(other)->as_bool(other);
     }
     return ((LoxBool*)self)->value - ((LoxBool*)other)->value;
 }
 
 static struct object_type BooleanType = (ObjectType) {
     .code = TYPE_BOOL,
+    .id = TYPEID_BOOL,
     .name = "bool",
 
     .as_bool = bool_self,
@@ -88,15 +89,15 @@ static struct object_type BooleanType = (ObjectType) {
 };
 
 static LoxBool _LoxTRUE = (LoxBool) {
-    .base.type = &BooleanType,
-    .base.refcount = 1,
+    .base.type_id = TYPEID_BOOL,
+    .base.immortal = true,
     .value = true,
 };
 LoxBool *LoxTRUE = &_LoxTRUE;
 
 static LoxBool _LoxFALSE = (LoxBool) {
-    .base.type = &BooleanType,
-    .base.refcount = 1,
+    .base.type_id = TYPEID_BOOL,
+    .base.immortal = true,
     .value = false,
 };
 LoxBool *LoxFALSE = &_LoxFALSE;
@@ -126,6 +127,7 @@ null_compare(Object *self, Object *other) {
 
 static struct object_type NilType = (ObjectType) {
     .code = TYPE_NIL,
+    .id = TYPEID_NIL,
     .name = "nil",
 
     .as_bool = null_asbool,
@@ -137,8 +139,8 @@ static struct object_type NilType = (ObjectType) {
 };
 
 static Object _LoxNIL = (Object) {
-    .type = &NilType,
-    .refcount = 1,
+    .type_id = TYPEID_NIL,
+    .immortal = true,
 };
 Object *LoxNIL = &_LoxNIL;
 
@@ -157,6 +159,7 @@ undef_asstring(Object* self) {
 
 static struct object_type UndefinedType = (ObjectType) {
     .code = TYPE_UNDEFINED,
+    .id = TYPEID_UNDEFINED,
     .name = "undefined",
 
     .as_bool = undef_asbool,
@@ -166,8 +169,15 @@ static struct object_type UndefinedType = (ObjectType) {
     .cleanup = ERROR,
 };
 
+OBJECT_TYPES_STARTUP
+static void boolean__register(void) {
+    LoxObject_registerType(&BooleanType);
+    LoxObject_registerType(&NilType);
+    LoxObject_registerType(&UndefinedType);
+}
+
 static Object _LoxUndefined = (Object) {
-    .type = &UndefinedType,
-    .refcount = 1,
+    .type_id = TYPEID_UNDEFINED,
+    .immortal = true,
 };
 Object *LoxUndefined = &_LoxUndefined;
\ No newline at end of file
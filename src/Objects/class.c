@@ -16,6 +16,8 @@ static struct object_type ClassType;
 static struct object_type InstanceType;
 static struct object_type BoundMethodType;
 
+unsigned long LoxClass_Epoch = 1;
+
 LoxClass*
 Class_build(LoxTable *attributes, LoxClass *parent) {
     LoxClass* O = object_new(sizeof(LoxClass), &ClassType);
@@ -37,7 +39,7 @@ Class_build(LoxTable *attributes, LoxClass *parent) {
         value = Tuple_GETITEM((LoxTuple*) next, 1);
 
         if (VmCode_isVmCode(value)) {
-            ((LoxVmCode*) value)->context->owner = (Object*) O;
+            VmCode_setOwner((LoxVmCode*) value, (Object*) O);
         }
     }
     LoxObject_Cleanup((Object*) it);
@@ -80,7 +82,7 @@ LoxClass_fromModuleDescriptionAndParent(ModuleDescription *desc, LoxClass *paren
     assert(desc->properties);
 
     LoxClass* self = object_new(sizeof(LoxClass), &ClassType);
-    self->name = (Object*) String_fromCharsAndSize(desc->name, strlen(desc->name));
+    self->name = (Object*) String_intern(desc->name, strlen(desc->name));
     INCREF(self->name);
 
     self->attributes = Hash_new();
@@ -98,13 +100,13 @@ LoxClass_fromModuleDescription(ModuleDescription *desc) {
 bool
 Class_isClass(Object* self) {
     assert(self);
-    return(self->type == &ClassType);
+    return(OBJECT_TYPE_ID(self) == TYPEID_CLASS);
 }
 
 static Object*
 class_getattr(Object *self, Object *name, hashval_t hash) {
     assert(self);
-    assert(self->type == &ClassType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_CLASS);
 
     LoxClass *class = (LoxClass*) self;
     Object *method;
@@ -121,20 +123,23 @@ class_getattr(Object *self, Object *name, hashval_t hash) {
 static void
 class_setattr(Object *self, Object *name, Object *value, hashval_t hash) {
     assert(self);
-    assert(self->type == &ClassType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_CLASS);
 
     LoxClass *this = (LoxClass*) self;
 
-    if (!this->attributes)
+    if (!this->attributes) {
         this->attributes = Hash_new();
+        INCREF(this->attributes);
+    }
 
     Hash_setItemEx(this->attributes, name, value, hash);
+    LoxClass_Epoch++;
 }
 
 static Object*
 class_instanciate(Object* self, VmScope *scope, Object* object, Object* args) {
     assert(self);
-    assert(self->type == &ClassType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_CLASS);
 
     // Create/return a object with (self) as the class
     LoxInstance *O = object_new(sizeof(LoxInstance), &InstanceType);
@@ -154,7 +159,7 @@ class_instanciate(Object* self, VmScope *scope, Object* object, Object* args) {
         // because the object refcount starts at zero, so it would return
         // to zero and then be cleaned up..
         O->base.protect_delete = true;
-        constructor->type->call(constructor, scope, (Object*) O, args);
+        OBJECT_TYPE(constructor)->call(constructor, scope, (Object*) O, args);
         O->base.protect_delete = false;
     }
 
@@ -172,21 +177,42 @@ class_asstring(Object *self) {
 
 static void
 class_cleanup(Object *self) {
-    assert(self->type == &ClassType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_CLASS);
 
     LoxClass *this = (LoxClass*) self;
     if (this->parent)
         DECREF((Object*) this->parent);
 
+    // Another class could be allocated at this same address
+    LoxClass_Epoch++;
+
     if (this->name)
         DECREF(this->name);
+
+    if (this->attributes)
+        DECREF(this->attributes);
+}
+
+static void
+class_traverse(Object *self, ObjectVisitor visit, void *arg) {
+    assert(OBJECT_TYPE_ID(self) == TYPEID_CLASS);
+
+    LoxClass *this = (LoxClass*) self;
+    if (this->parent)
+        visit((Object*) this->parent, arg);
+    if (this->name)
+        visit(this->name, arg);
+    if (this->attributes)
+        visit((Object*) this->attributes, arg);
 }
 
 static struct object_type ClassType = (ObjectType) {
     .code = TYPE_CLASS,
+    .id = TYPEID_CLASS,
     .name = "class",
     .hash = MYADDRESS,
     .cleanup = class_cleanup,
+    .traverse = class_traverse,
 
     .as_string = class_asstring,
 
@@ -197,10 +223,16 @@ static struct object_type ClassType = (ObjectType) {
     .call = class_instanciate,
 };
 
+bool
+Instance_isInstance(Object* self) {
+    assert(self);
+    return OBJECT_TYPE_ID(self) == TYPEID_INSTANCE;
+}
+
 static Object*
 instance_getattr(Object *self, Object *name, hashval_t hash) {
     assert(self);
-    assert(self->type == &InstanceType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_INSTANCE);
 
     LoxInstance *this = (LoxInstance*) self;
     assert(this->class);
@@ -217,17 +249,25 @@ instance_getattr(Object *self, Object *name, hashval_t hash) {
     return LoxUndefined;
 }
 
+/* Set an attribute of the instance, and return the entry it is kept in */
+HashEntry*
+LoxInstance_storeAttribute(LoxInstance *this, Object *name, Object *value,
+    hashval_t hash
+) {
+    if (!this->attributes) {
+        this->attributes = Hash_new();
+        INCREF(this->attributes);
+    }
+
+    return Hash_storeEx(this->attributes, name, value, hash);
+}
+
 static void
 instance_setattr(Object *self, Object *name, Object *value, hashval_t hash) {
     assert(self);
-    assert(self->type == &InstanceType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_INSTANCE);
 
-    LoxInstance *this = (LoxInstance*) self;
-
-    if (!this->attributes)
-        this->attributes = Hash_new();
-
-    Hash_setItemEx(this->attributes, name, value, hash);
+    LoxInstance_storeAttribute((LoxInstance*) self, name, value, hash);
 }
 
 void
@@ -242,7 +282,7 @@ LoxInstance_getAttribute(Object *self, Object *name) {
 
 static Object*
 instance_asstring(Object *self) {
-    assert(self->type == &InstanceType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_INSTANCE);
 
     static Object *toString = NULL;
     if (!toString)
@@ -250,7 +290,7 @@ instance_asstring(Object *self) {
 
     Object *repr = instance_getattr(self, toString, HASHVAL(toString));
     if (Function_isCallable(repr)) {
-        return repr->type->call(repr, NULL, self, (Object*) LoxEmptyTuple);
+        return OBJECT_TYPE(repr)->call(repr, NULL, self, (Object*) LoxEmptyTuple);
     }
 
     {
@@ -263,16 +303,31 @@ instance_asstring(Object *self) {
 
 static void
 instance_cleanup(Object* self) {
-    assert(self->type == &InstanceType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_INSTANCE);
 
     LoxInstance *this = (LoxInstance*) self;
     DECREF((Object*) this->class);
+
+    if (this->attributes)
+        DECREF(this->attributes);
+}
+
+static void
+instance_traverse(Object *self, ObjectVisitor visit, void *arg) {
+    assert(OBJECT_TYPE_ID(self) == TYPEID_INSTANCE);
+
+    LoxInstance *this = (LoxInstance*) self;
+    visit((Object*) this->class, arg);
+    if (this->attributes)
+        visit((Object*) this->attributes, arg);
 }
 
 static struct object_type InstanceType = (ObjectType) {
     .code = TYPE_OBJECT,
+    .id = TYPEID_INSTANCE,
     .name = "object",
     .cleanup = instance_cleanup,
+    .traverse = instance_traverse,
 
     .as_string = instance_asstring,
     .compare = IDENTITY,
@@ -298,29 +353,47 @@ BoundMethod_create(Object *method, Object *object) {
 static Object*
 boundmethod_invoke(Object* self, VmScope *scope, Object* object, Object* args) {
     assert(self);
-    assert(self->type == &BoundMethodType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_BOUND_METHOD);
 
     LoxBoundMethod *this = (LoxBoundMethod*) self;
     assert(this->method);
-    assert(this->method->type->call);
-    return this->method->type->call(this->method, scope, this->object, args);
+    assert(OBJECT_TYPE(this->method)->call);
+    return OBJECT_TYPE(this->method)->call(this->method, scope, this->object, args);
 }
 
 static void
 boundmethod_cleanup(Object* self) {
-    assert(self->type == &BoundMethodType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_BOUND_METHOD);
 
     LoxBoundMethod *this = (LoxBoundMethod*) self;
     DECREF(this->method);
     DECREF(this->object);
 }
 
+static void
+boundmethod_traverse(Object *self, ObjectVisitor visit, void *arg) {
+    assert(OBJECT_TYPE_ID(self) == TYPEID_BOUND_METHOD);
+
+    LoxBoundMethod *this = (LoxBoundMethod*) self;
+    visit(this->method, arg);
+    visit(this->object, arg);
+}
+
 static struct object_type BoundMethodType = (ObjectType) {
     .code = TYPE_BOUND_METHOD,
+    .id = TYPEID_BOUND_METHOD,
     .name = "method",
     .cleanup = boundmethod_cleanup,
+    .traverse = boundmethod_traverse,
 
     .compare = IDENTITY,
 
     .call = boundmethod_invoke,
-};
\ No newline at end of file
+};
+
+OBJECT_TYPES_STARTUP
+static void class__register(void) {
+    LoxObject_registerType(&ClassType);
+    LoxObject_registerType(&InstanceType);
+    LoxObject_registerType(&BoundMethodType);
+}
@@ -29,13 +29,19 @@ typedef struct boundmethod_object {
     LoxClass    *origin;
 } LoxBoundMethod;
 
+// Incremented whenever a class is changed (or destroyed) after it is built,
+// which invalidates any cached attribute lookups through classes
+extern unsigned long LoxClass_Epoch;
+
 LoxClass* Class_build(LoxTable*, LoxClass*);
 Object* BoundMethod_create(Object *, Object *);
 bool Class_isClass(Object*);
+bool Instance_isInstance(Object*);
 LoxClass* LoxClass_fromModuleDescriptionAndParent(ModuleDescription *, LoxClass *);
 LoxClass* LoxClass_fromModuleDescription(ModuleDescription *);
 
 void LoxInstance_setAttribute(Object *, Object *, Object *);
+HashEntry* LoxInstance_storeAttribute(LoxInstance *, Object *, Object *, hashval_t);
 Object* LoxInstance_getAttribute(Object *, Object *);
 
 #endif
\ No newline at end of file
@@ -18,7 +18,7 @@ static struct object_type StackTraceType;
 bool
 Exception_isException(Object *value) {
     assert(value);
-    return value->type == &ExceptionType;
+    return OBJECT_TYPE_ID(value) == TYPEID_EXCEPTION;
 }
 
 Object*
@@ -71,7 +71,7 @@ Exception_fromBaseTypeAndFormatVa(const char *format, va_list args) {
 static Object*
 exception_asstring(Object *self) {
     assert(self);
-    assert(self->type == &ExceptionType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_EXCEPTION);
 
     LoxException *this = (LoxException*) self;
     char buffer[32 + this->message->length];
@@ -118,12 +118,18 @@ exception__toString(VmScope *state, Object *self, Object *args) {
 
 static struct object_type ExceptionType = (ObjectType) {
     .code = TYPE_EXCEPTION,
+    .id = TYPEID_EXCEPTION,
     .name = "exception",
     .hash = MYADDRESS,
 
     .as_string = exception_asstring,
 };
 
+OBJECT_TYPES_STARTUP
+static void exception__register(void) {
+    LoxObject_registerType(&ExceptionType);
+}
+
 static ModuleDescription
 LoxBaseExceptionDescription = {
     .name = "Exception",
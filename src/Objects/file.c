@@ -31,7 +31,7 @@ Lox_FileOpen(const char *filename, const char *flags) {
 static Object*
 file_len(Object *self) {
     assert(self);
-    assert(self->type == &FileType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_FILE);
 
     struct stat st;
     stat(((LoxFile*) self)->filename, &st);
@@ -43,7 +43,7 @@ file_len(Object *self) {
 static Object*
 file_read(VmScope *state, Object *self, Object *args) {
     assert(self);
-    assert(self->type == &FileType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_FILE);
 
     int size;
     if (0 != Lox_ParseArgs(args, "i", &size))
@@ -69,7 +69,7 @@ file_read(VmScope *state, Object *self, Object *args) {
 Object*
 LoxFile_readLine(Object *self) {
     assert(self);
-    assert(self->type == &FileType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_FILE);
 
     off_t before, after;
     char *buffer = malloc(8192), *result;
@@ -106,7 +106,7 @@ file_readline(VmScope *state, Object *self, Object *args) {
 static Object*
 file_write(VmScope *state, Object *self, Object *args) {
     assert(self);
-    assert(self->type == &FileType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_FILE);
 
     int length, wrote;
     unsigned char *buffer;
@@ -131,7 +131,7 @@ file_write(VmScope *state, Object *self, Object *args) {
 static Object*
 file_close(VmScope *state, Object *self, Object *args) {
     assert(self);
-    assert(self->type == &FileType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_FILE);
 
     ((LoxFile*) self)->isopen = false;
 
@@ -141,7 +141,7 @@ file_close(VmScope *state, Object *self, Object *args) {
 static Object*
 file_flush(VmScope *state, Object *self, Object *args) {
     assert(self);
-    assert(self->type == &FileType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_FILE);
 
     return (Object*) Bool_fromBool(0 == fflush(((LoxFile*) self)->file));
 }
@@ -149,7 +149,7 @@ file_flush(VmScope *state, Object *self, Object *args) {
 static Object*
 file_tell(VmScope *state, Object *self, Object *args) {
     assert(self);
-    assert(self->type == &FileType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_FILE);
 
     if (!((LoxFile*) self)->isopen)
         return LoxUndefined;
@@ -165,7 +165,7 @@ file_tell(VmScope *state, Object *self, Object *args) {
 static Object*
 file_asstring(Object *self) {
     assert(self);
-    assert(self->type == &FileType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_FILE);
 
     char buffer[256];
     int length = snprintf(buffer, sizeof(buffer), "%s file '%s'",
@@ -187,7 +187,7 @@ file_readlines__next(Iterator *self) {
 static Iterator*
 LoxFile_getIterator(Object *self) {
     assert(self);
-    assert(self->type == &FileType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_FILE);
 
     Iterator* it = (Iterator*) LoxIterator_create((Object*) self, sizeof(Iterator));
     it->next = file_readlines__next;
@@ -202,7 +202,7 @@ file_readlines(VmScope *state, Object *self, Object *args) {
 static void
 file_cleanup(Object *self) {
     assert(self);
-    assert(self->type == &FileType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_FILE);
 
     LoxFile* F = (LoxFile*) self;
 
@@ -212,6 +212,7 @@ file_cleanup(Object *self) {
 
 static struct object_type FileType = (ObjectType) {
     .code = TYPE_OBJECT,
+    .id = TYPEID_FILE,
     .name = "file",
     .len = file_len,
 
@@ -233,4 +234,9 @@ static struct object_type FileType = (ObjectType) {
     },
 
     .cleanup = file_cleanup,
-};
\ No newline at end of file
+};
+
+OBJECT_TYPES_STARTUP
+static void file__register(void) {
+    LoxObject_registerType(&FileType);
+}
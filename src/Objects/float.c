@@ -30,41 +30,41 @@ Float_fromLongLong(long long value) {
 bool
 Float_isFloat(Object *value) {
     assert(value);
-    return value->type == &FloatType;
+    return OBJECT_TYPE_ID(value) == TYPEID_FLOAT;
 }
 
 Object*
 Float_fromObject(Object* value) {
-    assert(value->type);
+    assert(OBJECT_TYPE(value));
 
-    if (!value->type->as_int) {
-        fprintf(stderr, "Warning: Cannot coerce type `%s` to float\n", value->type->name);
+    if (!OBJECT_TYPE(value)->as_int) {
+        fprintf(stderr, "Warning: Cannot coerce type `%s` to float\n", OBJECT_TYPE(value)->name);
         return LoxUndefined;
     }
 
-    return value->type->as_float(value);
+    return OBJECT_TYPE(value)->as_float(value);
 }
 
 long double
 Float_toLongDouble(Object* value) {
-    assert(value->type);
+    assert(OBJECT_TYPE(value));
 
-    if (value->type != &FloatType) {
-        if (!value->type->as_float) {
+    if (OBJECT_TYPE_ID(value) != TYPEID_FLOAT) {
+        if (!OBJECT_TYPE(value)->as_float) {
             // TODO: Raise error
             return 0.0;
         }
-        value = value->type->as_float(value);
+        value = OBJECT_TYPE(value)->as_float(value);
     }
 
-    assert(value->type == &FloatType);
+    assert(OBJECT_TYPE_ID(value) == TYPEID_FLOAT);
 
     return ((LoxFloat*) value)->value;
 }
 
 hashval_t
 float_hash(Object* self) {
-    assert(self->type == &FloatType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_FLOAT);
 
     LoxFloat* S = (LoxFloat*) self;
     unsigned long long value = (unsigned long long) S->value;
@@ -73,19 +73,25 @@ float_hash(Object* self) {
 
 static Object*
 float_asint(Object* self) {
-    assert(self->type == &FloatType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_FLOAT);
     return (Object*) Integer_fromLongLong((long long) ((LoxFloat*) self)->value);
 }
 
 static Object*
 float_asfloat(Object* self) {
-    assert(self->type == &FloatType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_FLOAT);
     return (Object*) self;
 }
 
+static LoxBool*
+float_asbool(Object* self) {
+    assert(OBJECT_TYPE_ID(self) == TYPEID_FLOAT);
+    return ((LoxFloat*) self)->value == 0 ? LoxFALSE : LoxTRUE;
+}
+
 static Object*
 float_asstring(Object* self) {
-    assert(self->type == &FloatType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_FLOAT);
 
     char buffer[40];
     snprintf(buffer, sizeof(buffer), "%Lg", ((LoxFloat*) self)->value);
@@ -94,78 +100,78 @@ float_asstring(Object* self) {
 
 static struct object*
 float_op_plus(Object* self, Object* other) {
-    assert(self->type == &FloatType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_FLOAT);
 
-    if (other->type->code != TYPE_FLOAT) {
-        if (other->type->as_float == NULL) {
+    if (OBJECT_TYPE(other)->code != TYPE_FLOAT) {
+        if (OBJECT_TYPE(other)->as_float == NULL) {
             // interpreter_raise('Cannot add (object) to int')
         }
-        other = other->type->as_float(other);
+        other = OBJECT_TYPE(other)->as_float(other);
     }
     return (Object*) Float_fromLongDouble(((LoxFloat*) self)->value + ((LoxFloat*) other)->value);
 }
 
 static struct object*
 float_op_minus(Object* self, Object* other) {
-    assert(self->type == &FloatType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_FLOAT);
 
-    if (other->type->code != TYPE_FLOAT) {
-        if (other->type->as_float == NULL) {
+    if (OBJECT_TYPE(other)->code != TYPE_FLOAT) {
+        if (OBJECT_TYPE(other)->as_float == NULL) {
             // interpreter_raise('Cannot add (object) to int')
         }
-        other = other->type->as_float(other);
+        other = OBJECT_TYPE(other)->as_float(other);
     }
     return (Object*) Float_fromLongDouble(((LoxFloat*) self)->value - ((LoxFloat*) other)->value);
 }
 
 static struct object*
 float_op_neg(Object* self) {
-    assert(self->type == &FloatType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_FLOAT);
 
     return (Object*) Float_fromLongDouble(- ((LoxFloat*) self)->value);
 }
 
 static struct object*
 float_op_star(Object* self, Object* other) {
-    assert(self->type->code == TYPE_FLOAT);
+    assert(OBJECT_TYPE(self)->code == TYPE_FLOAT);
 
-    if (other->type->code != TYPE_FLOAT) {
-        if (other->type->as_float == NULL) {
+    if (OBJECT_TYPE(other)->code != TYPE_FLOAT) {
+        if (OBJECT_TYPE(other)->as_float == NULL) {
             // interpreter_raise('Cannot add (object) to int')
         }
-        other = other->type->as_float(other);
+        other = OBJECT_TYPE(other)->as_float(other);
     }
     return (Object*) Float_fromLongDouble(((LoxFloat*) self)->value * ((LoxFloat*) other)->value);
 }
 
 static struct object*
 float_op_slash(Object* self, Object* other) {
-    assert(self->type->code == TYPE_FLOAT);
+    assert(OBJECT_TYPE(self)->code == TYPE_FLOAT);
 
-    if (other->type->code != TYPE_FLOAT) {
-        if (other->type->as_float == NULL) {
+    if (OBJECT_TYPE(other)->code != TYPE_FLOAT) {
+        if (OBJECT_TYPE(other)->as_float == NULL) {
             // interpreter_raise('Cannot add (object) to int')
         }
-        other = other->type->as_float(other);
+        other = OBJECT_TYPE(other)->as_float(other);
     }
     return (Object*) Float_fromLongDouble(((LoxFloat*) self)->value / ((LoxFloat*) other)->value);
 }
 
 static inline Object*
 coerce_float(Object* value) {
-    if (value->type != &FloatType) {
-       if (value->type->as_float == NULL) {
-           fprintf(stderr, "Warning: Cannot coerce type `%s` to float\n", value->type->name);
+    if (OBJECT_TYPE_ID(value) != TYPEID_FLOAT) {
+       if (OBJECT_TYPE(value)->as_float == NULL) {
+           fprintf(stderr, "Warning: Cannot coerce type `%s` to float\n", OBJECT_TYPE(value)->name);
            return LoxUndefined;
        }
-       value = (Object*) value->type->as_float(value);
+       value = (Object*) OBJECT_TYPE(value)->as_float(value);
    }
    return value;
 }
 
 static int
 float_compare(Object *self, Object *other) {
-    assert(self->type->code == TYPE_FLOAT);
+    assert(OBJECT_TYPE(self)->code == TYPE_FLOAT);
 
     other = coerce_float(other);
 
@@ -176,12 +182,13 @@ float_compare(Object *self, Object *other) {
 
 static struct object_type FloatType = (ObjectType) {
     .code = TYPE_FLOAT,
+    .id = TYPEID_FLOAT,
     .name = "float",
-    .features = FEATURE_STASH,
     .hash = float_hash,
     .as_int = float_asint,
     .as_float = float_asfloat,
     .as_string = float_asstring,
+    .as_bool = float_asbool,
 
     .op_plus = float_op_plus,
     .op_minus = float_op_minus,
@@ -190,4 +197,9 @@ static struct object_type FloatType = (ObjectType) {
     .op_neg = float_op_neg,
 
     .compare = float_compare,
-};
\ No newline at end of file
+};
+
+OBJECT_TYPES_STARTUP
+static void float__register(void) {
+    LoxObject_registerType(&FloatType);
+}
@@ -10,6 +10,7 @@
 #include "string.h"
 #include "tuple.h"
 #include "Compile/vm.h"
+#include "Compile/compile.h"
 #include "Parse/debug_parse.h"
 
 static struct object_type FunctionType;
@@ -19,16 +20,16 @@ Function_isCallable(Object* object) {
     if (!object)
         return false;
 
-    assert(object->type);
+    assert(OBJECT_TYPE(object));
 
-    return object->type->call != NULL;
+    return OBJECT_TYPE(object)->call != NULL;
 }
 
 bool
 Function_isFunction(Object* object) {
     assert(object != NULL);
 
-    return object->type == &FunctionType;
+    return OBJECT_TYPE_ID(object) == TYPEID_FUNCTION;
 }
 
 Object*
@@ -49,7 +50,7 @@ Function_fromAST(ASTFunction* fun) {
         for (p = fun->arglist; p != NULL; p = p->next) {
             assert(p->type == AST_PARAM);
             param = (ASTFuncParam*) p;
-            *pname++ = String_fromCharsAndSize(param->name,
+            *pname++ = String_intern(param->name,
                 param->name_length);
         }
         O->parameters = (Object**) names;
@@ -57,14 +58,14 @@ Function_fromAST(ASTFunction* fun) {
     }
 
     if (fun->name_length)
-        O->name = (Object*) String_fromCharsAndSize(fun->name, fun->name_length);
+        O->name = (Object*) String_intern(fun->name, fun->name_length);
 
     return (Object*) O;
 }
 
 static Object*
 function_asstring(Object* self) {
-    assert(self->type == &FunctionType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_FUNCTION);
 
     char buffer[256];
     int bytes;
@@ -82,6 +83,7 @@ function_asstring(Object* self) {
 
 static struct object_type FunctionType = (ObjectType) {
     .code = TYPE_FUNCTION,
+    .id = TYPEID_FUNCTION,
     .name = "function",
 
     .as_string = function_asstring,
@@ -92,7 +94,7 @@ static struct object_type NativeFunctionType;
 
 bool
 Function_isNativeFunction(Object* object) {
-    return object->type == &NativeFunctionType;
+    return OBJECT_TYPE_ID(object) == TYPEID_NATIVE_FUNCTION;
 }
 
 Object*
@@ -104,7 +106,7 @@ NativeFunction_new(NativeFunctionCall callable) {
 
 Object*
 NativeFunction_bind(Object *self, Object *object) {
-    assert(self->type == &NativeFunctionType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_NATIVE_FUNCTION);
 
     LoxNativeFunc* this = object_new(sizeof(LoxNativeFunc), &NativeFunctionType);
     this->callable = ((LoxNativeFunc*)self)->callable;
@@ -116,30 +118,39 @@ NativeFunction_bind(Object *self, Object *object) {
 
 static Object*
 nfunction_call(Object* self, VmScope *scope, Object* object, Object* args) {
-    assert(self->type == &NativeFunctionType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_NATIVE_FUNCTION);
     return ((LoxNativeFunc*) self)->callable(scope, ((LoxNativeFunc*)self)->self, args);
 }
 
 static Object*
 nfunction_asstring(Object* self) {
-    assert(self->type == &NativeFunctionType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_NATIVE_FUNCTION);
     return (Object*) String_fromConstant("function() { native code }");
 }
 
 static void
 nfunction_cleanup(Object* self) {
-    assert(self->type == &NativeFunctionType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_NATIVE_FUNCTION);
 
     if (((LoxNativeFunc*)self)->self)
         DECREF(((LoxNativeFunc*)self)->self);
 }
 
+static void
+nfunction_traverse(Object *self, ObjectVisitor visit, void *arg) {
+    assert(OBJECT_TYPE_ID(self) == TYPEID_NATIVE_FUNCTION);
+
+    if (((LoxNativeFunc*)self)->self)
+        visit(((LoxNativeFunc*)self)->self, arg);
+}
+
 static struct object_type NativeFunctionType = (ObjectType) {
+    .id = TYPEID_NATIVE_FUNCTION,
     .name = "native function",
-    .features = FEATURE_STASH,
     .call = nfunction_call,
     .as_string = nfunction_asstring,
     .cleanup = nfunction_cleanup,
+    .traverse = nfunction_traverse,
 };
 
 
@@ -148,26 +159,66 @@ static struct object_type NativeFunctionType = (ObjectType) {
 static struct object_type LoxVmCodeType;
 
 Object*
-VmCode_fromContext(ASTFunction *fun, CodeContext *context) {
+VmCode_new(Object *name, CodeContext *context) {
     LoxVmCode* O = object_new(sizeof(LoxVmCode), &LoxVmCodeType);
     O->context = context;
+    O->name = name;
+    O->deferred = NULL;
+    O->owner = NULL;
+
+    return (Object*) O;
+}
+
+Object*
+VmCode_fromContext(ASTFunction *fun, CodeContext *context) {
+    Object *name = NULL;
 
     if (fun->name_length)
-        O->name = (Object*) String_fromCharsAndSize(fun->name, fun->name_length);
+        name = (Object*) String_intern(fun->name, fun->name_length);
+
+    return VmCode_new(name, context);
+}
+
+Object*
+VmCode_fromDeferred(ASTFunction *fun, struct compile_deferred *deferred) {
+    LoxVmCode *O = (LoxVmCode*) VmCode_fromContext(fun, NULL);
+    O->deferred = deferred;
 
     return (Object*) O;
 }
 
+/**
+ * Compile the body of the code, which was deferred until it was needed.
+ */
+CodeContext*
+VmCode_compile(LoxVmCode *code) {
+    assert(code->deferred);
+
+    code->context = compile_deferred(code->deferred);
+    code->context->owner = code->owner;
+    code->deferred = NULL;
+
+    return code->context;
+}
+
+void
+VmCode_setOwner(LoxVmCode *code, Object *owner) {
+    if (code->context)
+        code->context->owner = owner;
+    else
+        code->owner = owner;
+}
+
 bool
 VmCode_isVmCode(Object *callable) {
     assert(callable);
-    assert(callable->type);
-    return callable->type == &LoxVmCodeType;
+    assert(OBJECT_TYPE(callable));
+    return OBJECT_TYPE_ID(callable) == TYPEID_VMCODE;
 }
 
 Object*
 code_asstring(Object* self) {
-    assert(self->type == &LoxVmCodeType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_VMCODE);
 
     char buffer[256];
     int bytes;
@@ -184,24 +235,40 @@ code_asstring(Object* self) {
     return (Object*) String_fromCharsAndSize(buffer, bytes);
 }
 
+/**
+ * Unpack the items of an argument tuple into `values` for the VM. The values
+ * borrow the references held by the tuple.
+ */
+static VmCallArgs
+VmCallArgs_fromTuple(LoxTuple *args, LoxValue *values) {
+    size_t i = args->count;
+    while (i--)
+        values[i] = LoxValue_fromObject(args->items[i]);
+
+    return (VmCallArgs) {
+        .values = values,
+        .count = args->count,
+    };
+}
+
 static Object*
 codeobject_call(Object* self, VmScope *scope, Object *object, Object *args) {
-    assert(self->type == &LoxVmCodeType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_VMCODE);
     assert(Tuple_isTuple(args));
 
+    // At least one, a zero-length array is undefined
+    LoxValue values[((LoxTuple*) args)->count ? ((LoxTuple*) args)->count : 1];
     VmEvalContext call_ctx = (VmEvalContext) {
-        .code = ((LoxVmCode*) self)->context,
+        .code = VmCode_getContext((LoxVmCode*) self),
         .scope = scope,
         .this = object,
-        .args = (VmCallArgs) {
-            .values = ((LoxTuple*) args)->items,
-            .count = ((LoxTuple*) args)->count,
-        },
+        .args = VmCallArgs_fromTuple((LoxTuple*) args, values),
     };
     return LoxVM_eval(&call_ctx);
 }
 
 static struct object_type LoxVmCodeType = (ObjectType) {
+    .id = TYPEID_VMCODE,
     .name = "code",
     .hash = MYADDRESS,
     .compare = IDENTITY,
@@ -215,26 +282,45 @@ static struct object_type VmFunctionObjectType;
 
 static void
 vmfun_cleanup(Object* self) {
-    assert(self->type == &VmFunctionObjectType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_VMFUNCTION);
 
     LoxVmFunction *this = (LoxVmFunction*) self;
-    if (this->scope)
-        VmScope_leave(this->scope);
+    if (this->scope) {
+        // The scope was made for this function by OP_CLOSE_FUN, so the
+        // function holds the references to its cells
+        VmScope *scope = this->scope;
+        size_t i = scope->cells_count;
+        while (i--)
+            VALUE_DECREF(scope->cells[i]);
+        scope->cells_count = 0;
+        VmScope_leave(scope);
+    }
+}
+
+static void
+vmfun_traverse(Object *self, ObjectVisitor visit, void *arg) {
+    assert(OBJECT_TYPE_ID(self) == TYPEID_VMFUNCTION);
+
+    VmScope *scope = ((LoxVmFunction*) self)->scope;
+    size_t i;
+    if (scope) {
+        for (i = 0; i < scope->cells_count; i++)
+            if (VALUE_IS_OBJECT(scope->cells[i]))
+                visit(VALUE_AS_OBJECT(scope->cells[i]), arg);
+    }
 }
 
 static Object*
 vmfun_call(Object* self, VmScope *ignored, Object *object, Object *args) {
-    assert(self->type == &VmFunctionObjectType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_VMFUNCTION);
     assert(Tuple_isTuple(args));
 
+    LoxValue values[((LoxTuple*) args)->count ? ((LoxTuple*) args)->count : 1];
     VmEvalContext call_ctx = (VmEvalContext) {
-        .code = ((LoxVmFunction*) self)->code->context,
+        .code = VmCode_getContext(((LoxVmFunction*) self)->code),
         .scope = ((LoxVmFunction*) self)->scope,
         .this = object,
-        .args = (VmCallArgs) {
-            .values = ((LoxTuple*) args)->items,
-            .count = ((LoxTuple*) args)->count,
-        },
+        .args = VmCallArgs_fromTuple((LoxTuple*) args, values),
     };
     return LoxVM_eval(&call_ctx);
 }
@@ -246,7 +332,7 @@ vmfun_asstring(Object *self) {
 
 LoxVmFunction*
 VmCode_makeFunction(Object *code, VmScope *scope) {
-    assert(code->type == &LoxVmCodeType);
+    assert(OBJECT_TYPE_ID(code) == TYPEID_VMCODE);
 
     LoxVmFunction* O = object_new(sizeof(LoxVmFunction), &VmFunctionObjectType);
     O->code = (LoxVmCode*) code;
@@ -258,19 +344,65 @@ VmCode_makeFunction(Object *code, VmScope *scope) {
 bool
 VmFunction_isVmFunction(Object *callable) {
     assert(callable);
-    assert(callable->type);
-    return callable->type == &VmFunctionObjectType;
+    assert(OBJECT_TYPE(callable));
+    return OBJECT_TYPE_ID(callable) == TYPEID_VMFUNCTION;
 }
 
 static struct object_type VmFunctionObjectType = (ObjectType) {
+    .id = TYPEID_VMFUNCTION,
     .name = "function",
     .hash = MYADDRESS,
     .compare = IDENTITY,
     .call = vmfun_call,
     .cleanup = vmfun_cleanup,
+    .traverse = vmfun_traverse,
     .as_string = vmfun_asstring,
 };
 
+static struct object_type LoxCellType;
+
+/**
+ * Create a cell holding `value`. The reference to the value (if an object)
+ * is moved into the cell.
+ */
+LoxCell*
+LoxCell_create(LoxValue value) {
+    LoxCell *O = object_new(sizeof(LoxCell), &LoxCellType);
+    O->value = value;
+
+    return O;
+}
+
+bool
+LoxCell_isCell(LoxValue value) {
+    return VALUE_IS_OBJECT(value)
+        && OBJECT_TYPE_ID(VALUE_AS_OBJECT(value)) == TYPEID_CELL;
+}
+
+static void
+cell_cleanup(Object *self) {
+    assert(OBJECT_TYPE_ID(self) == TYPEID_CELL);
+    VALUE_DECREF(((LoxCell*) self)->value);
+}
+
+static void
+cell_traverse(Object *self, ObjectVisitor visit, void *arg) {
+    assert(OBJECT_TYPE_ID(self) == TYPEID_CELL);
+
+    LoxValue value = ((LoxCell*) self)->value;
+    if (VALUE_IS_OBJECT(value))
+        visit(VALUE_AS_OBJECT(value), arg);
+}
+
+static struct object_type LoxCellType = (ObjectType) {
+    .id = TYPEID_CELL,
+    .name = "cell",
+    .hash = MYADDRESS,
+    .compare = IDENTITY,
+    .cleanup = cell_cleanup,
+    .traverse = cell_traverse,
+};
+
 static struct object_type LoxNativePropertyType;
 
 Object*
@@ -304,13 +436,13 @@ nativeprop_cleanup(Object *self) {
 
 bool
 LoxNativeProperty_isProperty(Object *self) {
-    return self->type == &LoxNativePropertyType;
+    return OBJECT_TYPE_ID(self) == TYPEID_NATIVE_PROPERTY;
 }
 
 static Object*
 nativeprop_getattr(Object *self, Object *key, hashval_t hash) {
     assert(self);
-    assert(self->type == &LoxNativePropertyType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_NATIVE_PROPERTY);
 
     return (Object*) ((LoxNativeProperty*) self)->getter;
 }
@@ -318,7 +450,7 @@ nativeprop_getattr(Object *self, Object *key, hashval_t hash) {
 Object*
 LoxNativeProperty_callGetter(Object *self, VmScope *scope, Object *object) {
     assert(self);
-    assert(self->type == &LoxNativePropertyType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_NATIVE_PROPERTY);
     
     LoxNativeProperty *this = (LoxNativeProperty*) self;
     assert(Function_isNativeFunction(this->getter));
@@ -332,6 +464,7 @@ nativeprop_asstring(Object *self) {
 }
 
 static struct object_type LoxNativePropertyType = (ObjectType) {
+    .id = TYPEID_NATIVE_PROPERTY,
     .name = "property",
     .hash = MYADDRESS,
     .compare = IDENTITY,
@@ -339,4 +472,14 @@ static struct object_type LoxNativePropertyType = (ObjectType) {
     .getattr = nativeprop_getattr,
     //.setattr = nativeprop_setattr,
     .as_string = nativeprop_asstring,
-};
\ No newline at end of file
+};
+
+OBJECT_TYPES_STARTUP
+static void function__register(void) {
+    LoxObject_registerType(&FunctionType);
+    LoxObject_registerType(&NativeFunctionType);
+    LoxObject_registerType(&LoxVmCodeType);
+    LoxObject_registerType(&VmFunctionObjectType);
+    LoxObject_registerType(&LoxCellType);
+    LoxObject_registerType(&LoxNativePropertyType);
+}
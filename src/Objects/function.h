@@ -4,6 +4,7 @@
 #include <stdbool.h>
 
 #include "object.h"
+#include "value.h"
 #include "tuple.h"
 #include "Parse/parse.h"
 #include "Eval/scope.h"
@@ -35,10 +36,24 @@ typedef struct code_object {
     Object      base;
 
     Object      *name;
-    CodeContext *context;
+    CodeContext *context;               // NULL until the code is compiled
+    struct compile_deferred *deferred;  // How to compile the code
+    Object      *owner;                 // Class, if set before it was compiled
 } LoxVmCode;
 
+Object* VmCode_new(Object*, CodeContext*);
 Object* VmCode_fromContext(ASTFunction*, CodeContext*);
+Object* VmCode_fromDeferred(ASTFunction*, struct compile_deferred*);
+CodeContext* VmCode_compile(LoxVmCode*);
+void VmCode_setOwner(LoxVmCode*, Object*);
+
+// Function bodies are compiled on the first call (see compile_deferred)
+static inline CodeContext*
+VmCode_getContext(LoxVmCode *code) {
+    if (unlikely(code->context == NULL))
+        return VmCode_compile(code);
+    return code->context;
+}
 
 typedef struct vmfunction_object {
     Object      base;
@@ -48,6 +63,16 @@ typedef struct vmfunction_object {
 
 LoxVmFunction* VmCode_makeFunction(Object*, VmScope*);
 
+// A local variable captured by a closure. The frame which declares the
+// variable and the closures created there share the cell.
+typedef struct cell_object {
+    Object      base;
+    LoxValue    value;
+} LoxCell;
+
+LoxCell* LoxCell_create(LoxValue);
+bool LoxCell_isCell(LoxValue);
+
 typedef struct nfunction_object {
     // Inherits from Object
     Object          base;
@@ -0,0 +1,177 @@
+#include <assert.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "garbage.h"
+
+#define unlikely(x)     __builtin_expect((x),0)
+
+GarbageStats LoxGarbage_Stats = { 0 };
+
+// Containers alive, in the order they were allocated
+static GarbageLink Tracked = { .next = &Tracked, .prev = &Tracked };
+
+// Containers allocated less those released since the last collection
+static long Pending = 0;
+static long Threshold = GC_THRESHOLD;
+static bool Collecting = false;
+
+// Value of `refs` for containers found unreachable so far
+#define GARBAGE_UNREACHABLE LONG_MIN
+
+static inline void
+garbage_link_append(GarbageLink *list, GarbageLink *link) {
+    link->next = list;
+    link->prev = list->prev;
+    list->prev->next = link;
+    list->prev = link;
+}
+
+static inline void
+garbage_link_remove(GarbageLink *link) {
+    link->prev->next = link->next;
+    link->next->prev = link->prev;
+    link->next = link->prev = NULL;
+}
+
+/**
+ * Add a new container to the list walked by the cycle collector. This is
+ * where collections are triggered, before the new object is on the list.
+ */
+void
+garbage_track(Object *object) {
+    assert(object->tracked);
+
+    if (unlikely(++Pending > Threshold) && !Collecting)
+        garbage_collect();
+
+    garbage_link_append(&Tracked, GARBAGE_LINK(object));
+    LoxGarbage_Stats.tracked++;
+}
+
+void
+garbage_untrack(Object *object) {
+    GarbageLink *link = GARBAGE_LINK(object);
+
+    if (link->next) {
+        garbage_link_remove(link);
+        LoxGarbage_Stats.tracked--;
+        if (Pending > 0)
+            Pending--;
+    }
+}
+
+static inline GarbageLink*
+garbage_link_of(Object *object) {
+    // Static objects are not on the list, nor are objects being released
+    if (object && object->tracked && GARBAGE_LINK(object)->next)
+        return GARBAGE_LINK(object);
+    return NULL;
+}
+
+static void
+garbage_visit_decref(Object *object, void *arg) {
+    GarbageLink *link = garbage_link_of(object);
+
+    if (link)
+        link->refs--;
+}
+
+static void
+garbage_visit_reachable(Object *object, void *arg) {
+    GarbageLink *link = garbage_link_of(object);
+
+    if (!link)
+        return;
+
+    if (link->refs == GARBAGE_UNREACHABLE) {
+        // Move it back to be scanned again as reachable
+        garbage_link_remove(link);
+        garbage_link_append(&Tracked, link);
+        link->refs = 1;
+    }
+    else if (link->refs <= 0) {
+        // Not scanned yet, but known to be reachable now
+        link->refs = 1;
+    }
+}
+
+/**
+ * Find and free the reference cycles among all containers (trial deletion).
+ * References between containers are subtracted from their refcounts. What is
+ * left are references from the VM stacks, locals and objects which are not
+ * containers, and the containers which have any are reachable, as is
+ * everything they reference. The remaining containers are only kept alive
+ * by each other. Containers with no references at all are being built by
+ * native code and are kept too. Returns the number of containers freed.
+ */
+unsigned long
+garbage_collect(void) {
+    GarbageLink unreachable = { .next = &unreachable, .prev = &unreachable };
+    GarbageLink *link, *next;
+    Object *object;
+    unsigned long collected = 0;
+    clock_t start = clock();
+
+    Collecting = true;
+
+    for (link = Tracked.next; link != &Tracked; link = link->next) {
+        object = (Object*) (link + 1);
+        link->refs = (object->refcount == 0 || object->protect_delete
+                || object->immortal)
+            ? LONG_MAX : object->refcount;
+    }
+
+    for (link = Tracked.next; link != &Tracked; link = link->next) {
+        object = (Object*) (link + 1);
+        OBJECT_TYPE(object)->traverse(object, garbage_visit_decref, NULL);
+    }
+
+    link = Tracked.next;
+    while (link != &Tracked) {
+        if (link->refs > 0) {
+            object = (Object*) (link + 1);
+            OBJECT_TYPE(object)->traverse(object, garbage_visit_reachable, NULL);
+            next = link->next;
+        }
+        else {
+            next = link->next;
+            garbage_link_remove(link);
+            garbage_link_append(&unreachable, link);
+            link->refs = GARBAGE_UNREACHABLE;
+        }
+        link = next;
+    }
+
+    // Hold on to all the garbage while cleaning it up, so that nothing in
+    // it is released through DECREF while others still point to it
+    for (link = unreachable.next; link != &unreachable; link = link->next)
+        INCREF((Object*) (link + 1));
+
+    for (link = unreachable.next; link != &unreachable; link = link->next) {
+        object = (Object*) (link + 1);
+        if (OBJECT_TYPE(object)->cleanup)
+            OBJECT_TYPE(object)->cleanup(object);
+    }
+
+    while ((link = unreachable.next) != &unreachable) {
+        object = (Object*) (link + 1);
+        assert(object->refcount == 1);
+        garbage_link_remove(link);
+        object_free(object);
+        collected++;
+    }
+
+    LoxGarbage_Stats.tracked -= collected;
+    LoxGarbage_Stats.collected += collected;
+    LoxGarbage_Stats.collections++;
+    LoxGarbage_Stats.seconds += (double) (clock() - start) / CLOCKS_PER_SEC;
+
+    Pending = 0;
+    Threshold = LoxGarbage_Stats.tracked > GC_THRESHOLD
+        ? LoxGarbage_Stats.tracked : GC_THRESHOLD;
+    Collecting = false;
+
+    return collected;
+}
@@ -2,26 +2,36 @@
 #define GARBAGE_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
 #include "object.h"
 
-void garbage_collect(void);
-void garbage_mark(Object* object);
+// Collect reference cycles once this many more containers were allocated
+// than released since the last collection, or as many as survived it if that
+// is more. Objects with a `traverse` hook are containers.
+#ifndef GC_THRESHOLD
+#define GC_THRESHOLD 1000
+#endif
+
+typedef struct garbage_link {
+    struct garbage_link *next;
+    struct garbage_link *prev;
+    long                refs;           // References from outside while collecting
+} GarbageLink;
+
+#define GARBAGE_LINK(object) (((GarbageLink*) (object)) - 1)
 
-#define INCREF(object) ((Object*) (object))->refcount++
-#define DECREF(object) do { if (0 == --(((Object*) (object))->refcount)) garbage_mark((Object*) (object)); } while(0)
-// TODO: Trigger garbage collection if refcount==0
+typedef struct garbage_stats {
+    unsigned long       tracked;        // Containers alive
+    unsigned long       collections;    // Cycle collections run
+    unsigned long       collected;      // Containers freed by them
+    double              seconds;        // Processor time spent collecting
+} GarbageStats;
 
-typedef struct possibly_garbage {
-    Object                  *object;
-    bool                    inuse;
-    struct possibly_garbage *next;
-} PieceOfTrash;
+extern GarbageStats LoxGarbage_Stats;
 
-#define GARBAGE_HEAP_SIZE 32
-typedef struct garbage_heap {
-    PieceOfTrash            heap[GARBAGE_HEAP_SIZE];
-    unsigned                count;
-} GarbageHeap;
+void garbage_track(Object*);
+void garbage_untrack(Object*);
+unsigned long garbage_collect(void);
 
 #endif
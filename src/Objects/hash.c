@@ -5,7 +5,11 @@
 #include <limits.h>
 #include <string.h>
 #include <stdio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
+#include "Lib/builtin.h"
 #include "hash.h"
 #include "boolean.h"
 #include "integer.h"
@@ -16,134 +20,237 @@
 
 #include "Vendor/bdwgc/include/gc.h"
 
-#define hash_mangle(h) (((h >> 7) ^ (h << 9)) + h)
-
 static struct object_type HashType;
 
-// A quick hashtable implementation based on
-// https://gist.github.com/tonious/1377667
+// An open addressing table in the style of the SwissTable. Next to the
+// entries is an array of control bytes, one per slot, which is either
+// EMPTY, DELETED (a tombstone) or the low seven bits of a second hash of the
+// key in the slot. Lookups compare a group of sixteen control bytes at once
+// and only visit the entries whose control byte matches. The control bytes
+// of the first slots are cloned after the last one, so a group can always be
+// loaded from any slot without wrapping.
+
+#define HASH_GROUP_WIDTH    16
+#define HASH_MIN_SIZE       8
+#define HASH_CTRL_EMPTY     ((signed char) -128)
+#define HASH_CTRL_DELETED   ((signed char) -2)
+
+static inline signed char
+hash_h2(hashval_t hash) {
+    return (signed char) (((unsigned long long) hash * 0x9E3779B97F4A7C15ULL) >> 57);
+}
+
+static inline size_t
+hash_max_load(size_t size) {
+    return size - size / 8;
+}
+
+/* Bitmask of the slots in the group at `ctrl` with the control byte `value` */
+static inline unsigned
+hash_group_match(const signed char *ctrl, signed char value) {
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i*) ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(value), group));
+#else
+    unsigned i, mask = 0;
+    for (i = 0; i < HASH_GROUP_WIDTH; i++)
+        mask |= (ctrl[i] == value) << i;
+    return mask;
+#endif
+}
+
+/* Bitmask of the EMPTY and DELETED slots in the group at `ctrl` */
+static inline unsigned
+hash_group_match_available(const signed char *ctrl) {
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) ctrl));
+#else
+    unsigned i, mask = 0;
+    for (i = 0; i < HASH_GROUP_WIDTH; i++)
+        mask |= (ctrl[i] < 0) << i;
+    return mask;
+#endif
+}
+
+static inline void
+hash_set_ctrl(LoxTable *self, size_t slot, signed char value) {
+    size_t clone;
+
+    self->ctrl[slot] = value;
+    // Keep the clones after the end of the table (several times over if the
+    // table is smaller than a group)
+    for (clone = slot; clone < HASH_GROUP_WIDTH - 1; clone += self->size)
+        self->ctrl[self->size + clone] = value;
+}
+
+static int
+hash_alloc_table(LoxTable *self, size_t size) {
+    HashEntry *table = calloc(1, size * sizeof(HashEntry) + size + HASH_GROUP_WIDTH);
+    if (unlikely(table == NULL))
+        return errno;
+
+    self->table = table;
+    self->ctrl = (signed char*) (table + size);
+    memset(self->ctrl, HASH_CTRL_EMPTY, size + HASH_GROUP_WIDTH);
+    self->size = size;
+    self->size_mask = size - 1;
+    self->growth_left = hash_max_load(size) - self->count;
+
+    return 0;
+}
 
 /* Create a new hashtable. */
 LoxTable *Hash_newWithSize(size_t size) {
     LoxTable *hashtable = NULL;
 
-    // Check size is a power of 2, and at least 8
-    size_t newsize = 8;
-    while (newsize < size)
+    // Size is a power of 2, and at least 8, with room for `size` items
+    size_t newsize = HASH_MIN_SIZE;
+    while (hash_max_load(newsize) < size)
         newsize <<= 1;
 
     hashtable = object_new(sizeof(LoxTable), &HashType);
     if (unlikely(hashtable == NULL))
         return LoxNIL;
 
-    hashtable->table = calloc(newsize, sizeof(HashEntry));
-    if (unlikely(hashtable->table == NULL))
+    if (unlikely(0 != hash_alloc_table(hashtable, newsize)))
         return LoxNIL;
 
-    hashtable->size = newsize;
-    hashtable->size_mask = newsize - 1;
-
     return hashtable;
 }
 
 // My implementation as a table which will auto resize
 LoxTable *Hash_new(void) {
-    return Hash_newWithSize(8);
+    return Hash_newWithSize(0);
 }
 
 /* Hash a string for a particular hash table. */
 static hashval_t
 ht_hashval(Object *key) {
-    if (key->type->hash)
-        return key->type->hash(key);
+    if (OBJECT_TYPE(key)->hash)
+        return OBJECT_TYPE(key)->hash(key);
     else
         return (hashval_t) (void*) key;
 }
 
-static int
-hash_resize(LoxTable* self) {
-    unsigned newsize = 16;
+/*
+ * Find the first EMPTY or DELETED slot on the probe sequence of `hash`.
+ * Groups are probed triangularly, which visits all of them because the size
+ * is a power of two. There is always at least one EMPTY slot.
+ */
+static size_t
+hash_find_available(LoxTable *self, hashval_t hash) {
+    size_t pos = hash & self->size_mask, stride = 0;
+    unsigned match;
+
+    while (!(match = hash_group_match_available(self->ctrl + pos))) {
+        stride += HASH_GROUP_WIDTH;
+        pos = (pos + stride) & self->size_mask;
+    }
 
-    while (newsize <= self->size)
-        newsize <<= 1;
+    return (pos + __builtin_ctz(match)) & self->size_mask;
+}
 
-    HashEntry* table = calloc(newsize, sizeof(HashEntry));
-    if (unlikely(table == NULL))
-        return errno;
+/* Move all the entries to a new table of `newsize` slots, dropping the
+ * tombstones. */
+static int
+hash_resize(LoxTable* self, size_t newsize) {
+    HashEntry *table = self->table, *current;
+    signed char *ctrl = self->ctrl;
+    size_t i, slot, size = self->size;
+    int error;
+
+    if (unlikely(0 != (error = hash_alloc_table(self, newsize))))
+        return error;
 
     // Place all the keys in the new table
-    int slot, i;
-    size_t mask = newsize - 1;
-    hashval_t hash;
-    HashEntry *entry, *current;
-    for (current = self->table, i=self->size; i; current++, i--) {
-        if (current->key != NULL) {
-            hash = current->hash;
-            do {
-                // Find an empty slot
-                slot = hash & mask;
-                entry = table + slot;
-                hash = hash_mangle(hash);
-            }
-            while (hash && entry->key != NULL);
-            *entry = *current;
+    for (current = table, i = 0; i < size; current++, i++) {
+        if (ctrl[i] >= 0) {
+            slot = hash_find_available(self, current->hash);
+            hash_set_ctrl(self, slot, ctrl[i]);
+            self->table[slot] = *current;
         }
     }
 
-    free(self->table);
-    self->table = table;
-    self->size = newsize;
-    self->size_mask = mask;
-
+    free(table);
     return 0;
 }
 
 static Object* hash_asstring(Object*);
 
-/* Insert a key-value pair into a hash table. */
-static void
+static HashEntry*
+hash_lookup_fast(LoxTable* self, Object* key, hashval_t hash) {
+    size_t pos = hash & self->size_mask, stride = 0;
+    signed char h2 = hash_h2(hash);
+    unsigned match;
+    HashEntry *entry;
+
+    /* Step through the table a group at a time, looking for our value. */
+    for (;;) {
+        match = hash_group_match(self->ctrl + pos, h2);
+        while (match) {
+            entry = self->table + ((pos + __builtin_ctz(match)) & self->size_mask);
+            // Interned strings are found by identity without the compare
+            if (entry->hash == hash
+                && (entry->key == key
+                    || 0 == OBJECT_TYPE(entry->key)->compare(entry->key, key))
+            ) {
+                return entry;
+            }
+            match &= match - 1;
+        }
+
+        // The key would have been placed in an empty slot of this group
+        if (likely(hash_group_match(self->ctrl + pos, HASH_CTRL_EMPTY)))
+            return NULL;
+
+        stride += HASH_GROUP_WIDTH;
+        pos = (pos + stride) & self->size_mask;
+    }
+}
+
+/* Insert a key-value pair into a hash table. Returns the entry of the key. */
+static HashEntry*
 hash_set_fast(LoxTable *self, Object *key, Object *value, hashval_t hash) {
-    int slot;
     HashEntry *entry;
+    size_t slot, newsize;
 
-    // If the table is over half full, double the size
-    // TODO: Use a max_size property, set to about 80%
-    if (self->count >= self->size - 2) {
-        if (0 != hash_resize(self))
+    if ((entry = hash_lookup_fast(self, key, hash))) {
+        // There's something associated with this key. Let's replace it
+        INCREF(value);
+        DECREF(entry->value);
+        entry->value = value;
+        return entry;
+    }
+
+    slot = hash_find_available(self, hash);
+    if (unlikely(self->growth_left == 0 && self->ctrl[slot] == HASH_CTRL_EMPTY)) {
+        // Double the size if the table is mostly live entries. Otherwise drop
+        // the tombstones, and shrink the table if it is mostly empty. (Not
+        // when removing, which would move the entries under the iterators.)
+        if (self->count >= hash_max_load(self->size) / 2) {
+            newsize = self->size << 1;
+        }
+        else {
+            newsize = self->size;
+            while (newsize > HASH_MIN_SIZE && self->count < newsize / 4)
+                newsize >>= 1;
+        }
+
+        if (0 != hash_resize(self, newsize)) {
             // TODO: Raise error?
+            // There must be at least one empty slot or lookups for missing
+            // items would loop forever
             fprintf(stderr, "WARNING: Table resize failed\n");
-    }
-    // TODO: In case resize failed, check that there are at least two slots
-    // in the table. If there are not, then this insert should fail. There
-    // must be at least one empty slot or lookups for missing items would
-    // loop forever.
-
-    slot = hash & self->size_mask;
-    hashval_t slothash = hash;
-
-    entry = self->table + slot;
-    while (entry->key != NULL) {
-        if (hash == entry->hash
-            && 0 == entry->key->type->compare(entry->key, key)
-        ) {
-            // There's something associated with this key. Let's replace it
-            DECREF(entry->value);
-            INCREF(value);
-            entry->value = value;
-            return;
+            return NULL;
         }
-        slothash = hash_mangle(slothash);
-        slot = slothash & self->size_mask;
-        entry = self->table + slot;
+        slot = hash_find_available(self, hash);
     }
 
-    if (entry->hash) {
-        DECREF(entry->key);
-        DECREF(entry->value);
-        self->count--;
-    }
+    if (self->ctrl[slot] == HASH_CTRL_EMPTY)
+        self->growth_left--;
 
-    *entry = (HashEntry) {
+    hash_set_ctrl(self, slot, hash_h2(hash));
+    self->table[slot] = (HashEntry) {
         .value = value,
         .key = key,
         .hash = hash,
@@ -151,38 +258,17 @@ hash_set_fast(LoxTable *self, Object *key, Object *value, hashval_t hash) {
     INCREF(key);
     INCREF(value);
     self->count++;
+    return self->table + slot;
 }
 
 static void
 hash_set(Object *self, Object *key, Object *value) {
-    assert(self->type == &HashType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_HASH);
 
     hashval_t hash = 0;
     hash = ht_hashval(key);
 
-    return hash_set_fast((LoxTable*) self, key, value, hash);
-}
-
-static HashEntry*
-hash_lookup_fast(LoxTable* self, Object* key, hashval_t hash) {
-    int slot = hash & self->size_mask;
-    HashEntry *entry = self->table + slot;
-    hashval_t slothash = hash;
-
-    /* Step through the table, looking for our value. */
-    while (hash && entry->key != NULL) {
-        if (entry->hash == hash
-            && 0 == entry->key->type->compare(entry->key, key)
-        ) {
-            return entry;
-        }
-        slothash = hash_mangle(slothash);
-        slot = slothash & self->size_mask;
-        entry = self->table + slot;
-    }
-
-    /* Did we actually find anything? */
-    return NULL;
+    hash_set_fast((LoxTable*) self, key, value, hash);
 }
 
 static HashEntry*
@@ -193,7 +279,7 @@ hash_lookup(LoxTable *self, Object *key) {
 /* Retrieve a key-value pair from a hash table. */
 static Object*
 hash_get(Object *self, Object *key) {
-    assert(self->type == &HashType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_HASH);
     HashEntry *entry = hash_lookup((LoxTable*) self, key);
 
     if (entry == NULL)
@@ -205,7 +291,7 @@ hash_get(Object *self, Object *key) {
 
 static LoxBool*
 hash_contains(Object *self, Object *key) {
-    assert(self->type == &HashType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_HASH);
     HashEntry *entry = hash_lookup((LoxTable*) self, key);
     return (entry == NULL) ? LoxFALSE : LoxTRUE;
 }
@@ -213,7 +299,7 @@ hash_contains(Object *self, Object *key) {
 Object*
 Hash_getItem(LoxTable* self, Object* key) {
     assert(self);
-    assert(self->base.type == &HashType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_HASH);
 
     HashEntry *entry = hash_lookup((LoxTable*) self, key);
 
@@ -230,6 +316,12 @@ Hash_getItemEx(LoxTable* self, Object* key, hashval_t hash) {
     return NULL;
 }
 
+HashEntry*
+Hash_lookupEx(LoxTable* self, Object* key, hashval_t hash) {
+    assert(self);
+    return hash_lookup_fast(self, key, hash);
+}
+
 void
 Hash_setItem(LoxTable* self, Object* key, Object* value) {
     assert(self);
@@ -242,6 +334,13 @@ Hash_setItemEx(LoxTable* self, Object* key, Object* value, hashval_t hash) {
     hash_set_fast(self, key, value, hash);
 }
 
+/* Set an item like Hash_setItemEx, and return the entry it is kept in */
+HashEntry*
+Hash_storeEx(LoxTable* self, Object* key, Object* value, hashval_t hash) {
+    assert(self);
+    return hash_set_fast(self, key, value, hash);
+}
+
 bool
 Hash_contains(LoxTable* self, Object* key) {
     assert(self);
@@ -251,31 +350,64 @@ Hash_contains(LoxTable* self, Object* key) {
 
 int
 Hash_getSize(Object *self) {
-    assert(self->type == &HashType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_HASH);
     return ((LoxTable*)self)->count;
 }
 
+/*
+ * Whether the slot can be made EMPTY again rather than DELETED. That's the
+ * case if no group including the slot has been completely full, because no
+ * probe sequence could then have continued past it.
+ */
+static bool
+hash_was_never_full(LoxTable *self, size_t slot) {
+    unsigned before, after;
+
+    // Groups span the whole table
+    if (self->size <= HASH_GROUP_WIDTH)
+        return true;
+
+    before = hash_group_match(self->ctrl + ((slot - HASH_GROUP_WIDTH) & self->size_mask),
+        HASH_CTRL_EMPTY);
+    after = hash_group_match(self->ctrl + slot, HASH_CTRL_EMPTY);
+
+    return before && after
+        && (__builtin_clz(before) - (32 - HASH_GROUP_WIDTH)) + __builtin_ctz(after)
+            < HASH_GROUP_WIDTH;
+}
+
 static void
 hash_remove(Object* self, Object* key) {
-    assert(self->type == &HashType);
-    HashEntry *entry = hash_lookup((LoxTable*) self, key);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_HASH);
+    LoxTable *table = (LoxTable*) self;
+    HashEntry *entry = hash_lookup(table, key);
+    size_t slot;
 
     if (entry == NULL)
         // TODO: Raise error
         return;
 
-    ((LoxTable*) self)->count--;
+    table->count--;
 
     DECREF(entry->key);
     DECREF(entry->value);
     entry->key = NULL;
     entry->value = NULL;
+
+    slot = entry - table->table;
+    if (hash_was_never_full(table, slot)) {
+        hash_set_ctrl(table, slot, HASH_CTRL_EMPTY);
+        table->growth_left++;
+    }
+    else {
+        hash_set_ctrl(table, slot, HASH_CTRL_DELETED);
+    }
 }
 
 static Object*
 hash_len(Object* self) {
     assert(self != NULL);
-    assert(self->type == &HashType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_HASH);
 
     return (Object*) Integer_fromLongLong(((LoxTable*) self)->count);
 }
@@ -283,7 +415,7 @@ hash_len(Object* self) {
 static LoxBool*
 hash_asbool(Object* self) {
     assert(self != NULL);
-    assert(self->type == &HashType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_HASH);
 
     return ((LoxTable*) self)->count == 0 ? LoxFALSE : LoxTRUE;
 }
@@ -316,7 +448,7 @@ Hash_getIterator(LoxTable* self) {
 
 static Iterator*
 hash_iterate(Object *self) {
-    assert(self->type == &HashType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_HASH);
     return Hash_getIterator((LoxTable*) self);
 }
 
@@ -338,7 +470,7 @@ hash_values__next(Iterator* this) {
 
 static Object*
 hash_values(VmScope *state, Object *self, Object *args) {
-    assert(self->type == &HashType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_HASH);
     LoxTableIterator* it = (LoxTableIterator*) LoxIterator_create((Object*) self,
         sizeof(LoxTableIterator));
 
@@ -364,7 +496,7 @@ hash_keys__next(Iterator* this) {
 
 static Object*
 hash_keys(VmScope *state, Object *self, Object *args) {
-    assert(self->type == &HashType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_HASH);
     LoxTableIterator* it = (LoxTableIterator*) LoxIterator_create((Object*) self,
         sizeof(LoxTableIterator));
 
@@ -372,6 +504,20 @@ hash_keys(VmScope *state, Object *self, Object *args) {
     return (Object*) it;
 }
 
+static Object*
+hash_remove_key(VmScope *state, Object *self, Object *args) {
+    assert(OBJECT_TYPE_ID(self) == TYPEID_HASH);
+
+    Object *key;
+    Lox_ParseArgs(args, "O", &key);
+
+    if (hash_lookup((LoxTable*) self, key) == NULL)
+        return (Object*) LoxFALSE;
+
+    hash_remove(self, key);
+    return (Object*) LoxTRUE;
+}
+
 #define max(a,b) \
    ({ __typeof__ (a) _a = (a); \
        __typeof__ (b) _b = (b); \
@@ -379,7 +525,7 @@ hash_keys(VmScope *state, Object *self, Object *args) {
 
 static Object*
 hash_asstring(Object* self) {
-    assert(self->type == &HashType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_HASH);
 
     char buffer[2048];  // TODO: Use the + operator of LoxString
     char* position = buffer;
@@ -396,8 +542,8 @@ hash_asstring(Object* self) {
         assert(Tuple_isTuple(next));
         key = Tuple_getItem((LoxTuple*) next, 0);
         value = Tuple_getItem((LoxTuple*) next, 1);
-        skey = (LoxString*) key->type->as_string(key);
-        svalue = (LoxString*) value->type->as_string(value);
+        skey = (LoxString*) OBJECT_TYPE(key)->as_string(key);
+        svalue = (LoxString*) OBJECT_TYPE(value)->as_string(value);
         INCREF(skey);
         INCREF(svalue);
         bytes = snprintf(position, remaining, "%.*s: %.*s, ",
@@ -414,7 +560,7 @@ hash_asstring(Object* self) {
 
 static void
 hash_cleanup(Object *self) {
-    assert(self->type == &HashType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_HASH);
 
     LoxTable *this = (LoxTable*) self;
     HashEntry* table = this->table;
@@ -429,9 +575,24 @@ hash_cleanup(Object *self) {
     free(this->table);
 }
 
+static void
+hash_traverse(Object *self, ObjectVisitor visit, void *arg) {
+    assert(OBJECT_TYPE_ID(self) == TYPEID_HASH);
+
+    LoxTable *this = (LoxTable*) self;
+    HashEntry* table = this->table;
+    int p = this->size;
+    while (p--) {
+        if (table[p].key != NULL) {
+            visit(table[p].key, arg);
+            visit(table[p].value, arg);
+        }
+    }
+}
+
 static int
 hash_compare(Object *self, Object *other) {
-    if (other->type != &HashType)
+    if (OBJECT_TYPE_ID(other) != TYPEID_HASH)
         return -1;
 
     // All keys in this table are equivalent to the keys in the other.
@@ -446,11 +607,11 @@ hash_compare(Object *self, Object *other) {
         key = Tuple_getItem((LoxTuple*) next, 0);
         value = Tuple_getItem((LoxTuple*) next, 1);
         ovalue = Hash_getItem((LoxTable*) other, key);
-        if (ovalue == NULL || !value->type->compare) {
+        if (ovalue == NULL || !OBJECT_TYPE(value)->compare) {
             diff = -1;
             break;
         }
-        else if ((diff = value->type->compare(value, ovalue)) != 0) {
+        else if ((diff = OBJECT_TYPE(value)->compare(value, ovalue)) != 0) {
             break;
         }
     }
@@ -461,6 +622,7 @@ hash_compare(Object *self, Object *other) {
 
 static struct object_type HashType = (ObjectType) {
     .code = TYPE_HASH,
+    .id = TYPEID_HASH,
     .name = "hash",
 
     .len = hash_len,
@@ -474,10 +636,17 @@ static struct object_type HashType = (ObjectType) {
     .as_string = hash_asstring,
     .as_bool = hash_asbool,
     .cleanup = hash_cleanup,
+    .traverse = hash_traverse,
 
     .properties = (ObjectProperty[]) {
         {"values",  hash_values},
         {"keys",    hash_keys},
+        {"remove",  hash_remove_key},
         {0, 0},
     },
 };
+
+OBJECT_TYPES_STARTUP
+static void hash__register(void) {
+    LoxObject_registerType(&HashType);
+}
@@ -22,7 +22,9 @@ typedef struct hash_object {
     size_t  count;
     size_t  size;
     size_t  size_mask;
+    size_t  growth_left;        // Empty slots usable before a resize
     HashEntry *table;
+    signed char *ctrl;          // Control byte for each slot, after the table
 } LoxTable;
 
 typedef struct {
@@ -37,9 +39,11 @@ LoxTable* Hash_new(void);
 LoxTable* Hash_newWithSize(size_t);
 Object* Hash_getItem(LoxTable*, Object*);
 Object* Hash_getItemEx(LoxTable*, Object*, hashval_t);
+HashEntry* Hash_lookupEx(LoxTable*, Object*, hashval_t);
 bool Hash_contains(LoxTable*, Object*);
 void Hash_setItem(LoxTable*, Object*, Object*);
 void Hash_setItemEx(LoxTable*, Object*, Object*, hashval_t);
+HashEntry* Hash_storeEx(LoxTable*, Object*, Object*, hashval_t);
 Iterator* Hash_getIterator(LoxTable*);
 
 #endif
@@ -12,22 +12,22 @@ static struct object_type IntegerType;
 
 #define SMALL_INTS 16
 static LoxInteger SmallIntegers[SMALL_INTS] = {
-    [0] = (LoxInteger) { .value = 0, .base.protect_delete = true, .base.type = &IntegerType},
-    [1] = (LoxInteger) { .value = 1, .base.protect_delete = true, .base.type = &IntegerType },
-    [2] = (LoxInteger) { .value = 2, .base.protect_delete = true, .base.type = &IntegerType },
-    [3] = (LoxInteger) { .value = 3, .base.protect_delete = true, .base.type = &IntegerType },
-    [4] = (LoxInteger) { .value = 4, .base.protect_delete = true, .base.type = &IntegerType },
-    [5] = (LoxInteger) { .value = 5, .base.protect_delete = true, .base.type = &IntegerType },
-    [6] = (LoxInteger) { .value = 6, .base.protect_delete = true, .base.type = &IntegerType },
-    [7] = (LoxInteger) { .value = 7, .base.protect_delete = true, .base.type = &IntegerType },
-    [8] = (LoxInteger) { .value = 8, .base.protect_delete = true, .base.type = &IntegerType },
-    [9] = (LoxInteger) { .value = 9, .base.protect_delete = true, .base.type = &IntegerType },
-    [10] = (LoxInteger) { .value = 10, .base.protect_delete = true, .base.type = &IntegerType },
-    [11] = (LoxInteger) { .value = 11, .base.protect_delete = true, .base.type = &IntegerType },
-    [12] = (LoxInteger) { .value = 12, .base.protect_delete = true, .base.type = &IntegerType },
-    [13] = (LoxInteger) { .value = 13, .base.protect_delete = true, .base.type = &IntegerType },
-    [14] = (LoxInteger) { .value = 14, .base.protect_delete = true, .base.type = &IntegerType },
-    [15] = (LoxInteger) { .value = 15, .base.protect_delete = true, .base.type = &IntegerType },
+    [0] = (LoxInteger) { .value = 0, .base.immortal = true, .base.type_id = TYPEID_INTEGER},
+    [1] = (LoxInteger) { .value = 1, .base.immortal = true, .base.type_id = TYPEID_INTEGER },
+    [2] = (LoxInteger) { .value = 2, .base.immortal = true, .base.type_id = TYPEID_INTEGER },
+    [3] = (LoxInteger) { .value = 3, .base.immortal = true, .base.type_id = TYPEID_INTEGER },
+    [4] = (LoxInteger) { .value = 4, .base.immortal = true, .base.type_id = TYPEID_INTEGER },
+    [5] = (LoxInteger) { .value = 5, .base.immortal = true, .base.type_id = TYPEID_INTEGER },
+    [6] = (LoxInteger) { .value = 6, .base.immortal = true, .base.type_id = TYPEID_INTEGER },
+    [7] = (LoxInteger) { .value = 7, .base.immortal = true, .base.type_id = TYPEID_INTEGER },
+    [8] = (LoxInteger) { .value = 8, .base.immortal = true, .base.type_id = TYPEID_INTEGER },
+    [9] = (LoxInteger) { .value = 9, .base.immortal = true, .base.type_id = TYPEID_INTEGER },
+    [10] = (LoxInteger) { .value = 10, .base.immortal = true, .base.type_id = TYPEID_INTEGER },
+    [11] = (LoxInteger) { .value = 11, .base.immortal = true, .base.type_id = TYPEID_INTEGER },
+    [12] = (LoxInteger) { .value = 12, .base.immortal = true, .base.type_id = TYPEID_INTEGER },
+    [13] = (LoxInteger) { .value = 13, .base.immortal = true, .base.type_id = TYPEID_INTEGER },
+    [14] = (LoxInteger) { .value = 14, .base.immortal = true, .base.type_id = TYPEID_INTEGER },
+    [15] = (LoxInteger) { .value = 15, .base.immortal = true, .base.type_id = TYPEID_INTEGER },
 };
 
 LoxInteger*
@@ -43,16 +43,16 @@ Integer_fromLongLong(long long value) {
 
 long long
 Integer_toInt(Object* value) {
-    assert(value->type);
+    assert(OBJECT_TYPE(value));
 
-    if (value->type != &IntegerType) {
-        if (!value->type->as_int) {
+    if (OBJECT_TYPE_ID(value) != TYPEID_INTEGER) {
+        if (!OBJECT_TYPE(value)->as_int) {
             // TODO: Raise error
         }
-        value = value->type->as_int(value);
+        value = OBJECT_TYPE(value)->as_int(value);
     }
 
-    assert(value->type == &IntegerType);
+    assert(OBJECT_TYPE_ID(value) == TYPEID_INTEGER);
 
     return ((LoxInteger*) value)->value;
 }
@@ -60,25 +60,25 @@ Integer_toInt(Object* value) {
 bool
 Integer_isInteger(Object *value) {
     assert(value);
-    return value->type == &IntegerType;
+    return OBJECT_TYPE_ID(value) == TYPEID_INTEGER;
 }
 
 Object*
 Integer_fromObject(Object* value) {
-    assert(value->type);
+    assert(OBJECT_TYPE(value));
 
-    if (!value->type->as_int) {
-        fprintf(stderr, "Warning: Cannot coerce type `%s` to int\n", value->type->name);
+    if (!OBJECT_TYPE(value)->as_int) {
+        fprintf(stderr, "Warning: Cannot coerce type `%s` to int\n", OBJECT_TYPE(value)->name);
         return LoxUndefined;
     }
 
-    return value->type->as_int(value);
+    return OBJECT_TYPE(value)->as_int(value);
 }
 
 static hashval_t
 integer_hash(Object* self) {
     assert(self != NULL);
-    assert(self->type == &IntegerType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_INTEGER);
 
     LoxInteger* S = (LoxInteger*) self;
     return (int) (S->value >> 32) ^ (S->value & 0xffffffff);
@@ -92,7 +92,7 @@ integer_asint(Object* self) {
 static struct object*
 integer_asfloat(Object* self) {
     assert(self != NULL);
-    assert(self->type == &IntegerType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_INTEGER);
 
     return (Object*) Float_fromLongLong(((LoxInteger*) self)->value);
 }
@@ -100,7 +100,7 @@ integer_asfloat(Object* self) {
 static Object*
 integer_asstring(Object* self) {
     assert(self != NULL);
-    assert(self->type == &IntegerType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_INTEGER);
 
     char buffer[32];
     int length;
@@ -112,31 +112,31 @@ integer_asstring(Object* self) {
 static LoxBool*
 integer_asbool(Object* self) {
     assert(self != NULL);
-    assert(self->type == &IntegerType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_INTEGER);
 
     return ((LoxInteger*) self)->value == 0 ? LoxFALSE : LoxTRUE;
 }
 
 static inline Object*
 coerce_integer(Object* value) {
-    if (value->type != &IntegerType) {
-       if (value->type->as_int == NULL) {
-           fprintf(stderr, "Warning: Cannot coerce type `%s` to float\n", value->type->name);
+    if (OBJECT_TYPE_ID(value) != TYPEID_INTEGER) {
+       if (OBJECT_TYPE(value)->as_int == NULL) {
+           fprintf(stderr, "Warning: Cannot coerce type `%s` to float\n", OBJECT_TYPE(value)->name);
            return LoxUndefined;
        }
-       value = value->type->as_int(value);
+       value = OBJECT_TYPE(value)->as_int(value);
    }
    return value;
 }
 
 static struct object*
 integer_op_plus(Object* self, Object* other) {
-    assert(self->type == &IntegerType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_INTEGER);
 
     // Promote floating point operations
-    if (other->type != &IntegerType) {
-        if (other->type->code == TYPE_FLOAT) {
-            return other->type->op_plus(other, self);
+    if (OBJECT_TYPE_ID(other) != TYPEID_INTEGER) {
+        if (OBJECT_TYPE(other)->code == TYPE_FLOAT) {
+            return OBJECT_TYPE(other)->op_plus(other, self);
         }
         // Else coerce to integer
         else other = coerce_integer(other);
@@ -147,13 +147,13 @@ integer_op_plus(Object* self, Object* other) {
 
 static struct object*
 integer_op_minus(Object* self, Object* other) {
-    assert(self->type == &IntegerType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_INTEGER);
 
     // Promote floating point operations
-    if (other->type != &IntegerType) {
-        if (other->type->code == TYPE_FLOAT) {
-            Object *F = self->type->as_float(self);
-            return F->type->op_minus(F, other);
+    if (OBJECT_TYPE_ID(other) != TYPEID_INTEGER) {
+        if (OBJECT_TYPE(other)->code == TYPE_FLOAT) {
+            Object *F = OBJECT_TYPE(self)->as_float(self);
+            return OBJECT_TYPE(F)->op_minus(F, other);
         }
         // Else coerce to integer
         else other = coerce_integer(other);
@@ -164,7 +164,7 @@ integer_op_minus(Object* self, Object* other) {
 
 static struct object*
 integer_op_mod(Object* self, Object* other) {
-    assert(self->type == &IntegerType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_INTEGER);
 
     other = coerce_integer(other);
     return (Object*) Integer_fromLongLong(((LoxInteger*) self)->value % ((LoxInteger*) other)->value);
@@ -172,7 +172,7 @@ integer_op_mod(Object* self, Object* other) {
 
 static struct object*
 integer_op_lshift(Object* self, Object* other) {
-    assert(self->type == &IntegerType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_INTEGER);
 
     other = coerce_integer(other);
     return (Object*) Integer_fromLongLong(((LoxInteger*) self)->value << ((LoxInteger*) other)->value);
@@ -180,7 +180,7 @@ integer_op_lshift(Object* self, Object* other) {
 
 static struct object*
 integer_op_rshift(Object* self, Object* other) {
-    assert(self->type == &IntegerType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_INTEGER);
 
     other = coerce_integer(other);
     return (Object*) Integer_fromLongLong(((LoxInteger*) self)->value >> ((LoxInteger*) other)->value);
@@ -188,7 +188,7 @@ integer_op_rshift(Object* self, Object* other) {
 
 static struct object*
 integer_op_band(Object* self, Object* other) {
-    assert(self->type == &IntegerType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_INTEGER);
 
     other = coerce_integer(other);
     return (Object*) Integer_fromLongLong(((LoxInteger*) self)->value & ((LoxInteger*) other)->value);
@@ -196,7 +196,7 @@ integer_op_band(Object* self, Object* other) {
 
 static struct object*
 integer_op_bor(Object* self, Object* other) {
-    assert(self->type == &IntegerType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_INTEGER);
 
     other = coerce_integer(other);
     return (Object*) Integer_fromLongLong(((LoxInteger*) self)->value | ((LoxInteger*) other)->value);
@@ -204,19 +204,19 @@ integer_op_bor(Object* self, Object* other) {
 
 static struct object*
 integer_op_neg(Object* self) {
-    assert(self->type == &IntegerType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_INTEGER);
 
     return (Object*) Integer_fromLongLong(- ((LoxInteger*) self)->value);
 }
 
 static struct object*
 integer_op_multiply(Object* self, Object* other) {
-    assert(self->type == &IntegerType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_INTEGER);
 
     // Promote floating point operations
-    if (other->type != &IntegerType) {
-        if (other->type->code == TYPE_FLOAT) {
-            return other->type->op_star(other, self);
+    if (OBJECT_TYPE_ID(other) != TYPEID_INTEGER) {
+        if (OBJECT_TYPE(other)->code == TYPE_FLOAT) {
+            return OBJECT_TYPE(other)->op_star(other, self);
         }
         // Else coerce to integer
         else other = coerce_integer(other);
@@ -226,13 +226,13 @@ integer_op_multiply(Object* self, Object* other) {
 
 static struct object*
 integer_op_divide(Object* self, Object* other) {
-    assert(self->type == &IntegerType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_INTEGER);
 
     // Promote floating point operations
-    if (other->type != &IntegerType) {
-        if (other->type->code == TYPE_FLOAT) {
-            LoxFloat *F = (LoxFloat*) self->type->as_float(self);
-            return F->base.type->op_slash((Object*) F, other);
+    if (OBJECT_TYPE_ID(other) != TYPEID_INTEGER) {
+        if (OBJECT_TYPE(other)->code == TYPE_FLOAT) {
+            LoxFloat *F = (LoxFloat*) OBJECT_TYPE(self)->as_float(self);
+            return OBJECT_TYPE(F)->op_slash((Object*) F, other);
         }
         // Else coerce to integer
         else other = coerce_integer(other);
@@ -245,14 +245,16 @@ integer_compare(Object *self, Object *other) {
     if (!(other = coerce_integer(other)))
         return -1;
 
-    return ((LoxInteger*) self)->value - ((LoxInteger*) other)->value;
+    // The difference of the values may not fit in an int
+    long long a = ((LoxInteger*) self)->value, b = ((LoxInteger*) other)->value;
+    return (a > b) - (a < b);
 }
 
 
 static struct object_type IntegerType = (ObjectType) {
     .code = TYPE_INTEGER,
+    .id = TYPEID_INTEGER,
     .name = "int",
-    .features = FEATURE_STASH,
     .hash = integer_hash,
 
     // coercion
@@ -276,3 +278,8 @@ static struct object_type IntegerType = (ObjectType) {
     // comparison
     .compare = integer_compare,
 };
+
+OBJECT_TYPES_STARTUP
+static void integer__register(void) {
+    LoxObject_registerType(&IntegerType);
+}
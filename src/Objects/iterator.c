@@ -20,7 +20,7 @@ LoxIterator_create(Object *target, size_t sizeof_derived_type) {
 Object*
 iterator_next(VmScope *state, Object *self, Object *args) {
     assert(self);
-    assert(self->type == &IteratorType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_ITERATOR);
     
     Iterator *this = (Iterator*) self;
     return this->next(this);
@@ -29,7 +29,7 @@ iterator_next(VmScope *state, Object *self, Object *args) {
 static void
 iterator_cleanup(Object *self) {
     assert(self);
-    assert(self->type == &IteratorType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_ITERATOR);
 
     Iterator *this = (Iterator*) self;
 
@@ -38,20 +38,29 @@ iterator_cleanup(Object *self) {
         this->cleanup(self);
 }
 
+static void
+iterator_traverse(Object *self, ObjectVisitor visit, void *arg) {
+    assert(OBJECT_TYPE_ID(self) == TYPEID_ITERATOR);
+
+    visit(((Iterator*) self)->target, arg);
+}
+
 static Iterator*
 iterator_iterate(Object *self) {
     assert(self);
-    assert(self->type == &IteratorType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_ITERATOR);
 
     return (Iterator*) self;
 }
 
 static struct object_type IteratorType = (ObjectType) {
     .code = TYPE_ITERATOR,
+    .id = TYPEID_ITERATOR,
     .name = "iterator",
     .hash = MYADDRESS,
     .compare = IDENTITY,
     .cleanup = iterator_cleanup,
+    .traverse = iterator_traverse,
     .iterate = iterator_iterate,
     
     .properties = (ObjectProperty[]) {
@@ -67,6 +76,7 @@ iterstop_asstring(Object* self) {
 
 static struct object_type StopIterationType = (ObjectType) {
     .code = TYPE_UNDEFINED,
+    .id = TYPEID_STOP_ITERATION,
     .name = "stop-iteration",
 
     .as_string = iterstop_asstring,
@@ -76,8 +86,14 @@ static struct object_type StopIterationType = (ObjectType) {
     .cleanup = ERROR,
 };
 
+OBJECT_TYPES_STARTUP
+static void iterator__register(void) {
+    LoxObject_registerType(&IteratorType);
+    LoxObject_registerType(&StopIterationType);
+}
+
 static Object _LoxStopIteration = (Object) {
-    .type = &StopIterationType,
-    .refcount = 1,
+    .type_id = TYPEID_STOP_ITERATION,
+    .immortal = true,
 };
 Object *LoxStopIteration = &_LoxStopIteration;
\ No newline at end of file
@@ -57,12 +57,12 @@ LoxList_append(LoxList *self, Object *item) {
 
 void
 LoxList_extend(LoxList *self, Object *object) {
-    if (!object->type->iterate) {
+    if (!OBJECT_TYPE(object)->iterate) {
         fprintf(stderr, "WARNING: Item to extend list must be iterable.\n");
         return;
     }
 
-    Iterator *items = object->type->iterate(object);
+    Iterator *items = OBJECT_TYPE(object)->iterate(object);
     Object *item;
     while (LoxStopIteration != (item = items->next(items))) {
         LoxList_append(self, item);
@@ -175,7 +175,10 @@ LoxList_setItem(LoxList *self, int index, Object* item) {
         end = end->next;
     }
 
-    *(end->items + index - end->offset) = item;
+    Object **slot = end->items + index - end->offset;
+    INCREF(item);
+    DECREF(*slot);
+    *slot = item;
 }
 
 static Object*
@@ -205,7 +208,7 @@ LoxList_getIterator(LoxList* self) {
 
 static void
 list_cleanup(Object *self) {
-    assert(self->type == &ListType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_LIST);
     LoxList *this = (LoxList*) self;
 
     ListBucket *end = this->buckets, *T;
@@ -222,6 +225,19 @@ list_cleanup(Object *self) {
     }
 }
 
+static void
+list_traverse(Object *self, ObjectVisitor visit, void *arg) {
+    assert(OBJECT_TYPE_ID(self) == TYPEID_LIST);
+
+    ListBucket *bucket = ((LoxList*) self)->buckets;
+    int i;
+    while (bucket) {
+        for (i = 0; i < bucket->count; i++)
+            visit(bucket->items[i], arg);
+        bucket = bucket->next;
+    }
+}
+
 int
 LoxList_getLength(LoxList *self) {
     return ((LoxList*) self)->count;
@@ -229,7 +245,7 @@ LoxList_getLength(LoxList *self) {
 
 static Object*
 list_len(Object *self) {
-    assert(self->type == &ListType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_LIST);
     LoxList *this = (LoxList*) self;
 
     return (Object*) Integer_fromLongLong(this->count);
@@ -237,7 +253,7 @@ list_len(Object *self) {
 
 static Object*
 list_getitem(Object *self, Object *index) {
-    assert(self->type == &ListType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_LIST);
     LoxList *this = (LoxList*) self;
 
     if (!Integer_isInteger(index))
@@ -248,7 +264,7 @@ list_getitem(Object *self, Object *index) {
 
 static void
 list_setitem(Object *self, Object *index, Object *value) {
-    assert(self->type == &ListType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_LIST);
     LoxList *this = (LoxList*) self;
 
     if (!Integer_isInteger(index))
@@ -260,7 +276,7 @@ list_setitem(Object *self, Object *index, Object *value) {
 static Object*
 list_append(VmScope *state, Object *self, Object *args) {
     assert(self);
-    assert(self->type == &ListType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_LIST);
 
     Object *object;
     Lox_ParseArgs(args, "O", &object);
@@ -272,7 +288,7 @@ list_append(VmScope *state, Object *self, Object *args) {
 static Object*
 list_extend(VmScope *state, Object *self, Object *args) {
     assert(self);
-    assert(self->type == &ListType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_LIST);
 
     Object *object;
     Lox_ParseArgs(args, "O", &object);
@@ -283,7 +299,7 @@ list_extend(VmScope *state, Object *self, Object *args) {
 
 static Object*
 list_pop(VmScope *state, Object *self, Object *args) {
-    assert(self->type == &ListType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_LIST);
 
     if (Tuple_getSize(args) == 0)
         return LoxList_pop((LoxList*) self);
@@ -297,14 +313,14 @@ list_pop(VmScope *state, Object *self, Object *args) {
 static Iterator*
 list_iterate(Object *self) {
     assert(self);
-    assert(self->type == &ListType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_LIST);
 
     return LoxList_getIterator((LoxList*) self);
 }
 
 static Object*
 list_asstring(Object* self) {
-    assert(self->type == &ListType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_LIST);
 
     char buffer[1024];  // TODO: Use the + operator of LoxString
     char* position = buffer;
@@ -342,9 +358,9 @@ list_asstring(Object* self) {
 
 static LoxBool*
 list_contains(Object* self, Object *object) {
-    assert(self->type = &ListType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_LIST);
 
-    if (!object->type->compare)
+    if (!OBJECT_TYPE(object)->compare)
         return LoxUndefined;
 
     Iterator *iter = LoxList_getIterator((LoxList*) self);
@@ -353,7 +369,7 @@ list_contains(Object* self, Object *object) {
 
     while (LoxStopIteration != (item = iter->next(iter))) {
         INCREF(item);
-        if (0 == object->type->compare(object, item)) {
+        if (0 == OBJECT_TYPE(object)->compare(object, item)) {
             DECREF(item);
             rv = LoxTRUE;
             break;
@@ -367,12 +383,12 @@ list_contains(Object* self, Object *object) {
 
 static int object_type_compare(const void *left, const void *right) {
     Object *lhs = *(Object**) left, *rhs = *(Object**) right;
-    return lhs->type->compare(lhs, rhs);
+    return OBJECT_TYPE(lhs)->compare(lhs, rhs);
 }
 
 static Object*
 list_sort(VmScope *state, Object *self, Object *args) {
-    assert(self->type == &ListType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_LIST);
 
     // If the list fits in one bucket, then just sort that bucket.
     // Otherwise, allocate a new bucket big enough for all the buckets and move
@@ -411,6 +427,7 @@ list_sort(VmScope *state, Object *self, Object *args) {
 
 
 static struct object_type ListType = (ObjectType) {
+    .id = TYPEID_LIST,
     .name = "list",
     .len = list_len,
     .get_item = list_getitem,
@@ -420,6 +437,7 @@ static struct object_type ListType = (ObjectType) {
 
     .as_string = list_asstring,
     .cleanup = list_cleanup,
+    .traverse = list_traverse,
 
     .properties = (ObjectProperty[]) {
         { "append", list_append },
@@ -428,4 +446,9 @@ static struct object_type ListType = (ObjectType) {
         { "pop",    list_pop },
         { 0, 0 },
     },
-};
\ No newline at end of file
+};
+
+OBJECT_TYPES_STARTUP
+static void list__register(void) {
+    LoxObject_registerType(&ListType);
+}
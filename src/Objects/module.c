@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include "Compile/vm.h"
+#include "Compile/cache.h"
 
 #include "boolean.h"
 #include "function.h"
@@ -18,7 +19,7 @@ static struct object_type ModuleType;
 Object*
 Module_init(ModuleDescription* desc) {
     LoxModule* self = object_new(sizeof(LoxModule), &ModuleType);
-    self->name = (Object*) String_fromCharsAndSize(desc->name, strlen(desc->name));
+    self->name = (Object*) String_intern(desc->name, strlen(desc->name));
     INCREF(self->name);
     self->properties = Hash_new();
     INCREF(self->properties);
@@ -35,7 +36,7 @@ LoxModule_buildProperties(ObjectProperty *properties, LoxTable *table) {
     ObjectProperty* M = properties;
 
     while (M->name) {
-        name = String_fromCharsAndSize(M->name, strlen(M->name));
+        name = String_intern(M->name, strlen(M->name));
         if (M->type == OBJECT_PROP_TYPE_METHOD) {
             value = (Object*) NativeFunction_new(M->method);
         }
@@ -51,7 +52,7 @@ LoxModule_buildProperties(ObjectProperty *properties, LoxTable *table) {
 
 static Object*
 module_getitem(Object* self, Object* name) {
-    assert(self->type == &ModuleType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_MODULE);
 
     LoxModule* module = (LoxModule*) self;
     Object *value = Hash_getItem(module->properties, name);
@@ -65,28 +66,37 @@ module_getitem(Object* self, Object* name) {
 
 static LoxBool*
 module_contains(Object* self, Object* name) {
-    assert(self->type == &ModuleType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_MODULE);
 
     LoxModule* module = (LoxModule*) self;
     return Bool_fromBool(Hash_contains(module->properties, name));
 }
 
 static struct object_type ModuleType = (ObjectType) {
+    .id = TYPEID_MODULE,
     .name = "module",
     
     .get_item = module_getitem,
     .contains = module_contains,
 };
 
+OBJECT_TYPES_STARTUP
+static void module__register(void) {
+    LoxObject_registerType(&ModuleType);
+}
+
 // Utility API functions
 static LoxTable*
-import_file(FILE *text, const char *name) {
+import_file(FILE *text, const char *path, const char *name) {
+    // Compile the module, or load it from the bytecode cache next to it
+    CodeContext *code = LoxCache_compileFile(text, path, name);
+
     // Now, eval the compiled code in a new context to capture the defined "globals"
     LoxTable *globals = Hash_new();
     VmScope scope = (VmScope) {
         .globals = globals,
     };
-    LoxVM_evalFileWithScope(text, name, &scope);
+    LoxVM_evalCodeWithScope(code, &scope);
 
     // TODO: Place the module in a global scope as a cache
 
@@ -95,7 +105,7 @@ import_file(FILE *text, const char *name) {
 
 bool
 LoxModule_isModule(Object *object) {
-   return object->type == &ModuleType;
+   return OBJECT_TYPE_ID(object) == TYPEID_MODULE;
 }
 
 Object*
@@ -106,12 +116,12 @@ LoxModule_ImportFile(const char *absolute_path, const char *name) {
         return NULL;
     }
 
-    LoxTable *properties = import_file(text, name);
+    LoxTable *properties = import_file(text, absolute_path, name);
     fclose(text);
 
     // TODO: Create bonafide Module object
     LoxModule* module = object_new(sizeof(LoxModule), &ModuleType);
-    module->name = (Object*) String_fromCharsAndSize(name, strlen(name));
+    module->name = (Object*) String_intern(name, strlen(name));
     INCREF(module->name);
     module->properties = properties;
 
@@ -122,8 +132,8 @@ Object*
 LoxModule_ImportFileWithSearchPath(const char * module_name, Object * search) {
     char abs_path[256]; // XXX: Lookup max_path
     Object *module = NULL;
-    if (search->type->iterate) {
-        Iterator *it = search->type->iterate(search);
+    if (OBJECT_TYPE(search)->iterate) {
+        Iterator *it = OBJECT_TYPE(search)->iterate(search);
         Object *prefix;
         LoxString *S;
         while (LoxStopIteration != (prefix = it->next(it))) {
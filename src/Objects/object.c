@@ -4,89 +4,64 @@
 
 #include "object.h"
 #include "function.h"
+#include "garbage.h"
+#include "slab.h"
 #include "string.h"
 #include "Vendor/bdwgc/include/gc.h"
 
+ObjectType* LoxObject_Types[__TYPEID_MAX];
+
+void
+LoxObject_registerType(ObjectType* type) {
+    assert(type->id > TYPEID_NONE && type->id < __TYPEID_MAX);
+    assert(LoxObject_Types[type->id] == NULL || LoxObject_Types[type->id] == type);
+
+    LoxObject_Types[type->id] = type;
+}
+
 static void
 object_finalize(GC_PTR object, GC_PTR client_data) {
     Object* self = (Object*) object;
-    assert(self->type != NULL);
-    assert(self->type->cleanup != NULL);
+    assert(OBJECT_TYPE(self) != NULL);
+    assert(OBJECT_TYPE(self)->cleanup != NULL);
 
-    self->type->cleanup(self);
+    OBJECT_TYPE(self)->cleanup(self);
 }
 
-typedef struct stash_heap {
-    Object             *target;
-    struct stash_heap *next;
-} StashHeapEntry;
-
-static StashHeapEntry* StashHead = NULL;
-static StashHeapEntry* StashAvailable = NULL;
-static StashHeapEntry stash[32] = { { 0 } };
-
 void*
 object_new(size_t size, ObjectType* type) {
-    if (unlikely(type->features & FEATURE_STASH)) {
-        StashHeapEntry *entry = StashHead, *prev = NULL;
-        while (entry) {
-            if (entry->target->type == type) {
-                if (prev)
-                    prev->next = entry->next;
-                else if (StashHead == entry)
-                    StashHead = entry->next;
-                entry->next = StashAvailable;
-                StashAvailable = entry;
-                return entry->target;
-            }
-            prev = entry;
-            entry = entry->next;
-        }
+    // Containers are allocated with a link in front, which keeps them on the
+    // list the cycle collector walks
+    size_t link = type->traverse ? sizeof(GarbageLink) : 0;
+    char* block = NULL;
+    enum object_heap heap = OBJECT_HEAP_SYSTEM;
+
+    if (size + link <= SLAB_MAX_OBJECT
+        && (block = slab_alloc(size + link))
+    ) {
+        heap = OBJECT_HEAP_SLAB;
+    }
+    else {
+        block = calloc(1, size + link);
     }
 
-    Object* result = (void*) calloc(1, size);
-
-    if (unlikely(result == NULL)) {
+    if (unlikely(block == NULL)) {
         // TODO: Trigger error
     }
 
+    Object* result = (Object*) (block + link);
+    assert(LoxObject_Types[type->id] == type);
     *result = (Object) {
-        .type = type,
+        .type_id = type->id,
+        .heap = heap,
+        .tracked = link != 0,
         .refcount = 0,
     };
 
-    return (void*) result;
-}
-
-static bool
-object_trystash(Object* self) {
-    static bool initialized = false;
-    StashHeapEntry *entry;
-
-    if (unlikely(!initialized)) {
-        int i;
-        entry = &stash[0];
-        for (i = 0; i < 32; i++) {
-            entry->next = StashAvailable;
-            StashAvailable = entry;
-            entry++;
-        }
-        initialized = true;
-    }
+    if (link)
+        garbage_track(result);
 
-    entry = StashAvailable;
-    if (entry) {
-        StashAvailable = entry->next;
-        *entry = (StashHeapEntry) {
-            .next = StashHead,
-            .target = self,
-        };
-        StashHead = entry;
-        return true;
-    }
-   
-    // otherwise drop oldest entry?
-    return false;
+    return (void*) result;
 }
 
 void
@@ -94,21 +69,47 @@ LoxObject_Cleanup(Object* self) {
     if (unlikely(self->protect_delete))
         return;
 
-    if (self->type->cleanup != NULL)
-        self->type->cleanup(self);
+    if (self->tracked)
+        garbage_untrack(self);
 
-    if (unlikely(self->type->features & FEATURE_STASH))
-        if (object_trystash(self))
-            return;
+    if (OBJECT_TYPE(self)->cleanup != NULL)
+        OBJECT_TYPE(self)->cleanup(self);
 
-    free(self);
+    object_free(self);
+}
+
+/**
+ * Make the object live for the rest of the run. Its reference count is no
+ * longer kept and it is never cleaned up. The cycle collector treats it as a
+ * root, as anything it refers to is alive, too.
+ */
+void
+LoxObject_Immortalize(Object* self) {
+    self->immortal = true;
+}
+
+/**
+ * Release the memory of an object after its cleanup, back to where object_new
+ * allocated it from.
+ */
+void
+object_free(Object* self) {
+    void *block = self->tracked ? (void*) GARBAGE_LINK(self) : (void*) self;
+
+    switch (self->heap) {
+    case OBJECT_HEAP_SLAB:
+        slab_free(block);
+        break;
+    default:
+        free(block);
+    }
 }
 
 static LoxTable*
 object_setup_props(Object *self) {
     LoxTable *methods;
-    unsigned count;
-    ObjectProperty* method = self->type->properties;
+    unsigned count = 0;
+    ObjectProperty* method = OBJECT_TYPE(self)->properties;
     Object *value;
 
     while (method && method->name) {
@@ -116,9 +117,9 @@ object_setup_props(Object *self) {
         method++;
     }
 
-    self->type->_methodTable = methods = Hash_newWithSize(count);
+    OBJECT_TYPE(self)->_methodTable = methods = Hash_newWithSize(count);
     INCREF((Object*) methods);
-    method = self->type->properties;
+    method = OBJECT_TYPE(self)->properties;
     while (method && method->name) {
         if (method->type == OBJECT_PROP_TYPE_METHOD) {
             value = NativeFunction_new(method->method);
@@ -142,27 +143,44 @@ Object*
 object_getattr(Object* self, Object *name, hashval_t hash) {
     assert(self);
 
-    if (self->type->getattr)
-        return self->type->getattr(self, name, hash);
+    if (OBJECT_TYPE(self)->getattr)
+        return OBJECT_TYPE(self)->getattr(self, name, hash);
 
-    // Build a HashTable for faster access to methods
-    if (self->type->properties) {
-        LoxTable *methods = self->type->_methodTable;
-        if (!methods)
-            methods = object_setup_props(self);
-
-        assert(String_isString(name));
-
-        Object *result;
-        if (NULL != (result = Hash_getItemEx(methods, name, hash))) {
-            if (LoxNativeProperty_isProperty(result))
-                result = ((LoxNativeProperty*) result)->getter;
-            if (Function_isNativeFunction(result))
-                result = NativeFunction_bind(result, self);
-        }
+    if (OBJECT_TYPE(self)->properties) {
+        Object *result = object_getmethod(self, name, hash);
+        if (result && Function_isNativeFunction(result))
+            result = NativeFunction_bind(result, self);
 
         return result ? result : LoxUndefined;
     }
 
     return LoxUndefined;
+}
+
+/**
+ * Look up an attribute of a native type from its `properties` without
+ * binding it to `self`. Properties resolve to their getter. Returns NULL if
+ * the type has no such attribute.
+ */
+Object*
+object_getmethod(Object* self, Object *name, hashval_t hash) {
+    assert(self);
+
+    if (!OBJECT_TYPE(self)->properties)
+        return NULL;
+
+    // Build a HashTable for faster access to methods
+    LoxTable *methods = OBJECT_TYPE(self)->_methodTable;
+    if (!methods)
+        methods = object_setup_props(self);
+
+    assert(String_isString(name));
+
+    Object *result;
+    if (NULL != (result = Hash_getItemEx(methods, name, hash))) {
+        if (LoxNativeProperty_isProperty(result))
+            result = ((LoxNativeProperty*) result)->getter;
+    }
+
+    return result;
 }
\ No newline at end of file
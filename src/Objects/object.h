@@ -21,11 +21,47 @@ enum base_type {
     TYPE_ITERATOR,
 };
 
-enum object_type_feature {
-    FEATURE_STASH =     1<<0,
+// Index of each type in LoxObject_Types. The object header keeps the index
+// rather than a pointer to the type, which fits the header in a word.
+enum object_type_id {
+    TYPEID_NONE=0,
+    TYPEID_BOOL,
+    TYPEID_NIL,
+    TYPEID_UNDEFINED,
+    TYPEID_STOP_ITERATION,
+    TYPEID_INTEGER,
+    TYPEID_FLOAT,
+    TYPEID_STRING,
+    TYPEID_STRINGTREE,
+    TYPEID_TUPLE,
+    TYPEID_LIST,
+    TYPEID_HASH,
+    TYPEID_RANGE,
+    TYPEID_INT_RANGE,
+    TYPEID_ITERATOR,
+    TYPEID_FUNCTION,
+    TYPEID_NATIVE_FUNCTION,
+    TYPEID_NATIVE_PROPERTY,
+    TYPEID_VMCODE,
+    TYPEID_VMFUNCTION,
+    TYPEID_CELL,
+    TYPEID_CLASS,
+    TYPEID_INSTANCE,
+    TYPEID_BOUND_METHOD,
+    TYPEID_MODULE,
+    TYPEID_EXCEPTION,
+    TYPEID_FILE,
+    __TYPEID_MAX,
+};
+
+// Where object_new allocated an object from
+enum object_heap {
+    OBJECT_HEAP_SYSTEM=0,
+    OBJECT_HEAP_SLAB,
 };
 
 typedef struct object Object;
+typedef void (*ObjectVisitor)(Object*, void*);
 typedef long long int hashval_t;
 typedef struct bool_object LoxBool;
 typedef struct vmeval_scope VmScope;
@@ -57,8 +93,8 @@ typedef struct object_property {
 
 typedef struct object_type {
     enum base_type  code;
+    enum object_type_id id;
     char*           name;
-    enum object_type_feature features;
 
     // Hashtable support
     hashval_t (*hash)(Object*);
@@ -110,25 +146,55 @@ typedef struct object_type {
     Object* (*getattr)(Object*, Object*, hashval_t);
     void (*setattr)(Object*, Object*, Object*, hashval_t);
 
-    // TODO: Garbage collection cooperation
     void (*cleanup)(Object*);
+    // Call the visitor for each object this one holds a reference to. Only
+    // the cycle collector in garbage.c uses it; objects are otherwise
+    // released by refcount and are never moved.
+    void (*traverse)(Object*, ObjectVisitor, void*);
 } ObjectType;
 
+// The header packs into eight bytes: the refcount, the index of the type
+// and the flags
 typedef struct object {
-    ObjectType* type;
-    bool protect_delete;
     unsigned refcount;
+    unsigned short type_id;     // enum object_type_id, see OBJECT_TYPE()
+    bool immortal;              // Never released, so the refcount is not kept
+    bool protect_delete : 1;
+    bool tracked : 1;           // Container, preceded by a GarbageLink
+    unsigned char heap : 2;     // enum object_heap
 } Object;
 
+extern ObjectType* LoxObject_Types[__TYPEID_MAX];
+
+#define OBJECT_TYPE_ID(object) (((Object*) (object))->type_id)
+#define OBJECT_TYPE(object) (LoxObject_Types[OBJECT_TYPE_ID(object)])
+
+// The types are registered before any other startup code runs, as that
+// might already create objects
+#define OBJECT_TYPES_STARTUP __attribute__((constructor(101)))
+
+void LoxObject_registerType(ObjectType*);
 void* object_new(size_t size, ObjectType*);
+void object_free(Object*);
 Object* object_getattr(Object*, Object*, hashval_t);
+Object* object_getmethod(Object*, Object*, hashval_t);
 void LoxObject_Cleanup(Object*);
-
-#define INCREF(object) (((Object*) object)->refcount++)
-#define DECREF(object) do { if ((--((Object*) object)->refcount) == 0) LoxObject_Cleanup((Object*) object); } while(0)
-
-#define HASHVAL(object) (hashval_t) ((object)->type->hash \
-    ? (object)->type->hash(object) \
+void LoxObject_Immortalize(Object*);
+
+// Immortal objects are shared read-mostly, so their header is not written to
+#define INCREF(object) do { \
+    Object *_incref = (Object*) (object); \
+    if (!_incref->immortal) \
+        _incref->refcount++; \
+} while(0)
+#define DECREF(object) do { \
+    Object *_decref = (Object*) (object); \
+    if (!_decref->immortal && --_decref->refcount == 0) \
+        LoxObject_Cleanup(_decref); \
+} while(0)
+
+#define HASHVAL(object) (hashval_t) (OBJECT_TYPE(object)->hash \
+    ? OBJECT_TYPE(object)->hash(object) \
     : (hashval_t) (object))
 
 static hashval_t MYADDRESS(Object *self) {
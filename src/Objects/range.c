@@ -37,8 +37,8 @@ loxrange_next(Iterator *self) {
 
     // XXX: Add some assertions
     Object **current = &iter->current;
-    *current = (*current)->type->op_plus(*current, range->step);
-    if ((*current)->type->compare(*current, range->end) < 0)
+    *current = OBJECT_TYPE(*current)->op_plus(*current, range->step);
+    if (OBJECT_TYPE(*current)->compare(*current, range->end) < 0)
         return *current;
 
     return LoxStopIteration;
@@ -46,16 +46,17 @@ loxrange_next(Iterator *self) {
 
 Iterator*
 range_iterate(Object *self) {
-    assert(self->type == &LoxRangeType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_RANGE);
     LoxRange *this = (LoxRange*) self;
 
     LoxRangeIterator* iter = (LoxRangeIterator*) LoxIterator_create(self, sizeof(LoxRangeIterator));
     iter->iterator.next = loxrange_next;
-    iter->current = this->start->type->op_minus(this->start, this->step);
+    iter->current = OBJECT_TYPE(this->start)->op_minus(this->start, this->step);
     return (Iterator*) iter;
 }
 
 static struct object_type LoxRangeType = (ObjectType) {
+    .id = TYPEID_RANGE,
     .name = "range",
     .iterate = range_iterate,
 
@@ -64,8 +65,8 @@ static struct object_type LoxRangeType = (ObjectType) {
 
 // A specific range object optimized for integer operations
 
-static Object*
-loxrange_next_int(Iterator *self) {
+Object*
+LoxIntRange_next(Iterator *self) {
     LoxIntRange *range = (LoxIntRange*) self->target;
     LoxIntRangeIterator *iter = (LoxIntRangeIterator*) self;
 
@@ -80,17 +81,24 @@ loxrange_next_int(Iterator *self) {
 
 Iterator*
 range_iterate_int(Object *self) {
-    assert(self->type == &LoxIntRangeType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_INT_RANGE);
 
     LoxIntRangeIterator* iter = (LoxIntRangeIterator*) LoxIterator_create(self, sizeof(LoxRangeIterator));
-    iter->iterator.next = loxrange_next_int;
+    iter->iterator.next = LoxIntRange_next;
     iter->current = ((LoxIntRange*) self) ->start - ((LoxIntRange*) self) ->step;
     return (Iterator*) iter;
 }
 
 static struct object_type LoxIntRangeType = (ObjectType) {
+    .id = TYPEID_INT_RANGE,
     .name = "range",
     .iterate = range_iterate_int,
 
     //.as_string = range_asstring,
-};
\ No newline at end of file
+};
+
+OBJECT_TYPES_STARTUP
+static void range__register(void) {
+    LoxObject_registerType(&LoxRangeType);
+    LoxObject_registerType(&LoxIntRangeType);
+}
@@ -39,5 +39,14 @@ typedef struct {
 } LoxIntRangeIterator;
 
 Object* LoxRange_create(Object*, Object*, Object*);
+Object* LoxIntRange_next(Iterator*);
+
+// Iterators of integer ranges are advanced by the VM (see OP_FOR_RANGE)
+// without calling `next`
+static inline bool
+LoxIntRange_isIterator(Object *object) {
+    return OBJECT_TYPE(object)->code == TYPE_ITERATOR
+        && ((Iterator*) object)->next == LoxIntRange_next;
+}
 
 #endif
\ No newline at end of file
@@ -0,0 +1,147 @@
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "slab.h"
+
+#define unlikely(x)     __builtin_expect((x),0)
+
+SlabStats LoxSlab_Stats[SLAB_CLASSES] = {
+    { 16 }, { 32 }, { 48 }, { 64 }, { 80 }, { 96 }, { 112 }, { 128 },
+    { 160 }, { 192 }, { 224 }, { 256 },
+};
+
+// Size class for each multiple of 16 bytes
+static const unsigned char SlabClassOf[SLAB_MAX_OBJECT / 16 + 1] = {
+    0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 8, 9, 9, 10, 10, 11, 11,
+};
+
+// Slabs with room, by class
+static Slab *Available[SLAB_CLASSES] = { 0 };
+
+static inline Slab*
+slab_of(void *block) {
+    return (Slab*) ((uintptr_t) block & ~(uintptr_t) (SLAB_SIZE - 1));
+}
+
+static inline void
+slab_list_push(Slab *slab) {
+    Slab **head = &Available[slab->class];
+
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head)
+        (*head)->prev = slab;
+    *head = slab;
+    slab->available = true;
+}
+
+static inline void
+slab_list_remove(Slab *slab) {
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        Available[slab->class] = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+    slab->next = slab->prev = NULL;
+    slab->available = false;
+}
+
+/**
+ * Map a new slab from the system. mmap only aligns to pages, so twice the
+ * size is mapped and the ends outside of the aligned slab are unmapped.
+ */
+static Slab*
+slab_new(unsigned class) {
+    char *map = mmap(NULL, 2 * SLAB_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (map == MAP_FAILED)
+        return NULL;
+
+    char *start = (char*) (((uintptr_t) map + SLAB_SIZE - 1)
+        & ~(uintptr_t) (SLAB_SIZE - 1));
+    if (start > map)
+        munmap(map, start - map);
+    munmap(start + SLAB_SIZE, map + SLAB_SIZE - start);
+
+    Slab *slab = (Slab*) start;
+    *slab = (Slab) {
+        .top = slab->data,
+        .class = class,
+    };
+
+    SlabStats *stats = &LoxSlab_Stats[class];
+    if (++stats->slabs > stats->peak)
+        stats->peak = stats->slabs;
+
+    return slab;
+}
+
+static void
+slab_delete(Slab *slab) {
+    LoxSlab_Stats[slab->class].slabs--;
+    munmap(slab, SLAB_SIZE);
+}
+
+/**
+ * Allocate `size` bytes of zeroed memory from the slabs of its size class.
+ * Returns NULL if the system is out of memory.
+ */
+void*
+slab_alloc(size_t size) {
+    assert(size > 0 && size <= SLAB_MAX_OBJECT);
+
+    unsigned class = SlabClassOf[(size + 15) / 16];
+    SlabStats *stats = &LoxSlab_Stats[class];
+    Slab *slab = Available[class];
+    void *result;
+
+    if (unlikely(!slab)) {
+        if (!(slab = slab_new(class)))
+            return NULL;
+        slab_list_push(slab);
+    }
+
+    if (slab->free) {
+        result = slab->free;
+        slab->free = *(void**) result;
+    }
+    else {
+        result = slab->top;
+        slab->top += stats->size;
+    }
+
+    // Full slabs come back to the list when an object is released
+    if (!slab->free && slab->top + stats->size > (char*) slab + SLAB_SIZE)
+        slab_list_remove(slab);
+
+    slab->live++;
+    stats->allocated++;
+
+    return memset(result, 0, stats->size);
+}
+
+void
+slab_free(void *block) {
+    Slab *slab = slab_of(block);
+    assert(slab->live > 0);
+
+    *(void**) block = slab->free;
+    slab->free = block;
+    LoxSlab_Stats[slab->class].released++;
+
+    if (!slab->available)
+        slab_list_push(slab);
+
+    // Keep the last slab of the class with room around, so that a class which
+    // goes back and forth between one and two slabs doesn't map and unmap
+    if (--slab->live == 0
+        && (slab->next || slab->prev)
+    ) {
+        slab_list_remove(slab);
+        slab_delete(slab);
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Objects of up to SLAB_MAX_OBJECT bytes are allocated from slabs: aligned
+// blocks of SLAB_SIZE bytes, each holding objects of one size class. Objects
+// released are kept on a free list in their slab for the next allocation of
+// the class, and a slab is given back to the system once it is empty (unless
+// it is the last one of its class with room).
+#define SLAB_SIZE           (64 * 1024)
+#define SLAB_MAX_OBJECT     256
+#define SLAB_CLASSES        12
+
+typedef struct slab {
+    struct slab     *next;          // Slabs of the class with room
+    struct slab     *prev;
+    void            *free;          // Objects released
+    char            *top;           // Nothing allocated from here on yet
+    unsigned        live;           // Objects allocated
+    unsigned char   class;
+    bool            available;      // On the list of slabs with room
+    char            data[] __attribute__((aligned(16)));
+} Slab;
+
+typedef struct slab_stats {
+    size_t          size;           // Size of the objects in the class
+    unsigned long   allocated;      // Objects allocated
+    unsigned long   released;       // ... and released again
+    unsigned        slabs;          // Slabs in use
+    unsigned        peak;           // Most slabs in use at once
+} SlabStats;
+
+extern SlabStats LoxSlab_Stats[SLAB_CLASSES];
+
+void* slab_alloc(size_t);
+void slab_free(void*);
+
+#endif
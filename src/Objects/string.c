@@ -8,6 +8,7 @@
 #include "boolean.h"
 #include "integer.h"
 #include "list.h"
+#include "hash.h"
 #include "string.h"
 
 #include "Lib/builtin.h"
@@ -35,25 +36,64 @@ String_fromMalloc(const char *characters, size_t size) {
 
 LoxString*
 String_fromObject(Object* value) {
-    assert(value->type);
+    assert(OBJECT_TYPE(value));
 
-    if (value->type->as_string)
-        return (LoxString*) value->type->as_string(value);
+    if (OBJECT_TYPE(value)->as_string)
+        return (LoxString*) OBJECT_TYPE(value)->as_string(value);
 
     char buffer[32];
-    size_t length = snprintf(buffer, sizeof(buffer), "object<%s>@%p", value->type->name, value);
+    size_t length = snprintf(buffer, sizeof(buffer), "object<%s>@%p", OBJECT_TYPE(value)->name, value);
     return String_fromCharsAndSize(buffer, length);
 }
 
 LoxString*
 String_fromLiteral(const char* value, size_t size) {
     // TODO: Interpret backslash-escaped characters
-    return String_fromCharsAndSize(value, size);
+    return String_intern(value, size);
 }
 
 LoxString*
 String_fromConstant(const char* value) {
-    return String_fromMalloc(value, strlen(value));
+    return String_intern(value, strlen(value));
+}
+
+static hashval_t string_hash(Object*);
+
+/**
+ * Interned strings. Names and string literals are interned by the compiler,
+ * so that equal ones are the same object, and a lookup with one finds its
+ * key by comparing the pointers. Interned strings are immortal.
+ */
+static LoxTable *Interned;
+
+LoxString*
+String_intern(const char *characters, size_t size) {
+    LoxString *O, key = (LoxString) {
+        .base.type_id = TYPEID_STRING,
+        .length = size,
+        .characters = characters,
+    };
+    hashval_t hash;
+    HashEntry *entry;
+
+    if (size == 0)
+        return (LoxString*) LoxEmptyString;
+
+    if (unlikely(!Interned)) {
+        Interned = Hash_new();
+        LoxObject_Immortalize((Object*) Interned);
+    }
+
+    hash = string_hash((Object*) &key);
+    if ((entry = Hash_lookupEx(Interned, (Object*) &key, hash)))
+        return (LoxString*) entry->key;
+
+    O = String_fromCharsAndSize(characters, size);
+    O->interned = true;
+    O->hash = hash;
+    LoxObject_Immortalize((Object*) O);
+    Hash_setItemEx(Interned, (Object*) O, (Object*) O, hash);
+    return O;
 }
 
 Object*
@@ -67,7 +107,7 @@ LoxString_Build(int count, ...) {
         if (!result)
             result = va_arg(strings, Object*);
         else
-            result = result->type->op_plus(result, va_arg(strings, Object*));
+            result = OBJECT_TYPE(result)->op_plus(result, va_arg(strings, Object*));
     }
 
     va_end(strings);
@@ -85,14 +125,14 @@ LoxString_BuildFromList(int count, Object **first) {
         if (!result)
             result = current;
         else
-            result = result->type->op_plus(result, current);
+            result = OBJECT_TYPE(result)->op_plus(result, current);
     }
     return result;
 }
 
 static void
 string_cleanup(Object *self) {
-    assert(self->type == &StringType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_STRING);
 
     LoxString* this = (LoxString*) self;
     free((void*) this->characters);
@@ -156,24 +196,27 @@ _string_hash_final(Object *self, hashval_t initial) {
     hash ^= hash << 25;
     hash += hash >> 6;
 
-    // TODO: Consider caching the hash value
     return hash;
 }
 
 static hashval_t
 string_hash(Object* self) {
     assert(self != NULL);
-    assert(self->type == &StringType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_STRING);
 
     LoxString* S = (LoxString*) self;
 
-    return _string_hash_final(self, S->length);
+    // Strings don't change, so the hash is only computed once
+    if (unlikely(S->hash == 0))
+        S->hash = _string_hash_final(self, S->length);
+
+    return S->hash;
 }
 
 static Object*
 string_len(Object* self) {
     assert(self != NULL);
-    assert(self->type == &StringType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_STRING);
 
     LoxString* S = (LoxString*) self;
     if (S->length > 0 && S->char_count == 0) {
@@ -197,7 +240,7 @@ string_asstring(Object* self) {
 static LoxBool*
 string_asbool(Object* self) {
     assert(self != NULL);
-    assert(self->type == &StringType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_STRING);
 
     return ((LoxString*) self)->length == 0 ? LoxFALSE : LoxTRUE;
 }
@@ -216,8 +259,11 @@ string_asint(Object* self) {
 
 static int
 string_compare(Object *self, Object *other) {
-    assert(self->type == &StringType);
-    assert(other->type == &StringType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_STRING);
+    assert(OBJECT_TYPE_ID(other) == TYPEID_STRING);
+
+    if (self == other)
+        return 0;
 
     int cmp = strncmp(((LoxString*) self)->characters,
         ((LoxString*) other)->characters,
@@ -227,29 +273,38 @@ string_compare(Object *self, Object *other) {
         : ((LoxString*) self)->length - ((LoxString*) other)->length;
 }
 
-static Object*
-string_op_plus(Object* self, Object* other) {
-    assert(self != NULL);
-    assert(self->type == &StringType);
-
-    if (other->type == &StringTreeType)
-        return (Object*) StringTree_fromStrings(self, other);
-    if (!String_isString(other))
-        other = other->type->as_string(other);
-
+/**
+ * Concatenate two (flat) strings. Used by the `+` operator and directly by
+ * the VM once it knows both operands are strings.
+ */
+Object*
+String_concat(LoxString *self, LoxString *other) {
     // If adding something like single chars, build it as a string. Plus,
     // keeping the length as multiples of 4 characters, where possible, would
     // mean for more consistent hashing between string trees and normal
     // strings for the same sequence of characters.
-    if (((LoxString*)self)->length < 64) {
+    if (self->length < 64) {
         char *buffer;
-        asprintf(&buffer, "%.*s%.*s", ((LoxString*)self)->length, ((LoxString*)self)->characters,
-            ((LoxString*)other)->length, ((LoxString*)other)->characters);
-        return (Object*) String_fromMalloc(buffer, ((LoxString*)self)->length + ((LoxString*)other)->length);
+        asprintf(&buffer, "%.*s%.*s", self->length, self->characters,
+            other->length, other->characters);
+        return (Object*) String_fromMalloc(buffer, self->length + other->length);
     }
 
     // Otherwise, try not to duplicate memory
-    return (Object*) StringTree_fromStrings(self, other);
+    return (Object*) StringTree_fromStrings((Object*) self, (Object*) other);
+}
+
+static Object*
+string_op_plus(Object* self, Object* other) {
+    assert(self != NULL);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_STRING);
+
+    if (OBJECT_TYPE_ID(other) == TYPEID_STRINGTREE)
+        return (Object*) StringTree_fromStrings(self, other);
+    if (!String_isString(other))
+        other = OBJECT_TYPE(other)->as_string(other);
+
+    return String_concat((LoxString*) self, (LoxString*) other);
 }
 
 const char*
@@ -298,16 +353,16 @@ LoxString_getCharAt(LoxString *self, int index, int *length) {
 static Object*
 string_getitem(Object* self, Object* index) {
     assert(self != NULL);
-    assert(self->type == &StringType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_STRING);
 
     // This will be the same algorithm as the len method; however, it will
     // scan to the appropriate, requested spot
     if (!Integer_isInteger(index)) {
-        if (!index->type->as_int) {
+        if (!OBJECT_TYPE(index)->as_int) {
             // TODO: Raise exception
             return LoxNIL;
         }
-        index = index->type->as_int(index);
+        index = OBJECT_TYPE(index)->as_int(index);
     }
 
     int i = Integer_toInt(index);
@@ -364,7 +419,7 @@ string_iterate(Object *self) {
 Object*
 string_upper(VmScope *state, Object *self, Object *args) {
     assert(self);
-    assert(self->type == &StringType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_STRING);
 
     LoxString *S = (LoxString*) self;
     char *upper = malloc(S->length), *eupper = upper;
@@ -378,7 +433,7 @@ string_upper(VmScope *state, Object *self, Object *args) {
 Object*
 string_rtrim(VmScope *state, Object *self, Object *args) {
     assert(self);
-    assert(self->type == &StringType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_STRING);
 
     Object *chars = NULL;
     Lox_ParseArgs(args, "|O", &chars);
@@ -406,7 +461,7 @@ string_rtrim(VmScope *state, Object *self, Object *args) {
         stop = true;
         while (i--) {
             s2 = LoxList_getItem(list, i);
-            assert(s2->type == &StringType);
+            assert(OBJECT_TYPE_ID(s2) == TYPEID_STRING);
             if (String_compare((LoxString*) s2, s1) == 0) {
                 length--;
                 pos--;
@@ -428,6 +483,7 @@ string_rtrim(VmScope *state, Object *self, Object *args) {
 
 static struct object_type StringType = (ObjectType) {
     .code = TYPE_STRING,
+    .id = TYPEID_STRING,
     .name = "string",
     .hash = string_hash,
     .len = string_len,
@@ -451,8 +507,9 @@ static struct object_type StringType = (ObjectType) {
 };
 
 static LoxString _LoxEmptyString = (LoxString) {
-    .base.type = &StringType,
-    .base.refcount = 1,
+    .base.type_id = TYPEID_STRING,
+    .base.immortal = true,
+    .interned = true,
     .length = 0,
     .characters = "",
 };
@@ -460,7 +517,7 @@ const LoxString *LoxEmptyString = &_LoxEmptyString;
 
 bool
 String_isString(Object* value) {
-    if (value->type && value->type == &StringType)
+    if (OBJECT_TYPE(value) && OBJECT_TYPE_ID(value) == TYPEID_STRING)
         return true;
 
     return false;
@@ -470,7 +527,7 @@ int
 String_compare(LoxString* left, const char* right) {
     assert(left);
     assert(right);
-    assert(left->base.type == &StringType);
+    assert(OBJECT_TYPE_ID(left) == TYPEID_STRING);
 
     return strncmp(left->characters, right, left->length);
 }
@@ -490,12 +547,12 @@ StringTree_fromStrings(Object *a, Object *b) {
 
 bool
 StringTree_isStringTree(Object *O) {
-    return O->type == &StringTreeType;
+    return OBJECT_TYPE_ID(O) == TYPEID_STRINGTREE;
 }
 
 static void
 stringtree_cleanup(Object* self) {
-    assert(self->type == &StringTreeType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_STRINGTREE);
 
     LoxStringTree* this = (LoxStringTree*) self;
     DECREF(this->left);
@@ -505,18 +562,18 @@ stringtree_cleanup(Object* self) {
 static Object*
 stringtree_len(Object* self) {
     assert(self != NULL);
-    assert(self->type == &StringTreeType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_STRINGTREE);
 
     LoxStringTree* S = (LoxStringTree*) self;
 
-    int total = Integer_toInt(S->left->type->len(S->left));
-    return (Object*) Integer_fromLongLong(total + Integer_toInt(S->right->type->len(S->right)));
+    int total = Integer_toInt(OBJECT_TYPE(S->left)->len(S->left));
+    return (Object*) Integer_fromLongLong(total + Integer_toInt(OBJECT_TYPE(S->right)->len(S->right)));
 }
 
 static hashval_t
 stringtree_hash(Object* self) {
     assert(self != NULL);
-    assert(self->type == &StringTreeType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_STRINGTREE);
 
     Object *chunk;
     Iterator *chunks = LoxStringTree_iterChunks((LoxStringTree*) self);
@@ -535,11 +592,11 @@ stringtree_hash(Object* self) {
 
 static int
 stringtree_copy_buffer(Object* object, char *buffer, size_t size) {
-    if (object->type == &StringType) {
+    if (OBJECT_TYPE_ID(object) == TYPEID_STRING) {
         return snprintf(buffer, size, "%.*s",
             ((LoxString*) object)->length, ((LoxString*) object)->characters);
     }
-    else if (object->type == &StringTreeType) {
+    else if (OBJECT_TYPE_ID(object) == TYPEID_STRINGTREE) {
         size_t length;
         length = stringtree_copy_buffer(((LoxStringTree*) object)->left, buffer, size);
         buffer += length;
@@ -554,7 +611,7 @@ stringtree_copy_buffer(Object* object, char *buffer, size_t size) {
 static Object*
 stringtree_asstring(Object* self) {
     assert(self != NULL);
-    assert(self->type == &StringTreeType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_STRINGTREE);
 
     size_t size = Integer_toInt(stringtree_len(self)) + 1;
 
@@ -573,7 +630,7 @@ stringtree_asstring(Object* self) {
 static LoxBool*
 stringtree_asbool(Object* self) {
     assert(self != NULL);
-    assert(self->type == &StringTreeType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_STRINGTREE);
     return Integer_toInt(stringtree_len(self)) > 0 ? LoxTRUE : LoxFALSE;
 }
 
@@ -596,7 +653,7 @@ stringtree_chunks__next(Iterator* this) {
 
     if (self->pos == 0) {
         self->pos++;
-        if (target->left->type == &StringTreeType) {
+        if (OBJECT_TYPE_ID(target->left) == TYPEID_STRINGTREE) {
             self->inner = LoxStringTree_iterChunks(target->left);
             INCREF(self->inner);
             return stringtree_chunks__next(self->inner);
@@ -607,7 +664,7 @@ stringtree_chunks__next(Iterator* this) {
     }
     else if (self->pos == 1) {
         self->pos++;
-        if (target->right->type == &StringTreeType) {
+        if (OBJECT_TYPE_ID(target->right) == TYPEID_STRINGTREE) {
             self->inner = LoxStringTree_iterChunks(target->right);
             INCREF(self->inner);
             return stringtree_chunks__next(self->inner);
@@ -633,7 +690,7 @@ LoxStringTree_iterChunks(LoxStringTree* self) {
 Object*
 stringtree_chunks(VmScope *state, Object *self, Object *args) {
     assert(self);
-    assert(self->type == &StringTreeType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_STRINGTREE);
 
     return (Object*) LoxStringTree_iterChunks((LoxStringTree*) self);
 }
@@ -655,7 +712,7 @@ stringtree_op_plus(Object *self, Object *other) {
     LoxStringTree *this = (LoxStringTree*) self;
     Object *old = this->right;
 
-    this->right = this->right->type->op_plus(this->right, other);
+    this->right = OBJECT_TYPE(this->right)->op_plus(this->right, other);
     INCREF(this->right);
     DECREF(old);
 
@@ -664,6 +721,7 @@ stringtree_op_plus(Object *self, Object *other) {
 
 static struct object_type StringTreeType = (ObjectType) {
     .code = TYPE_STRINGTREE,
+    .id = TYPEID_STRINGTREE,
     .name = "string(tree)",
     .cleanup = stringtree_cleanup,
     .hash = stringtree_hash,
@@ -679,3 +737,9 @@ static struct object_type StringTreeType = (ObjectType) {
         { 0, 0 },
     },
 };
+
+OBJECT_TYPES_STARTUP
+static void string__register(void) {
+    LoxObject_registerType(&StringType);
+    LoxObject_registerType(&StringTreeType);
+}
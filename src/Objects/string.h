@@ -15,8 +15,10 @@ typedef struct string_object {
     Object  base;
 
     unsigned length;
-    unsigned char_count;
+    unsigned char_count : 31;
+    bool interned : 1;          // Single object for the characters, see String_intern
     const char *characters;
+    hashval_t hash;             // Cached by string_hash(), zero until then
 } LoxString;
 
 typedef struct {
@@ -44,11 +46,13 @@ LoxString* String_fromObject(Object*);
 LoxString* String_fromLiteral(const char*, size_t);
 LoxString* String_fromConstant(const char *);
 LoxString* String_fromMalloc(const char *, size_t);
+LoxString* String_intern(const char*, size_t);
 size_t String_getLength(Object* self);
 int String_compare(LoxString*, const char*);
 LoxString* String_fromConstant(const char*);
 Object* LoxString_Build(int, ...);
 Object* LoxString_BuildFromList(int, Object **);
+Object* String_concat(LoxString*, LoxString*);
 
 const LoxString *LoxEmptyString;
 
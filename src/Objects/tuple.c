@@ -13,7 +13,7 @@ LoxTuple*
 Tuple_new(size_t count) {
     LoxTuple* self = object_new(sizeof(LoxTuple), &TupleType);
     self->count = count;
-    self->items = malloc(count * sizeof(Object*));
+    self->items = calloc(count, sizeof(Object*));
     return self;
 }
 
@@ -74,14 +74,14 @@ Tuple_setItem(LoxTuple* self, size_t index, Object* value) {
 
 size_t
 Tuple_getSize(Object* self) {
-    assert(self->type == &TupleType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_TUPLE);
 
     return ((LoxTuple*) self)->count;
 }
 
 bool
 Tuple_isTuple(Object* self) {
-    return self->type == &TupleType;
+    return OBJECT_TYPE_ID(self) == TYPEID_TUPLE;
 }
 
 static Object*
@@ -106,7 +106,7 @@ Tuple_getIterator(LoxTuple* self) {
 
 static Object*
 tuple_getitem(Object* self, Object* index) {
-    assert(self->type == &TupleType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_TUPLE);
 
     int idx = Integer_toInt(index);
     return Tuple_getItem((LoxTuple*) self, idx);
@@ -114,13 +114,13 @@ tuple_getitem(Object* self, Object* index) {
 
 static Object*
 tuple_len(Object* self) {
-    assert(self->type == &TupleType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_TUPLE);
     return (Object*) Integer_fromLongLong(((LoxTuple*) self)->count);
 }
 
 static Object*
 tuple_asstring(Object* self) {
-    assert(self->type == &TupleType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_TUPLE);
 
     char buffer[1024];  // TODO: Use the + operator of LoxString
     char* position = buffer;
@@ -136,7 +136,7 @@ tuple_asstring(Object* self) {
     int k = this->count, j = k - 1, i = 0;
     for (; i < k; i++) {
         value = *(this->items + i);
-        svalue = (LoxString*) value->type->as_string(value);
+        svalue = (LoxString*) OBJECT_TYPE(value)->as_string(value);
         bytes = snprintf(position, remaining, "%.*s%s",
             svalue->length, svalue->characters,
             i == j ? "" : ", ");
@@ -149,7 +149,7 @@ tuple_asstring(Object* self) {
 
 static hashval_t
 tuple_hash(Object *self) {
-    assert(self->type == &TupleType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_TUPLE);
     LoxTuple *this = (LoxTuple*) self;
 
     int i = this->count;
@@ -157,8 +157,8 @@ tuple_hash(Object *self) {
     Object *item;
     while (i--) {
         item = *(this->items + i);
-        if (item->type->hash)
-            tmp = item->type->hash(item);
+        if (OBJECT_TYPE(item)->hash)
+            tmp = OBJECT_TYPE(item)->hash(item);
         else
             tmp = MYADDRESS(item);
 
@@ -178,25 +178,40 @@ tuple_hash(Object *self) {
 
 static Iterator*
 tuple_iterate(Object *self) {
-    assert(self->type == &TupleType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_TUPLE);
     return Tuple_getIterator((LoxTuple*) self);
 }
 
 static void
 tuple_cleanup(Object *self) {
-    assert(self->type == &TupleType);
+    assert(OBJECT_TYPE_ID(self) == TYPEID_TUPLE);
 
     LoxTuple *this = (LoxTuple*) self;
     Object** pitem = this->items;
-    while (this->count--)
-        DECREF(*(pitem++));
+    // DECREF evaluates its argument twice, so don't advance inside it
+    while (this->count--) {
+        DECREF(*pitem);
+        pitem++;
+    }
 
     free(this->items);
 }
 
+static void
+tuple_traverse(Object *self, ObjectVisitor visit, void *arg) {
+    assert(OBJECT_TYPE_ID(self) == TYPEID_TUPLE);
+
+    LoxTuple *this = (LoxTuple*) self;
+    int i;
+    // Items are NULL until they are set
+    for (i = 0; i < this->count; i++)
+        if (this->items[i])
+            visit(this->items[i], arg);
+}
+
 static int
 tuple_compare(Object *self, Object *other) {
-    if (other->type != &TupleType)
+    if (OBJECT_TYPE_ID(other) != TYPEID_TUPLE)
         return -1;
 
     int count = Tuple_getSize(self), rv = count - Tuple_getSize(other);
@@ -208,8 +223,8 @@ tuple_compare(Object *self, Object *other) {
     while (i < count) {
         item = Tuple_GETITEM(self, i);
         oitem = Tuple_GETITEM(other, i);
-        if (likely(item->type->compare != NULL)) {
-            if ((rv = item->type->compare(item, oitem)) != 0)
+        if (likely(OBJECT_TYPE(item)->compare != NULL)) {
+            if ((rv = OBJECT_TYPE(item)->compare(item, oitem)) != 0)
                 return rv;
         }
         else {
@@ -223,6 +238,7 @@ tuple_compare(Object *self, Object *other) {
 }
 
 static struct object_type TupleType = (ObjectType) {
+    .id = TYPEID_TUPLE,
     .name = "tuple",
     .len = tuple_len,
     .hash = tuple_hash,
@@ -232,11 +248,17 @@ static struct object_type TupleType = (ObjectType) {
 
     .as_string = tuple_asstring,
     .cleanup = tuple_cleanup,
+    .traverse = tuple_traverse,
 };
 
+OBJECT_TYPES_STARTUP
+static void tuple__register(void) {
+    LoxObject_registerType(&TupleType);
+}
+
 static LoxTuple _LoxEmptyTuple = (LoxTuple) {
-    .base.type = &TupleType,
-    .base.refcount = 1,
+    .base.type_id = TYPEID_TUPLE,
+    .base.immortal = true,
     .count = 0,
     .items = NULL,
 };
@@ -0,0 +1,127 @@
+#include <assert.h>
+
+#include "object.h"
+#include "boolean.h"
+#include "float.h"
+#include "integer.h"
+#include "value.h"
+
+/**
+ * Unpacks an object into an immediate value where possible. Reference counts
+ * are not touched; if the result is still an object, it refers to the same
+ * object as `object`.
+ */
+LoxValue
+LoxValue_fromObject(Object *object) {
+    assert(object);
+
+    switch (OBJECT_TYPE(object)->code) {
+    case TYPE_INTEGER: {
+        long long value = ((LoxInteger*) object)->value;
+        if (VALUE_INT_FITS(value))
+            return VALUE_FROM_INT(value);
+        break;
+    }
+    case TYPE_FLOAT:
+        return VALUE_FROM_DOUBLE((double) ((LoxFloat*) object)->value);
+    case TYPE_BOOL:
+        return VALUE_FROM_BOOL(object == (Object*) LoxTRUE);
+    case TYPE_NIL:
+        return VALUE_NIL;
+    default:
+        if (object == LoxUndefined)
+            return VALUE_UNDEFINED;
+    }
+
+    return VALUE_FROM_OBJECT(object);
+}
+
+/**
+ * Creates an owned value from an object. The value holds a reference to the
+ * object if it stays boxed; if it unpacks to an immediate, then `object` is
+ * released (which cleans up temporaries such as fresh math results).
+ */
+LoxValue
+LoxValue_fromObjectRef(Object *object) {
+    LoxValue value = LoxValue_fromObject(object);
+
+    INCREF(object);
+    if (!VALUE_IS_OBJECT(value))
+        DECREF(object);
+
+    return value;
+}
+
+/**
+ * Creates an integer value. Integers too wide for the immediate encoding are
+ * boxed, and the returned value then owns a reference to the box.
+ */
+LoxValue
+LoxValue_fromLongLong(long long value) {
+    if (VALUE_INT_FITS(value))
+        return VALUE_FROM_INT(value);
+
+    Object *boxed = (Object*) Integer_fromLongLong(value);
+    INCREF(boxed);
+    return VALUE_FROM_OBJECT(boxed);
+}
+
+/**
+ * Fetches an object representing the value. Immediate values are boxed into
+ * a new object (or one of the static singletons). Reference counts are not
+ * touched, so a freshly boxed object has a refcount of zero.
+ */
+Object*
+LoxValue_box(LoxValue value) {
+    if (VALUE_IS_OBJECT(value))
+        return VALUE_AS_OBJECT(value);
+    else if (VALUE_IS_INT(value))
+        return (Object*) Integer_fromLongLong(VALUE_AS_INT(value));
+    else if (VALUE_IS_DOUBLE(value))
+        return (Object*) Float_fromLongDouble(VALUE_AS_DOUBLE(value));
+
+    switch (value) {
+    case VALUE_TRUE:
+        return (Object*) LoxTRUE;
+    case VALUE_FALSE:
+        return (Object*) LoxFALSE;
+    case VALUE_NIL:
+        return LoxNIL;
+    default:
+        return LoxUndefined;
+    }
+}
+
+/**
+ * Converts an owned value (one with a reference, like one popped from the VM
+ * stack) into an owned object reference. The caller should DECREF the result
+ * when finished with it.
+ */
+Object*
+LoxValue_asObject(LoxValue value) {
+    if (VALUE_IS_OBJECT(value))
+        return VALUE_AS_OBJECT(value);
+
+    Object *boxed = LoxValue_box(value);
+    INCREF(boxed);
+    return boxed;
+}
+
+bool
+LoxValue_isTrue(LoxValue value) {
+    if (value == VALUE_TRUE)
+        return true;
+    else if (VALUE_IS_MISC(value))
+        return false;
+    else if (VALUE_IS_INT(value))
+        return VALUE_AS_INT(value) != 0;
+    else if (VALUE_IS_DOUBLE(value))
+        return VALUE_AS_DOUBLE(value) != 0.0;
+
+    // Leave other types to their `as_bool` coercion
+    Object *object = LoxValue_box(value);
+    INCREF(object);
+    bool result = Bool_isTrue(object);
+    DECREF(object);
+    return result;
+}
@@ -0,0 +1,87 @@
+#ifndef VALUE_H
+#define VALUE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "object.h"
+
+/**
+ * Immediate value representation used by the VM for the operand stack and
+ * local variables. Doubles are stored as-is and everything else is packed
+ * into the payload of a quiet NaN:
+ *
+ *   double      any non-NaN pattern (NaN results are canonicalized)
+ *   Object*     SIGN | QNAN | 48-bit pointer
+ *   integer     QNAN | TAG_INT | 48-bit two's complement
+ *   nil, undefined, true, false
+ *               QNAN | TAG_MISC | constant
+ *
+ * Integers which do not fit in 48 bits stay boxed as LoxInteger objects,
+ * so an integer value is either VALUE_IS_INT() or a boxed LoxInteger.
+ */
+typedef uint64_t LoxValue;
+
+#define VALUE_SIGN_BIT      ((uint64_t) 0x8000000000000000)
+#define VALUE_QNAN          ((uint64_t) 0x7ffc000000000000)
+#define VALUE_TAG_MASK      ((uint64_t) 0x0003000000000000)
+#define VALUE_TAG_INT       ((uint64_t) 0x0001000000000000)
+#define VALUE_TAG_MISC      ((uint64_t) 0x0002000000000000)
+#define VALUE_PAYLOAD_MASK  ((uint64_t) 0x0000ffffffffffff)
+#define VALUE_KIND_MASK     (VALUE_SIGN_BIT | VALUE_QNAN | VALUE_TAG_MASK)
+
+#define VALUE_INT_MAX       ((1LL << 47) - 1)
+#define VALUE_INT_MIN       (-(1LL << 47))
+
+#define VALUE_NIL           (VALUE_QNAN | VALUE_TAG_MISC | 1)
+#define VALUE_UNDEFINED     (VALUE_QNAN | VALUE_TAG_MISC | 2)
+#define VALUE_FALSE         (VALUE_QNAN | VALUE_TAG_MISC | 3)
+#define VALUE_TRUE          (VALUE_QNAN | VALUE_TAG_MISC | 4)
+
+// Not a Lox value. Marks an unused slot on the VM stack
+#define VALUE_EMPTY         (VALUE_QNAN | VALUE_TAG_MISC | 5)
+
+#define VALUE_IS_DOUBLE(v)  (((v) & VALUE_QNAN) != VALUE_QNAN)
+#define VALUE_IS_OBJECT(v)  (((v) & VALUE_KIND_MASK) == (VALUE_SIGN_BIT | VALUE_QNAN))
+#define VALUE_IS_INT(v)     (((v) & VALUE_KIND_MASK) == (VALUE_QNAN | VALUE_TAG_INT))
+#define VALUE_IS_MISC(v)    (((v) & VALUE_KIND_MASK) == (VALUE_QNAN | VALUE_TAG_MISC))
+#define VALUE_IS_BOOL(v)    ((v) == VALUE_TRUE || (v) == VALUE_FALSE)
+
+#define VALUE_INT_FITS(i)   ((i) >= VALUE_INT_MIN && (i) <= VALUE_INT_MAX)
+
+#define VALUE_AS_OBJECT(v)  ((Object*) (uintptr_t) ((v) & VALUE_PAYLOAD_MASK))
+#define VALUE_AS_INT(v)     (((int64_t) ((v) << 16)) >> 16)
+
+#define VALUE_FROM_OBJECT(o) (VALUE_SIGN_BIT | VALUE_QNAN | (uint64_t) (uintptr_t) (o))
+#define VALUE_FROM_INT(i)   (VALUE_QNAN | VALUE_TAG_INT | ((uint64_t) (i) & VALUE_PAYLOAD_MASK))
+#define VALUE_FROM_BOOL(b)  ((b) ? VALUE_TRUE : VALUE_FALSE)
+
+#define VALUE_INCREF(v) do { if (VALUE_IS_OBJECT(v)) INCREF(VALUE_AS_OBJECT(v)); } while(0)
+#define VALUE_DECREF(v) do { if (VALUE_IS_OBJECT(v)) DECREF(VALUE_AS_OBJECT(v)); } while(0)
+
+static inline double
+VALUE_AS_DOUBLE(LoxValue value) {
+    double result;
+    memcpy(&result, &value, sizeof(result));
+    return result;
+}
+
+static inline LoxValue
+VALUE_FROM_DOUBLE(double number) {
+    LoxValue result;
+    if (number != number)
+        // Canonical quiet NaN, which never collides with the tagged space
+        return (uint64_t) 0x7ff8000000000000;
+    memcpy(&result, &number, sizeof(result));
+    return result;
+}
+
+LoxValue LoxValue_fromObject(Object*);
+LoxValue LoxValue_fromObjectRef(Object*);
+LoxValue LoxValue_fromLongLong(long long);
+Object* LoxValue_box(LoxValue);
+Object* LoxValue_asObject(LoxValue);
+bool LoxValue_isTrue(LoxValue);
+
+#endif
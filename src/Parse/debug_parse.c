@@ -28,12 +28,12 @@ print_unary(FILE *output, ASTUnary *node) {
 static void
 print_object(FILE* output, Object *object) {
     LoxString* S;
-    if (object->type->as_string) {
-        S = (LoxString*) object->type->as_string(object);
+    if (OBJECT_TYPE(object)->as_string) {
+        S = (LoxString*) OBJECT_TYPE(object)->as_string(object);
         fprintf(output, "%.*s", S->length, S->characters);
     }
     else {
-        fprintf(output, "object<%s>@%p", object->type->name, object);
+        fprintf(output, "object<%s>@%p", OBJECT_TYPE(object)->name, object);
     }
 }
 
@@ -53,7 +53,7 @@ print_term(FILE* output, ASTTerm* node) {
 
 static void
 print_literal(FILE* output, ASTLiteral* node) {
-    LoxString* S = (LoxString*) node->literal->type->as_string(node->literal);
+    LoxString* S = (LoxString*) OBJECT_TYPE(node->literal)->as_string(node->literal);
     fprintf(output, "(%.*s)", S->length, S->characters);
 }
 
@@ -97,6 +97,19 @@ print_while(FILE* output, ASTWhile* node) {
     fprintf(output, "}");
 }
 
+static void
+print_for(FILE* output, ASTFor* node) {
+    fprintf(output, "For(");
+    print_node(output, node->initializer);
+    fprintf(output, "; ");
+    print_node(output, node->condition);
+    fprintf(output, "; ");
+    print_node(output, node->post_loop);
+    fprintf(output, ") {");
+    print_node(output, node->block);
+    fprintf(output, "}");
+}
+
 static void
 print_function(FILE* output, ASTFunction* node) {
     fprintf(output, "Function(name=%s, params={", node->name);
@@ -263,6 +276,8 @@ print_node_list(FILE* output, ASTNode* node, const char * separator) {
             print_while(output, (ASTWhile*) current);
             break;
         case AST_FOR:
+            print_for(output, (ASTFor*) current);
+            break;
         case AST_IF:
             print_if(output, (ASTIf*) current);
             break;
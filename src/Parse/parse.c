@@ -401,11 +401,11 @@ parse_TERM(Parser* self, Token *reference) {
     case T_WORD: {
         ASTLookup *lookup = GC_MALLOC(sizeof(ASTLookup));
         parser_node_init((ASTNode*) lookup, AST_LOOKUP, reference);
-        lookup->name = (Object*) String_fromCharsAndSize(
+        lookup->name = (Object*) String_intern(
             self->tokens->fetch_text(self->tokens, next),
             next->length
         );
-        lookup->hash = lookup->name->type->hash(lookup->name);
+        lookup->hash = OBJECT_TYPE(lookup->name)->hash(lookup->name);
         result = (ASTNode*) lookup;
         break;
     }
@@ -594,8 +594,6 @@ parse_tuple_items(Parser* self, ASTNode *first) {
     return (ASTNode*) result;
 }
 
-static inline void parse_try_reduce(ASTNode*);
-
 static ASTNode*
 parse_expression_r(Parser* self, const OperatorInfo *previous) {
     /* General expression grammar
@@ -703,40 +701,28 @@ parse_expression_r(Parser* self, const OperatorInfo *previous) {
         next = T->peek(T);
     }
 
-    if (lhs->type == AST_EXPRESSION)
-        parse_try_reduce(lhs);
     return lhs;
 }
 
-static bool
-parse_expr_is_constant(ASTNode *node) {
-    assert(node->type == AST_EXPRESSION);
-    ASTExpression *expr = (ASTExpression*) node;
-
-    if (expr->lhs->type == AST_EXPRESSION)
-        parse_try_reduce(expr->lhs);
-    if (expr->rhs->type == AST_EXPRESSION)
-        parse_try_reduce(expr->rhs);
-    return expr->lhs->type == AST_LITERAL && expr->rhs->type == AST_LITERAL;
-}
-
-static inline void
-parse_try_reduce(ASTNode *node) {
-    if (parse_expr_is_constant(node)) {
-        Object *result = LoxVM_evalAST(node);
-        // XXX: This assumes the size of a literal is less than that of an expr
-        // XXX: Free the expr->lhs and expr->rhs
-        node->type = AST_LITERAL;
-        ((ASTLiteral*) node)->literal = result;
-        INCREF(result);
-    }
-}
-
 static ASTNode*
 parse_expression(Parser* self) {
     return parse_expression_r(self, 0);
 }
 
+// The initializer and post-loop expressions of a `for` loop are run for their
+// side effects only
+static ASTNode*
+parse_for_clause(Parser* self) {
+    ASTNode *clause = parse_expression(self);
+
+    if (clause->type == AST_EXPRESSION)
+        ((ASTExpression*) clause)->result_ignored = true;
+    else if (clause->type == AST_INVOKE)
+        ((ASTInvoke*) clause)->return_value_ignored = true;
+
+    return clause;
+}
+
 static ASTNode*
 parse_statement(Parser* self) {
     Token* token = self->tokens->current, *peek, *next;
@@ -793,11 +779,27 @@ parse_statement(Parser* self) {
         ASTFor* astfor = GC_MALLOC(sizeof(ASTFor));
         parser_node_init((ASTNode*) astfor, AST_FOR, token);
         parse_expect(self, T_OPEN_PAREN);
-        astfor->initializer = parse_expression(self);
-        parse_expect(self, T_SEMICOLON);
-        astfor->condition = parse_expression(self);
+
+        // Each of the clauses is optional, and the initializer can declare
+        // a variable
+        peek = self->tokens->peek(self->tokens);
+        if (peek->type == T_VAR) {
+            // (The statement includes the semicolon)
+            self->tokens->next(self->tokens);
+            astfor->initializer = parse_statement(self);
+        }
+        else {
+            if (peek->type != T_SEMICOLON)
+                astfor->initializer = parse_for_clause(self);
+            parse_expect(self, T_SEMICOLON);
+        }
+
+        if (self->tokens->peek(self->tokens)->type != T_SEMICOLON)
+            astfor->condition = parse_expression(self);
         parse_expect(self, T_SEMICOLON);
-        astfor->post_loop = parse_expression(self);
+
+        if (self->tokens->peek(self->tokens)->type != T_CLOSE_PAREN)
+            astfor->post_loop = parse_for_clause(self);
         parse_expect(self, T_CLOSE_PAREN);
         astfor->block = parse_statement_or_block(self);
 
@@ -818,7 +820,7 @@ parse_statement(Parser* self) {
         parser_node_init((ASTNode*) astclass, AST_CLASS, token);
 
         next = parse_expect(self, T_WORD);
-        astclass->name = (Object*) String_fromCharsAndSize(
+        astclass->name = (Object*) String_intern(
             self->tokens->fetch_text(self->tokens, next),
             next->length);
 
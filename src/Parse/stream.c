@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "stream.h"
 #include "Vendor/bdwgc/include/gc.h"
@@ -19,6 +20,7 @@ typedef struct file_buffer_chunk {
 typedef struct {
     FILE* restrict file;
     int     fp;
+    bool    interactive;
     int     chunk_pos;
     FileBufferChunk* chunks;
 } FileStream;
@@ -27,7 +29,12 @@ static int
 file_stream_readahead(Stream* stream) {
     FileStream* context = (FileStream*) stream->context;
     FileBufferChunk *chunk = context->chunks;
-    if (!chunk || context->chunk_pos >= sizeof(chunk->buffer)) {
+
+    // Still something left to read in the current chunk
+    if (chunk && context->chunk_pos < chunk->length)
+        return 0;
+
+    if (!chunk || chunk->length == sizeof(chunk->buffer)) {
         chunk = GC_MALLOC(sizeof(FileBufferChunk));
         if (chunk == NULL)
             // PROBLEM
@@ -44,16 +51,23 @@ file_stream_readahead(Stream* stream) {
         context->chunk_pos = 0;
     }
 
-    int ret = fread(chunk->buffer + chunk->length, 1,
-        1, // sizeof(chunk->buffer) - chunk->length,
-        context->file);
-
-    if (ret >= 0)
-        chunk->length += ret;
-
-    else if (feof(context->file))
+    // Scripts are read a whole chunk at a time. Interactive input only takes
+    // what is available, which is a line from a terminal, as fread() would
+    // wait for the chunk to fill.
+    int ret;
+    if (context->interactive)
+        ret = read(fileno(context->file), chunk->buffer + chunk->length,
+            sizeof(chunk->buffer) - chunk->length);
+    else
+        ret = fread(chunk->buffer + chunk->length, 1,
+            sizeof(chunk->buffer) - chunk->length,
+            context->file);
+
+    if (ret <= 0)
         return -1;
 
+    chunk->length += ret;
+
     return 0;
 }
 
@@ -108,29 +122,34 @@ file_stream_readchunk(Stream* stream, int offset, int length) {
     int chunk_end = chunk->start + chunk->length;
 
     // Try and return a pointer into the existing chunk (rather than 
-    // allocating a new buffer)
-    if (offset + length <= chunk_end) {
+    // allocating a new buffer). The rest of the chunk is still zeroed if
+    // the text ends what was read so far, which terminates it.
+    if (offset + length == chunk_end
+        && chunk->length < sizeof(chunk->buffer)
+    ) {
         return chunk->buffer + chunk_pos;
     }
 
     // Allocate a buffer to return
     // TODO: Add a way to manage the pointer and indicate that it should 
     //       be freed later
-    char* buffer = GC_MALLOC_ATOMIC(length);
-
-    int copied = 0, requested = length;
+    // (Terminated, as the text of a token in a chunk is followed by more)
+    char* buffer = GC_MALLOC_ATOMIC(length + 1);
     char* bstart = buffer;
-    while (length--) {
-        *buffer++ = chunk->buffer[chunk_pos++];
-        if (chunk_pos > chunk_end) {
-            if (!chunk->next)
-                break;
-            chunk = chunk->next;
-            chunk_end = chunk->start + chunk->length;
-            chunk_pos = 0;
-        }
-        copied++;
+    int count;
+
+    // Copy from the chunk and the ones after it
+    while (length > 0 && chunk) {
+        count = chunk->length - chunk_pos;
+        if (count > length)
+            count = length;
+        memcpy(buffer, chunk->buffer + chunk_pos, count);
+        buffer += count;
+        length -= count;
+        chunk = chunk->next;
+        chunk_pos = 0;
     }
+    *buffer = 0;
     return bstart;
 }
 
@@ -179,6 +198,7 @@ stream_init_file_opts(Stream* stream, StreamInitOpts *options) {
     FileStream* fstream = (FileStream*) stream->context;
     *fstream = (FileStream) {
         .file = options->file,
+        .interactive = !options->readahead,
         .chunks = NULL,
     };
 
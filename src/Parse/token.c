@@ -46,7 +46,8 @@ next_token(Tokenizer *self) {
     *token = (struct token) {
         .pos = self->stream->offset,
         .line = self->stream->line,
-        .stream_pos = self->stream->pos - 1,
+        // (Nothing was consumed at the end of the stream)
+        .stream_pos = self->stream->pos - (c == -1 ? 0 : 1),
         .type = T_EOF,
         .length = 0,
         .text = NULL,